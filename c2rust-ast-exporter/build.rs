@@ -6,6 +6,7 @@ extern crate env_logger;
 use cmake::Config;
 use std::env;
 use std::ffi::OsStr;
+use std::fs;
 use std::path::{Path, PathBuf};
 use std::process::{self, Command, Stdio};
 
@@ -27,6 +28,12 @@ fn main() {
         }
         process::exit(1);
     }
+
+    // Generate the decoders of the nodes described by ast_schema.def
+    if let Err(e) = generate_schema() {
+        eprintln!("src/ast_schema.def: {}", e);
+        process::exit(1);
+    }
 }
 
 fn check_clang_version() -> Result<(), String> {
@@ -79,6 +86,7 @@ fn generate_bindings() -> Result<(), &'static str> {
         .rustified_enum("TypeTag")
         .rustified_enum("StringTypeTag")
         .rustified_enum("BuiltinVaListKind")
+        .rustified_enum("AstTablesSection")
         // Tell bindgen we are processing c++
         .clang_arg("-xc++")
         // Finish the builder and generate the bindings.
@@ -109,6 +117,261 @@ fn generate_bindings() -> Result<(), &'static str> {
     Ok(())
 }
 
+/// A call in ast_schema.def, such as `CHILD(body, getBody, Stmt, Required)`,
+/// or a bare name such as `Stmt`
+struct SchemaItem {
+    name: String,
+    /// The items each argument consists of
+    args: Vec<Vec<SchemaItem>>,
+}
+
+impl SchemaItem {
+    /// The items of all the arguments of a call
+    fn items(&self) -> impl Iterator<Item = &SchemaItem> {
+        self.args.iter().flat_map(|arg| arg.iter())
+    }
+
+    /// Name of the bare name that argument `i` consists of
+    fn arg(&self, i: usize) -> Result<&str, String> {
+        match self.args.get(i).map(|arg| &arg[..]) {
+            Some([item]) if item.args.is_empty() => Ok(&item.name),
+            _ => Err(format!("expected a name as argument {} of {}", i + 1, self.name)),
+        }
+    }
+}
+
+/// Split ast_schema.def into names and punctuation, leaving out comments and
+/// preprocessor directives
+fn schema_tokens(def: &str) -> Result<Vec<String>, String> {
+    let mut tokens = vec![];
+    for line in def.lines() {
+        let line = line.split("//").next().unwrap().trim();
+        if line.starts_with('#') {
+            continue;
+        }
+        let mut chars = line.chars().peekable();
+        while let Some(c) = chars.next() {
+            if c.is_alphanumeric() || c == '_' {
+                let mut name = c.to_string();
+                while let Some(&c) = chars.peek() {
+                    if !c.is_alphanumeric() && c != '_' {
+                        break;
+                    }
+                    name.push(c);
+                    chars.next();
+                }
+                tokens.push(name);
+            } else if c == '(' || c == ')' || c == ',' {
+                tokens.push(c.to_string());
+            } else if !c.is_whitespace() {
+                return Err(format!("unexpected character '{}'", c));
+            }
+        }
+    }
+    Ok(tokens)
+}
+
+/// Parse items up to the next `,` or `)` at this level
+fn parse_schema_items(tokens: &[String], pos: &mut usize) -> Result<Vec<SchemaItem>, String> {
+    let mut items = vec![];
+    while let Some(token) = tokens.get(*pos) {
+        if token == "," || token == ")" {
+            break;
+        }
+        if token == "(" {
+            return Err("unexpected '('".to_string());
+        }
+        *pos += 1;
+        let mut item = SchemaItem {
+            name: token.clone(),
+            args: vec![],
+        };
+        if tokens.get(*pos).map(String::as_str) == Some("(") {
+            loop {
+                *pos += 1;
+                item.args.push(parse_schema_items(tokens, pos)?);
+                match tokens.get(*pos).map(String::as_str) {
+                    Some(",") => {}
+                    Some(")") => break,
+                    _ => return Err(format!("unterminated call to {}", item.name)),
+                }
+            }
+            *pos += 1;
+        }
+        items.push(item);
+    }
+    Ok(items)
+}
+
+/// Rust decoder of a node described by ast_schema.def
+fn schema_decoder(node: &SchemaItem) -> Result<String, String> {
+    let class = node.arg(0)?;
+    let mut fields = String::new();
+    let mut decode = String::new();
+    let mut string_extras = vec![];
+    let (mut children, mut extras) = (0, 0);
+    for item in node.items().skip(1) {
+        match &item.name[..] {
+            "CHILDREN" => {
+                for child in item.items() {
+                    let (field, kind) = (child.arg(0)?, child.arg(2)?);
+                    let (ty, value) = match child.arg(3)? {
+                        "Required" => ("u64", format!("node.children[{}]?", children)),
+                        "Optional" => ("Option<u64>", format!("node.children[{}]", children)),
+                        presence => return Err(format!("unknown presence {}", presence)),
+                    };
+                    fields += &format!("    /// `{}` child\n    pub {}: {},\n", kind, field, ty);
+                    decode += &format!("            {}: {},\n", field, value);
+                    children += 1;
+                }
+            }
+            "EXTRAS" => {
+                for extra in item.items() {
+                    let field = extra.arg(0)?;
+                    match extra.arg(2)? {
+                        "String" => {
+                            fields += &format!("    /// `String` extra\n    pub {}: String,\n", field);
+                            decode += &format!(
+                                "            {}: match node.extras[{}] {{\n                \
+                                 Value::Text(ref s) => s.clone(),\n                \
+                                 _ => return None,\n            }},\n",
+                                field, extras
+                            );
+                            string_extras.push(extras.to_string());
+                        }
+                        ty => return Err(format!("unsupported extra type {}", ty)),
+                    }
+                    extras += 1;
+                }
+            }
+            name => return Err(format!("unexpected {} in NODE({})", name, class)),
+        }
+    }
+
+    Ok(format!(
+        "/// Children and extras of a `Tag{class}` node\n\
+         #[derive(Debug, Clone, PartialEq)]\n\
+         pub struct {class}Node {{\n{fields}}}\n\n\
+         impl {class}Node {{\n    \
+             /// Decode `node`, or None if it is not a well-formed `Tag{class}` node\n    \
+             pub fn decode(node: &AstNode) -> Option<Self> {{\n        \
+                 if node.tag != ASTEntryTag::Tag{class}\n            \
+                     || node.children.len() != {children}\n            \
+                     || node.extras.len() != {extras}\n        \
+                 {{\n            return None;\n        }}\n        \
+                 Some({class}Node {{\n{decode}        }})\n    \
+             }}\n\n    \
+             /// Positions of the extras that are strings\n    \
+             pub const STRING_EXTRAS: &'static [usize] = &[{string_extras}];\n\
+         }}\n\n",
+        class = class,
+        fields = fields,
+        children = children,
+        extras = extras,
+        decode = decode,
+        string_extras = string_extras.join(", "),
+    ))
+}
+
+/// Positions of the extras of a LAYOUT or TYPE_LAYOUT in ast_schema.def that
+/// are strings or arrays of strings
+fn layout_string_extras(layout: &SchemaItem) -> Result<Vec<String>, String> {
+    let class = layout.arg(0)?;
+    let mut string_extras = vec![];
+    for item in layout.items().skip(1) {
+        if item.name != "EXTRAS" {
+            return Err(format!("unexpected {} in {}({})", item.name, layout.name, class));
+        }
+        for (i, extra) in item.items().enumerate() {
+            if extra.name != "VALUE" {
+                return Err(format!("expected VALUE in {}({})", layout.name, class));
+            }
+            match extra.arg(1)? {
+                "String" | "OptString" | "Strings" => string_extras.push(i.to_string()),
+                "Bool" | "Int" | "UInt" | "OptUInt" | "Double" | "TypeId" | "OptTypeId" => {}
+                ty => return Err(format!("unknown extra type {}", ty)),
+            }
+        }
+    }
+    Ok(string_extras)
+}
+
+/// Generate $OUT_DIR/ast_schema.rs, the Rust decoders of the nodes described
+/// by ast_schema.def, which AstExporter.cpp generates the encoders of, and the
+/// positions of the string extras of every node and type it describes
+fn generate_schema() -> Result<(), String> {
+    println!("cargo:rerun-if-changed=src/ast_schema.def");
+    let def = fs::read_to_string("src/ast_schema.def").map_err(|e| e.to_string())?;
+    let tokens = schema_tokens(&def)?;
+    let mut pos = 0;
+    let items = parse_schema_items(&tokens, &mut pos)?;
+    if pos != tokens.len() {
+        return Err(format!("unexpected '{}'", tokens[pos]));
+    }
+
+    let mut out = String::from("// Generated by build.rs from src/ast_schema.def\n\n");
+    let mut classes = vec![];
+    let mut string_extras = String::new();
+    let mut type_string_extras = String::new();
+    for item in &items {
+        match &item.name[..] {
+            "NODE" => {
+                out += &schema_decoder(item)?;
+                classes.push(item.arg(0)?);
+                string_extras += &format!(
+                    "        ASTEntryTag::Tag{0} => {0}Node::STRING_EXTRAS,\n",
+                    item.arg(0)?
+                );
+            }
+            "LAYOUT" => {
+                string_extras += &format!(
+                    "        ASTEntryTag::Tag{} => &[{}],\n",
+                    item.arg(0)?,
+                    layout_string_extras(item)?.join(", ")
+                );
+            }
+            "TYPE_LAYOUT" => {
+                type_string_extras += &format!(
+                    "        TypeTag::Tag{} => &[{}],\n",
+                    item.arg(0)?,
+                    layout_string_extras(item)?.join(", ")
+                );
+            }
+            name => return Err(format!("expected NODE, LAYOUT or TYPE_LAYOUT, found {}", name)),
+        }
+    }
+
+    out += "/// Whether `node` has the children and extras the schema gives nodes with\n\
+            /// its tag, or None if the schema does not describe them\n\
+            pub fn matches_schema(node: &AstNode) -> Option<bool> {\n    \
+                match node.tag {\n";
+    for class in &classes {
+        out += &format!(
+            "        ASTEntryTag::Tag{0} => Some({0}Node::decode(node).is_some()),\n",
+            class
+        );
+    }
+    out += "        _ => None,\n    }\n}\n\n";
+
+    out += &format!(
+        "/// Positions of the extras of nodes with tag `tag` that hold indices into\n\
+         /// the string table, or arrays of them\n\
+         pub fn string_extras(tag: ASTEntryTag) -> &'static [usize] {{\n    \
+             match tag {{\n{}        _ => &[],\n    }}\n}}\n\n",
+        string_extras
+    );
+    out += &format!(
+        "/// Positions of the extras of types with tag `tag` that hold indices into\n\
+         /// the string table\n\
+         pub fn type_string_extras(tag: TypeTag) -> &'static [usize] {{\n    \
+             match tag {{\n{}        _ => &[],\n    }}\n}}\n",
+        type_string_extras
+    );
+
+    let out_dir = PathBuf::from(env::var("OUT_DIR").unwrap());
+    fs::write(out_dir.join("ast_schema.rs"), out).map_err(|e| e.to_string())
+}
+
 /// Call out to CMake, build the exporter library, and tell cargo where to look
 /// for it.  Note that `CMAKE_BUILD_TYPE` gets implicitly determined by the
 /// cmake crate according to the following:
@@ -0,0 +1,42 @@
+#!/bin/sh
+#
+# This wrapper script wraps a call to clang with all the arguments that the
+# AST exporter plugin needs to run, so that building a project with
+#
+#   make CC="/path/to/cc_wrapper.sh /path/to/clang /path/to/plugin.so"
+#
+# also exports the AST of each file it compiles, next to its object file.
+# Comments are only exported from clang's parse if all of them are parsed.
+# Plugin arguments (prune-unused-decls, offset-positions, columnar,
+# decls-only, system-header-comments, stats, trace, compress=zstd[:level],
+# output=<path>) can be passed in C2RUST_PLUGIN_ARGS. With -ftime-trace on
+# LLVM 9 and later, the phases of the export also show up in the trace clang
+# writes.
+
+if [ $# -lt 2 ]; then
+    echo "Usage: $0 <compiler> <plugin> <arguments...>"
+    exit 1
+fi
+
+PLUGIN_CC=$1
+shift
+if [ ! -e $PLUGIN_CC ]; then
+    echo "Compiler not found at '$PLUGIN_CC'" >&2
+    exit 1
+fi
+
+PLUGIN=$1
+shift
+if [ ! -e $PLUGIN ]; then
+    echo "Compiler plugin not found at '$PLUGIN'" >&2
+    exit 1
+fi
+
+PLUGIN_ARGS=
+for arg in $C2RUST_PLUGIN_ARGS; do
+    PLUGIN_ARGS="$PLUGIN_ARGS -Xclang -plugin-arg-c2rust-ast-exporter -Xclang $arg"
+done
+
+exec "$PLUGIN_CC" -Xclang -load -Xclang "$PLUGIN" \
+    -Xclang -add-plugin -Xclang c2rust-ast-exporter $PLUGIN_ARGS \
+    -fparse-all-comments "$@"
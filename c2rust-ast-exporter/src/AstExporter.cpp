@@ -1,19 +1,29 @@
 #include <algorithm>
 #include <cstdlib>
+#include <cstring>
 #include <fstream>
+#include <initializer_list>
 #include <iostream>
 #include <iterator>
+#include <mutex>
 #include <set>
+#include <tuple>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
 
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/Optional.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallVector.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Debug.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MD5.h"
 #include "llvm/Support/Path.h"
+#include "llvm/Support/ThreadPool.h"
 // Declares clang::SyntaxOnlyAction.
 #include "clang/Frontend/FrontendActions.h"
-#include "clang/Tooling/CommonOptionsParser.h"
 
 #include "clang/AST/DeclVisitor.h"
 #include "clang/AST/RecordLayout.h"
@@ -24,13 +34,20 @@
 #include "clang/Basic/Diagnostic.h"
 #include "clang/Basic/TargetInfo.h"
 #include "clang/Basic/Version.h"
+#include "clang/Frontend/ASTUnit.h"
 #include "clang/Frontend/CompilerInstance.h"
 #include "clang/Frontend/LangStandard.h"
+#include "clang/Frontend/TextDiagnosticPrinter.h"
+#include "clang/Frontend/Utils.h"
 #include "clang/Tooling/Tooling.h"
 
 #include "AstExporter.hpp"
+#include "AstTables.hpp"
 #include "ExportResult.hpp"
+#include "ExportStats.hpp"
 #include "FloatingLexer.h"
+#include "MacroExpansions.hpp"
+#include "ReachableDecls.hpp"
 #include "ast_tags.hpp"
 #include <tinycbor/cbor.h>
 
@@ -56,24 +73,285 @@ void cbor_encode_string(CborEncoder *encoder, const std::string &str) {
     cbor_encode_text_string(encoder, ptr, len);
 }
 
-// Encode an array of strings assuming that it is valid UTF-8 encoded text
-void cbor_encode_string_array(CborEncoder *encoder,
-                              const ArrayRef<std::string> strs) {
-    CborEncoder array;
-    cbor_encoder_create_array(encoder, &array, strs.size());
+// tinycbor writer callback that appends encoded bytes to an OutputBuffer
+CborError write_to_output_buffer(void *token, const void *data, size_t len,
+                                 CborEncoderAppendType) {
+    static_cast<OutputBuffer *>(token)->append(data, len);
+    return CborNoError;
+}
+
+// 64-bit FNV-1a hash of `text`. Comments exported by reference carry the
+// hash of the bytes they span, so that the transpiler can tell when their
+// file changed since it was exported (see import_comments in clang_ast.rs,
+// which computes the same hash).
+uint64_t comment_digest(StringRef text) {
+    uint64_t hash = 0xcbf29ce484222325;
+    for (unsigned char c : text) {
+        hash ^= c;
+        hash *= 0x100000001b3;
+    }
+    return hash;
+}
+
+// Tags that references are wrapped in by visitors encoding part of a
+// translation unit in parallel with others (see EncodeWorker). IDs, string
+// indices and file IDs are only assigned when their parts are merged, so the
+// parts refer to nodes and types by address and to strings by their text.
+// These never leave the exporter.
+enum ReferenceTag : CborTag {
+    // The address of an AST node or macro
+    NodeRefTag = 0x10000,
+    // The address of a clang::Type, with qualifiers in the low three bits
+    TypeRefTag,
+    // A text string to add to the string table
+    StringRefTag,
+    // The hash value of a FileID shifted left by one, plus one for va_list
+    FileRefTag,
+};
+
+// Strings the AST refers to by their index in a per-translation unit table,
+// so that names, attribute spellings and the like are only encoded once.
+// Indices are assigned in the order the strings are first used.
+class StringTable {
+    StringMap<uint64_t> indices;
+    // Keys of `indices` by index
+    std::vector<StringRef> strings;
+    // Encode references as StringRefTag strings rather than indices
+    bool inlineStrings;
+
+  public:
+    explicit StringTable(bool inlineStrings = false)
+        : inlineStrings(inlineStrings) {}
+
+    uint64_t intern(StringRef str) {
+        auto entry = indices.insert(std::make_pair(str, strings.size()));
+        if (entry.second)
+            strings.push_back(entry.first->getKey());
+        return entry.first->getValue();
+    }
+
+    void encodeRef(CborEncoder *encoder, StringRef str) {
+        if (inlineStrings) {
+            cbor_encode_tag(encoder, StringRefTag);
+            cbor_encode_text_string(encoder, str.data(), str.size());
+            return;
+        }
+        cbor_encode_uint(encoder, intern(str));
+    }
 
-    for (auto &s : strs) {
-        cbor_encode_string(&array, s);
+    ArrayRef<StringRef> getStrings() const { return strings; }
+
+    void encode(CborEncoder *encoder) const {
+        CborEncoder array;
+        cbor_encoder_create_array(encoder, &array, strings.size());
+        for (auto str : strings) {
+            cbor_encode_text_string(&array, str.data(), str.size());
+        }
+        cbor_encoder_close_container(encoder, &array);
     }
+};
+
+// Copy the text or byte string `it` is at and move past it
+std::vector<char> copy_cbor_string(CborValue *it) {
+    size_t length = 0;
+    cbor_value_calculate_string_length(it, &length);
+    // Room for the null byte tinycbor appends
+    std::vector<char> str(length + 1);
+    CborValue next;
+    if (cbor_value_is_text_string(it))
+        cbor_value_copy_text_string(it, str.data(), &length, &next);
+    else
+        cbor_value_copy_byte_string(it, reinterpret_cast<uint8_t *>(str.data()),
+                                    &length, &next);
+    str.resize(length);
+    *it = next;
+    return str;
+}
 
-    cbor_encoder_close_container(encoder, &array);
+// tinycbor writer callback that appends encoded bytes to a vector
+CborError write_to_vector(void *token, const void *data, size_t len,
+                          CborEncoderAppendType) {
+    auto bytes = static_cast<std::vector<uint8_t> *>(token);
+    auto begin = static_cast<const uint8_t *>(data);
+    bytes->insert(bytes->end(), begin, begin + len);
+    return CborNoError;
 }
 
+// Passes the items of a streamed export (see ast_exporter_stream) to a
+// ChunkSink as soon as each one is finished, rather than collecting the whole
+// export first. Items are batched into chunks of about ChunkSize bytes.
+class ChunkStream {
+    static const size_t ChunkSize = 64 * 1024;
+
+    const ChunkSink &sink;
+    const StringTable &strings;
+    // Number of strings in the table already sent
+    size_t sentStrings = 0;
+    // Encodes top-level items into `item`
+    CborEncoder encoder;
+    std::vector<uint8_t> item;
+    // Finished items not yet passed to the sink
+    std::vector<uint8_t> chunk;
+    // Bytes passed to the sink so far
+    size_t sent = 0;
+
+  public:
+    ChunkStream(const ChunkSink &sink, const StringTable &strings)
+        : sink(sink), strings(strings) {
+        cbor_encoder_init_writer(&encoder, write_to_vector, &item);
+    }
+
+    // Items are encoded here one at a time, each followed by a call to
+    // finishItem.
+    CborEncoder *getEncoder() { return &encoder; }
+
+    // Bytes of the stream so far, including the item being encoded
+    size_t size() const { return sent + chunk.size() + item.size(); }
+
+    // Queue the item just encoded, preceded by the strings added to the
+    // table while encoding it, so that the receiver knows every string an
+    // item refers to by the time it gets the item.
+    void finishItem() {
+        auto added = strings.getStrings().drop_front(sentStrings);
+        if (!added.empty()) {
+            CborEncoder stringEncoder;
+            cbor_encoder_init_writer(&stringEncoder, write_to_vector, &chunk);
+            for (auto str : added)
+                cbor_encode_text_string(&stringEncoder, str.data(), str.size());
+            sentStrings += added.size();
+        }
+
+        chunk.insert(chunk.end(), item.begin(), item.end());
+        item.clear();
+        if (chunk.size() >= ChunkSize)
+            flush();
+    }
+
+    void flush() {
+        if (!chunk.empty())
+            sink.onChunk(sink.ctx, chunk.data(), chunk.size());
+        sent += chunk.size();
+        chunk.clear();
+    }
+};
+
+// Assigns the IDs nodes are exported under: 1, 2, 3, ... in the order they
+// are first referenced, and 0 to null. Unlike addresses, these are small and
+// the same on every run.
+class NodeIds {
+    DenseMap<const void *, uint64_t> ids;
+    // Use addresses as IDs and encode them as `refTag` references, for
+    // visitors encoding part of a translation unit in parallel with others
+    bool addresses;
+    ReferenceTag refTag;
+
+  public:
+    explicit NodeIds(bool addresses = false, ReferenceTag refTag = NodeRefTag)
+        : addresses(addresses), refTag(refTag) {}
+
+    bool usesAddresses() const { return addresses; }
+
+    uint64_t get(const void *ptr) {
+        if (!ptr)
+            return 0;
+        if (addresses)
+            return reinterpret_cast<uintptr_t>(ptr);
+        auto entry = ids.insert(std::make_pair(ptr, uint64_t(ids.size() + 1)));
+        return entry.first->second;
+    }
+
+    // Encode an ID returned by get (possibly with flags in bits it leaves
+    // clear)
+    void encodeId(CborEncoder *encoder, uint64_t id) const {
+        if (addresses)
+            cbor_encode_tag(encoder, refTag);
+        cbor_encode_uint(encoder, id);
+    }
+
+    void encode(CborEncoder *encoder, const void *ptr) {
+        encodeId(encoder, get(ptr));
+    }
+};
+
+// Held while a visitor encoding part of a translation unit in parallel with
+// others queries clang. The SourceManager, the Preprocessor and the
+// ASTContext fill caches as they are queried, so they cannot be queried from
+// several threads at once. Does nothing without a mutex.
+class ClangLock {
+    std::unique_lock<std::recursive_mutex> lock;
+
+  public:
+    explicit ClangLock(std::recursive_mutex *mutex) {
+        if (mutex)
+            lock = std::unique_lock<std::recursive_mutex>(*mutex);
+    }
+};
+
+// Whether `D` is selected by one of `roots` (see ExportOptions::exportRoots)
+class ExportRootMatcher {
+    SourceManager &manager;
+    ArrayRef<ExportRoot> roots;
+    // The real path of the file of each root selecting lines
+    std::vector<std::string> paths;
+
+    // The file and line of the expansion location of `loc`
+    std::pair<FileID, unsigned> getLine(SourceLocation loc) const {
+        auto decomposed = manager.getDecomposedExpansionLoc(loc);
+        if (decomposed.first.isInvalid())
+            return decomposed;
+        auto line = manager.getLineNumber(decomposed.first, decomposed.second);
+        // Locations in a precompiled preamble have the same lines as the
+        // main file (see PreambleCache)
+        if (decomposed.first == manager.getPreambleFileID())
+            decomposed.first = manager.getMainFileID();
+        return std::make_pair(decomposed.first, line);
+    }
+
+  public:
+    ExportRootMatcher(SourceManager &manager, ArrayRef<ExportRoot> roots)
+        : manager(manager), roots(roots) {
+        for (auto const &root : roots) {
+            SmallString<256> path;
+            if (root.name.empty() && !sys::fs::real_path(root.file, path))
+                paths.push_back(path.str());
+            else
+                paths.push_back(root.file);
+        }
+    }
+
+    bool operator()(Decl *D) const {
+        auto ND = dyn_cast<NamedDecl>(D);
+        auto range = D->getSourceRange();
+        auto begin = getLine(range.getBegin());
+        auto end = getLine(range.getEnd());
+        auto entry = begin.first.isValid()
+                         ? manager.getFileEntryForID(begin.first)
+                         : nullptr;
+
+        for (size_t i = 0; i < roots.size(); i++) {
+            auto const &root = roots[i];
+            if (!root.name.empty()) {
+                if (ND && ND->getIdentifier() && ND->getName() == root.name)
+                    return true;
+                continue;
+            }
+            if (entry && begin.first == end.first &&
+                entry->tryGetRealPathName() == paths[i] &&
+                begin.second <= root.lastLine && end.second >= root.firstLine)
+                return true;
+        }
+        return false;
+    }
+};
+
 std::string make_realpath(std::string const &path) {
     if (auto abs_path = realpath(path.c_str(), nullptr)) {
         auto result = std::string(abs_path);
         free(abs_path);
         return result;
+    } else if (sys::path::is_absolute(path)) {
+        // Not on disk, like the virtual files of an ExportSession
+        return path;
     } else {
         std::cerr << "make_realpath: File not found: " << path << std::endl;
         abort();
@@ -86,8 +364,15 @@ class TranslateASTVisitor;
 class TypeEncoder final : public TypeVisitor<TypeEncoder> {
     ASTContext *Context;
     CborEncoder *encoder;
+    AstTablesWriter *tables;
+    ChunkStream *stream;
     std::unordered_map<void *, QualType> *sugared;
+    StringTable *strings;
+    // IDs of the AST nodes types refer to
+    NodeIds *nodeIds;
+    NodeIds typeIds;
     TranslateASTVisitor *astEncoder;
+    ExportStats *stats = nullptr;
 
     // Bounds recursion when visiting self-referential record declarations
     std::unordered_set<const clang::RecordDecl *> recordDeclsUnderVisit;
@@ -104,15 +389,21 @@ class TypeEncoder final : public TypeVisitor<TypeEncoder> {
 
     void encodeType(
         const clang::Type *T, TypeTag tag,
-        std::function<void(CborEncoder *)> extra = [](CborEncoder *) {}) {
+        llvm::function_ref<void(CborEncoder *)> extra = [](CborEncoder *) {}) {
         if (!markExported(T))
             return;
 
+        ExportStats::Entry counted(stats, tag);
+        if (tables) {
+            tables->addType(typeId(T), tag, extra);
+            return;
+        }
+
         CborEncoder local;
         cbor_encoder_create_array(encoder, &local, CborIndefiniteLength);
 
         // 1 - Entity ID
-        cbor_encode_uint(&local, uintptr_t(T));
+        encodeTypeId(&local, typeId(T));
 
         // 2 - Type tag
         cbor_encode_uint(&local, tag);
@@ -121,17 +412,46 @@ class TypeEncoder final : public TypeVisitor<TypeEncoder> {
         extra(&local);
 
         cbor_encoder_close_container(encoder, &local);
+        if (stream)
+            stream->finishItem();
+    }
+
+    // The low three bits of a type ID are left for its qualifiers. Types are
+    // aligned such that their addresses leave them clear too.
+    uint64_t typeId(const clang::Type *T) {
+        if (typeIds.usesAddresses())
+            return typeIds.get(T);
+        return typeIds.get(T) << 3;
     }
 
   public:
-    uintptr_t encodeQualType(QualType t) {
+    void setStats(ExportStats *stats) { this->stats = stats; }
+
+    // Encode an ID returned by encodeQualType
+    void encodeTypeId(CborEncoder *encoder, uint64_t id) const {
+        typeIds.encodeId(encoder, id);
+    }
+
+    // The ID of the type a TypeRefTag reference refers to, for merging the
+    // entries of visitors encoding in parallel
+    uint64_t mergeTypeRef(uint64_t ref) {
+        if (!ref)
+            return 0;
+        auto T = reinterpret_cast<const clang::Type *>(ref & ~uint64_t(7));
+        return typeId(T) | (ref & 7);
+    }
+
+    // Returns true the first time the entry of `T` is merged
+    bool markMerged(const clang::Type *T) { return markExported(T); }
+
+    uint64_t encodeQualType(QualType t) {
         auto s = t.split();
 
         auto desugared = sugared->find((void *)s.Ty);
         if (desugared != sugared->end())
             return encodeQualType(desugared->second);
 
-        auto i = uintptr_t(s.Ty);
+        auto i = typeId(s.Ty);
 
         if (t.isConstQualified()) {
             i |= 1;
@@ -147,10 +467,13 @@ class TypeEncoder final : public TypeVisitor<TypeEncoder> {
     }
 
     explicit TypeEncoder(ASTContext *Context, CborEncoder *encoder,
+                         AstTablesWriter *tables, ChunkStream *stream,
                          std::unordered_map<void *, QualType> *sugared,
+                         StringTable *strings, NodeIds *nodeIds,
                          TranslateASTVisitor *ast)
-        : Context(Context), encoder(encoder), sugared(sugared),
-          astEncoder(ast) {}
+        : Context(Context), encoder(encoder), tables(tables), stream(stream),
+          sugared(sugared), strings(strings), nodeIds(nodeIds),
+          typeIds(nodeIds->usesAddresses(), TypeRefTag), astEncoder(ast) {}
 
     void VisitQualType(const QualType &QT) {
         if (!QT.isNull()) {
@@ -170,8 +493,8 @@ class TypeEncoder final : public TypeVisitor<TypeEncoder> {
         auto qt = encodeQualType(t);
         auto k = T->getAttrKind();
 
-        encodeType(T, TagAttributedType, [qt, k](CborEncoder *local) {
-            cbor_encode_uint(local, qt);
+        encodeType(T, TagAttributedType, [this, qt, k](CborEncoder *local) {
+            encodeTypeId(local, qt);
 
             const char *tag;
             switch (k) {
@@ -202,7 +525,7 @@ class TypeEncoder final : public TypeVisitor<TypeEncoder> {
                 break;
             }
             if (tag) {
-                cbor_encode_text_stringz(local, tag);
+                strings->encodeRef(local, tag);
             } else {
                 cbor_encode_null(local);
             }
@@ -216,14 +539,14 @@ class TypeEncoder final : public TypeVisitor<TypeEncoder> {
         auto qt = encodeQualType(t);
 
         encodeType(T, TagParenType,
-                   [qt](CborEncoder *local) { cbor_encode_uint(local, qt); });
+                   [this, qt](CborEncoder *local) { encodeTypeId(local, qt); });
 
         VisitQualType(t);
     }
 
     void VisitEnumType(const EnumType *T) {
-        encodeType(T, TagEnumType, [T](CborEncoder *local) {
-            cbor_encode_uint(local, uintptr_t(T->getDecl()->getDefinition()));
+        encodeType(T, TagEnumType, [this, T](CborEncoder *local) {
+            nodeIds->encode(local, T->getDecl()->getDefinition());
         });
     }
 
@@ -231,8 +554,8 @@ class TypeEncoder final : public TypeVisitor<TypeEncoder> {
         auto t = T->getElementType();
         auto qt = encodeQualType(t);
 
-        encodeType(T, TagConstantArrayType, [T, qt](CborEncoder *local) {
-            cbor_encode_uint(local, qt);
+        encodeType(T, TagConstantArrayType, [this, T, qt](CborEncoder *local) {
+            encodeTypeId(local, qt);
             cbor_encode_uint(local, T->getSize().getLimitedValue());
         });
 
@@ -246,7 +569,7 @@ class TypeEncoder final : public TypeVisitor<TypeEncoder> {
         auto qt = encodeQualType(t);
 
         encodeType(T, TagIncompleteArrayType,
-                   [qt](CborEncoder *local) { cbor_encode_uint(local, qt); });
+                   [this, qt](CborEncoder *local) { encodeTypeId(local, qt); });
 
         VisitQualType(t);
     }
@@ -256,7 +579,7 @@ class TypeEncoder final : public TypeVisitor<TypeEncoder> {
         auto qt = encodeQualType(t);
 
         encodeType(T, TagBlockPointer,
-                   [qt](CborEncoder *local) { cbor_encode_uint(local, qt); });
+                   [this, qt](CborEncoder *local) { encodeTypeId(local, qt); });
 
         VisitQualType(t);
     }
@@ -268,8 +591,8 @@ class TypeEncoder final : public TypeVisitor<TypeEncoder> {
         auto t = T->getElementType();
         auto qt = encodeQualType(t);
 
-        encodeType(T, TagVectorType, [T, qt](CborEncoder *local) {
-            cbor_encode_uint(local, qt);
+        encodeType(T, TagVectorType, [this, T, qt](CborEncoder *local) {
+            encodeTypeId(local, qt);
             cbor_encode_uint(local, T->getNumElements());
         });
 
@@ -281,7 +604,7 @@ class TypeEncoder final : public TypeVisitor<TypeEncoder> {
         auto qt = encodeQualType(t);
 
         encodeType(T, TagComplexType,
-                   [qt](CborEncoder *local) { cbor_encode_uint(local, qt); });
+                   [this, qt](CborEncoder *local) { encodeTypeId(local, qt); });
 
         VisitQualType(t);
     }
@@ -340,9 +663,9 @@ class TypeEncoder final : public TypeVisitor<TypeEncoder> {
             size_t elts = T->getNumParams() + 1;
             cbor_encoder_create_array(local, &arrayEncoder, elts);
 
-            cbor_encode_uint(&arrayEncoder, encodeQualType(T->getReturnType()));
+            encodeTypeId(&arrayEncoder, encodeQualType(T->getReturnType()));
             for (auto t : T->param_types()) {
-                cbor_encode_uint(&arrayEncoder, encodeQualType(t));
+                encodeTypeId(&arrayEncoder, encodeQualType(t));
             }
 
             cbor_encoder_close_container(local, &arrayEncoder);
@@ -360,13 +683,13 @@ class TypeEncoder final : public TypeVisitor<TypeEncoder> {
 
     // See `VisitFunctionProtoType`.
     void VisitFunctionNoProtoType(const FunctionNoProtoType *T) {
-        encodeType(T, TagFunctionType, [T](CborEncoder *local) {
+        encodeType(T, TagFunctionType, [this, T](CborEncoder *local) {
             CborEncoder arrayEncoder;
 
             cbor_encoder_create_array(local, &arrayEncoder, 1);
 
-            cbor_encode_uint(&arrayEncoder,
-                             uintptr_t(T->getReturnType().getTypePtrOrNull()));
+            encodeTypeId(&arrayEncoder,
+                         typeId(T->getReturnType().getTypePtrOrNull()));
 
             cbor_encoder_close_container(local, &arrayEncoder);
 
@@ -383,7 +706,7 @@ class TypeEncoder final : public TypeVisitor<TypeEncoder> {
         auto qt = encodeQualType(pointee);
 
         encodeType(T, TagPointer,
-                   [qt](CborEncoder *local) { cbor_encode_uint(local, qt); });
+                   [this, qt](CborEncoder *local) { encodeTypeId(local, qt); });
 
         VisitQualType(pointee);
     }
@@ -395,7 +718,7 @@ class TypeEncoder final : public TypeVisitor<TypeEncoder> {
         auto qt = encodeQualType(pointee);
 
         encodeType(T, TagReference,
-                   [qt](CborEncoder *local) { cbor_encode_uint(local, qt); });
+                   [this, qt](CborEncoder *local) { encodeTypeId(local, qt); });
 
         VisitQualType(pointee);
     }
@@ -406,7 +729,7 @@ class TypeEncoder final : public TypeVisitor<TypeEncoder> {
         auto t = T->desugar();
         auto qt = encodeQualType(t);
         encodeType(T, TagTypeOfType,
-                   [qt](CborEncoder *local) { cbor_encode_uint(local, qt); });
+                   [this, qt](CborEncoder *local) { encodeTypeId(local, qt); });
         VisitQualType(t);
     }
 
@@ -414,7 +737,7 @@ class TypeEncoder final : public TypeVisitor<TypeEncoder> {
         auto t = T->desugar();
         auto qt = encodeQualType(t);
         encodeType(T, TagTypeOfType,
-                   [qt](CborEncoder *local) { cbor_encode_uint(local, qt); });
+                   [this, qt](CborEncoder *local) { encodeTypeId(local, qt); });
         VisitQualType(t);
     }
 
@@ -422,7 +745,7 @@ class TypeEncoder final : public TypeVisitor<TypeEncoder> {
         auto t = T->desugar();
         auto qt = encodeQualType(t);
         encodeType(T, TagElaboratedType,
-                   [qt](CborEncoder *local) { cbor_encode_uint(local, qt); });
+                   [this, qt](CborEncoder *local) { encodeTypeId(local, qt); });
 
         VisitQualType(t);
     }
@@ -431,7 +754,7 @@ class TypeEncoder final : public TypeVisitor<TypeEncoder> {
         auto t = T->desugar();
         auto qt = encodeQualType(t);
         encodeType(T, TagDecayedType,
-                   [qt](CborEncoder *local) { cbor_encode_uint(local, qt); });
+                   [this, qt](CborEncoder *local) { encodeTypeId(local, qt); });
 
         VisitQualType(t);
     }
@@ -445,12 +768,38 @@ class TranslateASTVisitor final
     };
 
     ASTContext *Context;
+    NodeIds nodeIds;
     TypeEncoder typeEncoder;
+    // FileIDs by the hash values FileRefTag references are made of
+    DenseMap<unsigned, FileID> fileRefs;
     CborEncoder *encoder;
+    // Where entries are added instead of `encoder` for the columnar format
+    AstTablesWriter *tables;
+    // Passes each entry written to `encoder` on if the export is streamed
+    ChunkStream *stream;
+    // Serializes the clang queries of visitors encoding parts of a
+    // translation unit in parallel, which encode references as ReferenceTag
+    // values. Null for a visitor encoding a whole translation unit.
+    std::recursive_mutex *clangMutex;
+    StringTable *strings;
     Preprocessor &PP;
+    // Null if expansions are not indexed, in which case macro names are
+    // lexed again to find the macros expanded
+    MacroExpansionIndex *macroExpansions;
+    // Whether source positions are encoded as byte offsets rather than line
+    // and column numbers
+    bool offsetPositions;
+    // Whether function bodies are left out, leaving declarations only
+    bool declsOnly;
+    ExportStats *stats = nullptr;
     std::vector<std::pair<string, SourceLocation>> files;
+    // A FileID with the contents of each entry in files, if any
+    std::vector<FileID> fileContents;
     // Mapping from SourceManager FileID to index in files
     DenseMap<FileID, size_t> file_id_mapping;
+    // Mapping from FileEntry to index in files, so that a file included
+    // several times is only exported once with offset positions
+    DenseMap<const FileEntry *, size_t> file_entry_mapping;
     std::set<std::pair<void *, ASTEntryTag>> exportedTags;
     std::unordered_map<MacroInfo*, MacroExpansionInfo> macros;
 
@@ -471,6 +820,7 @@ class TranslateASTVisitor final
     }
 
     bool evaluateConstantInt(Expr *E, APSInt &constant) {
+        ClangLock lock(clangMutex);
         bool hasValue = E->isIntegerConstantExpr(constant, *Context);
         if (!hasValue) {
 #if CLANG_VERSION_MAJOR < 8
@@ -492,16 +842,40 @@ class TranslateASTVisitor final
     void encode_entry_raw(void *ast, ASTEntryTag tag, SourceRange loc,
                           const QualType ty, bool rvalue,
                           bool isVaList, bool encodeMacroExpansions,
-                          const std::vector<void *> &childIds,
-                          std::function<void(CborEncoder *)> extra) {
+                          ArrayRef<void *> childIds,
+                          llvm::function_ref<void(CborEncoder *)> extra) {
         if (!markForExport(ast, tag))
             return;
 
+        ExportStats::Entry counted(stats, tag);
+        if (tables) {
+            // Same fields as below, in the same order
+            auto id = nodeIds.get(ast);
+            SmallVector<uint64_t, 8> children;
+            for (auto x : childIds)
+                children.push_back(nodeIds.get(x));
+            auto span = getSourceSpan(loc, isVaList);
+            auto typeId = ty.getTypePtrOrNull() ? typeEncoder.encodeQualType(ty) : 0;
+            SmallVector<uint64_t, 2> macroIds;
+            if (encodeMacroExpansions) {
+                for (auto I = curMacroExpansionStack.rbegin(), E = curMacroExpansionStack.rend();
+                     I != E; ++I) {
+                    macroIds.push_back(nodeIds.get(*I));
+                }
+            }
+            uint64_t macroText = curMacroExpansionSource.empty()
+                                     ? 0
+                                     : strings->intern(curMacroExpansionSource) + 1;
+            tables->addNode(id, tag, children, span, typeId, rvalue, macroIds,
+                            macroText, extra);
+            return;
+        }
+
         CborEncoder local, childEnc;
         cbor_encoder_create_array(encoder, &local, CborIndefiniteLength);
 
         // 0 - Entry ID
-        cbor_encode_uint(&local, uintptr_t(ast));
+        nodeIds.encode(&local, ast);
 
         // 1 - Entry Tag
         cbor_encode_uint(&local, tag);
@@ -512,7 +886,7 @@ class TranslateASTVisitor final
             if (x == nullptr) {
                 cbor_encode_null(&childEnc);
             } else {
-                cbor_encode_uint(&childEnc, uintptr_t(x));
+                nodeIds.encode(&childEnc, x);
             }
         }
         cbor_encoder_close_container(&local, &childEnc);
@@ -522,7 +896,10 @@ class TranslateASTVisitor final
         // 5 - Begin Column number
         // 6 - End Line number
         // 7 - End Column number
-        encodeSourceSpan(&local, loc, isVaList);
+        auto span = getSourceSpan(loc, isVaList);
+        encodeFileId(&local, span[0]);
+        for (size_t i = 1; i < span.size(); i++)
+            cbor_encode_uint(&local, span[i]);
 
         // 8 - Type ID (only for expressions)
         encode_qualtype(&local, ty);
@@ -537,14 +914,14 @@ class TranslateASTVisitor final
         if (encodeMacroExpansions) {
             for (auto I = curMacroExpansionStack.rbegin(), E = curMacroExpansionStack.rend();
                  I != E; ++I) {
-                cbor_encode_uint(&childEnc, uintptr_t(*I));
+                nodeIds.encode(&childEnc, *I);
             }
         }
         cbor_encoder_close_container(&local, &childEnc);
 
         // 11 - Macro expansion source string, if applicable.
         if (!curMacroExpansionSource.empty()) {
-            cbor_encode_string(&local, curMacroExpansionSource.str());
+            encodeStringRef(&local, curMacroExpansionSource);
         } else {
             cbor_encode_null(&local);
         }
@@ -553,19 +930,45 @@ class TranslateASTVisitor final
         extra(&local);
 
         cbor_encoder_close_container(encoder, &local);
+        if (stream)
+            stream->finishItem();
+    }
+
+    void encodeFileId(CborEncoder *enc, uint64_t id) {
+        if (nodeIds.usesAddresses())
+            cbor_encode_tag(enc, FileRefTag);
+        cbor_encode_uint(enc, id);
+    }
+
+    void encodeStringRef(CborEncoder *enc, StringRef str) {
+        strings->encodeRef(enc, str);
+    }
+
+    // Extras of the types ast_schema.def supports
+    void encodeStringExtra(CborEncoder *enc, StringRef str) {
+        encodeStringRef(enc, str);
+    }
+
+    void encodeStringRefs(CborEncoder *enc, ArrayRef<std::string> strs) {
+        CborEncoder array;
+        cbor_encoder_create_array(enc, &array, strs.size());
+        for (auto const &str : strs) {
+            encodeStringRef(&array, str);
+        }
+        cbor_encoder_close_container(enc, &array);
     }
 
     void encode_qualtype(CborEncoder *enc, QualType ty) {
         if (ty.getTypePtrOrNull()) {
-            cbor_encode_uint(enc, typeEncoder.encodeQualType(ty));
+            typeEncoder.encodeTypeId(enc, typeEncoder.encodeQualType(ty));
         } else {
             cbor_encode_null(enc);
         }
     }
 
     void encode_entry(
-        Expr *ast, ASTEntryTag tag, const std::vector<void *> &childIds,
-        std::function<void(CborEncoder *)> extra = [](CborEncoder *) {}) {
+        Expr *ast, ASTEntryTag tag, ArrayRef<void *> childIds,
+        llvm::function_ref<void(CborEncoder *)> extra = [](CborEncoder *) {}) {
         auto ty = ast->getType();
         auto isVaList = false;
         auto encodeMacroExpansions = true;
@@ -575,8 +978,8 @@ class TranslateASTVisitor final
     }
 
     void encode_entry(
-        Stmt *ast, ASTEntryTag tag, const std::vector<void *> &childIds,
-        std::function<void(CborEncoder *)> extra = [](CborEncoder *) {}) {
+        Stmt *ast, ASTEntryTag tag, ArrayRef<void *> childIds,
+        llvm::function_ref<void(CborEncoder *)> extra = [](CborEncoder *) {}) {
         QualType s = QualType(static_cast<clang::Type *>(nullptr), 0);
         auto rvalue = false;
         auto isVaList = false;
@@ -586,9 +989,9 @@ class TranslateASTVisitor final
     }
 
     void encode_entry(
-        Decl *ast, ASTEntryTag tag, const std::vector<void *> &childIds,
+        Decl *ast, ASTEntryTag tag, ArrayRef<void *> childIds,
         const QualType T,
-        std::function<void(CborEncoder *)> extra = [](CborEncoder *) {}) {
+        llvm::function_ref<void(CborEncoder *)> extra = [](CborEncoder *) {}) {
         auto rvalue = false;
         auto encodeMacroExpansions = false;
         encode_entry_raw(ast, tag, ast->getSourceRange(), T, rvalue,
@@ -600,8 +1003,8 @@ class TranslateASTVisitor final
     /// location.
     void encode_entry(
         Decl *ast, ASTEntryTag tag, SourceRange loc,
-        const std::vector<void *> &childIds, const QualType T,
-        std::function<void(CborEncoder *)> extra = [](CborEncoder *) {}) {
+        ArrayRef<void *> childIds, const QualType T,
+        llvm::function_ref<void(CborEncoder *)> extra = [](CborEncoder *) {}) {
         auto rvalue = false;
         auto encodeMacroExpansions = false;
         encode_entry_raw(ast, tag, loc, T, rvalue,
@@ -683,39 +1086,255 @@ class TranslateASTVisitor final
 
   public:
     explicit TranslateASTVisitor(ASTContext *Context, CborEncoder *encoder,
+                                 AstTablesWriter *tables, ChunkStream *stream,
                                  std::unordered_map<void *, QualType> *sugared,
-                                 Preprocessor &PP)
-        : Context(Context), typeEncoder(Context, encoder, sugared, this),
-          encoder(encoder), PP(PP),
-          files{{"", {}}} {}
+                                 StringTable *strings, Preprocessor &PP,
+                                 MacroExpansionIndex *macroExpansions,
+                                 bool offsetPositions, bool declsOnly,
+                                 std::recursive_mutex *clangMutex = nullptr)
+        : Context(Context), nodeIds(clangMutex != nullptr),
+          typeEncoder(Context, encoder, tables, stream, sugared, strings,
+                      &nodeIds, this),
+          encoder(encoder), tables(tables), stream(stream),
+          clangMutex(clangMutex), strings(strings), PP(PP),
+          macroExpansions(macroExpansions), offsetPositions(offsetPositions),
+          declsOnly(declsOnly), files{{"", {}}},
+          fileContents{FileID()} {}
 
     // Override the default behavior of the RecursiveASTVisitor
     bool shouldVisitImplicitCode() const { return true; }
 
+    // Count the nodes and types encoded from now on in `stats`
+    void setStats(ExportStats *stats) {
+        this->stats = stats;
+        typeEncoder.setStats(stats);
+    }
+
+    uint64_t getNodeId(const void *ptr) { return nodeIds.get(ptr); }
+
+    // The FileIDs the FileRefTag references encoded by this visitor refer to
+    const DenseMap<unsigned, FileID> &getFileRefs() const { return fileRefs; }
+
+    // Add the entries another visitor encoded in parallel with others into
+    // `bytes` (see EncodeWorker), replacing their references with the IDs
+    // this visitor assigns. Nodes and types that several visitors encoded
+    // are only added the first time they are merged.
+    void mergeEntries(ArrayRef<uint8_t> bytes,
+                      const DenseMap<unsigned, FileID> &refs) {
+        CborParser parser;
+        CborValue array, entry;
+        cbor_parser_init(bytes.data(), bytes.size(), 0, &parser, &array);
+        cbor_value_enter_container(&array, &entry);
+        while (!cbor_value_at_end(&entry)) {
+            if (isMerged(entry)) {
+                cbor_value_advance(&entry);
+                continue;
+            }
+            mergeValue(&entry, encoder, refs);
+        }
+    }
+
+  private:
+    // Whether the node or type `entry` describes was merged already, which
+    // marks it merged otherwise
+    bool isMerged(CborValue entry) {
+        CborValue field;
+        CborTag refTag;
+        uint64_t ptr, tag;
+        cbor_value_enter_container(&entry, &field);
+        cbor_value_get_tag(&field, &refTag);
+        cbor_value_advance_fixed(&field);
+        cbor_value_get_uint64(&field, &ptr);
+        cbor_value_advance_fixed(&field);
+        cbor_value_get_uint64(&field, &tag);
+
+        if (refTag == TypeRefTag)
+            return !typeEncoder.markMerged(
+                reinterpret_cast<const clang::Type *>(ptr));
+        return !markForExport(reinterpret_cast<void *>(ptr),
+                              static_cast<ASTEntryTag>(tag));
+    }
+
+    // Copy the value `it` is at to `enc`, replacing references, and move
+    // past it
+    void mergeValue(CborValue *it, CborEncoder *enc,
+                    const DenseMap<unsigned, FileID> &refs) {
+        uint64_t value;
+        switch (cbor_value_get_type(it)) {
+        case CborTagType: {
+            CborTag tag;
+            cbor_value_get_tag(it, &tag);
+            cbor_value_advance_fixed(it);
+            switch (tag) {
+            case NodeRefTag:
+                cbor_value_get_uint64(it, &value);
+                cbor_encode_uint(enc, nodeIds.get(reinterpret_cast<void *>(value)));
+                break;
+            case TypeRefTag:
+                cbor_value_get_uint64(it, &value);
+                cbor_encode_uint(enc, typeEncoder.mergeTypeRef(value));
+                break;
+            case FileRefTag:
+                cbor_value_get_uint64(it, &value);
+                cbor_encode_uint(enc, getExporterFileId(refs.lookup(value >> 1),
+                                                        value & 1));
+                break;
+            case StringRefTag: {
+                auto str = copy_cbor_string(it);
+                encodeStringRef(enc, StringRef(str.data(), str.size()));
+                return;
+            }
+            default:
+                cbor_encode_tag(enc, tag);
+                mergeValue(it, enc, refs);
+                return;
+            }
+            break;
+        }
+        case CborIntegerType:
+            cbor_value_get_raw_integer(it, &value);
+            if (cbor_value_is_unsigned_integer(it))
+                cbor_encode_uint(enc, value);
+            else
+                cbor_encode_negative_int(enc, value + 1);
+            break;
+        case CborByteStringType: {
+            auto bytes = copy_cbor_string(it);
+            cbor_encode_byte_string(
+                enc, reinterpret_cast<const uint8_t *>(bytes.data()), bytes.size());
+            return;
+        }
+        case CborTextStringType: {
+            auto str = copy_cbor_string(it);
+            cbor_encode_text_string(enc, str.data(), str.size());
+            return;
+        }
+        case CborArrayType:
+        case CborMapType: {
+            bool isArray = cbor_value_is_array(it);
+            size_t length = CborIndefiniteLength;
+            if (cbor_value_is_length_known(it)) {
+                if (isArray)
+                    cbor_value_get_array_length(it, &length);
+                else
+                    cbor_value_get_map_length(it, &length);
+            }
+            CborEncoder container;
+            if (isArray)
+                cbor_encoder_create_array(enc, &container, length);
+            else
+                cbor_encoder_create_map(enc, &container, length);
+            CborValue element;
+            cbor_value_enter_container(it, &element);
+            while (!cbor_value_at_end(&element))
+                mergeValue(&element, &container, refs);
+            cbor_value_leave_container(it, &element);
+            cbor_encoder_close_container(enc, &container);
+            return;
+        }
+        case CborBooleanType: {
+            bool b;
+            cbor_value_get_boolean(it, &b);
+            cbor_encode_boolean(enc, b);
+            break;
+        }
+        case CborNullType:
+            cbor_encode_null(enc);
+            break;
+        case CborUndefinedType:
+            cbor_encode_undefined(enc);
+            break;
+        case CborSimpleType: {
+            uint8_t simple;
+            cbor_value_get_simple_type(it, &simple);
+            cbor_encode_simple_value(enc, simple);
+            break;
+        }
+        case CborHalfFloatType: {
+            uint16_t half;
+            cbor_value_get_half_float(it, &half);
+            cbor_encode_half_float(enc, &half);
+            break;
+        }
+        case CborFloatType: {
+            float f;
+            cbor_value_get_float(it, &f);
+            cbor_encode_float(enc, f);
+            break;
+        }
+        case CborDoubleType: {
+            double d;
+            cbor_value_get_double(it, &d);
+            cbor_encode_double(enc, d);
+            break;
+        }
+        case CborInvalidType:
+            llvm_unreachable("Invalid CBOR in a part encoded in parallel");
+        }
+        cbor_value_advance_fixed(it);
+    }
+
+  public:
+
     // Return the filenames as a vector. Indices correspond to file IDs.
     const std::vector<std::pair<string, SourceLocation>> &getFiles() {
-        // Iterate file include locations until fix point
+        // Add the files containing include locations. Files added along the
+        // way are appended, so one pass over the vector covers them too.
         auto &manager = Context->getSourceManager();
-        size_t size;
-        do {
-            size = files.size();
-            for (auto const &file : files) {
-                getExporterFileId(manager.getFileID(file.second), false);
-            }
-        } while (size != files.size());
+        for (size_t i = 0; i < files.size(); i++) {
+            getExporterFileId(manager.getFileID(files[i].second), false);
+        }
         return files;
     }
 
+    // The offsets at which the lines of a file returned by getFiles start,
+    // counting "\r\n" and "\n\r" as one line break like clang does. Empty
+    // for files without contents.
+    std::vector<uint64_t> getLineStarts(size_t exporterFileId) {
+        auto &manager = Context->getSourceManager();
+        auto id = fileContents[exporterFileId];
+
+        std::vector<uint64_t> starts;
+        bool invalid = id.isInvalid();
+        StringRef data;
+        if (!invalid)
+            data = manager.getBufferData(id, &invalid);
+        if (invalid)
+            return starts;
+
+        starts.push_back(0);
+        for (size_t i = 0; i < data.size(); i++) {
+            char c = data[i];
+            if (c != '\n' && c != '\r')
+                continue;
+            if (i + 1 < data.size() &&
+                (data[i + 1] == '\n' || data[i + 1] == '\r') &&
+                data[i + 1] != c)
+                i++;
+            starts.push_back(i + 1);
+        }
+        return starts;
+    }
+
     void encodeMacros() {
-        // Sort macros by source location
+        // Sort macros by source location. Macros loaded from a precompiled
+        // preamble have locations numbered after those parsed in this
+        // translation unit, so compare their positions in the TU instead.
+        auto &manager = Context->getSourceManager();
         std::vector<std::pair<MacroInfo *, MacroExpansionInfo>> macro_vec(
             macros.begin(), macros.end());
-        std::sort(macro_vec.begin(), macro_vec.end(),
-                  [](const std::pair<MacroInfo *, MacroExpansionInfo> &a,
-                     const std::pair<MacroInfo *, MacroExpansionInfo> &b) {
-                      return a.first->getDefinitionLoc() <
-                             b.first->getDefinitionLoc();
-                  });
+        {
+            ClangLock lock(clangMutex);
+            std::sort(macro_vec.begin(), macro_vec.end(),
+                      [&manager](const std::pair<MacroInfo *, MacroExpansionInfo> &a,
+                                 const std::pair<MacroInfo *, MacroExpansionInfo> &b) {
+                          auto aLoc = a.first->getDefinitionLoc();
+                          auto bLoc = b.first->getDefinitionLoc();
+                          if (aLoc.isInvalid() || bLoc.isInvalid())
+                              return aLoc < bLoc;
+                          return manager.isBeforeInTranslationUnit(aLoc, bLoc);
+                      });
+        }
         for (auto &I : macro_vec) {
             auto &Mac = I.first;
             auto &Info = I.second;
@@ -726,70 +1345,93 @@ class TranslateASTVisitor final
             else
                 tag = TagMacroObjectDef;
 
-            std::vector<void *> childIds;
+            SmallVector<void *, 8> childIds;
             auto range = SourceRange(Mac->getDefinitionLoc(), Mac->getDefinitionEndLoc());
             encode_entry_raw(Mac, tag, range, QualType(), false,
-                             false, false, childIds, [Name](CborEncoder *local) {
-                                 cbor_encode_string(local, Name.str());
+                             false, false, childIds, [this, Name](CborEncoder *local) {
+                                 encodeStringRef(local, Name);
                              });
 
         }
     }
 
-    void encodeSourcePos(CborEncoder *enc, SourceLocation loc,
-                         bool isVaList = false) {
+    // The file ID of a location followed by its line and column numbers, or
+    // by its offset in the file if positions are offsets
+    SmallVector<uint64_t, 3> getSourcePos(SourceLocation loc,
+                                          bool isVaList = false) {
+        ClangLock lock(clangMutex);
         auto &manager = Context->getSourceManager();
 
-        // A check to see if the Source Location is a Macro
-        if (manager.isMacroArgExpansion(loc) ||
-            manager.isMacroBodyExpansion(loc))
-            loc = manager.getFileLoc(loc);
-
+        // Macro arguments are placed where they were written, and the rest of
+        // a macro expansion where the macro was expanded
+        loc = manager.getFileLoc(loc);
         auto fileid = getExporterFileId(manager.getFileID(loc), isVaList);
+
+        if (offsetPositions)
+            return {fileid, manager.getFileOffset(loc)};
+
         auto line = manager.getPresumedLineNumber(loc);
         auto col = manager.getPresumedColumnNumber(loc);
-
-        cbor_encode_uint(enc, fileid);
-        cbor_encode_uint(enc, line);
-        cbor_encode_uint(enc, col);
+        return {fileid, line, col};
     }
 
-    void encodeSourceSpan(CborEncoder *enc, SourceRange loc, bool isVaList = false) {
+    // The file ID of a range followed by the positions of its ends
+    SmallVector<uint64_t, 5> getSourceSpan(SourceRange loc,
+                                           bool isVaList = false) {
+        ClangLock lock(clangMutex);
         auto &manager = Context->getSourceManager();
 
-        auto begin = loc.getBegin();
-        auto end = loc.getEnd();
-        // A check to see if the Source Location is a Macro
-        if (manager.isMacroArgExpansion(begin) ||
-            manager.isMacroBodyExpansion(begin))
-            begin = manager.getFileLoc(begin);
-        if (manager.isMacroArgExpansion(end) ||
-            manager.isMacroBodyExpansion(end))
-            end = manager.getFileLoc(end);
-
+        // Resolved as in getSourcePos
+        auto begin = manager.getFileLoc(loc.getBegin());
+        auto end = manager.getFileLoc(loc.getEnd());
         auto fileid = getExporterFileId(manager.getFileID(begin), isVaList);
+
+        // Lines and columns are computed by the reader from the line starts
+        // of the file, which is much cheaper than presumed locations.
+        if (offsetPositions)
+            return {fileid, manager.getFileOffset(begin),
+                    manager.getFileOffset(end)};
+
         auto begin_line = manager.getPresumedLineNumber(begin);
         auto begin_col = manager.getPresumedColumnNumber(begin);
         auto end_line = manager.getPresumedLineNumber(end);
         auto end_col = manager.getPresumedColumnNumber(end);
-
-        cbor_encode_uint(enc, fileid);
-        cbor_encode_uint(enc, begin_line);
-        cbor_encode_uint(enc, begin_col);
-        cbor_encode_uint(enc, end_line);
-        cbor_encode_uint(enc, end_col);
+        return {fileid, begin_line, begin_col, end_line, end_col};
     }
 
     uint64_t getExporterFileId(FileID id, bool isVaList) {
         if (id.isInvalid())
             return 0;
 
+        // A precompiled preamble is built from a copy of the start of the
+        // main file, with the same line and column numbers (see
+        // PreambleCache), so report locations in the copy as main file ones.
+        auto &manager = Context->getSourceManager();
+        if (id == manager.getPreambleFileID())
+            id = manager.getMainFileID();
+
+        // Files are numbered when the parts encoded in parallel are merged
+        if (nodeIds.usesAddresses()) {
+            fileRefs[id.getHashValue()] = id;
+            return (uint64_t(id.getHashValue()) << 1) | isVaList;
+        }
+
         auto file = file_id_mapping.find(id);
         if (file != file_id_mapping.end())
             return file->second;
 
-        auto &manager = Context->getSourceManager();
+        // Headers without include guards get a FileID per #include. With
+        // offset positions, such a header is exported once, with the location
+        // of its first #include, since its line starts are the same each
+        // time. Each #include is exported as a file of its own otherwise.
         auto entry = manager.getFileEntryForID(id);
+        if (entry && offsetPositions) {
+            auto file = file_entry_mapping.find(entry);
+            if (file != file_entry_mapping.end()) {
+                file_id_mapping[id] = file->second;
+                return file->second;
+            }
+        }
 
         auto filename = string("?");
         if (entry)
@@ -800,7 +1442,10 @@ class TranslateASTVisitor final
 
         auto new_id = files.size();
         files.push_back(std::make_pair(filename, manager.getIncludeLoc(id)));
+        fileContents.push_back(id);
         file_id_mapping[id] = new_id;
+        if (entry && offsetPositions)
+            file_entry_mapping[entry] = new_id;
         return new_id;
     }
 
@@ -810,7 +1455,7 @@ class TranslateASTVisitor final
 
     /*
     bool VisitAttributedStmt(AttributedStmt *S) {
-        std::vector<void*> childIds { S->getSubStmt() };
+        SmallVector<void *, 8> childIds { S->getSubStmt() };
         encode_entry(S, TagAttributedStmt, childIds,
                      [S](CborEncoder *array){
                          for (auto s: S->getAttrs()) {
@@ -821,8 +1466,28 @@ class TranslateASTVisitor final
     }
     */
 
+    // Visitors of the nodes described by ast_schema.def. Their children are
+    // passed as a fixed-size initializer list and their extras as a lambda
+    // encoding them in order.
+#define CHILD(Field, Accessor, Kind, Presence) S->Accessor(),
+#define CHILDREN(...) {__VA_ARGS__}
+#define EXTRA(Field, Accessor, Type) encode##Type##Extra(extras, S->Accessor());
+#define EXTRAS(...) [&](CborEncoder *extras) { (void)extras; __VA_ARGS__ }
+#define NODE(Class, Children, Extras)                               \
+    bool Visit##Class(Class *S) {                                   \
+        std::initializer_list<void *> childIds = Children;          \
+        encode_entry(S, Tag##Class, childIds, Extras);              \
+        return true;                                                \
+    }
+#include "ast_schema.def"
+#undef NODE
+#undef EXTRAS
+#undef EXTRA
+#undef CHILDREN
+#undef CHILD
+
     bool VisitCompoundStmt(CompoundStmt *CS) {
-        std::vector<void *> childIds;
+        SmallVector<void *, 8> childIds;
         for (auto x : CS->children()) {
             childIds.push_back(x);
         }
@@ -831,20 +1496,8 @@ class TranslateASTVisitor final
         return true;
     }
 
-    bool VisitReturnStmt(ReturnStmt *RS) {
-        std::vector<void *> childIds = {RS->getRetValue()};
-        encode_entry(RS, TagReturnStmt, childIds);
-        return true;
-    }
-
-    bool VisitDoStmt(DoStmt *S) {
-        std::vector<void *> childIds = {S->getBody(), S->getCond()};
-        encode_entry(S, TagDoStmt, childIds);
-        return true;
-    }
-
     bool VisitGotoStmt(GotoStmt *GS) {
-        std::vector<void *> childIds = {GS->getLabel()->getStmt()};
+        SmallVector<void *, 8> childIds = {GS->getLabel()->getStmt()};
         encode_entry(GS, TagGotoStmt, childIds);
         return true;
     }
@@ -857,41 +1510,6 @@ class TranslateASTVisitor final
         abort();
     }
 
-    bool VisitLabelStmt(LabelStmt *LS) {
-
-        std::vector<void *> childIds = {LS->getSubStmt()};
-        encode_entry(LS, TagLabelStmt, childIds, [LS](CborEncoder *array) {
-            cbor_encode_text_stringz(array, LS->getName());
-        });
-        return true;
-    }
-
-    bool VisitNullStmt(NullStmt *NS) {
-        std::vector<void *> childIds;
-        encode_entry(NS, TagNullStmt, childIds);
-        return true;
-    }
-
-    bool VisitIfStmt(IfStmt *IS) {
-        std::vector<void *> childIds = {IS->getCond(), IS->getThen(),
-                                        IS->getElse()};
-        encode_entry(IS, TagIfStmt, childIds);
-        return true;
-    }
-
-    bool VisitForStmt(ForStmt *FS) {
-        std::vector<void *> childIds = {FS->getInit(), FS->getCond(),
-                                        FS->getInc(), FS->getBody()};
-        encode_entry(FS, TagForStmt, childIds);
-        return true;
-    }
-
-    bool VisitWhileStmt(WhileStmt *WS) {
-        std::vector<void *> childIds = {WS->getCond(), WS->getBody()};
-        encode_entry(WS, TagWhileStmt, childIds);
-        return true;
-    }
-
     bool VisitDeclStmt(DeclStmt *DS) {
 
         LLVM_DEBUG(dbgs() << "Visit ");
@@ -900,12 +1518,13 @@ class TranslateASTVisitor final
         // We copy only canonical decls and VarDecl's that are extern/local.
         // For more on the latter, see the comment at the top of
         // `VisitVarDecl`
-        std::vector<void *> childIds;
+        SmallVector<void *, 8> childIds;
         std::copy_if(DS->decl_begin(), DS->decl_end(),
-                     std::back_inserter(childIds), [](Decl *decl) {
+                     std::back_inserter(childIds), [this](Decl *decl) {
                          if (decl->isCanonicalDecl())
                              return true;
 
+                         ClangLock lock(clangMutex);
                          if (VarDecl *var_decl = dyn_cast<VarDecl>(decl))
                              return var_decl->isExternC() &&
                                     var_decl->isLocalVarDecl();
@@ -917,18 +1536,6 @@ class TranslateASTVisitor final
         return true;
     }
 
-    bool VisitBreakStmt(BreakStmt *BS) {
-        std::vector<void *> childIds;
-        encode_entry(BS, TagBreakStmt, childIds);
-        return true;
-    }
-
-    bool VisitContinueStmt(ContinueStmt *S) {
-        std::vector<void *> childIds;
-        encode_entry(S, TagContinueStmt, childIds);
-        return true;
-    }
-
     bool VisitCaseStmt(CaseStmt *CS) {
         auto expr = CS->getLHS();
 
@@ -940,7 +1547,7 @@ class TranslateASTVisitor final
             abort();
         }
 
-        std::vector<void *> childIds{expr, CS->getSubStmt()};
+        SmallVector<void *, 8> childIds{expr, CS->getSubStmt()};
         encode_entry(CS, TagCaseStmt, childIds, [value](CborEncoder *extra) {
             cbor_encode_boolean(extra, value.isSigned());
             if (value.isSigned()) {
@@ -952,18 +1559,6 @@ class TranslateASTVisitor final
         return true;
     }
 
-    bool VisitSwitchStmt(SwitchStmt *SS) {
-        std::vector<void *> childIds = {SS->getCond(), SS->getBody()};
-        encode_entry(SS, TagSwitchStmt, childIds);
-        return true;
-    }
-
-    bool VisitDefaultStmt(DefaultStmt *DS) {
-        std::vector<void *> childIds = {DS->getSubStmt()};
-        encode_entry(DS, TagDefaultStmt, childIds);
-        return true;
-    }
-
     // Encode ASM statements using the following encoding:
     // Child IDs: inputs expressions, output expressions
     // Extras:
@@ -977,14 +1572,19 @@ class TranslateASTVisitor final
     // match the length of the corresponding constraint arrays.
     bool VisitGCCAsmStmt(GCCAsmStmt *E) {
 
-        std::vector<void *> childIds;
+        SmallVector<void *, 8> childIds;
         copy(E->begin_inputs(), E->end_inputs(), std::back_inserter(childIds));
         copy(E->begin_outputs(), E->end_outputs(),
              std::back_inserter(childIds));
 
         encode_entry(E, TagAsmStmt, childIds, [E, this](CborEncoder *local) {
             cbor_encode_boolean(local, E->isVolatile());
-            cbor_encode_string(local, E->generateAsmString(*Context));
+            std::string asmString;
+            {
+                ClangLock lock(clangMutex);
+                asmString = E->generateAsmString(*Context);
+            }
+            encodeStringRef(local, asmString);
 
             std::vector<std::string> outputs, inputs, clobbers;
             std::vector<TargetInfo::ConstraintInfo> output_infos;
@@ -1028,9 +1628,9 @@ class TranslateASTVisitor final
                     clobber = Context->getTargetInfo().getNormalizedGCCRegisterName(clobber);
                 clobbers.emplace_back(clobber);
             }
-            cbor_encode_string_array(local, ArrayRef<std::string>(inputs));
-            cbor_encode_string_array(local, ArrayRef<std::string>(outputs));
-            cbor_encode_string_array(local, ArrayRef<std::string>(clobbers));
+            encodeStringRefs(local, inputs);
+            encodeStringRefs(local, outputs);
+            encodeStringRefs(local, clobbers);
         });
         return true;
     }
@@ -1077,20 +1677,40 @@ class TranslateASTVisitor final
         // if (!E->isConstantInitializer(*Context, false))
         //     return true;
 
-        auto &Mgr = Context->getSourceManager();
         auto Range = E->getSourceRange();
-        LLVM_DEBUG(dbgs() << "Checking expr for macro expansion: ");
-        LLVM_DEBUG(E->dump());
-        LLVM_DEBUG(Range.getBegin().dump(Mgr));
-        LLVM_DEBUG(Range.getEnd().dump(Mgr));
-
         auto Begin = Range.getBegin();
         auto End = Range.getEnd();
+        if (!Begin.isMacroID() || !End.isMacroID())
+            return true;
+
+        // The macros expanded to E, found while holding the lock and visited
+        // after releasing it
+        SmallVector<std::tuple<StringRef, SourceLocation, MacroInfo *>, 2>
+            expansions;
+        findMacroExpansions(E, Begin, End, expansions);
+        for (auto &expansion : expansions) {
+            auto mac = std::get<2>(expansion);
+            if (VisitMacro(std::get<0>(expansion), std::get<1>(expansion), mac, E)) {
+                curMacroExpansionStack.push_back(mac);
+            }
+        }
+        return true;
+    }
+
+    void findMacroExpansions(
+        Expr *E, SourceLocation Begin, SourceLocation End,
+        SmallVectorImpl<std::tuple<StringRef, SourceLocation, MacroInfo *>>
+            &expansions) {
+        ClangLock lock(clangMutex);
+        auto &Mgr = Context->getSourceManager();
+        LLVM_DEBUG(dbgs() << "Checking expr for macro expansion: ");
+        LLVM_DEBUG(E->dump());
+        LLVM_DEBUG(Begin.dump(Mgr));
+        LLVM_DEBUG(End.dump(Mgr));
 
         // Check that we are only expanding a single macro call.
-        if (!Begin.isMacroID() || !End.isMacroID() ||
-            Mgr.getImmediateMacroCallerLoc(Begin) != Mgr.getImmediateMacroCallerLoc(End))
-            return true;
+        if (Mgr.getImmediateMacroCallerLoc(Begin) != Mgr.getImmediateMacroCallerLoc(End))
+            return;
 
         if (Begin.isMacroID()) {
 #if CLANG_VERSION_MAJOR < 7
@@ -1120,10 +1740,24 @@ class TranslateASTVisitor final
             auto ExpansionEnd = ExpansionRange.getEnd();
 #endif
             StringRef name;
-            MacroInfo *mac = getMacroInfo(ExpansionBegin, name);
+            MacroInfo *mac;
+            if (!macroExpansions ||
+                !MacroExpansionIndex::isRecorded(Mgr, ExpansionBegin)) {
+                mac = getMacroInfo(ExpansionBegin, name);
+            } else if (auto expansion =
+                           macroExpansions->lookup(ExpansionBegin)) {
+                mac = expansion->info;
+                name = expansion->name;
+                ExpansionBegin = expansion->range.getBegin();
+                ExpansionEnd = expansion->range.getEnd();
+            } else {
+                // Every macro expanded here was recorded, so this is where
+                // an argument was substituted rather than a macro name
+                return;
+            }
 
             if (!mac || mac->getNumTokens() == 0)
-                return true;
+                return;
             auto ReplacementBegin = mac->getReplacementToken(0).getLocation();
             auto ReplacementEnd = mac->getDefinitionEndLoc();
             // Verify that this expansion covers the entire macro replacement
@@ -1131,21 +1765,18 @@ class TranslateASTVisitor final
             // replacement.
             if (Mgr.getSpellingLoc(Begin) != ReplacementBegin ||
                 Mgr.getSpellingLoc(End) != ReplacementEnd)
-                return true;
+                return;
 
             Begin = ExpansionBegin;
             End = ExpansionEnd;
 
-            if (VisitMacro(name, Begin, mac, E)) {
-                curMacroExpansionStack.push_back(mac);
-            }
+            expansions.emplace_back(name, Begin, mac);
         }
-        return true;
     }
 
 
     bool VisitVAArgExpr(VAArgExpr *E) {
-        std::vector<void *> childIds{E->getSubExpr()};
+        SmallVector<void *, 8> childIds{E->getSubExpr()};
         encode_entry(E, TagVAArgExpr, childIds);
         return true;
     }
@@ -1156,7 +1787,7 @@ class TranslateASTVisitor final
     }
 
     bool VisitUnaryExprOrTypeTraitExpr(UnaryExprOrTypeTraitExpr *E) {
-        std::vector<void *> childIds{
+        SmallVector<void *, 8> childIds{
             E->isArgumentType() ? nullptr : E->getArgumentExpr()};
         auto t = E->getTypeOfArgument();
         auto qt = typeEncoder.encodeQualType(t);
@@ -1165,16 +1796,16 @@ class TranslateASTVisitor final
             [E, t, qt, this](CborEncoder *extras) {
                 switch (E->getKind()) {
                 case UETT_SizeOf:
-                    cbor_encode_text_stringz(extras, "sizeof");
+                    encodeStringRef(extras, "sizeof");
                     break;
                 case UETT_AlignOf:
-                    cbor_encode_text_stringz(extras, "alignof");
+                    encodeStringRef(extras, "alignof");
                     break;
                 case UETT_VecStep:
-                    cbor_encode_text_stringz(extras, "vecstep");
+                    encodeStringRef(extras, "vecstep");
                     break;
                 case UETT_OpenMPRequiredSimdAlign:
-                    cbor_encode_text_stringz(extras, "openmprequiredsimdalign");
+                    encodeStringRef(extras, "openmprequiredsimdalign");
                     break;
 #if CLANG_VERSION_MAJOR >= 8
                 case UETT_PreferredAlignOf: {
@@ -1188,6 +1819,7 @@ class TranslateASTVisitor final
                     // preferred alignment if needed.
 
                     const clang::Type *T = t.getTypePtr();
+                    ClangLock lock(clangMutex);
                     TypeInfo TI = this->Context->getTypeInfo(T);
                     unsigned ABIAlign = TI.Align;
                     T = T->getBaseElementTypeUnsafe();
@@ -1200,9 +1832,9 @@ class TranslateASTVisitor final
                     if (T->isSpecificBuiltinType(BuiltinType::Double) ||
                         T->isSpecificBuiltinType(BuiltinType::LongLong) ||
                         T->isSpecificBuiltinType(BuiltinType::ULongLong))
-                        cbor_encode_text_stringz(extras, "preferredalignof");
+                        encodeStringRef(extras, "preferredalignof");
                     else
-                        cbor_encode_text_stringz(extras, "alignof");
+                        encodeStringRef(extras, "alignof");
                     break;
                 }
 #endif // CLANG_VERSION_MAJOR
@@ -1210,24 +1842,27 @@ class TranslateASTVisitor final
                     this->printError("Could not match UnaryExprOrTypeTrait", E);
                     abort();
                 }
-                cbor_encode_uint(extras, qt);
+                typeEncoder.encodeTypeId(extras, qt);
             });
         typeEncoder.VisitQualType(t);
         return true;
     }
 
     bool VisitStmtExpr(StmtExpr *E) {
-        std::vector<void *> childIds{E->getSubStmt()};
+        SmallVector<void *, 8> childIds{E->getSubStmt()};
         encode_entry(E, TagStmtExpr, childIds);
         return true;
     }
 
     bool VisitOffsetOfExpr(OffsetOfExpr *E) {
-        std::vector<void *> childIds;
+        SmallVector<void *, 8> childIds;
 
         APSInt value;
-        bool is_constant =
-            E->isIntegerConstantExpr(value, *this->Context);
+        bool is_constant;
+        {
+            ClangLock lock(clangMutex);
+            is_constant = E->isIntegerConstantExpr(value, *this->Context);
+        }
 
         encode_entry(
             E, TagOffsetOfExpr, childIds, [this, E, value, is_constant](CborEncoder *extras) {
@@ -1255,9 +1890,9 @@ class TranslateASTVisitor final
                     auto expr0 = E->getIndexExpr(0);
 
                     cbor_encode_null(extras);
-                    cbor_encode_uint(extras, qt);
-                    cbor_encode_uint(extras, uintptr_t(field));
-                    cbor_encode_uint(extras, uintptr_t(expr0));
+                    typeEncoder.encodeTypeId(extras, qt);
+                    nodeIds.encode(extras, field);
+                    nodeIds.encode(extras, expr0);
                 }
             });
 
@@ -1271,12 +1906,6 @@ class TranslateASTVisitor final
         return true;
     }
 
-    bool VisitParenExpr(ParenExpr *E) {
-        std::vector<void *> childIds{E->getSubExpr()};
-        encode_entry(E, TagParenExpr, childIds);
-        return true;
-    }
-
     /*
      [C99 6.5.2.3] Structure and Union Members.
      Children:
@@ -1286,7 +1915,7 @@ class TranslateASTVisitor final
      - true: is arrow; false: is dot
      */
     bool VisitMemberExpr(MemberExpr *E) {
-        std::vector<void *> childIds{E->getBase(),
+        SmallVector<void *, 8> childIds{E->getBase(),
                                      E->getMemberDecl()->getCanonicalDecl()};
         encode_entry(E, TagMemberExpr, childIds, [E](CborEncoder *extras) {
             cbor_encode_boolean(extras, E->isArrow());
@@ -1294,18 +1923,6 @@ class TranslateASTVisitor final
         return true;
     }
 
-    /*
-     [C99 6.5.2.5] Compound literal expression
-     Children:
-     - initializer expression
-     Extras: (none)
-     */
-    bool VisitCompoundLiteralExpr(CompoundLiteralExpr *E) {
-        std::vector<void *> childIds{E->getInitializer()};
-        encode_entry(E, TagCompoundLiteralExpr, childIds);
-        return true;
-    }
-
     bool VisitExtVectorElementExpr(ExtVectorElementExpr *E) {
         printWarning("Encountered unsupported vector element expression", E);
         return true;
@@ -1319,19 +1936,19 @@ class TranslateASTVisitor final
     bool VisitInitListExpr(InitListExpr *ILE) {
         auto inits = ILE->inits();
 
-        std::vector<void *> childIds(inits.begin(), inits.end());
+        SmallVector<void *, 8> childIds(inits.begin(), inits.end());
         encode_entry(ILE, TagInitListExpr, childIds,
-                     [ILE](CborEncoder *extras) {
+                     [this, ILE](CborEncoder *extras) {
                          auto union_field = ILE->getInitializedFieldInUnion();
                          if (union_field) {
-                             cbor_encode_uint(extras, uintptr_t(union_field));
+                             nodeIds.encode(extras, union_field);
                          } else {
                              cbor_encode_null(extras);
                          }
 
                          auto syntax = ILE->getSyntacticForm();
                          if (syntax) {
-                             cbor_encode_uint(extras, uintptr_t(syntax));
+                             nodeIds.encode(extras, syntax);
                          } else {
                              cbor_encode_null(extras);
                          }
@@ -1352,10 +1969,11 @@ class TranslateASTVisitor final
      [3, array_start, array_end] { [1 .. 2] = 3 }
      */
     bool VisitDesignatedInitExpr(DesignatedInitExpr *E) {
-        std::vector<void *> childIds{E->getInit()};
+        SmallVector<void *, 8> childIds{E->getInit()};
 
         encode_entry(
             E, TagDesignatedInitExpr, childIds, [this, E](CborEncoder *extras) {
+                ClangLock lock(clangMutex);
                 CborEncoder array;
                 cbor_encoder_create_array(extras, &array,
                                           E->designators().size());
@@ -1377,8 +1995,7 @@ class TranslateASTVisitor final
                     } else if (designator.isFieldDesignator()) {
                         cbor_encoder_create_array(&array, &entry, 2);
                         cbor_encode_int(&entry, 2);
-                        cbor_encode_uint(&entry,
-                                         uintptr_t(designator.getField()));
+                        nodeIds.encode(&entry, designator.getField());
                     } else if (designator.isArrayRangeDesignator()) {
                         cbor_encoder_create_array(&array, &entry, 3);
                         cbor_encode_int(&entry, 3);
@@ -1413,13 +2030,13 @@ class TranslateASTVisitor final
     }
 
     bool VisitPredefinedExpr(PredefinedExpr *E) {
-        std::vector<void *> childIds{E->getFunctionName()};
+        SmallVector<void *, 8> childIds{E->getFunctionName()};
         encode_entry(E, TagPredefinedExpr, childIds);
         return true;
     }
 
     bool VisitImplicitValueInitExpr(ImplicitValueInitExpr *E) {
-        std::vector<void *> childIds;
+        SmallVector<void *, 8> childIds;
         encode_entry(E, TagImplicitValueInitExpr, childIds);
         return true;
     }
@@ -1430,9 +2047,9 @@ class TranslateASTVisitor final
     }
 
     bool VisitImplicitCastExpr(ImplicitCastExpr *ICE) {
-        std::vector<void *> childIds = {ICE->getSubExpr()};
+        SmallVector<void *, 8> childIds = {ICE->getSubExpr()};
         encode_entry(
-            ICE, TagImplicitCastExpr, childIds, [ICE](CborEncoder *array) {
+            ICE, TagImplicitCastExpr, childIds, [this, ICE](CborEncoder *array) {
                 auto cast_name = ICE->getCastKindName();
 
 #if CLANG_VERSION_MAJOR < 8
@@ -1464,13 +2081,13 @@ class TranslateASTVisitor final
                     }
                 }
 
-                cbor_encode_text_stringz(array, cast_name);
+                encodeStringRef(array, cast_name);
             });
         return true;
     }
 
     bool VisitCStyleCastExpr(CStyleCastExpr *E) {
-        std::vector<void *> childIds = {E->getSubExpr()};
+        SmallVector<void *, 8> childIds = {E->getSubExpr()};
 
         if (E->getCastKind() == CastKind::CK_ToUnion) {
 
@@ -1492,23 +2109,23 @@ class TranslateASTVisitor final
             childIds.push_back(target_field);
         }
 
-        encode_entry(E, TagCStyleCastExpr, childIds, [E](CborEncoder *array) {
-            cbor_encode_text_stringz(array, E->getCastKindName());
+        encode_entry(E, TagCStyleCastExpr, childIds, [this, E](CborEncoder *array) {
+            encodeStringRef(array, E->getCastKindName());
         });
         return true;
     }
 
     bool VisitUnaryOperator(UnaryOperator *UO) {
-        std::vector<void *> childIds = {UO->getSubExpr()};
-        encode_entry(UO, TagUnaryOperator, childIds, [UO](CborEncoder *array) {
-            cbor_encode_string(array, UO->getOpcodeStr(UO->getOpcode()).str());
+        SmallVector<void *, 8> childIds = {UO->getSubExpr()};
+        encode_entry(UO, TagUnaryOperator, childIds, [this, UO](CborEncoder *array) {
+            encodeStringRef(array, UO->getOpcodeStr(UO->getOpcode()));
             cbor_encode_boolean(array, UO->isPrefix());
         });
         return true;
     }
 
     bool VisitBinaryOperator(BinaryOperator *BO) {
-        std::vector<void *> childIds = {BO->getLHS(), BO->getRHS()};
+        SmallVector<void *, 8> childIds = {BO->getLHS(), BO->getRHS()};
 
         QualType computationLHSType, computationResultType;
 
@@ -1522,7 +2139,7 @@ class TranslateASTVisitor final
         encode_entry(BO, TagBinaryOperator, childIds,
                      [this, BO, computationLHSType,
                       computationResultType](CborEncoder *array) {
-                         cbor_encode_string(array, BO->getOpcodeStr().str());
+                         encodeStringRef(array, BO->getOpcodeStr());
 
                          encode_qualtype(array, computationLHSType);
                          encode_qualtype(array, computationResultType);
@@ -1531,14 +2148,14 @@ class TranslateASTVisitor final
     }
 
     bool VisitConditionalOperator(ConditionalOperator *CO) {
-        std::vector<void *> childIds = {CO->getCond(), CO->getTrueExpr(),
+        SmallVector<void *, 8> childIds = {CO->getCond(), CO->getTrueExpr(),
                                         CO->getFalseExpr()};
         encode_entry(CO, TagConditionalOperator, childIds);
         return true;
     }
 
     bool VisitBinaryConditionalOperator(BinaryConditionalOperator *CO) {
-        std::vector<void *> childIds = {CO->getCommon(), CO->getFalseExpr()};
+        SmallVector<void *, 8> childIds = {CO->getCommon(), CO->getFalseExpr()};
         encode_entry(CO, TagBinaryConditionalOperator, childIds);
         return true;
     }
@@ -1557,7 +2174,7 @@ class TranslateASTVisitor final
 
         auto decl = DRE->getDecl()->getCanonicalDecl();
 
-        std::vector<void *> childIds{decl};
+        SmallVector<void *, 8> childIds{decl};
         encode_entry(DRE, TagDeclRefExpr, childIds);
 
         // Uses of undeclared declarations might never be traversed if we don't
@@ -1568,7 +2185,7 @@ class TranslateASTVisitor final
     }
 
     bool VisitCallExpr(CallExpr *CE) {
-        std::vector<void *> childIds = {CE->getCallee()};
+        SmallVector<void *, 8> childIds = {CE->getCallee()};
         for (auto x : CE->arguments()) {
             childIds.push_back(x);
         }
@@ -1576,22 +2193,16 @@ class TranslateASTVisitor final
         return true;
     }
 
-    bool VisitArraySubscriptExpr(ArraySubscriptExpr *E) {
-        std::vector<void *> childIds = {E->getLHS(), E->getRHS()};
-        encode_entry(E, TagArraySubscriptExpr, childIds);
-        return true;
-    }
-
     bool VisitShuffleVectorExpr(ShuffleVectorExpr *E) {
         auto children = E->children();
-        std::vector<void *> childIds(std::begin(children), std::end(children));
+        SmallVector<void *, 8> childIds(std::begin(children), std::end(children));
         encode_entry(E, TagShuffleVectorExpr, childIds);
         return true;
     }
 
     bool VisitConvertVectorExpr(ConvertVectorExpr *E) {
         auto children = E->children();
-        std::vector<void *> childIds(std::begin(children), std::end(children));
+        SmallVector<void *, 8> childIds(std::begin(children), std::end(children));
         encode_entry(E, TagConvertVectorExpr, childIds);
         return true;
     }
@@ -1599,7 +2210,7 @@ class TranslateASTVisitor final
 #if CLANG_VERSION_MAJOR >= 8
     bool VisitConstantExpr(ConstantExpr *E) {
         auto children = E->children();
-        std::vector<void *> childIds(std::begin(children), std::end(children));
+        SmallVector<void *, 8> childIds(std::begin(children), std::end(children));
 
         APSInt value;
         bool hasValue = evaluateConstantInt(E, value);
@@ -1623,14 +2234,14 @@ class TranslateASTVisitor final
 
     bool VisitAtomicExpr(AtomicExpr *E) {
         auto children = E->children();
-        std::vector<void *> childIds(std::begin(children), std::end(children));
+        SmallVector<void *, 8> childIds(std::begin(children), std::end(children));
         encode_entry(E, TagAtomicExpr, childIds,
                      [E, this](CborEncoder *array) {
                          switch (E->getOp()) {
 #define BUILTIN(ID, TYPE, ATTRS)
 #define ATOMIC_BUILTIN(ID, TYPE, ATTRS) \
                              case AtomicExpr::AO ## ID:                 \
-                                 cbor_encode_string(array, #ID);       \
+                                 encodeStringRef(array, #ID);          \
                                  break;
 #include "clang/Basic/Builtins.def"
                          default: printError("Unknown atomic builtin: " +
@@ -1647,7 +2258,7 @@ class TranslateASTVisitor final
 
     bool VisitChooseExpr(ChooseExpr *E) {
         auto children = E->children();
-        std::vector<void *> childIds(std::begin(children), std::end(children));
+        SmallVector<void *, 8> childIds(std::begin(children), std::end(children));
         encode_entry(E, TagChooseExpr, childIds,
                      [E](CborEncoder *array) {
                          cbor_encode_boolean(array, E->isConditionTrue());
@@ -1665,12 +2276,20 @@ class TranslateASTVisitor final
     // Declarations
     //
 
+    // Bodies are not traversed if only declarations are exported, including
+    // those clang parsed anyway, such as the ones in a precompiled preamble
+    bool TraverseFunctionDecl(FunctionDecl *FD) {
+        if (declsOnly)
+            return WalkUpFromFunctionDecl(FD);
+        return RecursiveASTVisitor<TranslateASTVisitor>::TraverseFunctionDecl(FD);
+    }
+
     // Some function declarations are also function definitions.
     // This method handles both types of declarations.
     bool VisitFunctionDecl(FunctionDecl *FD) {
         if (!FD->isCanonicalDecl()) {
             // Emit non-canonical decl so we have a placeholder to attach comments to
-            std::vector<void *> childIds = {FD->getCanonicalDecl()};
+            SmallVector<void *, 8> childIds = {FD->getCanonicalDecl()};
             auto span = FD->getSourceRange();
             if (FD->doesThisDeclarationHaveABody())
                 span = FD->getCanonicalDecl()->getSourceRange();
@@ -1687,10 +2306,13 @@ class TranslateASTVisitor final
         // Use the parameters from the function declaration
         // the defines the body, if one exists.
         const FunctionDecl *paramsFD = FD;
-        auto body =
-            FD->getBody(paramsFD); // replaces its argument if body exists
+        Stmt *body = nullptr;
+        if (declsOnly)
+            FD->isDefined(paramsFD); // replaces its argument if defined
+        else
+            body = FD->getBody(paramsFD); // replaces its argument if body exists
 
-        std::vector<void *> childIds;
+        SmallVector<void *, 8> childIds;
         for (auto x : paramsFD->parameters()) {
             auto cd = x->getCanonicalDecl();
             childIds.push_back(cd);
@@ -1704,8 +2326,7 @@ class TranslateASTVisitor final
         encode_entry(
             FD, TagFunctionDecl, span, childIds, functionType,
             [this, FD](CborEncoder *array) {
-                auto name = FD->getNameAsString();
-                cbor_encode_string(array, name);
+                encodeStringRef(array, FD->getName());
 
                 auto is_global = FD->isGlobal();
                 cbor_encode_boolean(array, is_global);
@@ -1735,15 +2356,13 @@ class TranslateASTVisitor final
                     auto attrs = def ? def->getAttrs() : FD->getAttrs();
 
                     for (auto attr : attrs) {
-                        cbor_encode_text_stringz(&attr_info,
-                                                 attr->getSpelling());
+                        encodeStringRef(&attr_info, attr->getSpelling());
 
                         if (auto *aa = dyn_cast<AliasAttr>(attr)) {
-                            cbor_encode_text_stringz(
-                                &attr_info, aa->getAliasee().str().c_str());
+                            encodeStringRef(&attr_info, aa->getAliasee());
                         } else if (auto *va = dyn_cast<VisibilityAttr>(attr)) {
                             const char *vis = VisibilityAttr::ConvertVisibilityTypeToStr(va->getVisibility());
-                            cbor_encode_text_stringz(&attr_info, vis);
+                            encodeStringRef(&attr_info, vis);
                         }
                     }
                 }
@@ -1768,14 +2387,22 @@ class TranslateASTVisitor final
     }*/
 
     bool VisitVarDecl(VarDecl *VD) {
+        bool is_extern_c, is_externally_visible;
+        {
+            // Linkage is computed lazily and cached in the decl
+            ClangLock lock(clangMutex);
+            is_extern_c = VD->isExternC();
+            is_externally_visible = VD->isExternallyVisible();
+        }
+
         // Skip non-canonical decls, as long as they aren't 'extern'.
         // Unfortunately, if there are two 'extern' variables in different
         // functions that should be the same at link time, Clang groups them.
         // That is unhelpful for us though, since we need to convert them into
         // two seperate `extern` blocks.
-        if (!VD->isCanonicalDecl() && !VD->isExternC()) {
+        if (!VD->isCanonicalDecl() && !is_extern_c) {
             // Emit non-canonical decl so we have a placeholder to attach comments to
-            std::vector<void *> childIds = {VD->getCanonicalDecl()};
+            SmallVector<void *, 8> childIds = {VD->getCanonicalDecl()};
             encode_entry(VD, TagNonCanonicalDecl, VD->getLocation(), childIds, VD->getType());
             typeEncoder.VisitQualType(VD->getType());
             return true;
@@ -1791,16 +2418,14 @@ class TranslateASTVisitor final
             }
         }
 
-        std::vector<void *> childIds{};
+        SmallVector<void *, 8> childIds{};
 
         // A local var def should allow for the possibility of no initializer
         // and be marked as not a definition
-        if (VD->isExternC() && VD->isLocalVarDecl()) {
+        if (is_extern_c && VD->isLocalVarDecl()) {
             is_defn = false;
         }
 
-        auto is_externally_visible = VD->isExternallyVisible();
-
         // Non static (externally visible) non definitions shouldn't receive an initializer,
         // otherwise get one
         if (!(is_externally_visible && !is_defn)) {
@@ -1819,9 +2444,8 @@ class TranslateASTVisitor final
 
         encode_entry(
             VD, TagVarDecl, loc, childIds, T,
-            [VD, is_defn, def, is_externally_visible](CborEncoder *array) {
-                auto name = VD->getNameAsString();
-                cbor_encode_string(array, name);
+            [this, VD, is_defn, def, is_externally_visible](CborEncoder *array) {
+                encodeStringRef(array, VD->getName());
 
                 auto has_static_duration =
                     VD->getStorageDuration() == SD_Static;
@@ -1845,15 +2469,12 @@ class TranslateASTVisitor final
                     auto attrs = def ? def->getAttrs() : VD->getAttrs();
 
                     for (auto attr : def->attrs()) {
-                        cbor_encode_text_stringz(&attr_info,
-                                                 attr->getSpelling());
+                        encodeStringRef(&attr_info, attr->getSpelling());
 
                         if (auto *sa = dyn_cast<SectionAttr>(attr)) {
-                            cbor_encode_text_stringz(
-                                &attr_info, sa->getName().str().c_str());
+                            encodeStringRef(&attr_info, sa->getName());
                         } else if (auto *aa = dyn_cast<AliasAttr>(attr)) {
-                            cbor_encode_text_stringz(
-                                &attr_info, aa->getAliasee().str().c_str());
+                            encodeStringRef(&attr_info, aa->getAliasee());
                         }
                     }
                 }
@@ -1876,7 +2497,7 @@ class TranslateASTVisitor final
     bool VisitRecordDecl(RecordDecl *D) {
         if (!D->isCanonicalDecl()) {
             // Emit non-canonical decl so we have a placeholder to attach comments to
-            std::vector<void *> childIds = {D->getCanonicalDecl()};
+            SmallVector<void *, 8> childIds = {D->getCanonicalDecl()};
             encode_entry(D, TagNonCanonicalDecl, D->getLocation(), childIds, QualType());
             return true;
         }
@@ -1892,7 +2513,7 @@ class TranslateASTVisitor final
         }
 
         auto loc = D->getLocation();
-        std::vector<void *> childIds;
+        SmallVector<void *, 8> childIds;
         if (def) {
             for (auto x : def->fields()) {
                 childIds.push_back(x->getCanonicalDecl());
@@ -1902,6 +2523,7 @@ class TranslateASTVisitor final
             // types.
             loc = def->getLocation();
 
+            ClangLock lock(clangMutex);
             const ASTRecordLayout &layout =
                 this->Context->getASTRecordLayout(def);
             recordAlignment = layout.getAlignment().getQuantity();
@@ -1912,13 +2534,13 @@ class TranslateASTVisitor final
 
         encode_entry(
             D, tag, loc, childIds, QualType(),
-            [D, def, recordAlignment, byteSize](CborEncoder *local) {
+            [this, D, def, recordAlignment, byteSize](CborEncoder *local) {
                 // 1. Encode name or null
-                auto name = D->getNameAsString();
+                auto name = D->getName();
                 if (name.empty()) {
                     cbor_encode_null(local);
                 } else {
-                    cbor_encode_string(local, name);
+                    encodeStringRef(local, name);
                 }
 
                 // 2. Boolean true when definition present
@@ -1929,7 +2551,7 @@ class TranslateASTVisitor final
                 size_t attrs_n = D->hasAttrs() ? D->getAttrs().size() : 0;
                 cbor_encoder_create_array(local, &attrs, attrs_n);
                 for (auto a : D->attrs()) {
-                    cbor_encode_text_stringz(&attrs, a->getSpelling());
+                    encodeStringRef(&attrs, a->getSpelling());
                 }
                 cbor_encoder_close_container(local, &attrs);
 
@@ -1971,7 +2593,7 @@ class TranslateASTVisitor final
             abort();
         }
 
-        std::vector<void *> childIds;
+        SmallVector<void *, 8> childIds;
         for (auto x : D->enumerators()) {
             childIds.push_back(x->getCanonicalDecl());
         }
@@ -1980,12 +2602,12 @@ class TranslateASTVisitor final
         typeEncoder.VisitQualType(underlying_type);
 
         encode_entry(D, TagEnumDecl, childIds, underlying_type,
-                     [D](CborEncoder *local) {
-                         auto name = D->getNameAsString();
+                     [this, D](CborEncoder *local) {
+                         auto name = D->getName();
                          if (name.empty()) {
                              cbor_encode_null(local);
                          } else {
-                             cbor_encode_string(local, name);
+                             encodeStringRef(local, name);
                          }
                      });
 
@@ -1995,17 +2617,16 @@ class TranslateASTVisitor final
     bool VisitEnumConstantDecl(EnumConstantDecl *D) {
         if (!D->isCanonicalDecl()) {
             // Emit non-canonical decl so we have a placeholder to attach comments to
-            std::vector<void *> childIds = {D->getCanonicalDecl()};
+            SmallVector<void *, 8> childIds = {D->getCanonicalDecl()};
             encode_entry(D, TagNonCanonicalDecl, D->getLocation(), childIds, QualType());
             return true;
         }
 
-        std::vector<void *> childIds; // = { D->getInitExpr() };
+        SmallVector<void *, 8> childIds; // = { D->getInitExpr() };
 
         encode_entry(D, TagEnumConstantDecl, childIds, QualType(),
-                     [D](CborEncoder *local) {
-                         auto name = D->getNameAsString();
-                         cbor_encode_string(local, name);
+                     [this, D](CborEncoder *local) {
+                         encodeStringRef(local, D->getName());
 
                          auto value = D->getInitVal();
                          cbor_encode_boolean(local, value.isSigned());
@@ -2021,13 +2642,13 @@ class TranslateASTVisitor final
     bool VisitFieldDecl(FieldDecl *D) {
         if (!D->isCanonicalDecl()) {
             // Emit non-canonical decl so we have a placeholder to attach comments to
-            std::vector<void *> childIds = {D->getCanonicalDecl()};
+            SmallVector<void *, 8> childIds = {D->getCanonicalDecl()};
             encode_entry(D, TagNonCanonicalDecl, D->getLocation(), childIds, D->getType());
             typeEncoder.VisitQualType(D->getType());
             return true;
         }
 
-        std::vector<void *> childIds;
+        SmallVector<void *, 8> childIds;
         auto t = D->getType();
         if(isa<AtomicType>(t)) {
             printC11AtomicError(D);
@@ -2035,21 +2656,26 @@ class TranslateASTVisitor final
         }
 
         auto record = D->getParent();
-        const ASTRecordLayout &layout =
-            this->Context->getASTRecordLayout(record);
-        auto index = D->getFieldIndex();
-        auto bitOffset = layout.getFieldOffset(index);
-        auto bitWidth = this->Context->getTypeSize(t);
+        uint64_t bitOffset, bitWidth, bitfieldWidth = 0;
+        {
+            ClangLock lock(clangMutex);
+            const ASTRecordLayout &layout =
+                this->Context->getASTRecordLayout(record);
+            bitOffset = layout.getFieldOffset(D->getFieldIndex());
+            bitWidth = this->Context->getTypeSize(t);
+            // Evaluates the width expression in the ASTContext
+            if (D->isBitField())
+                bitfieldWidth = D->getBitWidthValue(*this->Context);
+        }
         encode_entry(D, TagFieldDecl, childIds, t,
-                     [D, this, bitOffset, bitWidth](CborEncoder *array) {
+                     [D, this, bitOffset, bitWidth,
+                      bitfieldWidth](CborEncoder *array) {
                          // 1. Encode field name
-                         auto name = D->getNameAsString();
-                         cbor_encode_string(array, name);
+                         encodeStringRef(array, D->getName());
 
                          // 2. Encode bitfield width if any
                          if (D->isBitField()) {
-                             cbor_encode_uint(
-                                 array, D->getBitWidthValue(*this->Context));
+                             cbor_encode_uint(array, bitfieldWidth);
                          } else {
                              cbor_encode_null(array);
                          };
@@ -2072,17 +2698,16 @@ class TranslateASTVisitor final
         auto typeForDecl = D->getUnderlyingType();
         if (!D->isCanonicalDecl()) {
             // Emit non-canonical decl so we have a placeholder to attach comments to
-            std::vector<void *> childIds = {D->getCanonicalDecl()};
+            SmallVector<void *, 8> childIds = {D->getCanonicalDecl()};
             encode_entry(D, TagNonCanonicalDecl, D->getLocation(), childIds, typeForDecl);
             typeEncoder.VisitQualType(typeForDecl);
             return true;
         }
 
-        std::vector<void *> childIds;
+        SmallVector<void *, 8> childIds;
         encode_entry(D, TagTypedefDecl, childIds, typeForDecl,
-                     [D](CborEncoder *array) {
-                         auto name = D->getNameAsString();
-                         cbor_encode_string(array, name);
+                     [this, D](CborEncoder *array) {
+                         encodeStringRef(array, D->getName());
 
                          cbor_encode_boolean(array, D->isImplicit());
                      });
@@ -2099,14 +2724,18 @@ class TranslateASTVisitor final
     bool VisitIntegerLiteral(IntegerLiteral *IL) {
 
         auto &sourceManager = Context->getSourceManager();
-        auto prefix = sourceManager.getCharacterData(IL->getLocation());
+        const char *prefix;
+        {
+            ClangLock lock(clangMutex);
+            prefix = sourceManager.getCharacterData(IL->getLocation());
+        }
         auto value = IL->getValue().getLimitedValue();
 
         auto base = (value == 0 || prefix[0] != '0')
                         ? 10U
                         : (prefix[1] == 'x' || prefix[1] == 'X') ? 16U : 8U;
 
-        std::vector<void *> childIds;
+        SmallVector<void *, 8> childIds;
         encode_entry(IL, TagIntegerLiteral, childIds,
                      [value, base](CborEncoder *array) {
                          cbor_encode_uint(array, value);
@@ -2128,7 +2757,7 @@ class TranslateASTVisitor final
     }
 
     bool VisitCharacterLiteral(CharacterLiteral *L) {
-        std::vector<void *> childIds;
+        SmallVector<void *, 8> childIds;
         encode_entry(L, TagCharacterLiteral, childIds, [L](CborEncoder *array) {
             auto lit = L->getValue();
             cbor_encode_uint(array, lit);
@@ -2137,7 +2766,7 @@ class TranslateASTVisitor final
     }
 
     bool VisitStringLiteral(clang::StringLiteral *SL) {
-        std::vector<void *> childIds;
+        SmallVector<void *, 8> childIds;
         encode_entry(SL, TagStringLiteral, childIds, [SL](CborEncoder *array) {
             // C and C++ supports different string types, so
             // we need to identify the string literal type
@@ -2174,15 +2803,19 @@ class TranslateASTVisitor final
     bool VisitFloatingLiteral(clang::FloatingLiteral *L) {
 
         auto &sourceManager = Context->getSourceManager();
-        auto prefix = sourceManager.getCharacterData(L->getLocation());
+        const char *prefix;
+        {
+            ClangLock lock(clangMutex);
+            prefix = sourceManager.getCharacterData(L->getLocation());
+        }
         auto lexeme = matchFloatingLiteral(prefix);
 
-        std::vector<void *> childIds;
+        SmallVector<void *, 8> childIds;
         encode_entry(L, TagFloatingLiteral, childIds,
-                     [L, &lexeme](CborEncoder *array) {
+                     [this, L, &lexeme](CborEncoder *array) {
                          auto lit = L->getValueAsApproximateDouble();
                          cbor_encode_double(array, lit);
-                         cbor_encode_string(array, lexeme);
+                         encodeStringRef(array, lexeme);
                      });
         return true;
     }
@@ -2228,6 +2861,7 @@ class TranslateASTVisitor final
     }
 
     void printWarning(std::string Message, Decl *D) {
+        ClangLock lock(clangMutex);
         auto DiagBuilder =
             getDiagBuilder(D->getLocation(), DiagnosticsEngine::Warning);
         DiagBuilder.AddString(Message);
@@ -2236,6 +2870,7 @@ class TranslateASTVisitor final
     }
 
     void printWarning(std::string Message, Expr *E) {
+        ClangLock lock(clangMutex);
         auto DiagBuilder =
             getDiagBuilder(E->getExprLoc(), DiagnosticsEngine::Warning);
         DiagBuilder.AddString(Message);
@@ -2249,6 +2884,7 @@ class TranslateASTVisitor final
     }
 
     void printError(std::string Message, Decl *D) {
+        ClangLock lock(clangMutex);
         auto DiagBuilder =
                 getDiagBuilder(D->getLocation(), DiagnosticsEngine::Error);
         DiagBuilder.AddString(Message);
@@ -2257,6 +2893,7 @@ class TranslateASTVisitor final
     }
 
     void printError(std::string Message, Stmt *S) {
+        ClangLock lock(clangMutex);
 #if CLANG_VERSION_MAJOR < 8
         SourceLocation loc = S->getLocStart();
 #else
@@ -2280,8 +2917,8 @@ void TypeEncoder::VisitRecordType(const RecordType *T) {
 
     auto tag = T->isStructureType() ? TagStructType : TagUnionType;
 
-    encodeType(T, tag, [T](CborEncoder *local) {
-        cbor_encode_uint(local, uintptr_t(T->getDecl()->getCanonicalDecl()));
+    encodeType(T, tag, [this, T](CborEncoder *local) {
+        nodeIds->encode(local, T->getDecl()->getCanonicalDecl());
     });
 
     // record type might be anonymous and have no top-level declaration
@@ -2298,8 +2935,8 @@ void TypeEncoder::VisitTypedefType(const TypedefType *T) {
 
     auto D = T->getDecl()->getCanonicalDecl();
 
-    encodeType(T, TagTypedefType, [D](CborEncoder *local) {
-        cbor_encode_uint(local, uintptr_t(D));
+    encodeType(T, TagTypedefType, [this, D](CborEncoder *local) {
+        nodeIds->encode(local, D);
     });
     astEncoder->TraverseDecl(D);
 }
@@ -2311,10 +2948,10 @@ void TypeEncoder::VisitVariableArrayType(const VariableArrayType *T) {
     auto c = T->getSizeExpr();
     astEncoder->TraverseStmt(c);
 
-    encodeType(T, TagVariableArrayType, [qt, c](CborEncoder *local) {
-        cbor_encode_uint(local, qt);
+    encodeType(T, TagVariableArrayType, [this, qt, c](CborEncoder *local) {
+        encodeTypeId(local, qt);
         if (c) {
-            cbor_encode_uint(local, uintptr_t(c));
+            nodeIds->encode(local, c);
         } else {
             // This case occurs when the expression omitted and * is used:
             // void a_function(int example[][*]);
@@ -2334,44 +2971,269 @@ void TypeEncoder::VisitVariableArrayType(const VariableArrayType *T) {
 //    abort();
 //}
 
+// Encodes a run of top-level declarations on a thread of its own, along with
+// the types and macros they use. Its visitor refers to nodes, types, strings
+// and files with ReferenceTag values, which TranslateASTVisitor::mergeEntries
+// replaces once every worker is done.
+class EncodeWorker {
+    std::vector<uint8_t> bytes;
+    CborEncoder encoder;
+    CborEncoder entries;
+    std::unordered_map<void *, QualType> sugared;
+    StringTable strings;
+    TranslateASTVisitor visitor;
+    // Counts what this worker encodes, in bytes before merging, if the
+    // export is profiled
+    std::unique_ptr<ExportStats> stats;
+
+  public:
+    EncodeWorker(ASTContext &Context, Preprocessor &PP,
+                 MacroExpansionIndex *macroExpansions, bool offsetPositions,
+                 bool declsOnly, bool collectStats,
+                 std::recursive_mutex *clangMutex)
+        : strings(true),
+          visitor(&Context, &entries, nullptr, nullptr, &sugared, &strings, PP,
+                  macroExpansions, offsetPositions, declsOnly, clangMutex) {
+        if (collectStats) {
+            stats.reset(new ExportStats());
+            stats->setOutput(&bytes);
+            visitor.setStats(stats.get());
+        }
+    }
+
+    // Encode `decls` as one CBOR array of entries
+    void encode(ArrayRef<Decl *> decls) {
+        cbor_encoder_init_writer(&encoder, write_to_vector, &bytes);
+        cbor_encoder_create_array(&encoder, &entries, CborIndefiniteLength);
+        for (auto d : decls)
+            visitor.TraverseDecl(d);
+        visitor.encodeMacros();
+        cbor_encoder_close_container(&encoder, &entries);
+    }
+
+    ArrayRef<uint8_t> getEntries() const { return bytes; }
+
+    const DenseMap<unsigned, FileID> &getFileRefs() const {
+        return visitor.getFileRefs();
+    }
+
+    const ExportStats *getStats() const { return stats.get(); }
+};
+
 class TranslateConsumer : public clang::ASTConsumer {
     Outputs *outputs;
+    // Receives the export instead of `outputs` if not null
+    const ChunkSink *sink;
     const std::string outfile;
     Preprocessor &PP;
+    const ExportOptions &options;
+    MacroExpansionIndex macroExpansions;
+    // Where the time goes, if the export is profiled. Starts with parsing,
+    // which the consumer is created for.
+    std::unique_ptr<ExportStats> stats;
+    // Encode the text of comments rather than where they are in their files
+    bool copyComments = false;
+
+    // Write the stats next to the main file (see ExportOptions::exportStats)
+    void writeStats() {
+        auto write = [this](StringRef suffix, bool trace) {
+            auto path = outfile + suffix.str();
+            std::error_code ec;
+            llvm::raw_fd_ostream out(path, ec, sys::fs::F_Text);
+            if (!ec) {
+                if (trace)
+                    stats->writeTrace(out, outfile);
+                else
+                    stats->writeReport(out, outfile);
+                out.close();
+                if (out.has_error()) {
+                    ec = out.error();
+                    out.clear_error();
+                }
+            }
+            if (ec) {
+                auto &diags = PP.getDiagnostics();
+                auto id = diags.getCustomDiagID(
+                    DiagnosticsEngine::Warning,
+                    "c2rust: cannot write export stats to '%0': %1");
+                diags.Report(id) << path << ec.message();
+            }
+        };
+        write(".export-stats.json", false);
+        if (options.exportTrace)
+            write(".export-trace.json", true);
+    }
 
   public:
-    explicit TranslateConsumer(Outputs *outputs, llvm::StringRef InFile, Preprocessor &PP)
-        : outputs(outputs), outfile(InFile.str()), PP(PP) {}
+    explicit TranslateConsumer(Outputs *outputs, const ChunkSink *sink,
+                               llvm::StringRef InFile, Preprocessor &PP,
+                               const ExportOptions &options)
+        : outputs(outputs), sink(sink), outfile(InFile.str()), PP(PP),
+          options(options) {
+        if (options.exportStats || options.exportTrace)
+            stats.reset(new ExportStats());
+    }
 
-    virtual void HandleTranslationUnit(clang::ASTContext &Context) {
+    // Null if expansions are not indexed (see ExportOptions)
+    MacroExpansionIndex *getMacroExpansions() {
+        return options.indexMacroExpansions ? &macroExpansions : nullptr;
+    }
 
-        CborEncoder encoder;
+    // Encode comments as text, for source files that need not be on disk
+    // when the export is read
+    void copyCommentText() { copyComments = true; }
+
+    // Encode `decls` on options.encodeThreads threads, each taking a
+    // contiguous run of them, and merge what they encode with `visitor` in
+    // the order of the runs, so that the export does not depend on which
+    // thread finishes first.
+    void encodeInParallel(ASTContext &Context, TranslateASTVisitor &visitor,
+                          ArrayRef<Decl *> decls) {
+        if (decls.empty())
+            return;
 
-        // There are some type nodes (see `TypedefType` and `RecordType`) which
-        // can be "sugared". That means we should not follow the declarations we
+        std::recursive_mutex clangMutex;
+        size_t count = std::min<size_t>(options.encodeThreads, decls.size());
+        std::vector<std::unique_ptr<EncodeWorker>> workers;
+        for (size_t i = 0; i < count; i++) {
+            workers.emplace_back(new EncodeWorker(Context, PP,
+                                                  getMacroExpansions(),
+                                                  options.offsetPositions,
+                                                  options.declsOnly,
+                                                  stats != nullptr,
+                                                  &clangMutex));
+        }
+
+        llvm::ThreadPool pool(count);
+        for (size_t i = 0; i < count; i++) {
+            auto begin = decls.size() * i / count;
+            auto end = decls.size() * (i + 1) / count;
+            auto worker = workers[i].get();
+            auto run = decls.slice(begin, end - begin);
+            pool.async([worker, run] { worker->encode(run); });
+        }
+        pool.wait();
+
+        ExportStats::Phase phase(stats.get(), "merge");
+        for (auto &worker : workers) {
+            visitor.mergeEntries(worker->getEntries(), worker->getFileRefs());
+            if (stats)
+                stats->mergeEntries(*worker->getStats());
+        }
+    }
+
+    virtual void HandleTranslationUnit(clang::ASTContext &Context) {
+        if (stats)
+            stats->addPhase("parse", stats->getStart());
+
+        CborEncoder encoder;
+
+        // Declarations to export, if not all of them
+        std::unique_ptr<ReachableDecls> reachable;
+        if (!options.exportRoots.empty()) {
+            reachable.reset(new ReachableDecls(
+                Context, ExportRootMatcher(Context.getSourceManager(),
+                                           options.exportRoots)));
+        } else if (options.pruneUnusedDecls) {
+            reachable.reset(new ReachableDecls(Context));
+        }
+
+        // There are some type nodes (see `TypedefType` and `RecordType`) which
+        // can be "sugared". That means we should not follow the declarations we
         // normally would follow for those types, but we should use the
         // `desugared` type instead.
         std::unordered_map<void *, QualType> sugared;
 
-        auto process = [&encoder, &Context, &sugared, this](uint8_t *buffer,
-                                                            size_t len) {
-            cbor_encoder_init(&encoder, buffer, len, 0);
+        // Cleared if the export does not fit the columnar format
+        bool encoded = true;
 
-            CborEncoder outer;
-            cbor_encoder_create_array(&encoder, &outer, 5);
+        auto process = [&encoder, &Context, &sugared, &reachable, &encoded,
+                        this](OutputBuffer *buf) {
+            StringTable strings;
+
+            // Entries go into columns rather than CBOR for the columnar
+            // format, which is written once everything has been added
+            std::unique_ptr<AstTablesWriter> tables;
+            if (options.columnarFormat && !sink)
+                tables.reset(new AstTablesWriter(options.offsetPositions));
 
+            // A streamed export is a sequence of items rather than one
+            // array; see ast_exporter_stream
+            std::unique_ptr<ChunkStream> stream;
+            if (sink)
+                stream.reset(new ChunkStream(*sink, strings));
+
+            CborEncoder outer;
             CborEncoder array;
+            // Where the visitor encodes entries
+            CborEncoder *entries = &array;
+            if (stream) {
+                entries = stream->getEncoder();
+                cbor_encoder_create_array(entries, &outer, 1);
+                cbor_encode_boolean(&outer, options.offsetPositions);
+                cbor_encoder_close_container(entries, &outer);
+                stream->finishItem();
+            } else if (!tables) {
+                cbor_encoder_init_writer(&encoder, write_to_output_buffer, buf);
+                cbor_encoder_create_array(&encoder, &outer, 7);
+            }
 
             // 1. Encode all of the reachable AST nodes and types
-            cbor_encoder_create_array(&outer, &array, CborIndefiniteLength);
-            TranslateASTVisitor visitor(&Context, &array, &sugared, PP);
+            if (!stream && !tables)
+                cbor_encoder_create_array(&outer, &array, CborIndefiniteLength);
+            TranslateASTVisitor visitor(&Context, entries, tables.get(),
+                                        stream.get(), &sugared, &strings, PP,
+                                        getMacroExpansions(),
+                                        options.offsetPositions,
+                                        options.declsOnly);
+            if (stats) {
+                visitor.setStats(stats.get());
+                if (stream)
+                    stats->setOutput(stream.get());
+                else if (!tables)
+                    stats->setOutput(buf);
+            }
             auto translation_unit = Context.getTranslationUnitDecl();
-            visitor.TraverseDecl(translation_unit);
-            visitor.encodeMacros();
-            cbor_encoder_close_container(&outer, &array);
+            Optional<ExportStats::Phase> traverse;
+            traverse.emplace(stats.get(), "traverse");
+            // Only plain CBOR exports are encoded in parallel. An AST with
+            // an external source, such as a precompiled preamble, is
+            // deserialized as it is traversed, which cannot be done from
+            // several threads.
+            if (options.encodeThreads > 1 && !stream && !tables &&
+                !Context.getExternalSource()) {
+                std::vector<Decl *> decls;
+                for (auto d : translation_unit->decls()) {
+                    if (!reachable || reachable->contains(d))
+                        decls.push_back(d);
+                }
+                encodeInParallel(Context, visitor, decls);
+            } else if (reachable) {
+                // Declarations and types used by reachable ones are
+                // traversed along with them
+                for (auto d : translation_unit->decls()) {
+                    if (reachable->contains(d))
+                        visitor.TraverseDecl(d);
+                }
+            } else {
+                visitor.TraverseDecl(translation_unit);
+            }
+            traverse.reset();
+            {
+                ExportStats::Phase phase(stats.get(), "macros");
+                visitor.encodeMacros();
+            }
+            if (stream) {
+                cbor_encode_null(entries);
+                stream->finishItem();
+            } else if (!tables) {
+                cbor_encoder_close_container(&outer, &array);
+            }
 
             // 2. Track all of the top-level declarations
-            cbor_encoder_create_array(&outer, &array, CborIndefiniteLength);
+            Optional<ExportStats::Phase> phase;
+            phase.emplace(stats.get(), "top-level decls");
+            std::vector<uint64_t> top_nodes;
             for (auto d : translation_unit->decls()) {
                 if(!d->isCanonicalDecl() && isa<VarDecl>(d)) {
                     auto canonical_decl = d->getCanonicalDecl();
@@ -2389,80 +3251,244 @@ class TranslateConsumer : public clang::ASTConsumer {
                     continue;
                 }
 
-                cbor_encode_uint(&array, reinterpret_cast<std::uintptr_t>(d));
-            }
-            cbor_encoder_close_container(&outer, &array);
+                if (reachable && !reachable->contains(d))
+                    continue;
 
-            // 3. Encode all of the visited file names
-            auto files = visitor.getFiles();
-            cbor_encoder_create_array(&outer, &array, files.size());
-            for (auto const &file : files) {
-                CborEncoder entry;
-                cbor_encoder_create_array(&array, &entry, 2);
-                cbor_encode_string(&entry, file.first);
-                if (file.second.isValid()) {
-                    CborEncoder locEntry;
-                    cbor_encoder_create_array(&entry, &locEntry, 3);
-                    visitor.encodeSourcePos(&locEntry, file.second);
-                    cbor_encoder_close_container(&entry, &locEntry);
-                } else {
-                    cbor_encode_null(&entry);
-                }
-                cbor_encoder_close_container(&array, &entry);
+                top_nodes.push_back(visitor.getNodeId(d));
             }
-            cbor_encoder_close_container(&outer, &array);
 
-            // 4. Emit comments as array of arrays. Each comment is represented
-            // as an array of source position followed by comment string.
+            // 4. Comments, each one a source position followed by where the
+            // comment is in its file (see encode_tail)
             //
             // Getting all comments requires -fparse-all-comments (see
-            // augment_argv())!
-            auto comments = Context.getRawCommentList().getComments();
-            cbor_encoder_create_array(&outer, &array, comments.size());
-            for (auto comment : comments) {
-                CborEncoder entry;
-                cbor_encoder_create_array(&array, &entry, 4);
-#if CLANG_VERSION_MAJOR < 8
-                SourceLocation loc = comment->getLocStart();
-#else
-                SourceLocation loc = comment->getBeginLoc();
-#endif // CLANG_VERSION_MAJOR
-                visitor.encodeSourcePos(&entry, loc); // emits 3 values
-                auto raw_text = comment->getRawText(Context.getSourceManager());
-                cbor_encode_byte_string(&entry, raw_text.bytes_begin(),
-                                        raw_text.size());
-                cbor_encoder_close_container(&array, &entry);
+            // exporter_clang_args())!
+            //
+            // Comments in a precompiled preamble are only added to the list
+            // once the ASTContext first looks up a comment for a declaration,
+            // so make it do that.
+            //
+            // Comments the transpiler would attach to pruned declarations are
+            // left out, so that it does not attach them to others instead.
+            // So are those in system headers, unless asked for, since the
+            // transpiler has no use for them.
+            phase.reset();
+            phase.emplace(stats.get(), "comments");
+            auto &manager = Context.getSourceManager();
+            Context.getRawCommentForDeclNoCache(translation_unit);
+            std::vector<RawComment *> comments;
+            std::vector<SmallVector<uint64_t, 3>> comment_locs;
+            for (auto comment : Context.getRawCommentList().getComments()) {
+                auto begin = comment->getSourceRange().getBegin();
+                if (reachable && reachable->isUnreachableComment(comment))
+                    continue;
+                if (!options.systemHeaderComments &&
+                    manager.isInSystemHeader(begin))
+                    continue;
+                comments.push_back(comment);
+                comment_locs.push_back(visitor.getSourcePos(begin));
             }
-            cbor_encoder_close_container(&outer, &array);
+
+            // 3. All of the visited file names, along with the offsets their
+            // lines start at if positions are offsets. Gathered after the
+            // comments, since files are numbered as positions in them are
+            // first encoded.
+            phase.reset();
+            phase.emplace(stats.get(), "files");
+            auto files = visitor.getFiles();
 
             // 5. Target VaList type as BuiltiVaListKind
-            cbor_encode_uint(&outer, static_cast<std::uintptr_t>(Context.getTargetInfo().getBuiltinVaListKind()));
+            auto va_list_kind = Context.getTargetInfo().getBuiltinVaListKind();
+
+            // Everything from here on encodes what was gathered above
+            phase.reset();
+            phase.emplace(stats.get(), "write");
+
+            if (tables) {
+                for (auto id : top_nodes)
+                    tables->addTopNode(id);
+                for (size_t i = 0; i < files.size(); i++) {
+                    auto const &file = files[i];
+                    SmallVector<uint64_t, 3> include_loc;
+                    if (file.second.isValid())
+                        include_loc = visitor.getSourcePos(file.second);
+                    std::vector<uint64_t> line_starts;
+                    if (options.offsetPositions)
+                        line_starts = visitor.getLineStarts(i);
+                    tables->addFile(strings.intern(file.first), include_loc,
+                                    line_starts);
+                }
+                for (size_t i = 0; i < comments.size(); i++) {
+                    tables->addComment(comment_locs[i],
+                                       comments[i]->getRawText(manager));
+                }
+                if (!tables->write(buf, va_list_kind, strings.getStrings())) {
+                    auto &diags = PP.getDiagnostics();
+                    auto id = diags.getCustomDiagID(
+                        DiagnosticsEngine::Error,
+                        "c2rust: the AST of '%0' is too large for the columnar "
+                        "format; export it as CBOR instead");
+                    diags.Report(id) << outfile;
+                    encoded = false;
+                }
+                return;
+            }
+
+            // 2-5 of the CBOR export, as elements of `parent`
+            auto encode_tail = [&](CborEncoder *parent) {
+                cbor_encoder_create_array(parent, &array, top_nodes.size());
+                for (auto id : top_nodes)
+                    cbor_encode_uint(&array, id);
+                cbor_encoder_close_container(parent, &array);
+
+                cbor_encoder_create_array(parent, &array, files.size());
+                for (size_t i = 0; i < files.size(); i++) {
+                    auto const &file = files[i];
+                    CborEncoder entry;
+                    cbor_encoder_create_array(&array, &entry,
+                                              options.offsetPositions ? 3 : 2);
+                    cbor_encode_string(&entry, file.first);
+                    if (file.second.isValid()) {
+                        auto loc = visitor.getSourcePos(file.second);
+                        CborEncoder locEntry;
+                        cbor_encoder_create_array(&entry, &locEntry, loc.size());
+                        for (auto value : loc)
+                            cbor_encode_uint(&locEntry, value);
+                        cbor_encoder_close_container(&entry, &locEntry);
+                    } else {
+                        cbor_encode_null(&entry);
+                    }
+                    if (options.offsetPositions) {
+                        auto line_starts = visitor.getLineStarts(i);
+                        CborEncoder lines;
+                        cbor_encoder_create_array(&entry, &lines, line_starts.size());
+                        for (auto start : line_starts)
+                            cbor_encode_uint(&lines, start);
+                        cbor_encoder_close_container(&entry, &lines);
+                    }
+                    cbor_encoder_close_container(&array, &entry);
+                }
+                cbor_encoder_close_container(parent, &array);
+
+                // Comments refer to the bytes of their file they span, as
+                // the file offset they start at, unless their position is
+                // one, their length and the digest of those bytes. The
+                // transpiler reads them from the file itself, and drops
+                // those whose bytes no longer match. Only comments in files
+                // that are not on disk, or may not be (see copyCommentText),
+                // are encoded as text.
+                cbor_encoder_create_array(parent, &array, comments.size());
+                for (size_t i = 0; i < comments.size(); i++) {
+                    auto const &loc = comment_locs[i];
+                    auto range = comments[i]->getSourceRange();
+                    auto begin = manager.getDecomposedLoc(range.getBegin());
+                    auto end = manager.getDecomposedLoc(range.getEnd());
+                    auto const &path = files[loc[0]].first;
+                    bool reference = !copyComments && !path.empty() &&
+                                     path != "?";
+
+                    CborEncoder entry;
+                    cbor_encoder_create_array(
+                        &array, &entry,
+                        loc.size() + (!reference ? 1 : options.offsetPositions ? 2 : 3));
+                    for (auto value : loc)
+                        cbor_encode_uint(&entry, value);
+                    if (!reference) {
+                        auto raw_text = comments[i]->getRawText(manager);
+                        cbor_encode_byte_string(&entry, raw_text.bytes_begin(),
+                                                raw_text.size());
+                    } else {
+                        if (!options.offsetPositions)
+                            cbor_encode_uint(&entry, begin.second);
+                        cbor_encode_uint(&entry, end.second - begin.second);
+                        cbor_encode_uint(
+                            &entry, comment_digest(comments[i]->getRawText(manager)));
+                    }
+                    cbor_encoder_close_container(&array, &entry);
+                }
+                cbor_encoder_close_container(parent, &array);
+
+                cbor_encode_uint(parent, static_cast<std::uintptr_t>(va_list_kind));
+            };
+
+            if (stream) {
+                CborEncoder tail;
+                cbor_encoder_create_array(entries, &tail, 4);
+                encode_tail(&tail);
+                cbor_encoder_close_container(entries, &tail);
+                stream->finishItem();
+                stream->flush();
+                if (stats)
+                    stats->setTotalBytes(stream->size());
+                return;
+            }
+
+            encode_tail(&outer);
+
+            // 6. Strings referenced by index from the AST nodes and types
+            strings.encode(&outer);
+
+            // 7. Whether source positions are (file, offset) rather than
+            // (file, line, column)
+            cbor_encode_boolean(&outer, options.offsetPositions);
 
             cbor_encoder_close_container(&encoder, &outer);
         };
 
-        // A very large C file (SQLite amalgamation) produces a 18MB CBOR file.
-        // Allocate a conservatively large buffer. On most operating systems,
-        // the kernel just reserves the virtual address space and allocates
-        // physical pages lazily on demand.
-        std::vector<uint8_t> buf(64 * 1024 * 1024);
+        if (sink) {
+            process(nullptr);
+            if (stats)
+                writeStats();
+            return;
+        }
 
-        process(buf.data(), buf.size());
-        auto needed = cbor_encoder_get_extra_bytes_needed(&encoder);
-        assert(needed == size_t(0) && "CBOR output buffer was too small.");
-        auto written = cbor_encoder_get_buffer_size(&encoder, buf.data());
-        buf.resize(written);
-        buf.shrink_to_fit();
+        // A very large C file (SQLite amalgamation) produces a 18MB CBOR file
+        // while most translation units need a tiny fraction of that. The
+        // encoder appends to a segmented buffer which grows one segment at a
+        // time, so there is no size limit and no up-front reservation.
+        OutputBuffer buf;
+        process(&buf);
+        if (!encoded)
+            return;
+
+        if (stats) {
+            stats->setTotalBytes(buf.size());
+            writeStats();
+        }
 
         (*outputs)[make_realpath(outfile)] = std::move(buf);
     }
 };
 
+// Records the files read by a compilation, including the headers read into
+// its precompiled preamble, so that its export can be looked up in the cache
+// by their contents.
+class InputCollector : public DependencyCollector {
+  public:
+    bool needSystemDependencies() override { return true; }
+
+    bool sawDependency(StringRef filename, bool fromModule, bool isSystem,
+                       bool isModuleFile, bool isMissing) override {
+        // Preambles are temporary, and a missing header fails the export
+        return !isModuleFile && !isMissing &&
+               DependencyCollector::sawDependency(filename, fromModule,
+                                                  isSystem, isModuleFile,
+                                                  isMissing);
+    }
+};
+
 class TranslateAction : public clang::ASTFrontendAction {
     Outputs *outputs;
+    const ChunkSink *sink;
+    const ExportOptions &options;
+    bool copyComments;
+    std::shared_ptr<InputCollector> inputs;
 
   public:
-    TranslateAction(Outputs *outputs) : outputs(outputs) {}
+    TranslateAction(Outputs *outputs, const ChunkSink *sink,
+                    const ExportOptions &options, bool copyComments = false,
+                    std::shared_ptr<InputCollector> inputs = nullptr)
+        : outputs(outputs), sink(sink), options(options),
+          copyComments(copyComments), inputs(std::move(inputs)) {}
 
     virtual std::unique_ptr<clang::ASTConsumer>
     CreateASTConsumer(clang::CompilerInstance &Compiler,
@@ -2471,140 +3497,1078 @@ class TranslateAction : public clang::ASTFrontendAction {
             return nullptr;
         }
 
-        return std::unique_ptr<clang::ASTConsumer>(
-            new TranslateConsumer(outputs, InFile, Compiler.getPreprocessor()));
+        // Let clang skip over function bodies rather than parse them
+        if (options.declsOnly)
+            Compiler.getFrontendOpts().SkipFunctionBodies = true;
+
+        if (inputs) {
+            // The preprocessor already exists, so attach to it here; the
+            // compiler attaches the collector to the preamble's reader
+            inputs->attachToPreprocessor(Compiler.getPreprocessor());
+            Compiler.addDependencyCollector(inputs);
+        }
+
+        auto consumer = make_consumer(Compiler, InFile, outputs, sink, options);
+        if (copyComments)
+            consumer->copyCommentText();
+        return std::move(consumer);
+    }
+
+    static std::unique_ptr<TranslateConsumer>
+    make_consumer(CompilerInstance &Compiler, llvm::StringRef InFile,
+                  Outputs *outputs, const ChunkSink *sink,
+                  const ExportOptions &options) {
+        // The input file name is relative to the compile command's working
+        // directory, which need not be the working directory of this process.
+        SmallString<256> path(InFile);
+        Compiler.getFileManager().makeAbsolutePath(path);
+
+        auto consumer = llvm::make_unique<TranslateConsumer>(
+            outputs, sink, path, Compiler.getPreprocessor(), options);
+        // Record which macros are expanded where while parsing, rather than
+        // lexing macro names again for each expression expanded from one
+        if (auto index = consumer->getMacroExpansions())
+            Compiler.getPreprocessor().addPPCallbacks(index->createRecorder());
+        return consumer;
     }
 };
 
+std::unique_ptr<ASTConsumer>
+createExportConsumer(CompilerInstance &compiler, llvm::StringRef inFile,
+                     Outputs *outputs, const ExportOptions &options) {
+    return TranslateAction::make_consumer(compiler, inFile, outputs, nullptr,
+                                          options);
+}
+
 // Apply a custom category to all command-line options so that they are the
 // only ones displayed.
 static llvm::cl::OptionCategory MyToolCategory("my-tool options");
 
-// Added in C++ 17
-template <class _Tp, size_t _Sz>
-constexpr size_t size(const _Tp (&)[_Sz]) noexcept {
-    return _Sz;
-}
+static llvm::cl::opt<std::string> BuildPath(
+    "p", llvm::cl::desc("Build path"), llvm::cl::Optional,
+    llvm::cl::cat(MyToolCategory));
+
+static llvm::cl::list<std::string> SourcePaths(
+    llvm::cl::Positional, llvm::cl::desc("<source>"),
+    llvm::cl::cat(MyToolCategory));
+
+static llvm::cl::list<std::string> ExtraArgs(
+    "extra-arg",
+    llvm::cl::desc("Additional argument to append to the compiler command "
+                   "line"),
+    llvm::cl::cat(MyToolCategory));
+
+static llvm::cl::opt<bool> PruneUnusedDecls(
+    "prune-unused-decls",
+    llvm::cl::desc("Only export declarations reachable from the externally "
+                   "visible functions and variables"),
+    llvm::cl::cat(MyToolCategory));
+
+static llvm::cl::opt<bool> OffsetPositions(
+    "offset-positions",
+    llvm::cl::desc("Export source positions as byte offsets, along with the "
+                   "offsets at which the lines of each file start"),
+    llvm::cl::cat(MyToolCategory));
+
+static llvm::cl::opt<bool> ColumnarFormat(
+    "columnar",
+    llvm::cl::desc("Write the AST in the columnar format rather than CBOR"),
+    llvm::cl::cat(MyToolCategory));
+
+static llvm::cl::opt<unsigned> EncodeThreads(
+    "encode-threads",
+    llvm::cl::desc("Encode the top-level declarations of the AST on this many "
+                   "threads"),
+    llvm::cl::init(1), llvm::cl::cat(MyToolCategory));
+
+static llvm::cl::list<std::string> OnlyDecls(
+    "only-decl",
+    llvm::cl::desc("Only export the top-level declarations with this name, "
+                   "and everything they use"),
+    llvm::cl::value_desc("name"), llvm::cl::cat(MyToolCategory));
+
+// Parses the `file:first-last` line ranges of -only-lines. File names may
+// contain colons.
+struct LineRangeParser : public llvm::cl::basic_parser<ExportRoot> {
+    explicit LineRangeParser(llvm::cl::Option &O) : basic_parser(O) {}
+
+    bool parse(llvm::cl::Option &O, StringRef, StringRef Arg, ExportRoot &root) {
+        auto range = Arg.rsplit(':');
+        auto lines = range.second.split('-');
+        if (range.second.empty() || lines.first.getAsInteger(10, root.firstLine) ||
+            lines.second.getAsInteger(10, root.lastLine))
+            return O.error("'" + Arg + "' is not a line range");
+        root.file = range.first;
+        return false;
+    }
+};
 
-// We augment the command line arguments to ensure that comments are always
+static llvm::cl::list<ExportRoot, bool, LineRangeParser> OnlyLines(
+    "only-lines",
+    llvm::cl::desc("Only export the top-level declarations overlapping these "
+                   "lines, and everything they use"),
+    llvm::cl::value_desc("file:first-last"), llvm::cl::cat(MyToolCategory));
+
+static llvm::cl::opt<bool> FromAST(
+    "from-ast",
+    llvm::cl::desc("Load the source path as an AST serialized by clang "
+                   "-emit-ast or as a PCH, rather than parsing it"),
+    llvm::cl::cat(MyToolCategory));
+
+static llvm::cl::opt<bool> DeclsOnly(
+    "decls-only",
+    llvm::cl::desc("Export declarations, types and function signatures "
+                   "without function bodies"),
+    llvm::cl::cat(MyToolCategory));
+
+static llvm::cl::opt<bool> SystemHeaderComments(
+    "system-header-comments",
+    llvm::cl::desc("Export the comments in system headers too"),
+    llvm::cl::cat(MyToolCategory));
+
+static llvm::cl::opt<bool> WriteExportStats(
+    "export-stats",
+    llvm::cl::desc("Write where the time exporting goes, and the nodes and "
+                   "bytes encoded by tag, to <file>.export-stats.json"),
+    llvm::cl::cat(MyToolCategory));
+
+static llvm::cl::opt<bool> WriteExportTrace(
+    "export-trace",
+    llvm::cl::desc("Also write the phases of the export as Chrome trace "
+                   "events to <file>.export-trace.json"),
+    llvm::cl::cat(MyToolCategory));
+
+// Arguments we always pass to clang, to ensure that comments are always
 // parsed and string literals are always treated as constant.
-static std::vector<const char *> augment_argv(int argc, const char *argv[]) {
-    const char *const extras[] = {
-        "-extra-arg=-fparse-all-comments", // always parse comments
-        "-extra-arg=-Wwrite-strings",      // string literals are constant
-        "-extra-arg=-D_FORTIFY_SOURCE=0",  // we don't want to use checked
-                                           // versions of libc. without this we
-        // get calls to __builtin__memcpy_chk,
-        // etc.
+static std::vector<std::string> exporter_clang_args() {
+    std::vector<std::string> args = {
+        "-fparse-all-comments", // always parse comments
+        "-Wwrite-strings",      // string literals are constant
+        "-D_FORTIFY_SOURCE=0",  // we don't want to use checked
+                                // versions of libc. without this we
+                                // get calls to __builtin__memcpy_chk,
+                                // etc.
 
         // Also #define C2RUST, so examples can conditionally omit C code that
         // needs special handling in the Rust version (e.g., varargs functions)
-        "-extra-arg=-DC2RUST=1",
+        "-DC2RUST=1",
     };
 
     // Build a -resource-dir argument based on the path to the linked clang
     // installation. Without this, ClangTool builds the resource directory from
     // the path to the tool (in this case, the binary running the AST Exporter).
-    SmallString<128> P("-extra-arg=-resource-dir=" CLANG_BIN_PATH);
+    SmallString<128> P("-resource-dir=" CLANG_BIN_PATH);
     llvm::sys::path::append(P, "..", Twine("lib") + CLANG_LIBDIR_SUFFIX,
                             "clang", CLANG_VERSION_STRING);
-    std::string resource_dir = P.str();
-    char *resource_dir_cstr = new char[resource_dir.length() + 1];
-    strncpy(resource_dir_cstr, resource_dir.c_str(), resource_dir.length() + 1);
-
-    auto argv_ = std::vector<const char *>();
-    argv_.reserve(argc + size(extras) + 2);
+    args.push_back(P.str());
 
-    auto pusher = std::back_inserter(argv_);
-    std::copy_n(argv, argc, pusher);
-    std::copy_n(extras, size(extras), pusher);
-    *pusher++ = resource_dir_cstr;
-    *pusher++ =
-        nullptr; // The value of argv[argc] is guaranteed to be a null pointer.
+    return args;
+}
 
-    return argv_;
+// Export the translation unit serialized at `path` into `outputs`, or pass it
+// to `sink` if that is not null, printing diagnostics to `diagsOut`. The AST
+// is deserialized as it is encoded, so nothing is lexed, preprocessed or
+// checked again. Returns 0 on success and 1 if the file cannot be loaded.
+static int export_ast_file(const std::string &path, const ExportOptions &options,
+                           const PCHContainerReader &reader, Outputs *outputs,
+                           const ChunkSink *sink, llvm::raw_ostream &diagsOut) {
+    IntrusiveRefCntPtr<DiagnosticOptions> diagOpts = new DiagnosticOptions();
+    auto diags = CompilerInstance::createDiagnostics(
+        diagOpts.get(), new TextDiagnosticPrinter(diagsOut, diagOpts.get()));
+    auto unit = ASTUnit::LoadFromASTFile(path, reader, ASTUnit::LoadEverything,
+                                         diags, FileSystemOptions());
+    if (!unit)
+        return 1;
+
+    // Macro expansions are not serialized, and are only found by lexing the
+    // source files again, which may have changed or be missing since. The
+    // comments are those the build kept, which are all of them only if it
+    // passed -fparse-all-comments.
+    StringRef source = unit->getOriginalSourceFileName();
+    diags->Report(diags->getCustomDiagID(
+        DiagnosticsEngine::Warning,
+        "%0 does not record macro expansions; macros are only exported where "
+        "they can be found again in the source files"))
+        << path;
+
+    // Outputs are keyed by source file, but that of a serialized AST need not
+    // exist on this machine
+    TranslateConsumer consumer(outputs, sink,
+                               sys::fs::exists(source) ? source : StringRef(path),
+                               unit->getPreprocessor(), options);
+    consumer.copyCommentText();
+    consumer.HandleTranslationUnit(unit->getASTContext());
+    return 0;
 }
 
 class MyFrontendActionFactory : public FrontendActionFactory {
     Outputs *outputs;
+    const ChunkSink *sink;
+    ExportOptions options;
+    bool copyComments = false;
+    std::shared_ptr<InputCollector> inputs;
 
   public:
-    MyFrontendActionFactory(Outputs *outputs) : outputs(outputs) {}
+    MyFrontendActionFactory(Outputs *outputs, const ExportOptions &options,
+                            const ChunkSink *sink = nullptr)
+        : outputs(outputs), sink(sink), options(options) {}
+
+    // See TranslateConsumer::copyCommentText
+    void copyCommentText() { copyComments = true; }
+
+    // Have `collector` record the files that the compilation reads
+    void collectInputs(std::shared_ptr<InputCollector> collector) {
+        inputs = std::move(collector);
+    }
 
     clang::FrontendAction *create() override {
-        return new TranslateAction(outputs);
+        return new TranslateAction(outputs, sink, options, copyComments,
+                                   inputs);
+    }
+};
+
+// Runs each invocation with a precompiled preamble from `preambles` when
+// one can be shared. Invocations with different `flags` never share one.
+class PreambleActionFactory : public MyFrontendActionFactory {
+    PreambleCache *preambles;
+    std::string flags;
+
+  public:
+    PreambleActionFactory(Outputs *outputs, const ExportOptions &options,
+                          PreambleCache *preambles, std::string flags,
+                          const ChunkSink *sink = nullptr)
+        : MyFrontendActionFactory(outputs, options, sink),
+          preambles(preambles), flags(std::move(flags)) {}
+
+    bool runInvocation(std::shared_ptr<CompilerInvocation> invocation,
+                       FileManager *files,
+                       std::shared_ptr<PCHContainerOperations> pchContainerOps,
+                       DiagnosticConsumer *diagConsumer) override {
+        // Held until the compiler is done reading the preamble
+        auto preamble = preambles->addPreamble(*invocation, *files, flags,
+                                               pchContainerOps, diagConsumer);
+        return MyFrontendActionFactory::runInvocation(
+            std::move(invocation), files, std::move(pchContainerOps),
+            diagConsumer);
     }
 };
 
-// Marshal the output map into something easy to manipulate in Rust
-ExportResult *make_export_result(const Outputs &outputs) {
+// Marshal the output map into something easy to manipulate in Rust. The
+// output buffers are moved into the result, not copied; Rust reads them in
+// place until it calls drop_export_result.
+ExportResult *make_export_result(Outputs &&outputs) {
     auto result = new ExportResult;
     auto n = outputs.size();
     result->resize(n);
 
     std::size_t i = 0;
-    for (auto const &kv : outputs) {
+    for (auto &kv : outputs) {
         auto const &name = kv.first;
-        auto const &bytes = kv.second;
 
         auto name_array = new char[name.size() + 1];
         strcpy(name_array, name.c_str());
         result->names[i] = name_array;
 
-        auto byte_array = new uint8_t[bytes.size()];
-        std::copy(std::begin(bytes), std::end(bytes), byte_array);
-        result->bytes[i] = byte_array;
-        result->sizes[i] = bytes.size();
+        result->set_bytes(i, std::move(kv.second));
         i++;
     }
 
     return result;
 }
 
-// Extract clang AST for the source file specified in the argument vector.
-// Note: The arguments should only reference one source file at a time.
+// Export the source file named by the command line `argv` into `outputs`,
+// or pass it to `sink` if that is not null, through a session made for it:
+//
+//   c2rust-ast-exporter [options] <source> [-- <clang arguments>]
+//
+// The compile command of <source> is made from the clang arguments after --
+// if there are any. Otherwise it comes from the compilation database in the
+// -p build path, or found at or above the directory of <source>.
+static int run_exporter(int argc, const char *argv[], Outputs *outputs,
+                        const ChunkSink *sink) {
+    auto separator = std::find_if(argv, argv + argc, [](const char *arg) {
+        return std::strcmp(arg, "--") == 0;
+    });
+    auto fixedArgs = separator != argv + argc;
+    std::vector<std::string> clangArgs;
+    if (fixedArgs)
+        clangArgs.assign(separator + 1, argv + argc);
+
+    // Options keep the values of earlier calls unless they are reset, and
+    // lists keep their elements unless they are cleared
+    llvm::cl::ResetAllOptionOccurrences();
+    SourcePaths.clear();
+    ExtraArgs.clear();
+    OnlyDecls.clear();
+    OnlyLines.clear();
+    llvm::cl::HideUnrelatedOptions(MyToolCategory);
+    if (!llvm::cl::ParseCommandLineOptions(static_cast<int>(separator - argv),
+                                           argv, "", &llvm::errs()))
+        return 1;
+    if (SourcePaths.size() != 1) {
+        llvm::errs() << "Expected exactly one source path\n";
+        return 1;
+    }
+    std::string sourcePath = SourcePaths.front();
+    std::vector<std::string> extraArgs(ExtraArgs.begin(), ExtraArgs.end());
+
+    ExportOptions options;
+    options.pruneUnusedDecls = PruneUnusedDecls;
+    options.offsetPositions = OffsetPositions;
+    options.columnarFormat = ColumnarFormat;
+    options.encodeThreads = EncodeThreads;
+    options.declsOnly = DeclsOnly;
+    options.systemHeaderComments = SystemHeaderComments;
+    options.exportStats = WriteExportStats;
+    options.exportTrace = WriteExportTrace;
+    for (auto const &name : OnlyDecls) {
+        ExportRoot root;
+        root.name = name;
+        options.exportRoots.push_back(root);
+    }
+    options.exportRoots.insert(options.exportRoots.end(), OnlyLines.begin(),
+                               OnlyLines.end());
+    // The roots now live in the options; the next command line starts over
+    OnlyDecls.clear();
+    OnlyLines.clear();
+
+    if (FromAST) {
+        PCHContainerOperations pchContainerOps;
+        return export_ast_file(sourcePath, options,
+                               pchContainerOps.getRawReader(), outputs, sink,
+                               llvm::errs());
+    }
+
+    std::unique_ptr<ExportSession> session;
+    if (!fixedArgs) {
+        std::string buildPath = BuildPath;
+        if (buildPath.empty())
+            buildPath = sys::path::parent_path(getAbsolutePath(sourcePath));
+        std::string error;
+        session = ExportSession::create(buildPath, extraArgs, error);
+        if (!session) {
+            llvm::errs() << "Could not load compilation database from "
+                         << buildPath << ": " << error << "\n";
+            if (!BuildPath.empty())
+                return 1;
+            llvm::errs() << "Running without flags.\n";
+            fixedArgs = true;
+        }
+    }
+    if (!session)
+        session = ExportSession::create(std::move(extraArgs));
+    session->setOptions(options);
+
+    if (fixedArgs) {
+        return sink ? session->streamFileWithArgs(sourcePath, clangArgs, *sink)
+                    : session->exportFileWithArgs(sourcePath, clangArgs,
+                                                  outputs);
+    }
+    return sink ? session->streamFile(sourcePath, *sink)
+                : session->exportFile(sourcePath, outputs);
+}
+
 Outputs process(int argc, const char *argv[], int *result) {
-    static uint64_t source_path_count = 0;
-    auto argv_ = augment_argv(argc, argv);
-    int argc_ = argv_.size() - 1; // ignore the extra nullptr
-    CommonOptionsParser OptionsParser(argc_, argv_.data(), MyToolCategory);
-
-    // the logic below assumes we're only translating one source file
-    assert(OptionsParser.getSourcePathList().size() - 1 ==
-               source_path_count++ &&
-           "Expected exactly one source path");
-
-    // CommonOptionsParser is stateful so the vector returned by
-    // getSourcePathList() includes paths from past invocations.
-    std::string sourcePath = OptionsParser.getSourcePathList().back();
-    // Make a new list with just the file we're currently translating
-    std::vector<std::string> sourcePathList(1, sourcePath);
-    ClangTool Tool(OptionsParser.getCompilations(), sourcePathList);
+    Outputs outputs;
+    *result = run_exporter(argc, argv, &outputs, nullptr);
+    assert((*result != 0 || outputs.size() == 1) &&
+           "Expected exactly one output.");
+    return outputs;
+}
 
+int processStream(int argc, const char *argv[], const ChunkSink &sink) {
+    return run_exporter(argc, argv, nullptr, &sink);
+}
+
+std::unique_ptr<ExportSession>
+ExportSession::create(const std::string &cc_db,
+                      std::vector<std::string> extra_args,
+                      std::string &error) {
+    auto compilations =
+        CompilationDatabase::autoDetectFromDirectory(cc_db, error);
+    if (!compilations)
+        return nullptr;
+
+    return std::unique_ptr<ExportSession>(
+        new ExportSession(std::move(compilations), std::move(extra_args)));
+}
+
+std::unique_ptr<ExportSession>
+ExportSession::create(std::vector<std::string> extra_args) {
+    return std::unique_ptr<ExportSession>(
+        new ExportSession(nullptr, std::move(extra_args)));
+}
+
+ExportSession::ExportSession(
+    std::unique_ptr<CompilationDatabase> compilations,
+    std::vector<std::string> extra_args)
+    : compilations(std::move(compilations)),
+      pchContainerOps(std::make_shared<PCHContainerOperations>()),
+      virtualFileTime(0), generation(0) {
+    // The same adjustments ClangTool and CommonOptionsParser apply to every
+    // compile command, followed by the caller's and our own extra arguments.
+    auto args = std::move(extra_args);
+    auto exporter_args = exporter_clang_args();
+    args.insert(args.end(), exporter_args.begin(), exporter_args.end());
+
+    adjuster = getClangSyntaxOnlyAdjuster();
+    adjuster = combineAdjusters(adjuster, getClangStripOutputAdjuster());
+    adjuster = combineAdjusters(adjuster, getClangStripDependencyFileAdjuster());
+    adjuster = combineAdjusters(
+        adjuster, getInsertArgumentAdjuster(args, ArgumentInsertPosition::END));
+}
+
+// Serializes writes to llvm::errs() from concurrent exports
+static std::mutex errs_mutex;
+
+// Collect the diagnostics `run` writes for one file and print them in one
+// piece so that exports running on other threads don't interleave with them.
+static int
+print_diagnostics_after(llvm::function_ref<int(llvm::raw_ostream &)> run) {
+    std::string diagnostics;
+    llvm::raw_string_ostream diags(diagnostics);
+    auto result = run(diags);
+    diags.flush();
+
+    if (!diagnostics.empty()) {
+        std::lock_guard<std::mutex> lock(errs_mutex);
+        llvm::errs() << diagnostics;
+    }
+    return result;
+}
+
+int ExportSession::exportFile(const std::string &file, Outputs *outputs) {
+    return print_diagnostics_after([&](llvm::raw_ostream &diags) {
+        return exportFile(file, outputs, diags);
+    });
+}
+
+int ExportSession::streamFile(const std::string &file, const ChunkSink &sink) {
     Outputs outputs;
-    MyFrontendActionFactory myFrontendActionFactory(&outputs);
+    return print_diagnostics_after([&](llvm::raw_ostream &diags) {
+        return exportFile(file, &outputs, diags, &sink);
+    });
+}
 
-    *result = Tool.run(&myFrontendActionFactory);
-    assert(outputs.size() == 1 && "Expected exactly one output.");
-    return outputs;
+// The compile command a FixedCompilationDatabase with `args` would give
+// `file`, in the current directory
+static CompileCommand
+fixed_compile_command(const std::string &file,
+                      const std::vector<std::string> &args) {
+    SmallString<256> directory;
+    sys::fs::current_path(directory);
+    std::vector<std::string> commandLine;
+    commandLine.reserve(args.size() + 2);
+    commandLine.push_back("clang-tool");
+    commandLine.insert(commandLine.end(), args.begin(), args.end());
+    commandLine.push_back(file);
+    return CompileCommand(directory, file, std::move(commandLine), "");
 }
 
-// AST exporter library interface.
-extern "C" {
-ExportResult *ast_exporter(int argc, const char *argv[], int debug) {
+int ExportSession::exportFileWithArgs(const std::string &file,
+                                      const std::vector<std::string> &args,
+                                      Outputs *outputs) {
+    auto command = fixed_compile_command(file, args);
+    return print_diagnostics_after([&](llvm::raw_ostream &diags) {
+        return exportCompileCommand(command, outputs, diags) ? 0 : 1;
+    });
+}
+
+int ExportSession::streamFileWithArgs(const std::string &file,
+                                      const std::vector<std::string> &args,
+                                      const ChunkSink &sink) {
+    auto command = fixed_compile_command(file, args);
+    Outputs outputs;
+    return print_diagnostics_after([&](llvm::raw_ostream &diags) {
+        return exportCompileCommand(command, &outputs, diags, &sink) ? 0 : 1;
+    });
+}
+
+int ExportSession::exportASTFile(const std::string &file, Outputs *outputs) {
+    return print_diagnostics_after([&](llvm::raw_ostream &diags) {
+        return export_ast_file(file, options, pchContainerOps->getRawReader(),
+                               outputs, nullptr, diags);
+    });
+}
+
+int ExportSession::exportFile(const std::string &file, Outputs *outputs,
+                              llvm::raw_ostream &diags,
+                              const ChunkSink *sink) {
+    auto path = getAbsolutePath(file);
+    std::vector<CompileCommand> commands;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (compilations)
+            commands = compilations->getCompileCommands(path);
+    }
+    if (commands.empty()) {
+        diags << "Skipping " << path << ". Compile command not found.\n";
+        return 2;
+    }
+
+    // A stream holds a single export
+    if (sink)
+        commands.resize(1);
+
+    auto failed = false;
+    for (auto &command : commands) {
+        if (!exportCompileCommand(command, outputs, diags, sink))
+            failed = true;
+    }
+    return failed ? 1 : 0;
+}
+
+bool ExportSession::exportCompileCommand(const CompileCommand &command,
+                                         Outputs *outputs,
+                                         llvm::raw_ostream &diags,
+                                         const ChunkSink *sink) {
+    auto commandLine = adjuster(command.CommandLine, command.Filename);
+
+    // Everything but the file name affects the preamble
+    std::string flags = command.Directory;
+    for (auto const &arg : commandLine) {
+        if (arg != command.Filename) {
+            flags.push_back('\0');
+            flags.append(arg);
+        }
+    }
+
+    // Have clang resolve relative paths against the compile directory
+    // rather than changing the working directory of the whole process.
+    commandLine.push_back("-working-directory=" + command.Directory);
+
+    unsigned filesGeneration;
+    auto files = acquireFileManager(command.Directory, &filesGeneration);
+    auto success =
+        exportCommand(command, std::move(commandLine), std::move(flags),
+                      files.get(), outputs, diags, sink);
+    releaseFileManager(command.Directory, filesGeneration, std::move(files));
+    return success;
+}
+
+bool ExportSession::exportCommand(const CompileCommand &command,
+                                  std::vector<std::string> commandLine,
+                                  std::string flags, FileManager *files,
+                                  Outputs *outputs, llvm::raw_ostream &diags,
+                                  const ChunkSink *sink) {
+    // Streamed exports are passed on as they are encoded, so they can be
+    // neither looked up in nor added to the cache
+    std::string commandKey;
+    if (cache && !sink) {
+        commandKey = this->commandKey(commandLine);
+        // The export is keyed by the contents of the files that the last
+        // export of the same command read, so a lookup only reads those
+        // files again rather than preprocessing the source
+        std::string recorded, inputs, key;
+        if (cache->lookupInputs(commandKey, &recorded)) {
+            std::vector<std::string> paths;
+            SmallVector<StringRef, 64> lines;
+            StringRef(recorded).split(lines, '\n', -1, false);
+            for (auto line : lines)
+                paths.push_back(line.split(' ').second);
+            key = inputsKey(commandKey, paths, files, &inputs);
+        }
+        OutputBuffer bytes;
+        std::string cachedDiagnostics;
+        if (!key.empty() && cache->lookup(key, &bytes, &cachedDiagnostics)) {
+            diags << cachedDiagnostics;
+            SmallString<256> path(command.Filename);
+            files->makeAbsolutePath(path);
+            (*outputs)[make_realpath(path.str())] = std::move(bytes);
+            return true;
+        }
+    }
+
+    // Keep this command's diagnostics to store them along with its output
+    std::string diagnostics;
+    llvm::raw_string_ostream diagnosticsStream(diagnostics);
+    TextDiagnosticPrinter printer(diagnosticsStream, new DiagnosticOptions());
+
+    Outputs commandOutputs;
+    // A precompiled preamble would keep the AST from being encoded in
+    // parallel (see TranslateConsumer::HandleTranslationUnit)
+    std::unique_ptr<MyFrontendActionFactory> factory;
+    if (options.encodeThreads > 1)
+        factory.reset(
+            new MyFrontendActionFactory(&commandOutputs, options, sink));
+    else
+        factory.reset(new PreambleActionFactory(
+            &commandOutputs, options, &preambles, std::move(flags), sink));
+    if (!virtualFiles.empty())
+        factory->copyCommentText();
+    std::shared_ptr<InputCollector> collector;
+    if (!commandKey.empty()) {
+        collector = std::make_shared<InputCollector>();
+        factory->collectInputs(collector);
+    }
+    ToolInvocation invocation(std::move(commandLine), factory.get(), files,
+                              pchContainerOps);
+    invocation.setDiagnosticConsumer(&printer);
+    auto success = invocation.run();
+    diagnosticsStream.flush();
+    diags << diagnostics;
+
+    if (success && collector && commandOutputs.size() == 1) {
+        std::string inputs;
+        auto key = inputsKey(commandKey, collector->getDependencies(), files,
+                             &inputs);
+        if (!key.empty()) {
+            cache->store(key, commandOutputs.begin()->second, diagnostics);
+            cache->storeInputs(commandKey, inputs);
+        }
+    }
+
+    for (auto &kv : commandOutputs)
+        (*outputs)[kv.first] = std::move(kv.second);
+    return success;
+}
+
+// Bump whenever the exported CBOR changes, so that the exports cached by
+// older versions of the exporter are not used.
+static const char ExportCacheVersion[] = "7";
+
+static std::string hexDigest(llvm::MD5 &hash) {
+    llvm::MD5::MD5Result result;
+    hash.final(result);
+    SmallString<32> digest;
+    llvm::MD5::stringifyResult(result, digest);
+    return digest.str();
+}
+
+std::string
+ExportSession::commandKey(const std::vector<std::string> &commandLine) {
+    llvm::MD5 hash;
+    for (auto const &arg : commandLine) {
+        hash.update(arg);
+        hash.update(StringRef("", 1));
+    }
+    hash.update(ExportCacheVersion);
+    hash.update(StringRef("", 1));
+    hash.update(CLANG_VERSION_STRING);
+    hash.update(StringRef("", 1));
+    hash.update(options.pruneUnusedDecls ? "prune" : "");
+    hash.update(StringRef("", 1));
+    hash.update(options.offsetPositions ? "offsets" : "");
+    hash.update(StringRef("", 1));
+    hash.update(options.columnarFormat ? "columnar" : "");
+    hash.update(StringRef("", 1));
+    // Node IDs depend on how the declarations are split between threads
+    hash.update(options.encodeThreads > 1 ? std::to_string(options.encodeThreads)
+                                          : "");
+    hash.update(StringRef("", 1));
+    hash.update(options.declsOnly ? "decls-only" : "");
+    hash.update(StringRef("", 1));
+    hash.update(options.systemHeaderComments ? "system-comments" : "");
+    hash.update(StringRef("", 1));
+    hash.update(options.indexMacroExpansions ? "" : "lexed-macros");
+    hash.update(StringRef("", 1));
+    // Comments are exported as text with virtual files
+    hash.update(!virtualFiles.empty() ? "copy-comments" : "");
+    hash.update(StringRef("", 1));
+    for (auto const &root : options.exportRoots) {
+        hash.update(root.name);
+        hash.update(StringRef("", 1));
+        hash.update(root.file);
+        hash.update(StringRef("", 1));
+        hash.update(std::to_string(root.firstLine) + "-" +
+                    std::to_string(root.lastLine));
+        hash.update(StringRef("", 1));
+    }
+
+    return hexDigest(hash);
+}
+
+std::string ExportSession::inputsKey(const std::string &commandKey,
+                                     ArrayRef<std::string> paths,
+                                     FileManager *files, std::string *inputs) {
+    inputs->clear();
+    for (auto const &path : paths) {
+        // Read through the file manager so that relative paths are resolved
+        // against the compile directory and virtual files are seen
+        auto buffer = files->getBufferForFile(path);
+        if (!buffer)
+            return "";
+        llvm::MD5 hash;
+        hash.update((*buffer)->getBuffer());
+        inputs->append(hexDigest(hash));
+        inputs->push_back(' ');
+        inputs->append(path);
+        inputs->push_back('\n');
+    }
+
+    llvm::MD5 hash;
+    hash.update(commandKey);
+    hash.update(StringRef("", 1));
+    hash.update(*inputs);
+    return hexDigest(hash);
+}
+
+void ExportSession::setCache(const std::string &directory,
+                             std::uint64_t maxSize) {
+    cache.reset(new ExportCache(directory, maxSize));
+}
+
+void ExportSession::setOptions(const ExportOptions &options) {
+    this->options = options;
+}
+
+void ExportSession::flushFileCaches() {
+    std::lock_guard<std::mutex> lock(mutex);
+    fileManagers.clear();
+    generation++;
+}
+
+void ExportSession::addVirtualFile(const std::string &path,
+                                   StringRef contents) {
+    auto absolute = getAbsolutePath(path);
+    auto replaced = virtualFiles.count(absolute) != 0;
+    auto &file = virtualFiles[absolute];
+    file.modificationTime = ++virtualFileTime;
+    file.contents = llvm::MemoryBuffer::getMemBufferCopy(contents, absolute);
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (virtualFileSystem && !replaced) {
+            virtualFileSystem->addFileNoOwn(absolute, file.modificationTime,
+                                            file.contents.get());
+        } else {
+            // An in-memory file system cannot replace a file, so one with a
+            // new version of a file is built from scratch
+            virtualFileSystem = new InMemoryFileSystem();
+            for (auto const &kv : virtualFiles)
+                virtualFileSystem->addFileNoOwn(kv.first,
+                                                kv.second.modificationTime,
+                                                kv.second.contents.get());
+        }
+    }
+    // File managers remember which files do not exist
+    flushFileCaches();
+}
+
+void ExportSession::clearVirtualFiles() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        virtualFileSystem = nullptr;
+    }
+    // Drops the file managers that refer to the contents of the files
+    flushFileCaches();
+    virtualFiles.clear();
+}
+
+IntrusiveRefCntPtr<FileManager>
+ExportSession::acquireFileManager(const std::string &directory,
+                                  unsigned *filesGeneration) {
+    // A FileManager resolves relative paths against a fixed working
+    // directory, so files compiled in different directories cannot share
+    // one. Files compiled in the same directory share all cached lookups.
+    // FileManager is not thread-safe, so each one is used by at most one
+    // export at a time and concurrent exports get one each.
+    IntrusiveRefCntPtr<InMemoryFileSystem> inMemory;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        *filesGeneration = generation;
+        inMemory = virtualFileSystem;
+        auto &idle = fileManagers[directory];
+        if (!idle.empty()) {
+            auto files = std::move(idle.back());
+            idle.pop_back();
+            return files;
+        }
+    }
+
+    FileSystemOptions options;
+    options.WorkingDir = directory;
+    if (!inMemory)
+        return new FileManager(options);
+
+    // Virtual files hide those on disk
+#if CLANG_VERSION_MAJOR < 8
+    IntrusiveRefCntPtr<clang::vfs::OverlayFileSystem> overlay(
+        new clang::vfs::OverlayFileSystem(clang::vfs::getRealFileSystem()));
+#else
+    IntrusiveRefCntPtr<llvm::vfs::OverlayFileSystem> overlay(
+        new llvm::vfs::OverlayFileSystem(llvm::vfs::getRealFileSystem()));
+#endif // CLANG_VERSION_MAJOR
+    overlay->pushOverlay(std::move(inMemory));
+    return new FileManager(options, std::move(overlay));
+}
+
+void ExportSession::releaseFileManager(const std::string &directory,
+                                       unsigned filesGeneration,
+                                       IntrusiveRefCntPtr<FileManager> files) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (filesGeneration == generation)
+        fileManagers[directory].push_back(std::move(files));
+}
+
+static void set_debug_output(int debug) {
 #ifndef NDEBUG
+    // LLVM's debug settings are process-wide; set them once rather than from
+    // every (possibly concurrent) export that asks for them.
+    static std::once_flag once;
     if (debug) {
-        llvm::DebugFlag = true;
-        llvm::setCurrentDebugType(DEBUG_TYPE);
+        std::call_once(once, [] {
+            llvm::DebugFlag = true;
+            llvm::setCurrentDebugType(DEBUG_TYPE);
+        });
     }
 #endif // NDEBUG
+}
+
+// AST exporter library interface.
+//
+// ast_exporter and ast_exporter_stream go through the global LLVM command
+// line parser and must not be called concurrently. The session functions
+// below are re-entrant: any number of threads may export files through the
+// same session at once.
+extern "C" {
+ExportResult *ast_exporter(int argc, const char *argv[], int debug) {
+    set_debug_output(debug);
 
     int result;
     auto outputs = process(argc, argv, &result);
-    return make_export_result(outputs);
+    return make_export_result(std::move(outputs));
+}
+
+// Export like ast_exporter, but pass the CBOR to `on_chunk` while it is
+// encoded, so that the caller can decode it at the same time. Each call
+// passes `ctx` along with one or more complete CBOR items, and the data is
+// only valid until the call returns. The items are:
+//
+//   1. A one-element array: whether source positions are offsets
+//   2. The entries of the first element of the CBOR export, each one
+//      preceded by the strings it adds to the string table as text strings
+//   3. null
+//   4. Elements 2-5 of the CBOR export in an array: the top-level nodes,
+//      files, comments and va_list kind
+//
+// The columnar format cannot be streamed and is not used. Returns 0 on
+// success.
+int ast_exporter_stream(int argc, const char *argv[], int debug,
+                        void (*on_chunk)(void *ctx, const uint8_t *data,
+                                         size_t size),
+                        void *ctx) {
+    set_debug_output(debug);
+
+    ChunkSink sink = {on_chunk, ctx};
+    return processStream(argc, argv, sink);
 }
 
 void drop_export_result(ExportResult *result) { delete result; }
 
+// Load the compilation database found at or above `cc_db` for exporting any
+// number of the files it describes. `extra_args` are passed to clang for each
+// of them. Returns null if no compilation database could be loaded.
+ExportSession *ast_exporter_session_new(const char *cc_db, int argc,
+                                        const char *extra_args[]) {
+    std::string error;
+    auto session = ExportSession::create(
+        cc_db, std::vector<std::string>(extra_args, extra_args + argc), error);
+    if (!session) {
+        llvm::errs() << "Could not load compilation database from " << cc_db
+                     << ": " << error << "\n";
+        return nullptr;
+    }
+    return session.release();
+}
+
+// A session without a compilation database, for exporting files with
+// ast_exporter_session_export_args only. `extra_args` are passed to clang
+// for each of them.
+ExportSession *ast_exporter_session_new_without_database(
+    int argc, const char *extra_args[]) {
+    return ExportSession::create(
+               std::vector<std::string>(extra_args, extra_args + argc))
+        .release();
+}
+
+ExportResult *ast_exporter_session_export(ExportSession *session,
+                                          const char *file, int debug,
+                                          int *result) {
+    set_debug_output(debug);
+
+    Outputs outputs;
+    *result = session->exportFile(file, &outputs);
+    return make_export_result(std::move(outputs));
+}
+
+// Export `file` like ast_exporter_session_export, but pass the export to
+// `on_chunk` while it is encoded, as ast_exporter_stream does. Returns 0 on
+// success.
+int ast_exporter_session_export_stream(
+    ExportSession *session, const char *file, int debug,
+    void (*on_chunk)(void *ctx, const uint8_t *data, size_t size),
+    void *ctx) {
+    set_debug_output(debug);
+
+    ChunkSink sink = {on_chunk, ctx};
+    return session->streamFile(file, sink);
+}
+
+// Export `file` compiled with the `argc` clang arguments in `args`, rather
+// than with its compile command from the compilation database.
+ExportResult *ast_exporter_session_export_args(ExportSession *session,
+                                               const char *file, int argc,
+                                               const char *args[], int debug,
+                                               int *result) {
+    set_debug_output(debug);
+
+    Outputs outputs;
+    *result = session->exportFileWithArgs(
+        file, std::vector<std::string>(args, args + argc), &outputs);
+    return make_export_result(std::move(outputs));
+}
+
+// Export the AST serialized at `file` by clang -emit-ast or as a PCH, with the
+// options of the session, instead of parsing a source file.
+ExportResult *ast_exporter_session_export_ast_file(ExportSession *session,
+                                                   const char *file, int debug,
+                                                   int *result) {
+    set_debug_output(debug);
+
+    Outputs outputs;
+    *result = session->exportASTFile(file, &outputs);
+    return make_export_result(std::move(outputs));
+}
+
+// Cache exports in `directory`, using at most `max_size` bytes. Must not be
+// called while files are being exported through the session.
+void ast_exporter_session_set_cache(ExportSession *session,
+                                    const char *directory,
+                                    uint64_t max_size) {
+    session->setCache(directory, max_size);
+}
+
+// Only export the declarations reachable from those visible to other
+// translation units if `prune` is nonzero. Must not be called while files are
+// being exported through the session.
+void ast_exporter_session_set_prune_unused_decls(ExportSession *session,
+                                                 int prune) {
+    auto options = session->getOptions();
+    options.pruneUnusedDecls = prune != 0;
+    session->setOptions(options);
+}
+
+// Export source positions as byte offsets if `offsets` is nonzero. Must not
+// be called while files are being exported through the session.
+void ast_exporter_session_set_offset_positions(ExportSession *session,
+                                               int offsets) {
+    auto options = session->getOptions();
+    options.offsetPositions = offsets != 0;
+    session->setOptions(options);
+}
+
+// Export ASTs in the columnar format of AstTables.hpp rather than as CBOR if
+// `columnar` is nonzero. Must not be called while files are being exported
+// through the session.
+void ast_exporter_session_set_columnar(ExportSession *session, int columnar) {
+    auto options = session->getOptions();
+    options.columnarFormat = columnar != 0;
+    session->setOptions(options);
+}
+
+// Encode the top-level declarations of each translation unit on `threads`
+// threads. Must not be called while files are being exported through the
+// session.
+void ast_exporter_session_set_encode_threads(ExportSession *session,
+                                             unsigned threads) {
+    auto options = session->getOptions();
+    options.encodeThreads = threads;
+    session->setOptions(options);
+}
+
+// Leave function bodies out of the export if `decls_only` is nonzero. Must
+// not be called while files are being exported through the session.
+void ast_exporter_session_set_decls_only(ExportSession *session,
+                                         int decls_only) {
+    auto options = session->getOptions();
+    options.declsOnly = decls_only != 0;
+    session->setOptions(options);
+}
+
+// Export the comments in system headers too if `system_comments` is nonzero.
+// Must not be called while files are being exported through the session.
+void ast_exporter_session_set_system_header_comments(ExportSession *session,
+                                                     int system_comments) {
+    auto options = session->getOptions();
+    options.systemHeaderComments = system_comments != 0;
+    session->setOptions(options);
+}
+
+// Find the macros expressions were expanded from in a record of the
+// expansions made while parsing if `index` is nonzero, which is the default,
+// or by lexing macro names again otherwise. Must not be called while files
+// are being exported through the session.
+void ast_exporter_session_set_macro_expansion_index(ExportSession *session,
+                                                    int index) {
+    auto options = session->getOptions();
+    options.indexMacroExpansions = index != 0;
+    session->setOptions(options);
+}
+
+// Write a report of where the time exporting each file goes next to it if
+// `stats` is nonzero, along with a Chrome trace if `trace` is nonzero (see
+// ExportOptions::exportStats). Must not be called while files are being
+// exported through the session.
+void ast_exporter_session_set_export_stats(ExportSession *session, int stats,
+                                           int trace) {
+    auto options = session->getOptions();
+    options.exportStats = stats != 0;
+    options.exportTrace = trace != 0;
+    session->setOptions(options);
+}
+
+// Only export the top-level declarations named `name`, those selected by the
+// other roots added and everything they use. Must not be called while files
+// are being exported through the session.
+void ast_exporter_session_add_export_root(ExportSession *session,
+                                          const char *name) {
+    auto options = session->getOptions();
+    ExportRoot root;
+    root.name = name;
+    options.exportRoots.push_back(root);
+    session->setOptions(options);
+}
+
+// Like ast_exporter_session_add_export_root, but selects the top-level
+// declarations that overlap lines `first_line` to `last_line` of `file`.
+void ast_exporter_session_add_export_root_lines(ExportSession *session,
+                                                const char *file,
+                                                unsigned first_line,
+                                                unsigned last_line) {
+    auto options = session->getOptions();
+    ExportRoot root;
+    root.file = file;
+    root.firstLine = first_line;
+    root.lastLine = last_line;
+    options.exportRoots.push_back(root);
+    session->setOptions(options);
+}
+
+// Export every declaration again. Must not be called while files are being
+// exported through the session.
+void ast_exporter_session_clear_export_roots(ExportSession *session) {
+    auto options = session->getOptions();
+    options.exportRoots.clear();
+    session->setOptions(options);
+}
+
+// Have the files exported after this read the `size` bytes at `contents` from
+// `path`, which need not exist on disk. The contents are copied. Must not be
+// called while files are being exported through the session.
+void ast_exporter_session_add_virtual_file(ExportSession *session,
+                                           const char *path,
+                                           const char *contents, size_t size) {
+    session->addVirtualFile(path, StringRef(contents, size));
+}
+
+// Forget the files added with ast_exporter_session_add_virtual_file. Must not
+// be called while files are being exported through the session.
+void ast_exporter_session_clear_virtual_files(ExportSession *session) {
+    session->clearVirtualFiles();
+}
+
+void ast_exporter_session_drop(ExportSession *session) { delete session; }
+
 const char *clang_version() { return "" CLANG_VERSION_STRING; }
 }
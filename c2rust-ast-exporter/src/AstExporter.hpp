@@ -7,12 +7,247 @@
 #ifndef AstExporter_hpp
 #define AstExporter_hpp
 
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <unordered_map>
 #include <vector>
 
-using Outputs = std::unordered_map<std::string, std::vector<uint8_t>>;
+#include "clang/Basic/Version.h"
+#include "clang/Tooling/Tooling.h"
+#include "llvm/Support/MemoryBuffer.h"
+#if CLANG_VERSION_MAJOR < 8
+#include "clang/Basic/VirtualFileSystem.h"
+#else
+#include "llvm/Support/VirtualFileSystem.h"
+#endif // CLANG_VERSION_MAJOR
+
+#include "ExportCache.hpp"
+#include "OutputBuffer.hpp"
+#include "PreambleCache.hpp"
+
+using Outputs = std::unordered_map<std::string, OutputBuffer>;
+
+// A top-level declaration to export along with everything it uses, rather
+// than all of them: those named `name` or, if it is empty, those that overlap
+// lines `firstLine` to `lastLine` of `file`
+struct ExportRoot {
+    std::string name;
+    std::string file;
+    unsigned firstLine = 0;
+    unsigned lastLine = 0;
+};
+
+// Settings that change what is exported for a translation unit
+struct ExportOptions {
+    // Only export the declarations the transpiler keeps after pruning unused
+    // ones (see ReachableDecls), along with the types and macros they use.
+    bool pruneUnusedDecls = false;
+    // Encode source positions as byte offsets into their files, and the
+    // offsets at which the lines of each file start, instead of presumed
+    // line and column numbers. Ignores #line directives.
+    bool offsetPositions = false;
+    // Write the columnar format of AstTables.hpp instead of CBOR
+    bool columnarFormat = false;
+    // Encode top-level declarations on this many threads if more than one.
+    // Only applies to CBOR exports that are not streamed, and rules out
+    // precompiled preambles.
+    unsigned encodeThreads = 1;
+    // Leave function bodies out, exporting them as if they were only
+    // declared. Clang skips over them rather than parse them.
+    bool declsOnly = false;
+    // Only export the declarations these select and everything they use,
+    // directly or through types and macros, if there are any. Takes
+    // precedence over pruneUnusedDecls.
+    std::vector<ExportRoot> exportRoots;
+    // Export the comments in system headers too, rather than only those in
+    // the main file and the headers of the project, which are all the
+    // transpiler attaches to what it translates.
+    bool systemHeaderComments = false;
+    // Record the macros the preprocessor expands, and find those an
+    // expression was expanded from in that record. Otherwise each macro name
+    // is lexed again, which is only meant for comparing the two.
+    bool indexMacroExpansions = true;
+    // Time the phases of the export and count the nodes and types encoded,
+    // and the bytes they take up, by tag (see ExportStats.hpp). The report
+    // is written as JSON to <main file>.export-stats.json. Exports found in
+    // the export cache are not profiled.
+    bool exportStats = false;
+    // Also write the phases as Chrome trace events to
+    // <main file>.export-trace.json. Implies exportStats.
+    bool exportTrace = false;
+};
+
+// Receives a streamed export (see ast_exporter_stream) while it is encoded.
+// Each call passes one or more complete CBOR items.
+struct ChunkSink {
+    void (*onChunk)(void *ctx, const std::uint8_t *data, std::size_t size);
+    void *ctx;
+};
 
 Outputs process(int argc, const char *argv[], int *result);
 
+// A consumer that exports the translation unit `compiler` parses from `inFile`
+// into `outputs`, for exporting as part of another action, such as a compile
+// (see ExporterPlugin.cpp). Function bodies are parsed even if
+// options.declsOnly is set. `options` must outlive the consumer.
+std::unique_ptr<clang::ASTConsumer>
+createExportConsumer(clang::CompilerInstance &compiler, llvm::StringRef inFile,
+                     Outputs *outputs, const ExportOptions &options);
+
+// Like process, but passes the export to `sink` as it is encoded instead of
+// returning it. Returns the result of running clang.
+int processStream(int argc, const char *argv[], const ChunkSink &sink);
+
+// Exports any number of the files described by one compilation database, or
+// by the clang arguments given for each of them. The database is parsed once
+// when the session is created, and file system lookups made while exporting
+// one file are reused for the files after it, as are precompiled preambles
+// for #include directives files have in common. Source files may also be
+// given in memory rather than on disk. exportFile and exportFileWithArgs may
+// be called from several threads at once.
+class ExportSession {
+  public:
+    // Returns null and sets `error` if no compilation database can be found
+    // at or above `cc_db`.
+    static std::unique_ptr<ExportSession>
+    create(const std::string &cc_db, std::vector<std::string> extra_args,
+           std::string &error);
+
+    // A session without a compilation database, which only exports files
+    // through exportFileWithArgs.
+    static std::unique_ptr<ExportSession>
+    create(std::vector<std::string> extra_args);
+
+    // Export `file` into `outputs`. Returns 0 on success, 1 if clang failed
+    // and 2 if the database has no compile command for the file.
+    int exportFile(const std::string &file, Outputs *outputs);
+
+    // Like exportFile, but pass the export of the first compile command for
+    // `file` to `sink` while it is encoded (see ast_exporter_stream). The
+    // export cache is not used, and the export is always CBOR.
+    int streamFile(const std::string &file, const ChunkSink &sink);
+
+    // Export `file` compiled with the clang arguments `args` in the current
+    // directory, as if the database had that compile command for it, into
+    // `outputs`. Returns 0 on success and 1 if clang failed.
+    int exportFileWithArgs(const std::string &file,
+                           const std::vector<std::string> &args,
+                           Outputs *outputs);
+
+    // Like exportFileWithArgs, but pass the export to `sink` while it is
+    // encoded, as streamFile does.
+    int streamFileWithArgs(const std::string &file,
+                           const std::vector<std::string> &args,
+                           const ChunkSink &sink);
+
+    // Export the translation unit serialized at `file` by clang -emit-ast or
+    // as a PCH into `outputs`, without parsing anything. The export cache is
+    // not used. Returns 0 on success and 1 if the file cannot be loaded.
+    int exportASTFile(const std::string &file, Outputs *outputs);
+
+    // Look up exports in and add them to an on-disk cache, keyed by the
+    // contents of the files they read, the clang arguments and the clang
+    // version. A header added where an include would now find it instead of
+    // the one read before is not noticed. Must not be called while files are
+    // being exported.
+    void setCache(const std::string &directory, std::uint64_t maxSize);
+
+    const ExportOptions &getOptions() const { return options; }
+    // Must not be called while files are being exported.
+    void setOptions(const ExportOptions &options);
+
+    // Forget cached file system state. Files are otherwise assumed not to
+    // change on disk for the lifetime of the session.
+    void flushFileCaches();
+
+    // Have the files exported after this, and the headers they include, read
+    // `contents` from `path`, in place of the file there on disk if there is
+    // one. Nothing is written to disk. Since the transpiler cannot read them
+    // back from the files, comments are then exported as text. Must not be
+    // called while files are being exported.
+    void addVirtualFile(const std::string &path, llvm::StringRef contents);
+
+    // Forget the files added with addVirtualFile. Must not be called while
+    // files are being exported.
+    void clearVirtualFiles();
+
+  private:
+#if CLANG_VERSION_MAJOR < 8
+    using InMemoryFileSystem = clang::vfs::InMemoryFileSystem;
+#else
+    using InMemoryFileSystem = llvm::vfs::InMemoryFileSystem;
+#endif // CLANG_VERSION_MAJOR
+
+    struct VirtualFile {
+        std::time_t modificationTime;
+        std::unique_ptr<llvm::MemoryBuffer> contents;
+    };
+
+    ExportSession(
+        std::unique_ptr<clang::tooling::CompilationDatabase> compilations,
+        std::vector<std::string> extra_args);
+
+    // The export goes to `sink` rather than `outputs` if it is not null
+    int exportFile(const std::string &file, Outputs *outputs,
+                   llvm::raw_ostream &diags, const ChunkSink *sink = nullptr);
+
+    bool exportCompileCommand(const clang::tooling::CompileCommand &command,
+                              Outputs *outputs, llvm::raw_ostream &diags,
+                              const ChunkSink *sink = nullptr);
+
+    bool exportCommand(const clang::tooling::CompileCommand &command,
+                       std::vector<std::string> commandLine, std::string flags,
+                       clang::FileManager *files, Outputs *outputs,
+                       llvm::raw_ostream &diags, const ChunkSink *sink);
+
+    // Key of everything but the input files that the export of a command
+    // depends on: its arguments, the clang version and the export options.
+    std::string commandKey(const std::vector<std::string> &commandLine);
+
+    // Key of the export of the command with key `commandKey` that read the
+    // files at `paths`, with their digests and paths listed one per line in
+    // `inputs`. Returns an empty key if one of them cannot be read.
+    std::string inputsKey(const std::string &commandKey,
+                          llvm::ArrayRef<std::string> paths,
+                          clang::FileManager *files, std::string *inputs);
+
+    llvm::IntrusiveRefCntPtr<clang::FileManager>
+    acquireFileManager(const std::string &directory,
+                       unsigned *filesGeneration);
+    void releaseFileManager(const std::string &directory,
+                            unsigned filesGeneration,
+                            llvm::IntrusiveRefCntPtr<clang::FileManager> files);
+
+    // Null if files are only exported with explicit arguments
+    std::unique_ptr<clang::tooling::CompilationDatabase> compilations;
+    clang::tooling::ArgumentsAdjuster adjuster;
+    std::shared_ptr<clang::PCHContainerOperations> pchContainerOps;
+    PreambleCache preambles;
+    std::unique_ptr<ExportCache> cache;
+    ExportOptions options;
+
+    // Files added with addVirtualFile, keyed by absolute path, and the file
+    // system that serves them from their contents (null if there are none)
+    std::map<std::string, VirtualFile> virtualFiles;
+    llvm::IntrusiveRefCntPtr<InMemoryFileSystem> virtualFileSystem;
+    // Given to each version of a virtual file as its modification time, so
+    // that preambles built with an earlier one are not reused
+    std::time_t virtualFileTime;
+
+    // Guards compilations, fileManagers, generation and virtualFileSystem
+    std::mutex mutex;
+    // Idle file managers, keyed by compile command directory
+    std::unordered_map<std::string,
+                       std::vector<llvm::IntrusiveRefCntPtr<clang::FileManager>>>
+        fileManagers;
+    // Incremented by flushFileCaches so that file managers in use at the time
+    // are dropped instead of returned to the pool.
+    unsigned generation;
+};
+
 #endif /* AstExporter_hpp */
@@ -0,0 +1,199 @@
+//
+//  AstTables.cpp
+//
+
+#include <cassert>
+#include <cstring>
+#include <limits>
+
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/Host.h"
+
+#include "AstTables.hpp"
+
+using namespace llvm;
+
+namespace {
+// Sets `*overflow` if `value` does not fit in 32 bits
+std::uint32_t narrow_u32(std::uint64_t value, bool *overflow) {
+    if (value > std::numeric_limits<std::uint32_t>::max()) {
+        *overflow = true;
+        return 0;
+    }
+    return static_cast<std::uint32_t>(value);
+}
+
+CborError append_to_vector(void *token, const void *data, size_t len,
+                           CborEncoderAppendType) {
+    auto bytes = static_cast<std::vector<std::uint8_t> *>(token);
+    auto begin = static_cast<const std::uint8_t *>(data);
+    bytes->insert(bytes->end(), begin, begin + len);
+    return CborNoError;
+}
+
+// Append the extras written by `extras` to `bytes` as one CBOR array
+void encode_extras(std::vector<std::uint8_t> *bytes,
+                   function_ref<void(CborEncoder *)> extras) {
+    CborEncoder encoder, array;
+    cbor_encoder_init_writer(&encoder, append_to_vector, bytes);
+    cbor_encoder_create_array(&encoder, &array, CborIndefiniteLength);
+    extras(&array);
+    cbor_encoder_close_container(&encoder, &array);
+}
+
+template <typename T> void append_le(OutputBuffer *out, T value) {
+    value = support::endian::byte_swap<T, support::little>(value);
+    out->append(&value, sizeof(value));
+}
+
+// A section of the output, and the size of its elements
+struct Section {
+    const void *data;
+    std::size_t count;
+    std::size_t elementSize;
+
+    template <typename T>
+    Section(const std::vector<T> &column)
+        : data(column.data()), count(column.size()), elementSize(sizeof(T)) {}
+
+    std::size_t size() const { return count * elementSize; }
+
+    void write(OutputBuffer *out) const {
+        if (sys::IsLittleEndianHost || elementSize == 1) {
+            out->append(data, size());
+            return;
+        }
+        for (std::size_t i = 0; i < count; i++) {
+            switch (elementSize) {
+            case 2:
+                append_le(out, static_cast<const std::uint16_t *>(data)[i]);
+                break;
+            case 4:
+                append_le(out, static_cast<const std::uint32_t *>(data)[i]);
+                break;
+            default:
+                llvm_unreachable("Unexpected element size");
+            }
+        }
+    }
+};
+
+std::size_t align(std::size_t offset) { return (offset + 7) & ~std::size_t(7); }
+} // namespace
+
+std::uint32_t AstTablesWriter::narrow(std::uint64_t value) {
+    return narrow_u32(value, &overflow);
+}
+
+void AstTablesWriter::append(std::vector<std::uint32_t> *column,
+                             ArrayRef<std::uint64_t> values) {
+    for (auto value : values)
+        column->push_back(narrow(value));
+}
+
+AstTablesWriter::AstTablesWriter(bool offsetPositions)
+    : offsetPositions(offsetPositions), overflow(false), nodeChildStarts{0},
+      nodeMacroStarts{0}, nodeExtraStarts{0}, typeExtraStarts{0},
+      fileLineStarts{0}, commentStarts{0} {}
+
+bool AstTablesWriter::isAstTables(const OutputBuffer &bytes) {
+    return bytes.size() >= sizeof(AstTablesMagic) &&
+           std::memcmp(bytes.segment_data(0), AstTablesMagic,
+                       sizeof(AstTablesMagic)) == 0;
+}
+
+void AstTablesWriter::addNode(std::uint64_t id, ASTEntryTag tag,
+                              ArrayRef<std::uint64_t> children,
+                              ArrayRef<std::uint64_t> span,
+                              std::uint64_t typeId, bool rvalue,
+                              ArrayRef<std::uint64_t> macros,
+                              std::uint64_t macroText,
+                              function_ref<void(CborEncoder *)> extras) {
+    assert(span.size() == (offsetPositions ? 3 : 5) && "Unexpected span");
+    nodeIds.push_back(narrow(id));
+    nodeTags.push_back(tag);
+    append(&nodeChildren, children);
+    nodeChildStarts.push_back(narrow(nodeChildren.size()));
+    append(&nodeSpans, span);
+    nodeTypes.push_back(narrow(typeId));
+    nodeFlags.push_back(rvalue);
+    append(&nodeMacros, macros);
+    nodeMacroStarts.push_back(narrow(nodeMacros.size()));
+    nodeMacroTexts.push_back(narrow(macroText));
+    encode_extras(&nodeExtras, extras);
+    nodeExtraStarts.push_back(narrow(nodeExtras.size()));
+}
+
+void AstTablesWriter::addType(std::uint64_t id, TypeTag tag,
+                              function_ref<void(CborEncoder *)> extras) {
+    typeIds.push_back(narrow(id));
+    typeTags.push_back(tag);
+    encode_extras(&typeExtras, extras);
+    typeExtraStarts.push_back(narrow(typeExtras.size()));
+}
+
+void AstTablesWriter::addFile(std::uint64_t path,
+                              ArrayRef<std::uint64_t> includeLoc,
+                              ArrayRef<std::uint64_t> lineStarts) {
+    filePaths.push_back(narrow(path));
+    if (includeLoc.empty())
+        fileIncludes.resize(fileIncludes.size() + (offsetPositions ? 2 : 3));
+    else
+        append(&fileIncludes, includeLoc);
+    append(&fileLines, lineStarts);
+    fileLineStarts.push_back(narrow(fileLines.size()));
+}
+
+void AstTablesWriter::addComment(ArrayRef<std::uint64_t> loc, StringRef text) {
+    append(&commentLocs, loc);
+    comments.insert(comments.end(), text.bytes_begin(), text.bytes_end());
+    commentStarts.push_back(narrow(comments.size()));
+}
+
+bool AstTablesWriter::write(OutputBuffer *out, std::uint32_t vaListKind,
+                            ArrayRef<StringRef> strings) const {
+    auto overflow = this->overflow;
+    std::vector<std::uint32_t> stringStarts{0};
+    std::vector<std::uint8_t> stringBytes;
+    for (auto str : strings) {
+        stringBytes.insert(stringBytes.end(), str.bytes_begin(), str.bytes_end());
+        stringStarts.push_back(narrow_u32(stringBytes.size(), &overflow));
+    }
+    if (overflow)
+        return false;
+
+    // In the order of AstTablesSection
+    const Section sections[] = {
+        nodeIds,         nodeTags,       nodeChildStarts, nodeChildren,
+        nodeSpans,       nodeTypes,      nodeFlags,       nodeMacroStarts,
+        nodeMacros,      nodeMacroTexts, nodeExtraStarts, nodeExtras,
+        typeIds,         typeTags,       typeExtraStarts, typeExtras,
+        topNodes,        filePaths,      fileIncludes,    fileLineStarts,
+        fileLines,       commentLocs,    commentStarts,   comments,
+        stringStarts,    stringBytes,
+    };
+    static_assert(sizeof(sections) / sizeof(sections[0]) == SectionCount,
+                  "Every section must be written");
+
+    out->append(AstTablesMagic, sizeof(AstTablesMagic));
+    append_le<std::uint32_t>(out, AstTablesVersion);
+    append_le<std::uint32_t>(out, offsetPositions ? AstTablesOffsetPositions : 0);
+    append_le<std::uint32_t>(out, vaListKind);
+    append_le<std::uint32_t>(out, SectionCount);
+
+    std::size_t offset = out->size() + SectionCount * 2 * sizeof(std::uint64_t);
+    for (auto const &section : sections) {
+        offset = align(offset);
+        append_le<std::uint64_t>(out, offset);
+        append_le<std::uint64_t>(out, section.size());
+        offset += section.size();
+    }
+
+    static const std::uint8_t padding[8] = {};
+    for (auto const &section : sections) {
+        out->append(padding, align(out->size()) - out->size());
+        section.write(out);
+    }
+    return true;
+}
@@ -0,0 +1,114 @@
+//
+//  AstTables.hpp
+//
+
+#ifndef AstTables_hpp
+#define AstTables_hpp
+
+#include <cstdint>
+#include <vector>
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/StringRef.h"
+#include <tinycbor/cbor.h>
+
+#include "OutputBuffer.hpp"
+#include "ast_tags.hpp"
+
+const char AstTablesMagic[8] = {'C', '2', 'R', 'T', 'A', 'B', 'L', 'E'};
+// Bump whenever the layout changes
+const std::uint32_t AstTablesVersion = 1;
+// Header flags
+const std::uint32_t AstTablesOffsetPositions = 1;
+
+// Columnar alternative to the CBOR export, which the transpiler reads in
+// place instead of parsing it into a tree of values first.
+//
+// All integers are little-endian. The output starts with a header:
+//
+//   magic        8 bytes, AstTablesMagic
+//   version      u32, AstTablesVersion
+//   flags        u32, AstTablesOffsetPositions if positions are offsets
+//   va_list_kind u32, a BuiltinVaListKind
+//   sections     u32, the number of sections
+//
+// followed by the offset and size in bytes of each section as two u64s, in
+// the order of AstTablesSection. Every section starts at a multiple of 8
+// bytes.
+//
+// Positions are a file ID followed by a line and column number, or by a
+// byte offset into the file if AstTablesOffsetPositions is set; spans are a
+// file ID followed by two such positions. Extras are CBOR encoded as in the
+// CBOR export, one array per node or type.
+class AstTablesWriter {
+  public:
+    explicit AstTablesWriter(bool offsetPositions);
+
+    // Returns whether `bytes` starts with AstTablesMagic
+    static bool isAstTables(const OutputBuffer &bytes);
+
+    void addNode(std::uint64_t id, ASTEntryTag tag,
+                 llvm::ArrayRef<std::uint64_t> children,
+                 llvm::ArrayRef<std::uint64_t> span, std::uint64_t typeId,
+                 bool rvalue, llvm::ArrayRef<std::uint64_t> macros,
+                 std::uint64_t macroText,
+                 llvm::function_ref<void(CborEncoder *)> extras);
+
+    void addType(std::uint64_t id, TypeTag tag,
+                 llvm::function_ref<void(CborEncoder *)> extras);
+
+    void addTopNode(std::uint64_t id) { topNodes.push_back(id); }
+
+    // `includeLoc` is empty for files that were not #included
+    void addFile(std::uint64_t path, llvm::ArrayRef<std::uint64_t> includeLoc,
+                 llvm::ArrayRef<std::uint64_t> lineStarts);
+
+    void addComment(llvm::ArrayRef<std::uint64_t> loc, llvm::StringRef text);
+
+    // Returns false, writing nothing, if an ID, position, index or size did
+    // not fit in the 32 bits the format has for it
+    bool write(OutputBuffer *out, std::uint32_t vaListKind,
+               llvm::ArrayRef<llvm::StringRef> strings) const;
+
+  private:
+    std::uint32_t narrow(std::uint64_t value);
+    void append(std::vector<std::uint32_t> *column,
+                llvm::ArrayRef<std::uint64_t> values);
+
+    // Positions are offsets rather than lines and columns
+    bool offsetPositions;
+    // A value added so far did not fit in 32 bits
+    bool overflow;
+
+    std::vector<std::uint32_t> nodeIds;
+    std::vector<std::uint16_t> nodeTags;
+    std::vector<std::uint32_t> nodeChildStarts;
+    std::vector<std::uint32_t> nodeChildren;
+    std::vector<std::uint32_t> nodeSpans;
+    std::vector<std::uint32_t> nodeTypes;
+    std::vector<std::uint8_t> nodeFlags;
+    std::vector<std::uint32_t> nodeMacroStarts;
+    std::vector<std::uint32_t> nodeMacros;
+    std::vector<std::uint32_t> nodeMacroTexts;
+    std::vector<std::uint32_t> nodeExtraStarts;
+    std::vector<std::uint8_t> nodeExtras;
+
+    std::vector<std::uint32_t> typeIds;
+    std::vector<std::uint16_t> typeTags;
+    std::vector<std::uint32_t> typeExtraStarts;
+    std::vector<std::uint8_t> typeExtras;
+
+    std::vector<std::uint32_t> topNodes;
+
+    std::vector<std::uint32_t> filePaths;
+    std::vector<std::uint32_t> fileIncludes;
+    std::vector<std::uint32_t> fileLineStarts;
+    std::vector<std::uint32_t> fileLines;
+
+    std::vector<std::uint32_t> commentLocs;
+    std::vector<std::uint32_t> commentStarts;
+    std::vector<std::uint8_t> comments;
+};
+
+#endif /* AstTables_hpp */
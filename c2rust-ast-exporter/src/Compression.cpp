@@ -0,0 +1,88 @@
+//
+//  Compression.cpp
+//
+
+#include <memory>
+#include <vector>
+
+#ifdef C2RUST_WITH_ZSTD
+#include <zstd.h>
+#endif // C2RUST_WITH_ZSTD
+
+#include "Compression.hpp"
+
+using namespace llvm;
+
+bool Compression::parse(StringRef spec, Compression &compression,
+                        std::string &error) {
+    auto parts = spec.split(':');
+    if (parts.first != "zstd") {
+        error = "unknown compression '" + spec.str() + "', expected zstd[:level]";
+        return false;
+    }
+#ifdef C2RUST_WITH_ZSTD
+    int level = 0;
+    if (!parts.second.empty() &&
+        (parts.second.getAsInteger(10, level) || level < 1 ||
+         level > ZSTD_maxCLevel())) {
+        error = "invalid zstd level '" + parts.second.str() +
+                "', expected 1 to " + std::to_string(ZSTD_maxCLevel());
+        return false;
+    }
+    compression.zstd = true;
+    compression.level = level;
+    return true;
+#else
+    error = "the exporter was built without zstd";
+    return false;
+#endif // C2RUST_WITH_ZSTD
+}
+
+bool writeCompressed(const OutputBuffer &bytes, const Compression &compression,
+                     function_ref<void(const char *, std::size_t)> write,
+                     std::string &error) {
+    if (!compression.zstd) {
+        for (std::size_t i = 0; i < bytes.segment_count(); i++) {
+            write(reinterpret_cast<const char *>(bytes.segment_data(i)),
+                  bytes.segment_size(i));
+        }
+        return true;
+    }
+
+#ifdef C2RUST_WITH_ZSTD
+    std::unique_ptr<ZSTD_CStream, std::size_t (*)(ZSTD_CStream *)> stream(
+        ZSTD_createCStream(), ZSTD_freeCStream);
+    if (!stream) {
+        error = "cannot allocate zstd stream";
+        return false;
+    }
+    auto result = ZSTD_initCStream(stream.get(), compression.level);
+    std::vector<char> out(ZSTD_CStreamOutSize());
+    for (std::size_t i = 0; i < bytes.segment_count() && !ZSTD_isError(result);
+         i++) {
+        ZSTD_inBuffer input = {bytes.segment_data(i), bytes.segment_size(i), 0};
+        while (input.pos < input.size) {
+            ZSTD_outBuffer output = {out.data(), out.size(), 0};
+            result = ZSTD_compressStream(stream.get(), &output, &input);
+            if (ZSTD_isError(result))
+                break;
+            write(out.data(), output.pos);
+        }
+    }
+    // Flush what zstd has buffered and end the frame
+    while (!ZSTD_isError(result)) {
+        ZSTD_outBuffer output = {out.data(), out.size(), 0};
+        result = ZSTD_endStream(stream.get(), &output);
+        if (ZSTD_isError(result))
+            break;
+        write(out.data(), output.pos);
+        if (result == 0)
+            return true;
+    }
+    error = std::string("zstd compression failed: ") + ZSTD_getErrorName(result);
+    return false;
+#else
+    error = "the exporter was built without zstd";
+    return false;
+#endif // C2RUST_WITH_ZSTD
+}
@@ -0,0 +1,41 @@
+//
+//  Compression.hpp
+//
+
+#ifndef Compression_hpp
+#define Compression_hpp
+
+#include <cstddef>
+#include <string>
+
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/StringRef.h"
+
+#include "OutputBuffer.hpp"
+
+// How the exporter binary and plugin compress the files they write, as given
+// by --compress=zstd[:level]. zstd is only available if the exporter was
+// built with it (see CMakeLists.txt).
+struct Compression {
+    bool zstd = false;
+    // zstd's default level if 0
+    int level = 0;
+
+    // Parse "zstd" or "zstd:<level>". Returns false and sets `error` if
+    // `spec` is neither, or if zstd is not available.
+    static bool parse(llvm::StringRef spec, Compression &compression,
+                      std::string &error);
+
+    // Appended to the names of compressed files
+    const char *extension() const { return zstd ? ".zst" : ""; }
+};
+
+// Pass `bytes` to `write` a piece at a time, compressed as `compression`
+// says. Segments are compressed one after the other into a single zstd
+// frame, so the whole output is never copied. Returns false and sets `error`
+// if compression fails.
+bool writeCompressed(const OutputBuffer &bytes, const Compression &compression,
+                     llvm::function_ref<void(const char *, std::size_t)> write,
+                     std::string &error);
+
+#endif /* Compression_hpp */
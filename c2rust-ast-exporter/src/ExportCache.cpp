@@ -0,0 +1,159 @@
+//
+//  ExportCache.cpp
+//
+
+#include <algorithm>
+#include <utility>
+#include <utime.h>
+#include <vector>
+
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "ExportCache.hpp"
+
+namespace fs = llvm::sys::fs;
+
+namespace {
+const char EntryExtension[] = ".cbor";
+const char InputsExtension[] = ".inputs";
+} // namespace
+
+ExportCache::ExportCache(std::string directory, std::uint64_t maxSize)
+    : directory(std::move(directory)), maxSize(maxSize), size(-1) {}
+
+std::string ExportCache::entryPath(const std::string &key,
+                                   llvm::StringRef extension) const {
+    llvm::SmallString<256> path(directory);
+    llvm::sys::path::append(path, key + extension);
+    return path.str();
+}
+
+bool ExportCache::lookup(const std::string &key, OutputBuffer *bytes,
+                         std::string *diagnostics) {
+    auto path = entryPath(key, EntryExtension);
+    auto buffer = llvm::MemoryBuffer::getFile(path);
+    if (!buffer)
+        return false;
+
+    // <diagnostics size>\n<diagnostics><CBOR>
+    auto header = (*buffer)->getBuffer().split('\n');
+    std::size_t diagnosticsSize;
+    if (header.first.getAsInteger(10, diagnosticsSize) ||
+        diagnosticsSize >= header.second.size())
+        return false;
+
+    *diagnostics = header.second.take_front(diagnosticsSize).str();
+    auto cbor = header.second.drop_front(diagnosticsSize);
+    bytes->append(cbor.data(), cbor.size());
+
+    // Mark the entry as recently used
+    utime(path.c_str(), nullptr);
+    return true;
+}
+
+void ExportCache::store(const std::string &key, const OutputBuffer &bytes,
+                        llvm::StringRef diagnostics) {
+    auto header = std::to_string(diagnostics.size()) + '\n' + diagnostics.str();
+    if (write(entryPath(key, EntryExtension), header, &bytes))
+        grow(header.size() + bytes.size());
+}
+
+bool ExportCache::lookupInputs(const std::string &key, std::string *inputs) {
+    auto path = entryPath(key, InputsExtension);
+    auto buffer = llvm::MemoryBuffer::getFile(path);
+    if (!buffer)
+        return false;
+    *inputs = (*buffer)->getBuffer().str();
+    utime(path.c_str(), nullptr);
+    return true;
+}
+
+void ExportCache::storeInputs(const std::string &key, llvm::StringRef inputs) {
+    if (write(entryPath(key, InputsExtension), inputs, nullptr))
+        grow(inputs.size());
+}
+
+bool ExportCache::write(const std::string &path, llvm::StringRef text,
+                        const OutputBuffer *bytes) {
+    if (fs::create_directories(directory))
+        return false;
+
+    llvm::SmallString<256> model(directory);
+    llvm::sys::path::append(model, "tmp-%%%%%%%%%%%%");
+    llvm::SmallString<256> tmpPath;
+    int fd;
+    if (fs::createUniqueFile(model, fd, tmpPath))
+        return false;
+
+    {
+        llvm::raw_fd_ostream out(fd, /*shouldClose=*/true);
+        out << text;
+        for (std::size_t i = 0; bytes && i < bytes->segment_count(); i++) {
+            out.write(reinterpret_cast<const char *>(bytes->segment_data(i)),
+                      bytes->segment_size(i));
+        }
+        out.close();
+        if (out.has_error()) {
+            out.clear_error();
+            fs::remove(tmpPath);
+            return false;
+        }
+    }
+
+    // Another process may be storing the same entry; either copy will do.
+    if (fs::rename(tmpPath, path)) {
+        fs::remove(tmpPath);
+        return false;
+    }
+    return true;
+}
+
+void ExportCache::grow(std::uint64_t added) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (size < 0) {
+        evict(maxSize);
+    } else {
+        size += added;
+        // Evict down to below the limit so that we don't have to scan the
+        // directory again on the next store.
+        if (static_cast<std::uint64_t>(size) > maxSize)
+            evict(maxSize / 10 * 9);
+    }
+}
+
+void ExportCache::evict(std::uint64_t target) {
+    struct Entry {
+        std::string path;
+        llvm::sys::TimePoint<> time;
+        std::uint64_t size;
+    };
+    std::vector<Entry> entries;
+    std::uint64_t total = 0;
+
+    std::error_code ec;
+    for (fs::directory_iterator it(directory, ec), end; !ec && it != end;
+         it.increment(ec)) {
+        auto extension = llvm::sys::path::extension(it->path());
+        if (extension != EntryExtension && extension != InputsExtension)
+            continue;
+        fs::file_status status;
+        if (fs::status(it->path(), status))
+            continue;
+        entries.push_back(
+            {it->path(), status.getLastModificationTime(), status.getSize()});
+        total += status.getSize();
+    }
+
+    std::sort(entries.begin(), entries.end(),
+              [](const Entry &a, const Entry &b) { return a.time < b.time; });
+    for (auto const &entry : entries) {
+        if (total <= target)
+            break;
+        if (!fs::remove(entry.path))
+            total -= entry.size;
+    }
+    size = total;
+}
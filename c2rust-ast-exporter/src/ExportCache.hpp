@@ -0,0 +1,63 @@
+//
+//  ExportCache.hpp
+//
+
+#ifndef ExportCache_hpp
+#define ExportCache_hpp
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+#include "llvm/ADT/StringRef.h"
+
+#include "OutputBuffer.hpp"
+
+// Content-addressed on-disk cache of exported CBOR.
+//
+// Each entry is one file named after its key, holding the diagnostics printed
+// while exporting followed by the CBOR. Alongside them are entries listing
+// the input files last read for each compile command, whose contents the
+// exports are keyed by. Entries are written to a temporary file and renamed
+// into place, so several processes may share a cache directory. Reading an
+// entry bumps its modification time, and once the entries take up more than
+// the maximum size the least recently used ones are deleted.
+class ExportCache {
+  public:
+    ExportCache(std::string directory, std::uint64_t maxSize);
+
+    // Returns false if there is no entry for `key`.
+    bool lookup(const std::string &key, OutputBuffer *bytes,
+                std::string *diagnostics);
+
+    void store(const std::string &key, const OutputBuffer &bytes,
+               llvm::StringRef diagnostics);
+
+    // Returns false if no inputs were stored for `key`.
+    bool lookupInputs(const std::string &key, std::string *inputs);
+
+    void storeInputs(const std::string &key, llvm::StringRef inputs);
+
+  private:
+    std::string entryPath(const std::string &key,
+                          llvm::StringRef extension) const;
+    // Write `text` followed by `bytes`, if any, to the entry at `path`.
+    // Returns false if it could not be written.
+    bool write(const std::string &path, llvm::StringRef text,
+               const OutputBuffer *bytes);
+    // Account for `added` bytes of new entries, evicting if need be
+    void grow(std::uint64_t added);
+    // Delete the least recently used entries until at most `target` bytes
+    // remain. Must be called with `mutex` held.
+    void evict(std::uint64_t target);
+
+    std::string directory;
+    std::uint64_t maxSize;
+
+    // Guards size
+    std::mutex mutex;
+    // Approximate total size of the entries, or -1 if not yet known
+    std::int64_t size;
+};
+
+#endif /* ExportCache_hpp */
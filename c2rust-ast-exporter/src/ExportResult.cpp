@@ -5,31 +5,51 @@
 //  Created by Eric Mertens on 9/11/18.
 //
 
+#include <utility>
+
 #include "ExportResult.hpp"
+#include "OutputBuffer.hpp"
 
-ExportResult::ExportResult() : entries(0), names(), bytes(), sizes() {}
+ExportResult::ExportResult()
+    : entries(0), names(), segments(), segment_counts(), buffers() {}
 
 ExportResult::~ExportResult() { deallocate(); }
 
 void ExportResult::resize(std::size_t n) {
     deallocate();
     names = new char *[n];
-    bytes = new std::uint8_t *[n];
-    sizes = new std::size_t[n];
+    segments = new ExportSegment *[n];
+    segment_counts = new std::size_t[n];
+    buffers = new OutputBuffer[n];
     std::fill_n(names, n, nullptr);
-    std::fill_n(bytes, n, nullptr);
-    std::fill_n(sizes, n, 0);
+    std::fill_n(segments, n, nullptr);
+    std::fill_n(segment_counts, n, 0);
     entries = n;
 }
 
+void ExportResult::set_bytes(std::size_t i, OutputBuffer &&bytes) {
+    buffers[i] = std::move(bytes);
+    auto const &buffer = buffers[i];
+
+    auto n = buffer.segment_count();
+    delete[] segments[i];
+    segments[i] = new ExportSegment[n];
+    for (std::size_t j = 0; j < n; j++) {
+        segments[i][j].data = buffer.segment_data(j);
+        segments[i][j].size = buffer.segment_size(j);
+    }
+    segment_counts[i] = n;
+}
+
 void ExportResult::deallocate() {
     for (std::size_t i = 0; i < entries; i++) {
         delete[] names[i];
-        delete[] bytes[i];
+        delete[] segments[i];
     }
     delete[] names;
-    delete[] bytes;
-    delete[] sizes;
+    delete[] segments;
+    delete[] segment_counts;
+    delete[] buffers;
 
     entries = 0;
 }
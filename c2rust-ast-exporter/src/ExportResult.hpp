@@ -12,11 +12,23 @@
 #include <cstddef>
 #include <cstdint>
 
+class OutputBuffer;
+
+// A contiguous run of exported bytes. The memory is owned by the ExportResult
+// the segment was obtained from.
+struct ExportSegment {
+    const std::uint8_t *data;
+    std::size_t size;
+};
+
 struct ExportResult {
     std::size_t entries;
     char **names;
-    std::uint8_t **bytes;
-    std::size_t *sizes;
+    // The output for entry i is handed over in the segments it was encoded
+    // into rather than copied: segments[i] is an array of segment_counts[i]
+    // segments which, concatenated, form the CBOR for that entry.
+    ExportSegment **segments;
+    std::size_t *segment_counts;
 
     ExportResult();
     ExportResult(ExportResult const &) = delete;
@@ -26,7 +38,12 @@ struct ExportResult {
 
     void resize(std::size_t n);
 
+    // Take ownership of `bytes` and expose its segments as entry i
+    void set_bytes(std::size_t i, OutputBuffer &&bytes);
+
   private:
+    OutputBuffer *buffers;
+
     void deallocate();
 };
 
@@ -0,0 +1,173 @@
+//
+//  ExportStats.cpp
+//
+
+#include "clang/Basic/Version.h"
+#include "llvm/Support/Format.h"
+#if CLANG_VERSION_MAJOR >= 9
+#include "llvm/Support/TimeProfiler.h"
+#endif // CLANG_VERSION_MAJOR
+
+#include "ExportStats.hpp"
+
+using namespace llvm;
+
+namespace {
+std::uint64_t microseconds(ExportStats::Clock::duration time) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(time).count();
+}
+
+void writeString(raw_ostream &os, StringRef str) {
+    os << '"';
+    for (unsigned char c : str) {
+        if (c == '"' || c == '\\')
+            os << '\\' << c;
+        else if (c < 0x20)
+            os << format("\\u%04x", c);
+        else
+            os << c;
+    }
+    os << '"';
+}
+} // namespace
+
+ExportStats::Phase::Phase(ExportStats *stats, const char *name)
+    : stats(stats), name(name) {
+    if (!stats)
+        return;
+    begin = Clock::now();
+#if CLANG_VERSION_MAJOR >= 9
+    if (timeTraceProfilerEnabled())
+        timeTraceProfilerBegin(StringRef("c2rust: " + std::string(name)),
+                               StringRef());
+#endif // CLANG_VERSION_MAJOR
+}
+
+ExportStats::Phase::~Phase() {
+    if (!stats)
+        return;
+#if CLANG_VERSION_MAJOR >= 9
+    if (timeTraceProfilerEnabled())
+        timeTraceProfilerEnd();
+#endif // CLANG_VERSION_MAJOR
+    stats->addPhase(name, begin);
+}
+
+ExportStats::Entry::Entry(ExportStats *stats, ASTEntryTag tag)
+    : stats(stats), isType(false), tag(tag) {
+    if (!stats)
+        return;
+    written = stats->written();
+    begin = Clock::now();
+}
+
+ExportStats::Entry::Entry(ExportStats *stats, TypeTag tag)
+    : stats(stats), isType(true), tag(tag) {
+    if (!stats)
+        return;
+    written = stats->written();
+    begin = Clock::now();
+}
+
+ExportStats::Entry::~Entry() {
+    if (!stats)
+        return;
+    auto time = Clock::now() - begin;
+    stats->addEntry(isType ? stats->types : stats->entries, tag,
+                    stats->written() - written, time);
+}
+
+ExportStats::ExportStats() : start(Clock::now()) {}
+
+void ExportStats::addPhase(const char *name, Clock::time_point begin) {
+    phases.push_back({name, begin, Clock::now()});
+}
+
+void ExportStats::addEntry(std::vector<TagStats> &tags, unsigned tag,
+                           std::size_t bytes, Clock::duration time) {
+    if (tag >= tags.size())
+        tags.resize(tag + 1);
+    auto &stats = tags[tag];
+    stats.count++;
+    stats.bytes += bytes;
+    stats.nanoseconds +=
+        std::chrono::duration_cast<std::chrono::nanoseconds>(time).count();
+}
+
+void ExportStats::mergeEntries(const ExportStats &other) {
+    auto merge = [](std::vector<TagStats> &tags,
+                    const std::vector<TagStats> &others) {
+        if (others.size() > tags.size())
+            tags.resize(others.size());
+        for (size_t i = 0; i < others.size(); i++) {
+            tags[i].count += others[i].count;
+            tags[i].bytes += others[i].bytes;
+            tags[i].nanoseconds += others[i].nanoseconds;
+        }
+    };
+    merge(entries, other.entries);
+    merge(types, other.types);
+}
+
+// {
+//   "file": <main file>,
+//   "bytes": <size of the export>,
+//   "phases": [{"name", "start_us", "duration_us"}, ...],
+//   "entries": [{"tag", "count", "bytes", "encode_ns"}, ...],
+//   "types": [{"tag", "count", "bytes", "encode_ns"}, ...]
+// }
+//
+// Tags are the values of ASTEntryTag and TypeTag, and only those that were
+// encoded are listed.
+void ExportStats::writeReport(raw_ostream &os, StringRef file) const {
+    os << "{\n  \"file\": ";
+    writeString(os, file);
+    os << ",\n  \"bytes\": " << totalBytes << ",\n  \"phases\": [";
+    for (size_t i = 0; i < phases.size(); i++) {
+        auto const &phase = phases[i];
+        os << (i ? ",\n" : "\n") << "    {\"name\": ";
+        writeString(os, phase.name);
+        os << ", \"start_us\": " << microseconds(phase.begin - start)
+           << ", \"duration_us\": " << microseconds(phase.end - phase.begin)
+           << "}";
+    }
+    os << "\n  ]";
+
+    auto writeTags = [&os](const char *name, const std::vector<TagStats> &tags) {
+        os << ",\n  \"" << name << "\": [";
+        bool first = true;
+        for (size_t tag = 0; tag < tags.size(); tag++) {
+            auto const &stats = tags[tag];
+            if (!stats.count)
+                continue;
+            os << (first ? "\n" : ",\n") << "    {\"tag\": " << tag
+               << ", \"count\": " << stats.count
+               << ", \"bytes\": " << stats.bytes
+               << ", \"encode_ns\": " << stats.nanoseconds << "}";
+            first = false;
+        }
+        os << "\n  ]";
+    };
+    writeTags("entries", entries);
+    writeTags("types", types);
+    os << "\n}\n";
+}
+
+// Complete events in the format of clang's -ftime-trace output, on the same
+// process and thread, so that chrome://tracing shows them together
+void ExportStats::writeTrace(raw_ostream &os, StringRef file) const {
+    os << "{\"traceEvents\": [";
+    for (size_t i = 0; i < phases.size(); i++) {
+        auto const &phase = phases[i];
+        os << (i ? ",\n" : "\n")
+           << "{\"pid\": 1, \"tid\": 0, \"ph\": \"X\", \"ts\": "
+           << microseconds(phase.begin - start)
+           << ", \"dur\": " << microseconds(phase.end - phase.begin)
+           << ", \"name\": ";
+        writeString(os, std::string("c2rust: ") + phase.name);
+        os << ", \"args\": {\"detail\": ";
+        writeString(os, file);
+        os << "}}";
+    }
+    os << "\n]}\n";
+}
@@ -0,0 +1,119 @@
+//
+//  ExportStats.hpp
+//
+
+#ifndef ExportStats_hpp
+#define ExportStats_hpp
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "ast_tags.hpp"
+
+// Where the time exporting a translation unit goes, for finding the hot paths
+// of the exporter (see ExportOptions::exportStats).
+//
+// Phases of the export are timed as a whole. Each AST node and type is
+// counted under its tag along with the time taken to encode it, not counting
+// its children, and the bytes its entry takes up in the output set with
+// setOutput. Entries added to the columnar tables have no size of their own.
+class ExportStats {
+  public:
+    using Clock = std::chrono::steady_clock;
+
+    // Times a phase from construction to destruction. In a compile with
+    // -ftime-trace, the phase also shows up in the trace clang writes. Does
+    // nothing without stats.
+    class Phase {
+        ExportStats *stats;
+        const char *name;
+        Clock::time_point begin;
+
+      public:
+        Phase(ExportStats *stats, const char *name);
+        ~Phase();
+        Phase(const Phase &) = delete;
+        Phase &operator=(const Phase &) = delete;
+    };
+
+    // Counts an AST node or type under `tag`, timing it from construction to
+    // destruction. Does nothing without stats.
+    class Entry {
+        ExportStats *stats;
+        bool isType;
+        unsigned tag;
+        std::size_t written;
+        Clock::time_point begin;
+
+      public:
+        Entry(ExportStats *stats, ASTEntryTag tag);
+        Entry(ExportStats *stats, TypeTag tag);
+        ~Entry();
+        Entry(const Entry &) = delete;
+        Entry &operator=(const Entry &) = delete;
+    };
+
+    ExportStats();
+
+    // When the export started, which the times in the report are relative to
+    Clock::time_point getStart() const { return start; }
+
+    // Record a phase that started at `begin` and ends now
+    void addPhase(const char *name, Clock::time_point begin);
+
+    // Measure the bytes entries take up by how much `output` grows while
+    // they are encoded. `output` must have a size() of bytes written so far.
+    template <typename Output> void setOutput(const Output *output) {
+        this->output = output;
+        outputSize = [](const void *output) -> std::size_t {
+            return static_cast<const Output *>(output)->size();
+        };
+    }
+
+    // Add the entries counted by the stats of a visitor encoding part of the
+    // same translation unit (see EncodeWorker)
+    void mergeEntries(const ExportStats &other);
+
+    void setTotalBytes(std::uint64_t bytes) { totalBytes = bytes; }
+
+    // Write the stats as a JSON object
+    void writeReport(llvm::raw_ostream &os, llvm::StringRef file) const;
+
+    // Write the phases as Chrome trace events, which can be loaded along
+    // with the trace clang writes for -ftime-trace
+    void writeTrace(llvm::raw_ostream &os, llvm::StringRef file) const;
+
+  private:
+    struct TagStats {
+        std::uint64_t count = 0;
+        std::uint64_t bytes = 0;
+        std::uint64_t nanoseconds = 0;
+    };
+
+    struct PhaseTime {
+        const char *name;
+        Clock::time_point begin;
+        Clock::time_point end;
+    };
+
+    std::size_t written() const { return output ? outputSize(output) : 0; }
+
+    void addEntry(std::vector<TagStats> &tags, unsigned tag,
+                  std::size_t bytes, Clock::duration time);
+
+    Clock::time_point start;
+    std::vector<PhaseTime> phases;
+    // Indexed by tag
+    std::vector<TagStats> entries;
+    std::vector<TagStats> types;
+    const void *output = nullptr;
+    std::size_t (*outputSize)(const void *) = nullptr;
+    std::uint64_t totalBytes = 0;
+};
+
+#endif /* ExportStats_hpp */
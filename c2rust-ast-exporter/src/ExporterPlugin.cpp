@@ -0,0 +1,157 @@
+//
+//  ExporterPlugin.cpp
+//
+//  Clang plugin that exports the AST of each file the build compiles, with
+//  the exact flags the build uses, instead of parsing it again from a
+//  compilation database. Load it with cc_wrapper.sh. The export is written
+//  next to the object file, as <output>.cbor, or <output>.cbor.zst with
+//  compress=zstd.
+//
+
+#include <cstring>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include "clang/AST/ASTConsumer.h"
+#include "clang/Frontend/CompilerInstance.h"
+#include "clang/Frontend/FrontendPluginRegistry.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "AstExporter.hpp"
+#include "Compression.hpp"
+
+using namespace clang;
+
+namespace {
+
+// Owns what the export consumer refers to, since the plugin action is gone
+// by the time the translation unit has been parsed
+class PluginConsumer : public ASTConsumer {
+    CompilerInstance &ci;
+    std::string outputPath;
+    ExportOptions options;
+    Compression compression;
+    Outputs outputs;
+    std::unique_ptr<ASTConsumer> consumer;
+
+  public:
+    PluginConsumer(CompilerInstance &ci, llvm::StringRef inFile,
+                   std::string outputPath, const ExportOptions &options,
+                   const Compression &compression)
+        : ci(ci), outputPath(std::move(outputPath)), options(options),
+          compression(compression) {
+        consumer = createExportConsumer(ci, inFile, &outputs, this->options);
+    }
+
+    void HandleTranslationUnit(ASTContext &Context) override {
+        // The build fails anyway, so don't leave a partial export behind
+        auto &diags = ci.getDiagnostics();
+        if (diags.hasErrorOccurred())
+            return;
+
+        consumer->HandleTranslationUnit(Context);
+
+        std::error_code ec;
+        std::string error;
+        llvm::raw_fd_ostream out(outputPath, ec, llvm::sys::fs::F_None);
+        if (!ec) {
+            auto write = [&out](const char *data, std::size_t size) {
+                out.write(data, size);
+            };
+            for (auto &output : outputs) {
+                if (!writeCompressed(output.second, compression, write, error))
+                    break;
+            }
+            out.close();
+            if (out.has_error()) {
+                ec = out.error();
+                out.clear_error();
+            }
+        }
+        if (ec)
+            error = ec.message();
+        if (!error.empty()) {
+            auto id = diags.getCustomDiagID(
+                DiagnosticsEngine::Error,
+                "cannot write AST export to '%0': %1");
+            diags.Report(id) << outputPath << error;
+        }
+    }
+};
+
+class ExportAction : public PluginASTAction {
+    ExportOptions options;
+    Compression compression;
+    std::string outputPath;
+
+  protected:
+    std::unique_ptr<ASTConsumer> CreateASTConsumer(CompilerInstance &ci,
+                                                   llvm::StringRef inFile) override {
+        auto path = outputPath;
+        if (path.empty()) {
+            auto &objectFile = ci.getFrontendOpts().OutputFile;
+            path = (objectFile.empty() || objectFile == "-" ? inFile.str()
+                                                            : objectFile) +
+                   ".cbor" + compression.extension();
+        }
+        return llvm::make_unique<PluginConsumer>(ci, inFile, path, options,
+                                                 compression);
+    }
+
+    // Takes the arguments passed with -plugin-arg-c2rust-ast-exporter
+    bool ParseArgs(const CompilerInstance &ci,
+                   const std::vector<std::string> &args) override {
+        for (auto &arg : args) {
+            llvm::StringRef name(arg);
+            if (name == "prune-unused-decls") {
+                options.pruneUnusedDecls = true;
+            } else if (name == "offset-positions") {
+                options.offsetPositions = true;
+            } else if (name == "columnar") {
+                options.columnarFormat = true;
+            } else if (name == "decls-only") {
+                options.declsOnly = true;
+            } else if (name == "system-header-comments") {
+                options.systemHeaderComments = true;
+            } else if (name == "stats") {
+                options.exportStats = true;
+            } else if (name == "trace") {
+                options.exportTrace = true;
+            } else if (name.startswith("output=")) {
+                outputPath = name.drop_front(strlen("output=")).str();
+            } else if (name.startswith("compress=")) {
+                std::string error;
+                if (!Compression::parse(name.drop_front(strlen("compress=")),
+                                        compression, error)) {
+                    auto &diags = ci.getDiagnostics();
+                    auto id = diags.getCustomDiagID(
+                        DiagnosticsEngine::Error,
+                        "invalid c2rust-ast-exporter plugin argument '%0': %1");
+                    diags.Report(id) << arg << error;
+                    return false;
+                }
+            } else {
+                auto &diags = ci.getDiagnostics();
+                auto id = diags.getCustomDiagID(
+                    DiagnosticsEngine::Error,
+                    "unknown c2rust-ast-exporter plugin argument '%0'");
+                diags.Report(id) << arg;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    PluginASTAction::ActionType getActionType() override {
+        return AddBeforeMainAction;
+    }
+};
+
+} // namespace
+
+static FrontendPluginRegistry::Add<ExportAction>
+    X("c2rust-ast-exporter", "export the AST for the c2rust transpiler");
@@ -0,0 +1,61 @@
+//
+//  MacroExpansions.cpp
+//
+
+#include <algorithm>
+
+#include "clang/Basic/IdentifierTable.h"
+#include "clang/Lex/Token.h"
+
+#include "MacroExpansions.hpp"
+
+using namespace clang;
+
+class MacroExpansionIndex::Recorder : public PPCallbacks {
+    std::vector<Expansion> &expansions;
+
+  public:
+    explicit Recorder(std::vector<Expansion> &expansions)
+        : expansions(expansions) {}
+
+    void MacroExpands(const Token &name, const MacroDefinition &MD,
+                      SourceRange range, const MacroArgs *) override {
+        auto info = MD.getMacroInfo();
+        if (!info)
+            return;
+        expansions.push_back(
+            Expansion{info, name.getIdentifierInfo()->getName(), range});
+    }
+};
+
+std::unique_ptr<PPCallbacks> MacroExpansionIndex::createRecorder() {
+    return std::unique_ptr<PPCallbacks>(new Recorder(expansions));
+}
+
+const MacroExpansionIndex::Expansion *
+MacroExpansionIndex::lookup(SourceLocation loc) {
+    // Expansions are mostly recorded in order already
+    if (!sorted) {
+        std::stable_sort(expansions.begin(), expansions.end(),
+                         [](const Expansion &a, const Expansion &b) {
+                             return a.range.getBegin() < b.range.getBegin();
+                         });
+        sorted = true;
+    }
+
+    auto expansion = std::lower_bound(
+        expansions.begin(), expansions.end(), loc,
+        [](const Expansion &expansion, SourceLocation loc) {
+            return expansion.range.getBegin() < loc;
+        });
+    if (expansion == expansions.end() || expansion->range.getBegin() != loc)
+        return nullptr;
+    return &*expansion;
+}
+
+bool MacroExpansionIndex::isRecorded(const SourceManager &SM,
+                                     SourceLocation loc) {
+    // Preambles and AST files are loaded, and their source locations with
+    // them
+    return !SM.isLoadedSourceLocation(loc);
+}
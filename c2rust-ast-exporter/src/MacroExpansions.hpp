@@ -0,0 +1,55 @@
+//
+//  MacroExpansions.hpp
+//
+
+#ifndef MacroExpansions_hpp
+#define MacroExpansions_hpp
+
+#include <memory>
+#include <vector>
+
+#include "clang/Basic/SourceLocation.h"
+#include "clang/Basic/SourceManager.h"
+#include "clang/Lex/MacroInfo.h"
+#include "clang/Lex/PPCallbacks.h"
+#include "llvm/ADT/StringRef.h"
+
+// The macro expansions of a translation unit, recorded as the preprocessor
+// expands them so that the exporter does not need to lex macro names again
+// to find out which macro an expression was expanded from.
+//
+// Expansions in a precompiled preamble happened while building the preamble
+// and are not recorded.
+class MacroExpansionIndex {
+  public:
+    struct Expansion {
+        clang::MacroInfo *info;
+        // Owned by the preprocessor's identifier table
+        llvm::StringRef name;
+        // From the macro name to the end of the invocation
+        clang::SourceRange range;
+    };
+
+    // Callbacks to add to the preprocessor to record its expansions into
+    // this index, which must outlive them.
+    std::unique_ptr<clang::PPCallbacks> createRecorder();
+
+    // The expansion of the macro whose name is at `loc`, or null if none was
+    // recorded. Must not be called before preprocessing ends.
+    const Expansion *lookup(clang::SourceLocation loc);
+
+    // Whether a macro expanded at `loc` would have been recorded, which it
+    // is not if it was expanded while building a precompiled preamble or an
+    // AST file loaded instead of parsed.
+    static bool isRecorded(const clang::SourceManager &SM,
+                           clang::SourceLocation loc);
+
+  private:
+    class Recorder;
+
+    // Ordered by the start of their ranges once sorted is set
+    std::vector<Expansion> expansions;
+    bool sorted = false;
+};
+
+#endif /* MacroExpansions_hpp */
@@ -3,22 +3,125 @@
 //
 //  Created by Alec Theriault on 10/4/18.
 //
+#include <cstring>
 #include <fstream>
+#include <iostream>
 #include <iterator>
+#include <string>
+#include <vector>
 
 #include "AstExporter.hpp"
+#include "AstTables.hpp"
+#include "Compression.hpp"
+
+static void write_bytes(std::ostream &out, OutputBuffer const &bytes) {
+    for (std::size_t i = 0; i < bytes.segment_count(); i++) {
+        out.write(reinterpret_cast<const char *>(bytes.segment_data(i)),
+                  bytes.segment_size(i));
+    }
+}
+
+// Serve export requests from stdin until it is closed. The compilation
+// database, file system caches and clang state shared between files are kept
+// warm across requests. Each request is one line:
+//
+//   export <file>  Export <file>. The reply is a line "<result> <size>"
+//                  followed by <size> bytes of CBOR. <result> is 0 on
+//                  success, 1 if clang failed, 2 if the file has no compile
+//                  command and 3 if the request was not understood.
+//   flush          Forget cached file system state after files on disk have
+//                  changed. The reply is "0 0".
+//   quit           Stop serving.
+static int serve(const char *cc_db, std::vector<std::string> extra_args) {
+    std::string error;
+    auto session = ExportSession::create(cc_db, std::move(extra_args), error);
+    if (!session) {
+        std::cerr << "Could not load compilation database from " << cc_db
+                  << ": " << error << std::endl;
+        return 1;
+    }
+
+    const std::string export_request = "export ";
+    std::string request;
+    while (std::getline(std::cin, request)) {
+        if (request == "quit")
+            break;
+
+        if (request == "flush") {
+            session->flushFileCaches();
+            std::cout << "0 0\n" << std::flush;
+            continue;
+        }
+
+        if (request.compare(0, export_request.size(), export_request) != 0) {
+            std::cerr << "Unknown request: " << request << std::endl;
+            std::cout << "3 0\n" << std::flush;
+            continue;
+        }
+
+        Outputs outputs;
+        auto result = session->exportFile(
+            request.substr(export_request.size()), &outputs);
+
+        // A file compiled by several commands is exported once per command
+        // into the same entry, so there is at most one output.
+        if (outputs.empty()) {
+            std::cout << result << " 0\n";
+        } else {
+            auto const &bytes = outputs.begin()->second;
+            std::cout << result << " " << bytes.size() << "\n";
+            write_bytes(std::cout, bytes);
+        }
+        std::cout << std::flush;
+    }
+
+    return 0;
+}
 
 int main(int argc, char *argv[]) {
-    int result;
-    auto outputs = process(argc, const_cast<const char **>(argv), &result);
+    // c2rust-ast-exporter --server <build path> [clang args...]
+    if (argc >= 3 && std::strcmp(argv[1], "--server") == 0) {
+        return serve(argv[2], std::vector<std::string>(argv + 3, argv + argc));
+    }
 
-    for (auto const &kv : outputs) {
-        auto const &filename = kv.first;
-        auto const &bytes = kv.second;
+    // --compress=zstd[:level] only applies to the files written here, so it
+    // is taken out before the arguments are parsed
+    const char compress_option[] = "--compress=";
+    const auto compress_length = sizeof(compress_option) - 1;
+    Compression compression;
+    std::vector<const char *> args;
+    for (int i = 0; i < argc; i++) {
+        if (std::strncmp(argv[i], compress_option, compress_length) != 0) {
+            args.push_back(argv[i]);
+            continue;
+        }
+        std::string error;
+        if (!Compression::parse(argv[i] + compress_length, compression,
+                                error)) {
+            std::cerr << error << std::endl;
+            return 1;
+        }
+    }
 
-        std::ofstream out(filename + ".cbor", out.binary | out.trunc);
+    int result;
+    auto outputs = process(args.size(), args.data(), &result);
 
-        out.write(reinterpret_cast<const char *>(bytes.data()), bytes.size());
+    for (auto const &kv : outputs) {
+        auto extension =
+            AstTablesWriter::isAstTables(kv.second) ? ".ast" : ".cbor";
+        auto path = kv.first + extension + compression.extension();
+        std::ofstream out(path, out.binary | out.trunc);
+        std::string error;
+        bool written = writeCompressed(
+            kv.second, compression,
+            [&out](const char *data, std::size_t size) { out.write(data, size); },
+            error);
+        out.close();
+        if (!written || !out) {
+            std::cerr << "Could not write " << path << ": "
+                      << (written ? "write failed" : error) << std::endl;
+            return 1;
+        }
     }
 
     return result;
@@ -0,0 +1,36 @@
+//
+//  OutputBuffer.cpp
+//
+
+#include <algorithm>
+#include <cstring>
+
+#include "OutputBuffer.hpp"
+
+const std::size_t OutputBuffer::SegmentSize;
+
+OutputBuffer::OutputBuffer() : segments(), total(0) {}
+
+void OutputBuffer::append(const void *data, std::size_t len) {
+    auto src = static_cast<const std::uint8_t *>(data);
+
+    while (len > 0) {
+        auto used = total % SegmentSize;
+        if (used == 0 && total == segments.size() * SegmentSize) {
+            segments.emplace_back(new std::uint8_t[SegmentSize]);
+        }
+
+        auto n = std::min(len, SegmentSize - used);
+        std::memcpy(segments.back().get() + used, src, n);
+
+        src += n;
+        len -= n;
+        total += n;
+    }
+}
+
+std::size_t OutputBuffer::segment_size(std::size_t i) const {
+    if (i + 1 < segments.size())
+        return SegmentSize;
+    return total - i * SegmentSize;
+}
@@ -0,0 +1,48 @@
+//
+//  OutputBuffer.hpp
+//
+
+#ifndef OutputBuffer_hpp
+#define OutputBuffer_hpp
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Append-only byte buffer backed by a list of fixed-size segments.
+//
+// The exporter does not know how large the CBOR for a translation unit will be
+// until it has been written. Growing a single contiguous buffer either needs
+// an up-front worst-case reservation or repeated reallocation and copying.
+// Segments are allocated one at a time as they fill up, so memory use tracks
+// the amount of output actually produced and previously written bytes never
+// move.
+class OutputBuffer {
+  public:
+    static const std::size_t SegmentSize = 1024 * 1024;
+
+    OutputBuffer();
+    OutputBuffer(OutputBuffer &&) = default;
+    OutputBuffer &operator=(OutputBuffer &&) = default;
+    OutputBuffer(OutputBuffer const &) = delete;
+    OutputBuffer &operator=(OutputBuffer const &) = delete;
+
+    void append(const void *data, std::size_t len);
+
+    // Total number of bytes written so far
+    std::size_t size() const { return total; }
+
+    // Segments are filled in order; every segment but the last one is full.
+    std::size_t segment_count() const { return segments.size(); }
+    const std::uint8_t *segment_data(std::size_t i) const {
+        return segments[i].get();
+    }
+    std::size_t segment_size(std::size_t i) const;
+
+  private:
+    std::vector<std::unique_ptr<std::uint8_t[]>> segments;
+    std::size_t total;
+};
+
+#endif /* OutputBuffer_hpp */
@@ -0,0 +1,280 @@
+//
+//  PreambleCache.cpp
+//
+
+#include <algorithm>
+
+#include "clang/Basic/Version.h"
+#include "clang/Frontend/CompilerInstance.h"
+#include "clang/Frontend/CompilerInvocation.h"
+#include "llvm/Support/Path.h"
+
+#include "PreambleCache.hpp"
+
+using namespace clang;
+
+namespace {
+
+#if CLANG_VERSION_MAJOR < 8
+using FileSystemRef = IntrusiveRefCntPtr<clang::vfs::FileSystem>;
+#else
+using FileSystemRef = IntrusiveRefCntPtr<llvm::vfs::FileSystem>;
+#endif // CLANG_VERSION_MAJOR
+
+// The file system `files` reads from, which has the virtual files of the
+// session in it if there are any
+FileSystemRef fileSystem(FileManager &files) {
+#if CLANG_VERSION_MAJOR < 9
+    return files.getVirtualFileSystem();
+#else
+    return &files.getVirtualFileSystem();
+#endif // CLANG_VERSION_MAJOR
+}
+
+bool isBlank(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\f' || c == '\v';
+}
+
+// Offsets just past the lines of the leading block of preprocessor directives
+// in `text` at which a preamble may end. A preamble must end after a complete
+// directive, outside of comments and conditional blocks, and is only worth
+// building once it contains an #include. Anything this does not understand
+// ends the block early, which is always safe.
+std::vector<std::size_t> preambleCutPoints(llvm::StringRef text) {
+    std::vector<std::size_t> cuts;
+    auto inComment = false;
+    auto sawInclude = false;
+    int depth = 0;
+
+    std::size_t pos = 0;
+    while (pos < text.size()) {
+        // Find the end of the logical line
+        auto end = pos;
+        while (true) {
+            end = text.find('\n', end);
+            if (end == llvm::StringRef::npos)
+                return cuts;
+            auto last = end;
+            if (last > pos && text[last - 1] == '\r')
+                last--;
+            if (last > pos && text[last - 1] == '\\') {
+                end++;
+                continue;
+            }
+            break;
+        }
+        auto line = text.slice(pos, end);
+        pos = end + 1;
+
+        auto directive = !inComment && line.ltrim().startswith("#");
+        auto code = false;
+        for (std::size_t i = 0; i < line.size() && !code; i++) {
+            auto c = line[i];
+            auto next = i + 1 < line.size() ? line[i + 1] : '\0';
+            if (inComment) {
+                if (c == '*' && next == '/') {
+                    inComment = false;
+                    i++;
+                }
+            } else if (c == '/' && next == '*') {
+                inComment = true;
+                i++;
+            } else if (c == '/' && next == '/') {
+                break;
+            } else if (directive && (c == '"' || c == '\'')) {
+                for (i++; i < line.size() && line[i] != c; i++) {
+                    if (line[i] == '\\')
+                        i++;
+                }
+            } else if (!directive && !isBlank(c)) {
+                code = true;
+            }
+        }
+        if (code)
+            break;
+        if (!directive)
+            continue;
+
+        auto name = line.ltrim().drop_front().ltrim();
+        name = name.take_while([](char c) {
+            return c == '_' || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+        });
+        if (name == "if" || name == "ifdef" || name == "ifndef") {
+            depth++;
+        } else if (name == "endif") {
+            if (depth == 0)
+                break;
+            depth--;
+        } else if (name == "include" || name == "include_next" ||
+                   name == "import") {
+            sawInclude = true;
+        }
+
+        if (!inComment && depth == 0 && sawInclude)
+            cuts.push_back(pos);
+    }
+    return cuts;
+}
+
+// Length of the common prefix of `a` and `b`
+std::size_t commonPrefix(llvm::StringRef a, llvm::StringRef b) {
+    auto n = std::min(a.size(), b.size());
+    return std::mismatch(a.begin(), a.begin() + n, b.begin()).first - a.begin();
+}
+
+} // namespace
+
+const std::size_t PreambleCache::MaxPreambles;
+const std::size_t PreambleCache::MaxCandidates;
+
+PreambleCache::PreambleCache() : nextId(0) {}
+
+std::shared_ptr<PrecompiledPreamble> PreambleCache::addPreamble(
+    CompilerInvocation &invocation, FileManager &files,
+    const std::string &flags,
+    std::shared_ptr<PCHContainerOperations> pchContainerOps,
+    DiagnosticConsumer *diags) {
+    auto &inputs = invocation.getFrontendOpts().Inputs;
+    if (inputs.size() != 1 || !inputs[0].isFile())
+        return nullptr;
+
+    SmallString<256> mainPath(inputs[0].getFile());
+    files.makeAbsolutePath(mainPath);
+    auto buffer = files.getBufferForFile(mainPath);
+    if (!buffer)
+        return nullptr;
+    auto contents = (*buffer)->getBuffer();
+
+    auto cuts = preambleCutPoints(contents);
+    if (cuts.empty())
+        return nullptr;
+
+    // Quoted includes are looked up next to the including file, so only
+    // files in the same directory can share a preamble.
+    auto directory = llvm::sys::path::parent_path(mainPath);
+    auto key = flags;
+    key.push_back('\0');
+    key.append(directory.begin(), directory.end());
+
+    auto preamble = findPreamble(key, invocation, files, **buffer);
+    if (!preamble) {
+        auto size = sharedPrefix(key, contents, cuts);
+        if (size == 0)
+            return nullptr;
+        preamble = buildPreamble(key, directory, contents.take_front(size),
+                                 invocation, files, std::move(pchContainerOps),
+                                 diags);
+        if (!preamble)
+            return nullptr;
+    }
+
+    // The compiler takes ownership of the main file buffer.
+    auto vfs = fileSystem(files);
+    preamble->AddImplicitPreamble(invocation, vfs, buffer->release());
+    return preamble;
+}
+
+std::shared_ptr<PrecompiledPreamble>
+PreambleCache::findPreamble(const std::string &key,
+                            CompilerInvocation &invocation, FileManager &files,
+                            const llvm::MemoryBuffer &contents) {
+    auto vfs = fileSystem(files);
+    while (true) {
+        // Use the longest preamble the file starts with
+        std::shared_ptr<PrecompiledPreamble> preamble;
+        std::size_t size = 0;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto best = entries.end();
+            for (auto it = entries.begin(); it != entries.end(); ++it) {
+                if (it->key == key && it->text.size() > size &&
+                    contents.getBuffer().startswith(it->text)) {
+                    best = it;
+                    size = it->text.size();
+                }
+            }
+            if (best == entries.end())
+                return nullptr;
+            entries.splice(entries.begin(), entries, best);
+            preamble = best->preamble;
+        }
+
+        // Headers may have changed since the preamble was built
+        if (preamble->CanReuse(invocation, &contents, preamble->getBounds(),
+                               vfs.get()))
+            return preamble;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        entries.remove_if(
+            [&](const Entry &entry) { return entry.preamble == preamble; });
+    }
+}
+
+std::size_t PreambleCache::sharedPrefix(const std::string &key,
+                                        llvm::StringRef contents,
+                                        const std::vector<std::size_t> &cuts) {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    // Find the longest run of leading directives this file shares with
+    // one exported before it.
+    std::size_t size = 0;
+    for (auto const &candidate : candidates) {
+        if (candidate.first != key)
+            continue;
+        auto common = commonPrefix(candidate.second, contents);
+        auto cut = std::upper_bound(cuts.begin(), cuts.end(), common);
+        if (cut != cuts.begin())
+            size = std::max(size, *(cut - 1));
+    }
+
+    if (size == 0) {
+        candidates.emplace_front(key, contents.take_front(cuts.back()).str());
+        if (candidates.size() > MaxCandidates)
+            candidates.pop_back();
+    }
+    return size;
+}
+
+std::shared_ptr<PrecompiledPreamble> PreambleCache::buildPreamble(
+    const std::string &key, llvm::StringRef directory, llvm::StringRef text,
+    CompilerInvocation &invocation, FileManager &files,
+    std::shared_ptr<PCHContainerOperations> pchContainerOps,
+    DiagnosticConsumer *diags) {
+    unsigned id;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        id = nextId++;
+    }
+
+    // The preamble is compiled from a copy of the shared directives. It
+    // lives next to the main file so that quoted includes resolve the same
+    // way, and never touches the disk.
+    SmallString<256> path(directory);
+    llvm::sys::path::append(path,
+                            "c2rust-preamble-" + std::to_string(id) + ".h");
+
+    CompilerInvocation preambleInvocation(invocation);
+    auto &input = preambleInvocation.getFrontendOpts().Inputs[0];
+    input = FrontendInputFile(path, input.getKind(), input.isSystem());
+
+    auto buffer = llvm::MemoryBuffer::getMemBufferCopy(text, path);
+    auto diagnostics = CompilerInstance::createDiagnostics(
+        &preambleInvocation.getDiagnosticOpts(), diags,
+        /*ShouldOwnClient=*/false);
+    PreambleCallbacks callbacks;
+    auto built = PrecompiledPreamble::Build(
+        preambleInvocation, buffer.get(),
+        PreambleBounds(text.size(), /*PreambleEndsAtStartOfLine=*/true),
+        *diagnostics, fileSystem(files), std::move(pchContainerOps),
+        /*StoreInMemory=*/false, callbacks);
+    if (!built)
+        return nullptr;
+
+    auto preamble = std::make_shared<PrecompiledPreamble>(std::move(*built));
+
+    std::lock_guard<std::mutex> lock(mutex);
+    entries.push_front(Entry{key, text.str(), preamble});
+    if (entries.size() > MaxPreambles)
+        entries.pop_back();
+    return preamble;
+}
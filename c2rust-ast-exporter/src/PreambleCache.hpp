@@ -0,0 +1,78 @@
+//
+//  PreambleCache.hpp
+//
+
+#ifndef PreambleCache_hpp
+#define PreambleCache_hpp
+
+#include <cstddef>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "clang/Frontend/PrecompiledPreamble.h"
+
+// Precompiled preambles shared between the translation units of a session.
+//
+// Most C files start with the same block of #include directives. Whenever a
+// file starts with the same directives as one exported before it, the common
+// part is precompiled once and loaded by every later file that starts with
+// it, instead of parsing the same headers again for each of them.
+//
+// A preamble is built from a copy of the shared directives under a name of
+// its own, so the files that use it see their first lines (and the include
+// locations of the headers) in that copy rather than in the main file. The
+// exporter maps the copy back to the main file via
+// SourceManager::getPreambleFileID; since the bytes are identical, so are the
+// line and column numbers.
+class PreambleCache {
+  public:
+    PreambleCache();
+
+    // Make `invocation` load a precompiled preamble for the leading #include
+    // directives of its main file if there is (or can now be built) one it
+    // may share. Only invocations with the same `flags` share preambles.
+    // The result must be kept alive until the invocation has finished.
+    std::shared_ptr<clang::PrecompiledPreamble>
+    addPreamble(clang::CompilerInvocation &invocation,
+                clang::FileManager &files, const std::string &flags,
+                std::shared_ptr<clang::PCHContainerOperations> pchContainerOps,
+                clang::DiagnosticConsumer *diags);
+
+  private:
+    struct Entry {
+        std::string key;
+        std::string text;
+        std::shared_ptr<clang::PrecompiledPreamble> preamble;
+    };
+
+    std::shared_ptr<clang::PrecompiledPreamble>
+    findPreamble(const std::string &key, clang::CompilerInvocation &invocation,
+                 clang::FileManager &files, const llvm::MemoryBuffer &contents);
+
+    std::size_t sharedPrefix(const std::string &key, llvm::StringRef contents,
+                             const std::vector<std::size_t> &cuts);
+
+    std::shared_ptr<clang::PrecompiledPreamble>
+    buildPreamble(const std::string &key, llvm::StringRef directory,
+                  llvm::StringRef text, clang::CompilerInvocation &invocation,
+                  clang::FileManager &files,
+                  std::shared_ptr<clang::PCHContainerOperations> pchContainerOps,
+                  clang::DiagnosticConsumer *diags);
+
+    static const std::size_t MaxPreambles = 16;
+    static const std::size_t MaxCandidates = 32;
+
+    std::mutex mutex;
+    // Most recently used first
+    std::list<Entry> entries;
+    // Leading directives of recently exported files that had no preamble,
+    // most recent first, as (key, text) pairs
+    std::list<std::pair<std::string, std::string>> candidates;
+    unsigned nextId;
+};
+
+#endif /* PreambleCache_hpp */
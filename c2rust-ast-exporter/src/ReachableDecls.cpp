@@ -0,0 +1,231 @@
+//
+//  ReachableDecls.cpp
+//
+
+#include <algorithm>
+
+#include "clang/AST/RawCommentList.h"
+#include "clang/AST/RecursiveASTVisitor.h"
+
+#include "ReachableDecls.hpp"
+
+using namespace clang;
+
+namespace {
+
+// Mirrors the roots chosen by TypedAstContext::prune_unused_decls, using the
+// same properties the exporter encodes for functions and variables.
+bool isRoot(Decl *D) {
+    for (auto R : D->redecls()) {
+        if (R->hasAttr<UsedAttr>())
+            return true;
+    }
+
+    if (auto FD = dyn_cast<FunctionDecl>(D)) {
+        FD = FD->getCanonicalDecl();
+        auto def = FD->getDefinition();
+        return FD->getBody() && FD->isGlobal() &&
+               !(def && def->isInlineSpecified());
+    }
+
+    if (auto VD = dyn_cast<VarDecl>(D)) {
+        if (!VD->isExternallyVisible())
+            return false;
+        for (auto R : VD->redecls()) {
+            if (!R->hasExternalStorage() || R->getInit())
+                return true;
+        }
+    }
+    return false;
+}
+
+class ReachabilityVisitor final
+    : public RecursiveASTVisitor<ReachabilityVisitor> {
+    std::unordered_set<const Decl *> &decls;
+    std::unordered_set<const clang::Type *> types;
+    // Reachable declarations that have not been traversed yet
+    std::vector<Decl *> worklist;
+
+  public:
+    explicit ReachabilityVisitor(std::unordered_set<const Decl *> &decls)
+        : decls(decls) {}
+
+    bool shouldVisitImplicitCode() const { return true; }
+
+    void addDecl(Decl *D) {
+        if (!D)
+            return;
+        D = D->getCanonicalDecl();
+        if (!decls.insert(D).second)
+            return;
+        worklist.push_back(D);
+
+        // Using an enumerator or a field uses the whole enum or record
+        if (isa<EnumConstantDecl>(D) || isa<FieldDecl>(D) ||
+            isa<IndirectFieldDecl>(D))
+            addDecl(cast<Decl>(D->getDeclContext()));
+    }
+
+    void addType(QualType T) {
+        if (T.isNull())
+            return;
+        auto ty = T.getTypePtr();
+        if (!types.insert(ty).second)
+            return;
+
+        if (auto TT = dyn_cast<TypedefType>(ty)) {
+            addDecl(TT->getDecl());
+        } else if (auto TT = dyn_cast<TagType>(ty)) {
+            addDecl(TT->getDecl());
+        } else if (auto PT = dyn_cast<PointerType>(ty)) {
+            addType(PT->getPointeeType());
+        } else if (auto AT = dyn_cast<ArrayType>(ty)) {
+            addType(AT->getElementType());
+            if (auto VAT = dyn_cast<VariableArrayType>(AT))
+                TraverseStmt(VAT->getSizeExpr());
+        } else if (auto FT = dyn_cast<FunctionType>(ty)) {
+            addType(FT->getReturnType());
+            if (auto FPT = dyn_cast<FunctionProtoType>(FT)) {
+                for (auto param : FPT->getParamTypes())
+                    addType(param);
+            }
+        } else if (auto AT = dyn_cast<AtomicType>(ty)) {
+            addType(AT->getValueType());
+        } else if (auto CT = dyn_cast<ComplexType>(ty)) {
+            addType(CT->getElementType());
+        } else if (auto VT = dyn_cast<VectorType>(ty)) {
+            addType(VT->getElementType());
+        } else if (auto TE = dyn_cast<TypeOfExprType>(ty)) {
+            TraverseStmt(TE->getUnderlyingExpr());
+        }
+
+        // Look through parentheses, attributes, typeof and the like
+        auto desugared = ty->getLocallyUnqualifiedSingleStepDesugaredType();
+        if (desugared.getTypePtr() != ty)
+            addType(desugared);
+    }
+
+    // Traverse the reachable declarations until no new ones are found
+    void run() {
+        while (!worklist.empty()) {
+            auto D = worklist.back();
+            worklist.pop_back();
+            for (auto R : D->redecls())
+                TraverseDecl(R);
+        }
+    }
+
+    bool VisitDecl(Decl *D) {
+        if (auto cleanup = D->getAttr<CleanupAttr>())
+            addDecl(cleanup->getFunctionDecl());
+        return true;
+    }
+
+    bool VisitValueDecl(ValueDecl *D) {
+        addType(D->getType());
+        return true;
+    }
+
+    bool VisitTypedefNameDecl(TypedefNameDecl *D) {
+        addType(D->getUnderlyingType());
+        return true;
+    }
+
+    bool VisitTypeLoc(TypeLoc TL) {
+        addType(TL.getType());
+        return true;
+    }
+
+    bool VisitExpr(Expr *E) {
+        addType(E->getType());
+        return true;
+    }
+
+    bool VisitDeclRefExpr(DeclRefExpr *E) {
+        addDecl(E->getDecl());
+        return true;
+    }
+
+    bool VisitMemberExpr(MemberExpr *E) {
+        addDecl(E->getMemberDecl());
+        return true;
+    }
+
+    bool VisitOffsetOfExpr(OffsetOfExpr *E) {
+        for (unsigned i = 0; i < E->getNumComponents(); i++) {
+            auto const &component = E->getComponent(i);
+            if (component.getKind() == OffsetOfNode::Field)
+                addDecl(component.getField());
+        }
+        return true;
+    }
+};
+
+} // namespace
+
+ReachableDecls::ReachableDecls(ASTContext &Context)
+    : ReachableDecls(Context, isRoot) {}
+
+ReachableDecls::ReachableDecls(ASTContext &Context,
+                               const std::function<bool(Decl *)> &isRoot)
+    : manager(Context.getSourceManager()) {
+    auto translation_unit = Context.getTranslationUnitDecl();
+
+    ReachabilityVisitor visitor(decls);
+    for (auto D : translation_unit->decls()) {
+        if (isRoot(D))
+            visitor.addDecl(D);
+    }
+    visitor.run();
+
+    for (auto D : translation_unit->decls()) {
+        if (D->isImplicit())
+            continue;
+        auto range = D->getSourceRange();
+        auto begin = decompose(range.getBegin());
+        auto end = decompose(range.getEnd());
+        if (begin.first.isInvalid() || begin.first != end.first)
+            continue;
+        topLevelDecls[begin.first].push_back(
+            TopLevelDecl{begin.second, end.second, contains(D)});
+    }
+    for (auto &file : topLevelDecls) {
+        auto &fileDecls = file.second;
+        std::stable_sort(fileDecls.begin(), fileDecls.end(),
+                         [](const TopLevelDecl &a, const TopLevelDecl &b) {
+                             return a.begin < b.begin;
+                         });
+        for (std::size_t i = 1; i < fileDecls.size(); i++)
+            fileDecls[i].end = std::max(fileDecls[i].end, fileDecls[i - 1].end);
+    }
+}
+
+bool ReachableDecls::contains(const Decl *D) const {
+    return decls.count(D->getCanonicalDecl()) != 0;
+}
+
+bool ReachableDecls::isUnreachableComment(const RawComment *comment) const {
+    auto loc = decompose(comment->getSourceRange().getBegin());
+    auto file = topLevelDecls.find(loc.first);
+    if (file == topLevelDecls.end())
+        return false;
+
+    auto const &fileDecls = file->second;
+    auto decl = std::lower_bound(
+        fileDecls.begin(), fileDecls.end(), loc.second,
+        [](const TopLevelDecl &decl, unsigned offset) {
+            return decl.end < offset;
+        });
+    return decl != fileDecls.end() && !decl->reachable;
+}
+
+std::pair<FileID, unsigned>
+ReachableDecls::decompose(SourceLocation loc) const {
+    auto decomposed = manager.getDecomposedExpansionLoc(loc);
+    // The exporter reports locations in a precompiled preamble as main file
+    // ones, at the same offsets (see PreambleCache).
+    if (decomposed.first.isValid() &&
+        decomposed.first == manager.getPreambleFileID())
+        decomposed.first = manager.getMainFileID();
+    return decomposed;
+}
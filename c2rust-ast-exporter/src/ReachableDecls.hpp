@@ -0,0 +1,61 @@
+//
+//  ReachableDecls.hpp
+//
+
+#ifndef ReachableDecls_hpp
+#define ReachableDecls_hpp
+
+#include <functional>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "clang/AST/ASTContext.h"
+#include "llvm/ADT/DenseMap.h"
+
+// The declarations of a translation unit the transpiler keeps when it prunes
+// unused ones (see TypedAstContext::prune_unused_decls).
+//
+// The roots are the top-level declarations that may be used by other
+// translation units: global non-inline function definitions, externally
+// visible variable definitions and functions and variables marked `used`.
+// Everything a reachable declaration refers to, directly or through a type,
+// is reachable as well. The set may contain declarations the transpiler would
+// still prune, but never misses one it keeps.
+//
+// Other roots can be chosen instead, to export only some declarations along
+// with everything they use.
+class ReachableDecls {
+  public:
+    explicit ReachableDecls(clang::ASTContext &Context);
+
+    // The top-level declarations `isRoot` returns true for are the roots
+    ReachableDecls(clang::ASTContext &Context,
+                   const std::function<bool(clang::Decl *)> &isRoot);
+
+    bool contains(const clang::Decl *D) const;
+
+    // Whether the transpiler would attach `comment` to a top-level
+    // declaration that is not reachable, i.e. to the first one in the same
+    // file that does not end before the comment.
+    bool isUnreachableComment(const clang::RawComment *comment) const;
+
+  private:
+    struct TopLevelDecl {
+        unsigned begin;
+        // Greatest end offset of this and all preceding declarations
+        unsigned end;
+        bool reachable;
+    };
+
+    std::pair<clang::FileID, unsigned>
+    decompose(clang::SourceLocation loc) const;
+
+    clang::SourceManager &manager;
+    // Canonical declarations
+    std::unordered_set<const clang::Decl *> decls;
+    // Top-level declarations of each file, ordered by their start
+    llvm::DenseMap<clang::FileID, std::vector<TopLevelDecl>> topLevelDecls;
+};
+
+#endif /* ReachableDecls_hpp */
@@ -0,0 +1,541 @@
+//! Reader for the columnar format the exporter writes instead of CBOR when
+//! asked to (see AstTables.hpp). Columns are read in place from the exported
+//! bytes, which may be borrowed from the exporter or mapped from a file, so
+//! nothing is decoded up front. Only the extras of each node are CBOR, and
+//! they are decoded one node at a time.
+
+use clang_ast::*;
+use serde_cbor::from_slice;
+use std::convert::TryInto;
+use std::io::{self, Error, ErrorKind};
+use std::path::Path;
+
+use clang_ast::AstTablesSection::*;
+
+/// First bytes of the columnar format
+pub const MAGIC: &[u8] = b"C2RTABLE";
+/// Version of the format this reader understands
+pub const VERSION: u32 = 1;
+
+/// Header flag set when positions are byte offsets
+const OFFSET_POSITIONS: u32 = 1;
+/// Magic, version, flags, va_list kind and section count
+const HEADER_LEN: usize = 24;
+
+fn invalid_data<E: ToString>(error: E) -> Error {
+    Error::new(ErrorKind::InvalidData, error.to_string())
+}
+
+fn read_u32(bytes: &[u8], offset: usize) -> u32 {
+    u32::from_le_bytes(bytes[offset..offset + 4].try_into().unwrap())
+}
+
+fn read_u64(bytes: &[u8], offset: usize) -> u64 {
+    u64::from_le_bytes(bytes[offset..offset + 8].try_into().unwrap())
+}
+
+/// A column of little-endian `u32`s, read in place
+#[derive(Clone, Copy)]
+pub struct U32Column<'a>(&'a [u8]);
+
+impl<'a> U32Column<'a> {
+    pub fn len(&self) -> usize {
+        self.0.len() / 4
+    }
+
+    pub fn get(&self, i: usize) -> u32 {
+        read_u32(self.0, i * 4)
+    }
+
+    /// Elements `start..end`, widened to `u64`
+    pub fn range(self, start: usize, end: usize) -> impl Iterator<Item = u64> + 'a {
+        (start..end).map(move |i| self.get(i) as u64)
+    }
+
+    /// Elements `starts[i]..starts[i + 1]`, where `starts` delimits the rows
+    /// of a table
+    pub fn row(self, starts: U32Column, i: usize) -> impl Iterator<Item = u64> + 'a {
+        self.range(starts.get(i) as usize, starts.get(i + 1) as usize)
+    }
+}
+
+/// Bytes `starts[i]..starts[i + 1]` of `bytes`
+fn byte_row<'a>(bytes: &'a [u8], starts: U32Column, i: usize) -> &'a [u8] {
+    &bytes[starts.get(i) as usize..starts.get(i + 1) as usize]
+}
+
+fn read_u16(bytes: &[u8], i: usize) -> u16 {
+    u16::from_le_bytes(bytes[i * 2..i * 2 + 2].try_into().unwrap())
+}
+
+fn import_section(section: usize) -> AstTablesSection {
+    unsafe { std::mem::transmute::<u32, AstTablesSection>(section as u32) }
+}
+
+fn optional_id(id: u64) -> Option<u64> {
+    if id == 0 {
+        None
+    } else {
+        Some(id)
+    }
+}
+
+/// The sections of an export in the columnar format
+pub struct AstTables<'a> {
+    flags: u32,
+    va_list_kind: u32,
+    sections: Vec<&'a [u8]>,
+}
+
+impl<'a> AstTables<'a> {
+    /// Whether `bytes` are in the columnar format rather than CBOR
+    pub fn is_ast_tables(bytes: &[u8]) -> bool {
+        bytes.starts_with(MAGIC)
+    }
+
+    /// Check the header of `bytes` and locate their sections
+    pub fn new(bytes: &'a [u8]) -> io::Result<AstTables<'a>> {
+        if !Self::is_ast_tables(bytes) || bytes.len() < HEADER_LEN {
+            return Err(invalid_data("Not a columnar AST"));
+        }
+        let version = read_u32(bytes, 8);
+        if version != VERSION {
+            return Err(invalid_data(format!(
+                "Unsupported columnar AST version {} (expected {})",
+                version, VERSION
+            )));
+        }
+        let flags = read_u32(bytes, 12);
+        let va_list_kind = read_u32(bytes, 16);
+
+        // Sections this reader does not know about may follow its own
+        let count = read_u32(bytes, 20) as usize;
+        if count < SectionCount as usize || bytes.len() < HEADER_LEN + count * 16 {
+            return Err(invalid_data("Truncated columnar AST"));
+        }
+        let sections = (0..count)
+            .map(|i| {
+                let entry = HEADER_LEN + i * 16;
+                let offset = read_u64(bytes, entry) as usize;
+                let size = read_u64(bytes, entry + 8) as usize;
+                offset
+                    .checked_add(size)
+                    .and_then(|end| bytes.get(offset..end))
+                    .ok_or_else(|| invalid_data("Truncated columnar AST"))
+            })
+            .collect::<io::Result<Vec<_>>>()?;
+
+        let tables = AstTables {
+            flags,
+            va_list_kind,
+            sections,
+        };
+        tables.validate()?;
+        Ok(tables)
+    }
+
+    /// Check that every column has as many elements as its table has rows,
+    /// that the rows of each table stay within its data, and that the
+    /// indices into other tables are in range, so that reading the tables
+    /// cannot go out of bounds
+    fn validate(&self) -> io::Result<()> {
+        let bad_column = |section: AstTablesSection| {
+            Err(invalid_data(format!("Malformed columnar AST ({:?})", section)))
+        };
+
+        for i in 0..SectionCount as usize {
+            let section = import_section(i);
+            let element_size = match section {
+                SectionNodeTags | SectionTypeTags => 2,
+                SectionNodeFlags | SectionNodeExtras | SectionTypeExtras | SectionComments
+                | SectionStrings => 1,
+                _ => 4,
+            };
+            if self.sections[i].len() % element_size != 0 {
+                return bad_column(section);
+            }
+        }
+
+        let (loc_len, span_len) = if self.offset_positions() { (2, 3) } else { (3, 5) };
+        let nodes = self.node_count();
+        let types = self.type_count();
+        let files = self.file_count();
+        let comments = self.comment_count();
+        let string_count = self.u32s(SectionStringStarts).len().saturating_sub(1);
+        let lengths = [
+            (SectionNodeTags, nodes * 2),
+            (SectionNodeSpans, nodes * span_len * 4),
+            (SectionNodeTypes, nodes * 4),
+            (SectionNodeFlags, nodes),
+            (SectionNodeMacroTexts, nodes * 4),
+            (SectionTypeTags, types * 2),
+            (SectionFileIncludes, files * loc_len * 4),
+            (SectionCommentLocs, comments * loc_len * 4),
+        ];
+        for &(section, len) in &lengths {
+            if self.section(section).len() != len {
+                return bad_column(section);
+            }
+        }
+
+        // Each row of a table is delimited by one of its starts and the next
+        let rows = [
+            (SectionNodeChildStarts, nodes, self.u32s(SectionNodeChildren).len()),
+            (SectionNodeMacroStarts, nodes, self.u32s(SectionNodeMacros).len()),
+            (SectionNodeExtraStarts, nodes, self.section(SectionNodeExtras).len()),
+            (SectionTypeExtraStarts, types, self.section(SectionTypeExtras).len()),
+            (SectionFileLineStarts, files, self.u32s(SectionFileLines).len()),
+            (SectionCommentStarts, comments, self.section(SectionComments).len()),
+            (SectionStringStarts, string_count, self.section(SectionStrings).len()),
+        ];
+        for &(section, count, data_len) in &rows {
+            let starts = self.u32s(section);
+            let ordered = (1..starts.len()).all(|i| starts.get(i - 1) <= starts.get(i));
+            if starts.len() != count + 1
+                || starts.get(0) != 0
+                || !ordered
+                || starts.get(count) as usize > data_len
+            {
+                return bad_column(section);
+            }
+        }
+
+        let paths = self.u32s(SectionFilePaths);
+        if (0..files).any(|i| paths.get(i) as usize >= string_count) {
+            return bad_column(SectionFilePaths);
+        }
+        let macro_texts = self.u32s(SectionNodeMacroTexts);
+        if (0..nodes).any(|i| macro_texts.get(i) as usize > string_count) {
+            return bad_column(SectionNodeMacroTexts);
+        }
+
+        // Offsets are converted with the line starts of their file
+        if self.offset_positions() {
+            let in_files = |section: AstTablesSection, stride: usize| {
+                let values = self.u32s(section);
+                (0..values.len() / stride).all(|i| (values.get(i * stride) as usize) < files)
+            };
+            for &(section, stride) in &[
+                (SectionNodeSpans, span_len),
+                (SectionFileIncludes, loc_len),
+                (SectionCommentLocs, loc_len),
+            ] {
+                if !in_files(section, stride) {
+                    return bad_column(section);
+                }
+            }
+        }
+
+        Ok(())
+    }
+
+    fn section(&self, section: AstTablesSection) -> &'a [u8] {
+        self.sections[section as usize]
+    }
+
+    fn u32s(&self, section: AstTablesSection) -> U32Column<'a> {
+        U32Column(self.section(section))
+    }
+
+    pub fn offset_positions(&self) -> bool {
+        self.flags & OFFSET_POSITIONS != 0
+    }
+
+    pub fn va_list_kind(&self) -> BuiltinVaListKind {
+        import_va_list_kind(self.va_list_kind as u64)
+    }
+
+    pub fn node_count(&self) -> usize {
+        self.u32s(SectionNodeIds).len()
+    }
+
+    pub fn node_id(&self, i: usize) -> u64 {
+        self.u32s(SectionNodeIds).get(i) as u64
+    }
+
+    pub fn node_tag(&self, i: usize) -> ASTEntryTag {
+        import_ast_tag(read_u16(self.section(SectionNodeTags), i) as u64)
+    }
+
+    pub fn node_children(&self, i: usize) -> impl Iterator<Item = Option<u64>> + 'a {
+        self.u32s(SectionNodeChildren)
+            .row(self.u32s(SectionNodeChildStarts), i)
+            .map(optional_id)
+    }
+
+    pub fn node_type(&self, i: usize) -> Option<u64> {
+        optional_id(self.u32s(SectionNodeTypes).get(i) as u64)
+    }
+
+    pub fn type_count(&self) -> usize {
+        self.u32s(SectionTypeIds).len()
+    }
+
+    pub fn type_id(&self, i: usize) -> u64 {
+        self.u32s(SectionTypeIds).get(i) as u64
+    }
+
+    pub fn type_tag(&self, i: usize) -> TypeTag {
+        import_type_tag(read_u16(self.section(SectionTypeTags), i) as u64)
+    }
+
+    pub fn top_nodes(&self) -> impl Iterator<Item = u64> + 'a {
+        let top_nodes = self.u32s(SectionTopNodes);
+        top_nodes.range(0, top_nodes.len())
+    }
+
+    pub fn file_count(&self) -> usize {
+        self.u32s(SectionFilePaths).len()
+    }
+
+    pub fn comment_count(&self) -> usize {
+        self.u32s(SectionCommentStarts).len().saturating_sub(1)
+    }
+
+    fn strings(&self) -> io::Result<Vec<String>> {
+        let starts = self.u32s(SectionStringStarts);
+        let bytes = self.section(SectionStrings);
+        (0..starts.len().saturating_sub(1))
+            .map(|i| {
+                String::from_utf8(byte_row(bytes, starts, i).to_vec()).map_err(invalid_data)
+            })
+            .collect()
+    }
+
+    fn positions(&self) -> Positions {
+        if !self.offset_positions() {
+            return Positions::Lines;
+        }
+        let starts = self.u32s(SectionFileLineStarts);
+        let lines = self.u32s(SectionFileLines);
+        Positions::Offsets(
+            (0..self.file_count())
+                .map(|i| lines.row(starts, i).collect())
+                .collect(),
+        )
+    }
+
+    /// Decode every node, type, file and comment into an `AstContext`
+    pub fn to_context(&self) -> io::Result<AstContext> {
+        let strings = self.strings()?;
+        let positions = self.positions();
+
+        let mut ast_nodes = NodeTable::new(0);
+        let children = self.u32s(SectionNodeChildren);
+        let child_starts = self.u32s(SectionNodeChildStarts);
+        let spans = self.u32s(SectionNodeSpans);
+        let flags = self.section(SectionNodeFlags);
+        let macros = self.u32s(SectionNodeMacros);
+        let macro_starts = self.u32s(SectionNodeMacroStarts);
+        let macro_texts = self.u32s(SectionNodeMacroTexts);
+        let extras = self.section(SectionNodeExtras);
+        let extra_starts = self.u32s(SectionNodeExtraStarts);
+        let span_len = positions.span_len();
+        for i in 0..self.node_count() {
+            let tag = self.node_tag(i);
+
+            let mut span = [0; 5];
+            for (j, value) in span[..span_len].iter_mut().enumerate() {
+                *value = spans.get(i * span_len + j) as u64;
+            }
+
+            let mut node_extras: Vec<Value> =
+                from_slice(byte_row(extras, extra_starts, i)).map_err(invalid_data)?;
+            resolve_string_extras(&mut node_extras, schema::string_extras(tag), &strings)?;
+
+            let node = AstNode {
+                tag,
+                children: children.row(child_starts, i).map(optional_id).collect(),
+                loc: positions.span(&span),
+                type_id: self.node_type(i),
+                rvalue: if flags[i] & 1 != 0 {
+                    LRValue::RValue
+                } else {
+                    LRValue::LValue
+                },
+                macro_expansions: macros.row(macro_starts, i).collect(),
+                macro_expansion_text: match macro_texts.get(i) {
+                    0 => None,
+                    n => Some(strings[n as usize - 1].clone()),
+                },
+                extras: node_extras,
+            };
+            ast_nodes.insert(self.node_id(i), node);
+        }
+
+        let mut type_nodes = NodeTable::new(TypeNode::ID_SHIFT);
+        let extras = self.section(SectionTypeExtras);
+        let extra_starts = self.u32s(SectionTypeExtraStarts);
+        for i in 0..self.type_count() {
+            let tag = self.type_tag(i);
+            let mut type_extras: Vec<Value> =
+                from_slice(byte_row(extras, extra_starts, i)).map_err(invalid_data)?;
+            resolve_string_extras(&mut type_extras, schema::type_string_extras(tag), &strings)?;
+            type_nodes.insert(
+                self.type_id(i),
+                TypeNode {
+                    tag,
+                    extras: type_extras,
+                },
+            );
+        }
+
+        let paths = self.u32s(SectionFilePaths);
+        let includes = self.u32s(SectionFileIncludes);
+        let loc_len = positions.loc_len();
+        let files = (0..self.file_count())
+            .map(|i| {
+                let path = match strings[paths.get(i) as usize].as_str() {
+                    "" => None,
+                    "?" => None,
+                    path => Some(Path::new(path).to_path_buf()),
+                };
+                let include: Vec<u64> = includes.range(i * loc_len, (i + 1) * loc_len).collect();
+                SrcFile {
+                    path,
+                    // File 0 stands for invalid locations, so it never
+                    // includes anything
+                    include_loc: if include[0] == 0 {
+                        None
+                    } else {
+                        Some(positions.loc(&include))
+                    },
+                }
+            })
+            .collect();
+
+        let locs = self.u32s(SectionCommentLocs);
+        let texts = self.section(SectionComments);
+        let text_starts = self.u32s(SectionCommentStarts);
+        let comments = (0..self.comment_count())
+            .map(|i| {
+                let loc: Vec<u64> = locs.range(i * loc_len, (i + 1) * loc_len).collect();
+                CommentNode {
+                    loc: positions.loc(&loc),
+                    string: String::from_utf8_lossy(byte_row(texts, text_starts, i)).to_string(),
+                }
+            })
+            .collect();
+
+        Ok(AstContext {
+            ast_nodes,
+            type_nodes,
+            top_nodes: self.top_nodes().collect(),
+            comments,
+            files,
+            va_list_kind: self.va_list_kind(),
+        })
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn u32s(values: &[u32]) -> Vec<u8> {
+        values.iter().flat_map(|value| value.to_le_bytes().to_vec()).collect()
+    }
+
+    /// An export with line and column positions and the given sections. The
+    /// others are empty tables.
+    fn encode(given: &[(AstTablesSection, Vec<u8>)]) -> Vec<u8> {
+        let mut sections = vec![vec![]; SectionCount as usize];
+        for &section in &[
+            SectionNodeChildStarts,
+            SectionNodeMacroStarts,
+            SectionNodeExtraStarts,
+            SectionTypeExtraStarts,
+            SectionFileLineStarts,
+            SectionCommentStarts,
+            SectionStringStarts,
+        ] {
+            sections[section as usize] = u32s(&[0]);
+        }
+        for &(section, ref bytes) in given {
+            sections[section as usize] = bytes.clone();
+        }
+
+        let mut out = MAGIC.to_vec();
+        out.extend(u32s(&[VERSION, 0, 0, SectionCount as u32]));
+        let mut offset = out.len() + sections.len() * 16;
+        for section in &sections {
+            out.extend(&(offset as u64).to_le_bytes());
+            out.extend(&(section.len() as u64).to_le_bytes());
+            offset += section.len();
+        }
+        for section in &sections {
+            out.extend(section);
+        }
+        out
+    }
+
+    /// The sections of a single null statement, with ID 1
+    fn null_stmt() -> Vec<(AstTablesSection, Vec<u8>)> {
+        vec![
+            (SectionNodeIds, u32s(&[1])),
+            (SectionNodeTags, (ASTEntryTag::TagNullStmt as u16).to_le_bytes().to_vec()),
+            (SectionNodeChildStarts, u32s(&[0, 0])),
+            (SectionNodeSpans, u32s(&[0, 1, 2, 1, 3])),
+            (SectionNodeTypes, u32s(&[0])),
+            (SectionNodeFlags, vec![1]),
+            (SectionNodeMacroStarts, u32s(&[0, 0])),
+            (SectionNodeMacroTexts, u32s(&[0])),
+            // An empty CBOR array
+            (SectionNodeExtras, vec![0x80]),
+            (SectionNodeExtraStarts, u32s(&[0, 1])),
+        ]
+    }
+
+    #[test]
+    fn test_decode_empty() {
+        let bytes = encode(&[]);
+        let context = AstTables::new(&bytes).unwrap().to_context().unwrap();
+        assert_eq!(context.ast_nodes.values().count(), 0);
+        assert_eq!(context.type_nodes.values().count(), 0);
+        assert!(context.files.is_empty());
+    }
+
+    #[test]
+    fn test_decode_node() {
+        let bytes = encode(&null_stmt());
+        let context = AstTables::new(&bytes).unwrap().to_context().unwrap();
+        let node = context.ast_nodes.get(&1).unwrap();
+        assert_eq!(node.tag, ASTEntryTag::TagNullStmt);
+        assert_eq!((node.loc.begin_line, node.loc.begin_column), (1, 2));
+        assert_eq!((node.loc.end_line, node.loc.end_column), (1, 3));
+        assert!(node.children.is_empty());
+        assert!(node.extras.is_empty());
+    }
+
+    /// Replace a section of `null_stmt` and check that the result is rejected
+    /// as invalid data rather than read out of bounds
+    fn assert_rejected(section: AstTablesSection, bytes: Vec<u8>) {
+        let mut sections = null_stmt();
+        sections.retain(|&(s, _)| s != section);
+        sections.push((section, bytes));
+        let bytes = encode(&sections);
+        match AstTables::new(&bytes) {
+            Err(e) => assert_eq!(e.kind(), ErrorKind::InvalidData),
+            Ok(_) => panic!("Malformed {:?} accepted", section),
+        }
+    }
+
+    #[test]
+    fn test_reject_short_column() {
+        assert_rejected(SectionNodeSpans, u32s(&[0, 1, 2, 1]));
+        assert_rejected(SectionNodeTypes, vec![]);
+        assert_rejected(SectionNodeTags, vec![0]);
+    }
+
+    #[test]
+    fn test_reject_rows_out_of_bounds() {
+        assert_rejected(SectionNodeChildStarts, u32s(&[0, 2]));
+        assert_rejected(SectionNodeExtraStarts, u32s(&[0, 2]));
+        assert_rejected(SectionNodeMacroStarts, u32s(&[0]));
+    }
+
+    #[test]
+    fn test_reject_string_index_out_of_range() {
+        assert_rejected(SectionNodeMacroTexts, u32s(&[1]));
+    }
+}
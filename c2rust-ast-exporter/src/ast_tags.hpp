@@ -191,4 +191,45 @@ enum BuiltinVaListKind {
     SystemZBuiltinVaList
 };
 
+// Sections of the columnar AST format (see AstTables.hpp), in the order of
+// its section table. Columns named per node have one element per AST node,
+// in the order the nodes were exported, and likewise for types, files and
+// comments. Starts columns have one more element than their table has rows:
+// the items of row i are those from starts[i] up to starts[i + 1].
+enum AstTablesSection {
+    SectionNodeIds = 0,    // u32 per node
+    SectionNodeTags,       // u16 per node, an ASTEntryTag
+    SectionNodeChildStarts,
+    SectionNodeChildren,   // u32 node IDs, 0 for null
+    SectionNodeSpans,      // u32 file ID and positions per node
+    SectionNodeTypes,      // u32 type ID per node, 0 for none
+    SectionNodeFlags,      // u8 per node, 1 for rvalues
+    SectionNodeMacroStarts,
+    SectionNodeMacros,     // u32 macro node IDs
+    SectionNodeMacroTexts, // u32 string index + 1 per node, 0 for none
+    SectionNodeExtraStarts,
+    SectionNodeExtras,     // CBOR array of extras per node
+
+    SectionTypeIds,        // u32 per type
+    SectionTypeTags,       // u16 per type, a TypeTag
+    SectionTypeExtraStarts,
+    SectionTypeExtras,     // CBOR array of extras per type
+
+    SectionTopNodes,       // u32 node IDs
+
+    SectionFilePaths,      // u32 string index per file
+    SectionFileIncludes,   // u32 file ID and position per file, 0 for none
+    SectionFileLineStarts,
+    SectionFileLines,      // u32 offsets at which lines start
+
+    SectionCommentLocs,    // u32 file ID and position per comment
+    SectionCommentStarts,
+    SectionComments,       // bytes of comment text
+
+    SectionStringStarts,
+    SectionStrings,        // UTF-8 bytes of the string table
+
+    SectionCount
+};
+
 #endif /* ast_tags_h */
@@ -1,14 +1,23 @@
-use serde_bytes::ByteBuf;
-use serde_cbor::error;
 use std;
 use std::collections::{HashMap, VecDeque};
 use std::convert::TryInto;
+use std::fs;
+use std::io::{self, Error, ErrorKind};
 use std::path::{Path, PathBuf};
 
 pub use serde_cbor::value::{from_value, Value};
 
 include!(concat!(env!("OUT_DIR"), "/bindings.rs"));
 
+/// Decoders of the AST nodes described by ast_schema.def, from which the
+/// exporter's encoders of those nodes are generated too, and the positions of
+/// the string extras of every node and type it describes
+pub mod schema {
+    use super::{ASTEntryTag, AstNode, TypeTag, Value};
+
+    include!(concat!(env!("OUT_DIR"), "/ast_schema.rs"));
+}
+
 #[derive(Debug, Clone, Copy, Eq, PartialEq)]
 pub enum LRValue {
     LValue,
@@ -69,7 +78,7 @@ impl SrcSpan {
     }
 }
 
-#[derive(Debug, Clone)]
+#[derive(Debug, Clone, PartialEq)]
 pub struct AstNode {
     pub tag: ASTEntryTag,
     pub children: Vec<Option<u64>>,
@@ -85,19 +94,19 @@ pub struct AstNode {
     pub extras: Vec<Value>,
 }
 
-#[derive(Debug, Clone)]
+#[derive(Debug, Clone, PartialEq)]
 pub struct TypeNode {
     pub tag: TypeTag,
     pub extras: Vec<Value>,
 }
 
-#[derive(Debug, Clone)]
+#[derive(Debug, Clone, PartialEq)]
 pub struct CommentNode {
     pub loc: SrcLoc,
     pub string: String,
 }
 
-#[derive(Debug, Clone)]
+#[derive(Debug, Clone, PartialEq)]
 pub struct SrcFile {
     pub path: Option<PathBuf>,
     pub include_loc: Option<SrcLoc>,
@@ -105,16 +114,85 @@ pub struct SrcFile {
 
 impl TypeNode {
     // Masks used to decode the IDs given to type nodes
-    pub const ID_MASK: u64 = !0b111;
+    pub const ID_SHIFT: u32 = 3;
+    pub const ID_MASK: u64 = !0b111 & !TypeNode::ID_TAG;
+    // The exporter numbers AST nodes and types independently, so consumers
+    // that keep both kinds of IDs in one namespace tag the type IDs
+    pub const ID_TAG: u64 = 1 << 63;
     pub const CONST_MASK: u64 = 0b001;
     pub const RESTRICT_MASK: u64 = 0b010;
     pub const VOLATILE_MASK: u64 = 0b100;
 }
 
-#[derive(Debug, Clone)]
+/// Nodes indexed by their IDs. The exporter numbers the nodes of each kind
+/// 1, 2, 3, ... (shifted left by `shift` bits), so they are kept in a vector
+/// rather than a map. Type IDs may carry `TypeNode::ID_TAG`, which is ignored.
+#[derive(Debug, Clone, PartialEq)]
+pub struct NodeTable<T> {
+    nodes: Vec<Option<T>>,
+    shift: u32,
+}
+
+impl<T> NodeTable<T> {
+    pub(crate) fn new(shift: u32) -> Self {
+        NodeTable {
+            nodes: vec![],
+            shift,
+        }
+    }
+
+    fn index(&self, id: u64) -> Option<usize> {
+        let id = id & !TypeNode::ID_TAG;
+        if id & ((1 << self.shift) - 1) == 0 {
+            Some((id >> self.shift) as usize)
+        } else {
+            None
+        }
+    }
+
+    pub(crate) fn get_mut(&mut self, id: u64) -> Option<&mut T> {
+        match self.index(id) {
+            Some(i) => self.nodes.get_mut(i).and_then(Option::as_mut),
+            None => None,
+        }
+    }
+
+    pub(crate) fn insert(&mut self, id: u64, node: T) {
+        let i = self.index(id).expect("Invalid node ID");
+        if i >= self.nodes.len() {
+            self.nodes.resize_with(i + 1, || None);
+        }
+        self.nodes[i] = Some(node);
+    }
+
+    pub fn get(&self, id: &u64) -> Option<&T> {
+        self.index(*id)
+            .and_then(|i| self.nodes.get(i))
+            .and_then(Option::as_ref)
+    }
+
+    pub fn contains_key(&self, id: &u64) -> bool {
+        self.get(id).is_some()
+    }
+
+    pub fn values(&self) -> impl Iterator<Item = &T> {
+        self.nodes.iter().filter_map(Option::as_ref)
+    }
+
+    /// The nodes along with their IDs, in order of ID
+    pub fn iter(&self) -> impl Iterator<Item = (u64, &T)> {
+        let shift = self.shift;
+        self.nodes
+            .iter()
+            .enumerate()
+            .filter_map(move |(i, node)| node.as_ref().map(|node| ((i as u64) << shift, node)))
+    }
+}
+
+#[derive(Debug, Clone, PartialEq)]
 pub struct AstContext {
-    pub ast_nodes: HashMap<u64, AstNode>,
-    pub type_nodes: HashMap<u64, TypeNode>,
+    pub ast_nodes: NodeTable<AstNode>,
+    pub type_nodes: NodeTable<TypeNode>,
     pub top_nodes: Vec<u64>,
     pub comments: Vec<CommentNode>,
     pub files: Vec<SrcFile>,
@@ -137,120 +215,373 @@ pub fn expect_opt_u64(val: &Value) -> Option<Option<u64>> {
     }
 }
 
-fn import_ast_tag(tag: u64) -> ASTEntryTag {
+pub(crate) fn import_ast_tag(tag: u64) -> ASTEntryTag {
     unsafe {
         return std::mem::transmute::<u32, ASTEntryTag>(tag as u32);
     }
 }
 
-fn import_type_tag(tag: u64) -> TypeTag {
+pub(crate) fn import_type_tag(tag: u64) -> TypeTag {
     unsafe {
         return std::mem::transmute::<u32, TypeTag>(tag as u32);
     }
 }
 
-fn import_va_list_kind(tag: u64) -> BuiltinVaListKind {
+pub(crate) fn import_va_list_kind(tag: u64) -> BuiltinVaListKind {
     unsafe {
         return std::mem::transmute::<u32, BuiltinVaListKind>(tag as u32);
     }
 }
 
-pub fn process(items: Value) -> error::Result<AstContext> {
-    let mut asts: HashMap<u64, AstNode> = HashMap::new();
-    let mut types: HashMap<u64, TypeNode> = HashMap::new();
-    let mut comments: Vec<CommentNode> = vec![];
+fn invalid_data<E: ToString>(error: E) -> Error {
+    Error::new(ErrorKind::InvalidData, error.to_string())
+}
 
-    let (all_nodes, top_nodes, files, raw_comments, va_list_kind): (
-        Vec<VecDeque<Value>>,
-        Vec<u64>,
-        Vec<(String, Option<(u64, u64, u64)>)>,
-        Vec<(u64, u64, u64, ByteBuf)>,
-        u64,
-    ) = from_value(items)?;
+/// The next value of an entry, which must not have ended yet
+fn pop(entry: &mut VecDeque<Value>) -> io::Result<Value> {
+    entry.pop_front().ok_or_else(|| invalid_data("Truncated AST entry"))
+}
 
-    let va_list_kind = import_va_list_kind(va_list_kind);
+/// The string at index `i` of the string table
+fn string_at(strings: &[String], i: u64) -> io::Result<&String> {
+    strings
+        .get(i as usize)
+        .ok_or_else(|| invalid_data("String index out of range"))
+}
 
-    for (fileid, line, column, bytes) in raw_comments {
-        comments.push(CommentNode {
-            loc: SrcLoc { fileid, line, column },
-            string: String::from_utf8_lossy(&bytes).to_string(),
-        })
+/// Replace the string table indices in `value` by the strings they refer to
+fn resolve_strings(value: &mut Value, strings: &[String]) -> io::Result<()> {
+    match *value {
+        Value::Integer(i) => *value = Value::Text(string_at(strings, i as u64)?.clone()),
+        Value::Array(ref mut values) => {
+            for value in values {
+                resolve_strings(value, strings)?;
+            }
+        }
+        _ => {}
+    }
+    Ok(())
+}
+
+pub(crate) fn resolve_string_extras(
+    extras: &mut [Value],
+    positions: &[usize],
+    strings: &[String],
+) -> io::Result<()> {
+    for &i in positions {
+        if let Some(value) = extras.get_mut(i) {
+            resolve_strings(value, strings)?;
+        }
+    }
+    Ok(())
+}
+
+/// How the exporter encoded source positions
+pub(crate) enum Positions {
+    /// (file, line, column)
+    Lines,
+    /// (file, byte offset), along with the offsets at which the lines of
+    /// each file start
+    Offsets(Vec<Vec<u64>>),
+}
+
+impl Positions {
+    /// Number of values encoding a location, including its file ID
+    pub(crate) fn loc_len(&self) -> usize {
+        match *self {
+            Positions::Lines => 3,
+            Positions::Offsets(_) => 2,
+        }
+    }
+
+    /// Number of values encoding a span, including its file ID
+    pub(crate) fn span_len(&self) -> usize {
+        match *self {
+            Positions::Lines => 5,
+            Positions::Offsets(_) => 3,
+        }
     }
 
+    /// Line and column number of a byte offset into a file. Both are 0 for
+    /// files without contents, as for invalid locations.
+    fn line_column(line_starts: &[u64], offset: u64) -> (u64, u64) {
+        let line = match line_starts.binary_search(&offset) {
+            Ok(i) => i + 1,
+            Err(i) => i,
+        };
+        if line == 0 {
+            (0, 0)
+        } else {
+            (line as u64, offset - line_starts[line - 1] + 1)
+        }
+    }
+
+    /// Decode the `loc_len()` values of a location
+    pub(crate) fn loc(&self, values: &[u64]) -> SrcLoc {
+        let fileid = values[0];
+        let (line, column) = match *self {
+            Positions::Lines => (values[1], values[2]),
+            Positions::Offsets(ref line_starts) => {
+                Self::line_column(&line_starts[fileid as usize], values[1])
+            }
+        };
+        SrcLoc { fileid, line, column }
+    }
+
+    /// Decode the `span_len()` values of a span
+    pub(crate) fn span(&self, values: &[u64]) -> SrcSpan {
+        let fileid = values[0];
+        let (begin_line, begin_column, end_line, end_column) = match *self {
+            Positions::Lines => (values[1], values[2], values[3], values[4]),
+            Positions::Offsets(ref line_starts) => {
+                let line_starts = &line_starts[fileid as usize];
+                let begin = Self::line_column(line_starts, values[1]);
+                let end = Self::line_column(line_starts, values[2]);
+                (begin.0, begin.1, end.0, end.1)
+            }
+        };
+        SrcSpan {
+            fileid,
+            begin_line,
+            begin_column,
+            end_line,
+            end_column,
+        }
+    }
+
+    pub(crate) fn pop_values(entry: &mut VecDeque<Value>, values: &mut [u64]) -> io::Result<()> {
+        for value in values {
+            *value = from_value(pop(entry)?).map_err(invalid_data)?;
+        }
+        Ok(())
+    }
+
+    pub(crate) fn pop_loc(&self, entry: &mut VecDeque<Value>) -> io::Result<SrcLoc> {
+        let mut values = [0; 3];
+        Self::pop_values(entry, &mut values[..self.loc_len()])?;
+        self.check_file(values[0])?;
+        Ok(self.loc(&values))
+    }
+
+    pub(crate) fn pop_span(&self, entry: &mut VecDeque<Value>) -> io::Result<SrcSpan> {
+        let mut values = [0; 5];
+        Self::pop_values(entry, &mut values[..self.span_len()])?;
+        self.check_file(values[0])?;
+        Ok(self.span(&values))
+    }
+
+    /// Check that the line starts of file `fileid` are known, if positions
+    /// are offsets, so that its positions can be decoded
+    pub(crate) fn check_file(&self, fileid: u64) -> io::Result<()> {
+        match *self {
+            Positions::Offsets(ref line_starts) if fileid as usize >= line_starts.len() => {
+                Err(invalid_data("File ID out of range"))
+            }
+            _ => Ok(()),
+        }
+    }
+}
+
+/// Read the files of an export, each one (path, include location, line
+/// starts if positions are offsets), and how its positions are encoded
+pub(crate) fn import_files(
+    mut files: Vec<VecDeque<Value>>,
+    offsets: bool,
+) -> io::Result<(Positions, Vec<SrcFile>)> {
+    let positions = if offsets {
+        Positions::Offsets(
+            files
+                .iter_mut()
+                .map(|file| {
+                    let line_starts = file
+                        .pop_back()
+                        .ok_or_else(|| invalid_data("Truncated AST file"))?;
+                    from_value::<Vec<u64>>(line_starts).map_err(invalid_data)
+                })
+                .collect::<io::Result<_>>()?,
+        )
+    } else {
+        Positions::Lines
+    };
+
     let files = files.into_iter()
-        .map(|(path, loc)| {
+        .map(|mut file| {
+            let path = from_value::<String>(pop(&mut file)?).map_err(invalid_data)?;
             let path = match path.as_str() {
                 "" => None,
                 "?" => None,
                 path => Some(Path::new(path).to_path_buf()),
             };
-            SrcFile {
-                path,
-                include_loc: loc.map(|(fileid, line, column)| SrcLoc { fileid, line, column }),
-            }
-        })
-        .collect::<Vec<_>>();
-
-    for mut entry in all_nodes.into_iter() {
-        let entry_id: u64 = from_value(entry.pop_front().unwrap()).unwrap();
-        let tag = from_value(entry.pop_front().unwrap()).unwrap();
-
-        if tag < 400 {
-            let children = from_value::<Vec<Value>>(entry.pop_front().unwrap())
-                .unwrap()
-                .iter()
-                .map(|x| expect_opt_u64(x).unwrap())
-                .collect::<Vec<Option<u64>>>();
-
-            // entry[3]
-            let fileid = from_value(entry.pop_front().unwrap()).unwrap();
-            let begin_line = from_value(entry.pop_front().unwrap()).unwrap();
-            let begin_column = from_value(entry.pop_front().unwrap()).unwrap();
-            let end_line = from_value(entry.pop_front().unwrap()).unwrap();
-            let end_column = from_value(entry.pop_front().unwrap()).unwrap();
-
-            // entry[8]
-            let type_id: Option<u64> = expect_opt_u64(&entry.pop_front().unwrap()).unwrap();
-
-            // entry[9]
-            let rvalue = if from_value(entry.pop_front().unwrap()).unwrap() {
-                LRValue::RValue
-            } else {
-                LRValue::LValue
+            let include_loc = match pop(&mut file)? {
+                Value::Array(loc) => Some(positions.pop_loc(&mut loc.into())?),
+                _ => None,
             };
+            Ok(SrcFile { path, include_loc })
+        })
+        .collect::<io::Result<Vec<_>>>()?;
 
-            // entry[10]
-            let macro_expansions = from_value::<Vec<u64>>(entry.pop_front().unwrap()).unwrap();
-
-            let macro_expansion_text = expect_opt_str(&entry.pop_front().unwrap()).unwrap()
-                .map(|s| s.to_string());
-
-            let node = AstNode {
-                tag: import_ast_tag(tag),
-                children,
-                loc: SrcSpan {
-                    fileid,
-                    begin_line,
-                    begin_column,
-                    end_line,
-                    end_column,
-                },
-                type_id,
-                rvalue,
-                macro_expansions,
-                macro_expansion_text,
-                extras: entry.into_iter().collect(),
-            };
+    Ok((positions, files))
+}
+
+/// 64-bit FNV-1a hash of `bytes`, as `comment_digest` in the exporter
+fn comment_digest(bytes: &[u8]) -> u64 {
+    bytes.iter().fold(0xcbf29ce484222325, |hash, &b| {
+        (hash ^ u64::from(b)).wrapping_mul(0x100000001b3)
+    })
+}
+
+/// Read the comments of an export. Each one is a position followed by either
+/// its text or where it is in its file: the offset it starts at, unless the
+/// position is one, its length and the digest of its bytes. Comments are
+/// only read from their files here, and those whose files are gone or have
+/// changed since they were exported are left out.
+pub(crate) fn import_comments(
+    raw_comments: Vec<VecDeque<Value>>,
+    positions: &Positions,
+    files: &[SrcFile],
+) -> io::Result<Vec<CommentNode>> {
+    // The contents of the files comments are in, read once each
+    let mut contents: HashMap<u64, Option<Vec<u8>>> = HashMap::new();
+    let mut comments = vec![];
+    for mut entry in raw_comments {
+        let mut values = [0; 3];
+        Positions::pop_values(&mut entry, &mut values[..positions.loc_len()])?;
+        positions.check_file(values[0])?;
+        let loc = positions.loc(&values);
+        let string = match pop(&mut entry)? {
+            Value::Bytes(bytes) => String::from_utf8_lossy(&bytes).to_string(),
+            value => {
+                let (offset, length): (u64, u64) = match *positions {
+                    Positions::Lines => (
+                        from_value(value).map_err(invalid_data)?,
+                        from_value(pop(&mut entry)?).map_err(invalid_data)?,
+                    ),
+                    Positions::Offsets(_) => (values[1], from_value(value).map_err(invalid_data)?),
+                };
+                let digest: u64 = from_value(pop(&mut entry)?).map_err(invalid_data)?;
+                let contents = contents.entry(loc.fileid).or_insert_with(|| {
+                    files
+                        .get(loc.fileid as usize)
+                        .and_then(|file| file.path.as_ref())
+                        .and_then(|path| fs::read(path).ok())
+                });
+                let bytes = contents
+                    .as_ref()
+                    .and_then(|contents| contents.get(offset as usize..(offset + length) as usize));
+                match bytes {
+                    Some(bytes) if comment_digest(bytes) == digest => {
+                        String::from_utf8_lossy(bytes).to_string()
+                    }
+                    _ => continue,
+                }
+            }
+        };
+        comments.push(CommentNode { loc, string });
+    }
+    Ok(comments)
+}
 
-            asts.insert(entry_id, node);
+/// Read an AST node or type entry into `asts` or `types`. `pop_span` reads
+/// the span of an AST node.
+pub(crate) fn import_entry<F>(
+    mut entry: VecDeque<Value>,
+    pop_span: F,
+    strings: &[String],
+    asts: &mut NodeTable<AstNode>,
+    types: &mut NodeTable<TypeNode>,
+) -> io::Result<()>
+where
+    F: FnOnce(&mut VecDeque<Value>) -> io::Result<SrcSpan>,
+{
+    let entry_id: u64 = from_value(pop(&mut entry)?).map_err(invalid_data)?;
+    let tag = from_value(pop(&mut entry)?).map_err(invalid_data)?;
+    let expect_id = |value: &Value| {
+        expect_opt_u64(value).ok_or_else(|| invalid_data("Expected an optional ID"))
+    };
+
+    if tag < 400 {
+        let children = from_value::<Vec<Value>>(pop(&mut entry)?)
+            .map_err(invalid_data)?
+            .iter()
+            .map(expect_id)
+            .collect::<io::Result<Vec<Option<u64>>>>()?;
+
+        // entry[3]
+        let loc = pop_span(&mut entry)?;
+
+        // entry[8] (entry[6] if positions are offsets)
+        let type_id: Option<u64> = expect_id(&pop(&mut entry)?)?;
+
+        // entry[9]
+        let rvalue = if from_value(pop(&mut entry)?).map_err(invalid_data)? {
+            LRValue::RValue
         } else {
-            let node = TypeNode {
-                tag: import_type_tag(tag),
-                extras: entry.into_iter().collect(),
-            };
+            LRValue::LValue
+        };
+
+        // entry[10]
+        let macro_expansions =
+            from_value::<Vec<u64>>(pop(&mut entry)?).map_err(invalid_data)?;
+
+        let macro_expansion_text = match expect_id(&pop(&mut entry)?)? {
+            Some(i) => Some(string_at(strings, i)?.clone()),
+            None => None,
+        };
+
+        let tag = import_ast_tag(tag);
+        let mut extras: Vec<Value> = entry.into_iter().collect();
+        resolve_string_extras(&mut extras, schema::string_extras(tag), strings)?;
+
+        let node = AstNode {
+            tag,
+            children,
+            loc,
+            type_id,
+            rvalue,
+            macro_expansions,
+            macro_expansion_text,
+            extras,
+        };
+
+        asts.insert(entry_id, node);
+    } else {
+        let tag = import_type_tag(tag);
+        let mut extras: Vec<Value> = entry.into_iter().collect();
+        resolve_string_extras(&mut extras, schema::type_string_extras(tag), strings)?;
+
+        let node = TypeNode { tag, extras };
+
+        types.insert(entry_id, node);
+    }
+    Ok(())
+}
 
-            types.insert(entry_id, node);
-        }
+pub fn process(items: Value) -> io::Result<AstContext> {
+    let mut asts: NodeTable<AstNode> = NodeTable::new(0);
+    let mut types: NodeTable<TypeNode> = NodeTable::new(TypeNode::ID_SHIFT);
+
+    let (all_nodes, top_nodes, files, raw_comments, va_list_kind, strings, offsets): (
+        Vec<VecDeque<Value>>,
+        Vec<u64>,
+        Vec<VecDeque<Value>>,
+        Vec<VecDeque<Value>>,
+        u64,
+        Vec<String>,
+        bool,
+    ) = from_value(items).map_err(invalid_data)?;
+
+    let va_list_kind = import_va_list_kind(va_list_kind);
+    let (positions, files) = import_files(files, offsets)?;
+    let comments = import_comments(raw_comments, &positions, &files)?;
+
+    for entry in all_nodes.into_iter() {
+        import_entry(
+            entry,
+            |entry| positions.pop_span(entry),
+            &strings,
+            &mut asts,
+            &mut types,
+        )?;
     }
     Ok(AstContext {
         top_nodes,
@@ -1,16 +1,21 @@
 #![allow(non_camel_case_types)]
 extern crate libc;
-extern crate serde_bytes;
 extern crate serde_cbor;
+extern crate zstd;
 
-use serde_cbor::{from_slice, Value};
-use std::collections::HashMap;
+use serde_cbor::{from_reader, from_slice, Value};
 use std::ffi::{CStr, CString};
-use std::io::{Error, ErrorKind};
-use std::path::Path;
+use std::fs;
+use std::io::{self, Error, ErrorKind, Read};
+use std::path::{Path, PathBuf};
 use std::slice;
+use std::sync::mpsc::{sync_channel, SyncSender};
+use std::thread;
 
+pub mod ast_tables;
 pub mod clang_ast;
+pub mod project;
+mod stream;
 
 pub fn get_clang_major_version() -> Option<u32> {
     let s = unsafe { CStr::from_ptr(clang_version()) };
@@ -29,70 +34,630 @@ pub fn get_untyped_ast(
     extra_args: &[&str],
     debug: bool,
 ) -> Result<clang_ast::AstContext, Error> {
-    let cbors = get_ast_cbors(file_path, cc_db, extra_args, debug);
-    let buffer = cbors.values().next().ok_or(Error::new(
-        ErrorKind::InvalidData,
-        "Could not parse input file",
-    ))?;
+    ExportSession::new(cc_db, extra_args)?.get_untyped_ast(file_path, debug)
+}
+
+/// Read an AST written by the exporter binary or plugin, as CBOR or in the
+/// columnar format, and compressed with `--compress=zstd` or not.
+pub fn read_untyped_ast(path: &Path) -> Result<clang_ast::AstContext, Error> {
+    let bytes = fs::read(path)?;
+    decode_export(&[&bytes])
+}
+
+/// Number of chunks of a streamed export that may be waiting to be decoded
+/// before the exporter waits for the decoder to catch up
+const STREAM_CHUNKS: usize = 4;
+
+/// Export the source file named by `args`, a command line for the exporter
+/// (starting with the program name), decoding its AST on another thread
+/// while clang is still encoding it. The AST is always streamed as CBOR.
+///
+/// Like the exporter's command line parser, this must not be called from
+/// several threads at once; `ExportSession::stream_untyped_ast` may be.
+pub fn stream_untyped_ast(args: &[&str], debug: bool) -> Result<clang_ast::AstContext, Error> {
+    let args_owned: Vec<CString> = args.iter().map(|&arg| CString::new(arg).unwrap()).collect();
+    let args_ptrs: Vec<*const libc::c_char> = args_owned.iter().map(|x| x.as_ptr()).collect();
+    decode_stream(|on_chunk, ctx| unsafe {
+        ast_exporter_stream(
+            args_ptrs.len() as libc::c_int,
+            args_ptrs.as_ptr(),
+            debug.into(),
+            on_chunk,
+            ctx,
+        )
+    })
+}
+
+/// Run `export`, which streams an export to the callback and context it is
+/// given and returns the exporter's result, and decode the export on
+/// another thread as it arrives
+fn decode_stream<F>(export: F) -> Result<clang_ast::AstContext, Error>
+where
+    F: FnOnce(ChunkCallback, *mut libc::c_void) -> libc::c_int,
+{
+    let (sender, receiver) = sync_channel::<Vec<u8>>(STREAM_CHUNKS);
+    let decoder = thread::spawn(move || {
+        let mut decoder = stream::StreamDecoder::new();
+        for chunk in receiver {
+            // Dropping the receiver makes the exporter's remaining sends
+            // fail, which send_chunk ignores
+            decoder.chunk(&chunk)?;
+        }
+        decoder.finish()
+    });
+
+    let res = export(
+        send_chunk,
+        &sender as *const SyncSender<Vec<u8>> as *mut libc::c_void,
+    );
+    drop(sender);
+
+    let context = decoder.join().expect("AST stream decoder panicked");
+    if res != 0 && context.is_err() {
+        return Err(Error::new(
+            ErrorKind::InvalidData,
+            "Could not parse input file",
+        ));
+    }
+    context
+}
+
+/// Called by the exporter with each chunk of a streamed export
+type ChunkCallback = extern "C" fn(ctx: *mut libc::c_void, data: *const u8, size: usize);
+
+/// Callback passed to ast_exporter_stream, which sends each chunk on to the
+/// decoder thread
+extern "C" fn send_chunk(ctx: *mut libc::c_void, data: *const u8, size: usize) {
+    let sender = unsafe { &*(ctx as *const SyncSender<Vec<u8>>) };
+    let chunk = unsafe { slice::from_raw_parts(data, size) }.to_vec();
+    let _ = sender.send(chunk);
+}
+
+/// Selects top-level declarations to export, along with everything they use,
+/// instead of all of them
+pub enum ExportRoot {
+    /// The declarations with this name
+    Name(String),
+    /// The declarations that overlap lines `first` to `last` of a file
+    Lines(PathBuf, u32, u32),
+}
+
+/// A compilation database loaded once and reused to export any number of the
+/// files it describes, or of files given with their clang arguments. Source
+/// files may also be held in memory rather than written to disk.
+///
+/// Files may be exported from several threads at once through a shared
+/// session.
+pub struct ExportSession(*mut CExportSession);
+
+// The C++ session synchronizes its own state, and each export works on a
+// separate clang instance and output buffer.
+unsafe impl Send for ExportSession {}
+unsafe impl Sync for ExportSession {}
+
+impl ExportSession {
+    /// Load the compilation database at or above `cc_db`. `extra_args` are
+    /// passed to clang for every file exported through this session.
+    pub fn new(cc_db: &Path, extra_args: &[&str]) -> Result<ExportSession, Error> {
+        let cc_db_str = CString::new(cc_db.to_str().unwrap()).unwrap();
+        let args_owned: Vec<CString> = extra_args
+            .iter()
+            .map(|&arg| CString::new(arg).unwrap())
+            .collect();
+        let args_ptrs: Vec<*const libc::c_char> = args_owned.iter().map(|x| x.as_ptr()).collect();
+
+        let ptr = unsafe {
+            ast_exporter_session_new(
+                cc_db_str.as_ptr(),
+                args_ptrs.len() as libc::c_int,
+                args_ptrs.as_ptr(),
+            )
+        };
+        if ptr.is_null() {
+            Err(Error::new(
+                ErrorKind::NotFound,
+                format!("Could not load compilation database {}", cc_db.display()),
+            ))
+        } else {
+            Ok(ExportSession(ptr))
+        }
+    }
+
+    /// A session without a compilation database, which only exports files
+    /// with `get_untyped_ast_with_args`. `extra_args` are passed to clang for
+    /// every file exported through this session.
+    pub fn without_database(extra_args: &[&str]) -> ExportSession {
+        let args_owned: Vec<CString> = extra_args
+            .iter()
+            .map(|&arg| CString::new(arg).unwrap())
+            .collect();
+        let args_ptrs: Vec<*const libc::c_char> = args_owned.iter().map(|x| x.as_ptr()).collect();
+
+        ExportSession(unsafe {
+            ast_exporter_session_new_without_database(
+                args_ptrs.len() as libc::c_int,
+                args_ptrs.as_ptr(),
+            )
+        })
+    }
+
+    /// Have the files exported after this, and the headers they include,
+    /// read `contents` from `path`, in place of the file there on disk if
+    /// there is one. Nothing is written to disk, and comments are exported as
+    /// text since they cannot be read back from the file.
+    pub fn add_virtual_file(&mut self, path: &Path, contents: &[u8]) {
+        let path = CString::new(path.to_str().unwrap()).unwrap();
+        unsafe {
+            ast_exporter_session_add_virtual_file(
+                self.0,
+                path.as_ptr(),
+                contents.as_ptr() as *const libc::c_char,
+                contents.len(),
+            )
+        }
+    }
+
+    /// Forget the files added with `add_virtual_file`.
+    pub fn clear_virtual_files(&mut self) {
+        unsafe { ast_exporter_session_clear_virtual_files(self.0) }
+    }
+
+    /// Cache exported ASTs in `dir`, keeping at most `max_size` bytes of
+    /// them. A file is only parsed again if its preprocessed source, its
+    /// clang arguments or the clang version differ from every cached export.
+    pub fn set_cache(&mut self, dir: &Path, max_size: u64) {
+        let dir = CString::new(dir.to_str().unwrap()).unwrap();
+        unsafe { ast_exporter_session_set_cache(self.0, dir.as_ptr(), max_size) }
+    }
+
+    /// Only export the declarations reachable from the functions and
+    /// variables visible to other translation units, and the types and macros
+    /// they use, rather than pruning the others after importing them.
+    pub fn set_prune_unused_decls(&mut self, prune: bool) {
+        unsafe { ast_exporter_session_set_prune_unused_decls(self.0, prune.into()) }
+    }
+
+    /// Export source positions as byte offsets, along with the offsets at
+    /// which the lines of each file start, rather than having clang compute
+    /// their line and column numbers. The numbers computed from the offsets
+    /// do not take `#line` directives into account.
+    pub fn set_offset_positions(&mut self, offsets: bool) {
+        unsafe { ast_exporter_session_set_offset_positions(self.0, offsets.into()) }
+    }
+
+    /// Export ASTs in the columnar format read by `ast_tables` rather than as
+    /// CBOR, which saves decoding the whole export into `Value`s.
+    pub fn set_columnar(&mut self, columnar: bool) {
+        unsafe { ast_exporter_session_set_columnar(self.0, columnar.into()) }
+    }
+
+    /// Encode the top-level declarations of each translation unit on
+    /// `threads` threads. CBOR exports only, and precompiled preambles are
+    /// not used when this is more than one.
+    pub fn set_encode_threads(&mut self, threads: u32) {
+        unsafe { ast_exporter_session_set_encode_threads(self.0, threads) }
+    }
+
+    /// Leave function bodies out of exported ASTs, which then only declare
+    /// the functions they define. Clang does not parse the bodies at all.
+    pub fn set_decls_only(&mut self, decls_only: bool) {
+        unsafe { ast_exporter_session_set_decls_only(self.0, decls_only.into()) }
+    }
+
+    /// Export the comments in system headers too. Only those in the main file
+    /// and the headers of the project are exported otherwise.
+    pub fn set_system_header_comments(&mut self, system_comments: bool) {
+        unsafe {
+            ast_exporter_session_set_system_header_comments(self.0, system_comments.into())
+        }
+    }
+
+    /// Whether to find the macros that expressions were expanded from in a
+    /// record of the expansions made while parsing, as by default, or by
+    /// lexing their names again. Only meant for checking that the two agree.
+    pub fn set_macro_expansion_index(&mut self, index: bool) {
+        unsafe { ast_exporter_session_set_macro_expansion_index(self.0, index.into()) }
+    }
+
+    /// Write a JSON report of where the time exporting each file goes, and
+    /// of the nodes, types and bytes encoded by tag, to
+    /// `<file>.export-stats.json`. With `trace`, also write the phases of the
+    /// export as Chrome trace events to `<file>.export-trace.json`. Exports
+    /// found in the cache are not profiled.
+    pub fn set_export_stats(&mut self, stats: bool, trace: bool) {
+        unsafe { ast_exporter_session_set_export_stats(self.0, stats.into(), trace.into()) }
+    }
+
+    /// Only export the declarations `roots` select and the declarations,
+    /// types and macros they use, directly or not, rather than all of them.
+    /// Everything is exported if `roots` is empty.
+    pub fn set_export_roots(&mut self, roots: &[ExportRoot]) {
+        unsafe { ast_exporter_session_clear_export_roots(self.0) }
+        for root in roots {
+            match *root {
+                ExportRoot::Name(ref name) => {
+                    let name = CString::new(name.as_str()).unwrap();
+                    unsafe { ast_exporter_session_add_export_root(self.0, name.as_ptr()) }
+                }
+                ExportRoot::Lines(ref file, first, last) => {
+                    let file = CString::new(file.to_str().unwrap()).unwrap();
+                    unsafe {
+                        ast_exporter_session_add_export_root_lines(
+                            self.0,
+                            file.as_ptr(),
+                            first,
+                            last,
+                        )
+                    }
+                }
+            }
+        }
+    }
+
+    pub fn get_untyped_ast(
+        &self,
+        file_path: &Path,
+        debug: bool,
+    ) -> Result<clang_ast::AstContext, Error> {
+        decode_cbors(self.get_ast_cbors(file_path, debug))
+    }
+
+    /// Like `get_untyped_ast`, but decode the AST on another thread while
+    /// clang is still encoding it. The AST is always streamed as CBOR, and
+    /// the export cache is not used.
+    pub fn stream_untyped_ast(
+        &self,
+        file_path: &Path,
+        debug: bool,
+    ) -> Result<clang_ast::AstContext, Error> {
+        let file = CString::new(file_path.to_str().unwrap()).unwrap();
+        decode_stream(|on_chunk, ctx| unsafe {
+            ast_exporter_session_export_stream(
+                self.0,
+                file.as_ptr(),
+                debug.into(),
+                on_chunk,
+                ctx,
+            )
+        })
+    }
+
+    /// Export `file_path` compiled with the clang arguments `args` in the
+    /// current directory, rather than with its compile command from the
+    /// compilation database.
+    pub fn get_untyped_ast_with_args(
+        &self,
+        file_path: &Path,
+        args: &[&str],
+        debug: bool,
+    ) -> Result<clang_ast::AstContext, Error> {
+        decode_cbors(self.get_ast_cbors_with_args(file_path, args, debug))
+    }
+
+    /// Like `get_untyped_ast_with_args`, but return the export as the
+    /// exporter encoded it rather than decoding it.
+    pub fn get_export_with_args(
+        &self,
+        file_path: &Path,
+        args: &[&str],
+        debug: bool,
+    ) -> Result<Vec<u8>, Error> {
+        let cbors = self.get_ast_cbors_with_args(file_path, args, debug);
+        if cbors.len() == 0 {
+            return Err(Error::new(
+                ErrorKind::InvalidData,
+                "Could not parse input file",
+            ));
+        }
+        Ok(cbors.segments(0).concat())
+    }
+
+    /// Export the AST serialized at `ast_path` by `clang -emit-ast` or as a
+    /// PCH, rather than parsing a source file. Macro expansions are only
+    /// exported if they can be found again in the source files.
+    pub fn get_untyped_ast_from_ast_file(
+        &self,
+        ast_path: &Path,
+        debug: bool,
+    ) -> Result<clang_ast::AstContext, Error> {
+        let mut res = 0;
+        let file = CString::new(ast_path.to_str().unwrap()).unwrap();
+        let cbors = unsafe {
+            ExportedCbors(ast_exporter_session_export_ast_file(
+                self.0,
+                file.as_ptr(),
+                debug.into(),
+                &mut res,
+            ))
+        };
+        decode_cbors(cbors)
+    }
+
+    fn get_ast_cbors(&self, file_path: &Path, debug: bool) -> ExportedCbors {
+        let mut res = 0;
+        let file = CString::new(file_path.to_str().unwrap()).unwrap();
+
+        unsafe {
+            let ptr = ast_exporter_session_export(self.0, file.as_ptr(), debug.into(), &mut res);
+            ExportedCbors(ptr)
+        }
+    }
+
+    fn get_ast_cbors_with_args(
+        &self,
+        file_path: &Path,
+        args: &[&str],
+        debug: bool,
+    ) -> ExportedCbors {
+        let mut res = 0;
+        let file = CString::new(file_path.to_str().unwrap()).unwrap();
+        let args_owned: Vec<CString> = args.iter().map(|&arg| CString::new(arg).unwrap()).collect();
+        let args_ptrs: Vec<*const libc::c_char> = args_owned.iter().map(|x| x.as_ptr()).collect();
+
+        unsafe {
+            ExportedCbors(ast_exporter_session_export_args(
+                self.0,
+                file.as_ptr(),
+                args_ptrs.len() as libc::c_int,
+                args_ptrs.as_ptr(),
+                debug.into(),
+                &mut res,
+            ))
+        }
+    }
+}
+
+/// Decode the AST of the first export in `cbors`
+fn decode_cbors(cbors: ExportedCbors) -> Result<clang_ast::AstContext, Error> {
+    if cbors.len() == 0 {
+        return Err(Error::new(
+            ErrorKind::InvalidData,
+            "Could not parse input file",
+        ));
+    }
 
     // let cbor_path = file_path.with_extension("cbor");
     // let mut cbor_file = File::create(&cbor_path)?;
-    // cbor_file.write_all(&buffer[..])?;
+    // for segment in cbors.segments(0) {
+    //     cbor_file.write_all(segment)?;
+    // }
     // eprintln!("Dumped CBOR to {}", cbor_path.to_string_lossy());
 
-    let items: Value = from_slice(&buffer[..]).unwrap();
-
-    match clang_ast::process(items) {
-        Ok(cxt) => Ok(cxt),
-        Err(e) => Err(Error::new(ErrorKind::InvalidData, format!("{:}", e))),
-    }
+    decode_export(&cbors.segments(0))
 }
 
-fn get_ast_cbors(
-    file_path: &Path,
-    cc_db: &Path,
-    extra_args: &[&str],
-    debug: bool,
-) -> HashMap<String, Vec<u8>> {
-    let mut res = 0;
+/// Magic number at the start of a zstd frame
+const ZSTD_MAGIC: [u8; 4] = [0x28, 0xb5, 0x2f, 0xfd];
 
-    let mut args_owned = vec![CString::new("ast_exporter").unwrap()];
-    args_owned.push(CString::new(file_path.to_str().unwrap()).unwrap());
-    args_owned.push(CString::new("-p").unwrap());
-    args_owned.push(CString::new(cc_db.to_str().unwrap()).unwrap());
+/// Decode an export split across `segments`, decompressing it first if it
+/// was compressed with zstd
+fn decode_export(segments: &[&[u8]]) -> Result<clang_ast::AstContext, Error> {
+    if segments.first().map_or(false, |s| s.starts_with(&ZSTD_MAGIC)) {
+        let bytes = zstd::stream::decode_all(SegmentReader::new(segments))?;
+        return decode_export(&[&bytes]);
+    }
 
-    for &arg in extra_args {
-        args_owned.push(CString::new(["-extra-arg=", arg].join("")).unwrap())
+    if segments.first().map_or(false, |s| ast_tables::AstTables::is_ast_tables(s)) {
+        // The columnar format is read in place, so it has to be
+        // contiguous
+        return match segments[..] {
+            [bytes] => ast_tables::AstTables::new(bytes)?.to_context(),
+            _ => ast_tables::AstTables::new(&segments.concat())?.to_context(),
+        };
     }
 
-    let args_ptrs: Vec<*const libc::c_char> = args_owned.iter().map(|x| x.as_ptr()).collect();
+    let items: Value = decode_segments(&segments)
+        .map_err(|e| Error::new(ErrorKind::InvalidData, e.to_string()))?;
+    clang_ast::process(items)
+}
 
-    let hashmap;
-    unsafe {
-        let ptr = ast_exporter(
-            args_ptrs.len() as libc::c_int,
-            args_ptrs.as_ptr(),
-            debug.into(),
-            &mut res,
-        );
-        hashmap = marshal_result(ptr);
-        drop_export_result(ptr);
+impl Drop for ExportSession {
+    fn drop(&mut self) {
+        unsafe { ast_exporter_session_drop(self.0) }
     }
-    hashmap
 }
 
 include!(concat!(env!("OUT_DIR"), "/cppbindings.rs"));
 
+/// Opaque handle to the exporter's `ExportSession`
+#[repr(C)]
+pub struct CExportSession {
+    _private: [u8; 0],
+}
+
 extern "C" {
-    // ExportResult *ast_exporter(int argc, char *argv[]);
+    // ExportSession *ast_exporter_session_new(const char *cc_db, int argc,
+    //                                         const char *extra_args[]);
     #[no_mangle]
-    fn ast_exporter(
+    fn ast_exporter_session_new(
+        cc_db: *const libc::c_char,
         argc: libc::c_int,
-        argv: *const *const libc::c_char,
+        extra_args: *const *const libc::c_char,
+    ) -> *mut CExportSession;
+
+    // ExportSession *ast_exporter_session_new_without_database(
+    //     int argc, const char *extra_args[]);
+    #[no_mangle]
+    fn ast_exporter_session_new_without_database(
+        argc: libc::c_int,
+        extra_args: *const *const libc::c_char,
+    ) -> *mut CExportSession;
+
+    // ExportResult *ast_exporter_session_export(ExportSession *session,
+    //                                           const char *file, int debug,
+    //                                           int *result);
+    #[no_mangle]
+    fn ast_exporter_session_export(
+        session: *mut CExportSession,
+        file: *const libc::c_char,
+        debug: libc::c_int,
+        res: *mut libc::c_int,
+    ) -> *mut ExportResult;
+
+    // int ast_exporter_session_export_stream(
+    //     ExportSession *session, const char *file, int debug,
+    //     void (*on_chunk)(void *ctx, const uint8_t *data, size_t size),
+    //     void *ctx);
+    #[no_mangle]
+    fn ast_exporter_session_export_stream(
+        session: *mut CExportSession,
+        file: *const libc::c_char,
+        debug: libc::c_int,
+        on_chunk: extern "C" fn(ctx: *mut libc::c_void, data: *const u8, size: usize),
+        ctx: *mut libc::c_void,
+    ) -> libc::c_int;
+
+    // ExportResult *ast_exporter_session_export_args(ExportSession *session,
+    //                                                const char *file, int argc,
+    //                                                const char *args[],
+    //                                                int debug, int *result);
+    #[no_mangle]
+    fn ast_exporter_session_export_args(
+        session: *mut CExportSession,
+        file: *const libc::c_char,
+        argc: libc::c_int,
+        args: *const *const libc::c_char,
+        debug: libc::c_int,
+        res: *mut libc::c_int,
+    ) -> *mut ExportResult;
+
+    // ExportResult *ast_exporter_session_export_ast_file(ExportSession *session,
+    //                                                   const char *file,
+    //                                                   int debug, int *result);
+    #[no_mangle]
+    fn ast_exporter_session_export_ast_file(
+        session: *mut CExportSession,
+        file: *const libc::c_char,
         debug: libc::c_int,
         res: *mut libc::c_int,
     ) -> *mut ExportResult;
 
+    // void ast_exporter_session_set_cache(ExportSession *session,
+    //                                     const char *directory,
+    //                                     uint64_t max_size);
+    #[no_mangle]
+    fn ast_exporter_session_set_cache(
+        session: *mut CExportSession,
+        directory: *const libc::c_char,
+        max_size: u64,
+    );
+
+    // void ast_exporter_session_set_prune_unused_decls(ExportSession *session,
+    //                                                  int prune);
+    #[no_mangle]
+    fn ast_exporter_session_set_prune_unused_decls(
+        session: *mut CExportSession,
+        prune: libc::c_int,
+    );
+
+    // void ast_exporter_session_set_offset_positions(ExportSession *session,
+    //                                                int offsets);
+    #[no_mangle]
+    fn ast_exporter_session_set_offset_positions(
+        session: *mut CExportSession,
+        offsets: libc::c_int,
+    );
+
+    // void ast_exporter_session_set_columnar(ExportSession *session,
+    //                                        int columnar);
+    #[no_mangle]
+    fn ast_exporter_session_set_columnar(session: *mut CExportSession, columnar: libc::c_int);
+
+    // void ast_exporter_session_set_encode_threads(ExportSession *session,
+    //                                              unsigned threads);
+    #[no_mangle]
+    fn ast_exporter_session_set_encode_threads(
+        session: *mut CExportSession,
+        threads: libc::c_uint,
+    );
+
+    // void ast_exporter_session_set_decls_only(ExportSession *session,
+    //                                          int decls_only);
+    #[no_mangle]
+    fn ast_exporter_session_set_decls_only(session: *mut CExportSession, decls_only: libc::c_int);
+
+    // void ast_exporter_session_set_system_header_comments(
+    //     ExportSession *session, int system_comments);
+    #[no_mangle]
+    fn ast_exporter_session_set_system_header_comments(
+        session: *mut CExportSession,
+        system_comments: libc::c_int,
+    );
+
+    // void ast_exporter_session_set_macro_expansion_index(
+    //     ExportSession *session, int index);
+    #[no_mangle]
+    fn ast_exporter_session_set_macro_expansion_index(
+        session: *mut CExportSession,
+        index: libc::c_int,
+    );
+
+    // void ast_exporter_session_set_export_stats(ExportSession *session,
+    //                                            int stats, int trace);
+    #[no_mangle]
+    fn ast_exporter_session_set_export_stats(
+        session: *mut CExportSession,
+        stats: libc::c_int,
+        trace: libc::c_int,
+    );
+
+    // void ast_exporter_session_add_export_root(ExportSession *session,
+    //                                           const char *name);
+    #[no_mangle]
+    fn ast_exporter_session_add_export_root(
+        session: *mut CExportSession,
+        name: *const libc::c_char,
+    );
+
+    // void ast_exporter_session_add_export_root_lines(ExportSession *session,
+    //                                                 const char *file,
+    //                                                 unsigned first_line,
+    //                                                 unsigned last_line);
+    #[no_mangle]
+    fn ast_exporter_session_add_export_root_lines(
+        session: *mut CExportSession,
+        file: *const libc::c_char,
+        first_line: libc::c_uint,
+        last_line: libc::c_uint,
+    );
+
+    // void ast_exporter_session_clear_export_roots(ExportSession *session);
+    #[no_mangle]
+    fn ast_exporter_session_clear_export_roots(session: *mut CExportSession);
+
+    // void ast_exporter_session_add_virtual_file(ExportSession *session,
+    //                                            const char *path,
+    //                                            const char *contents,
+    //                                            size_t size);
+    #[no_mangle]
+    fn ast_exporter_session_add_virtual_file(
+        session: *mut CExportSession,
+        path: *const libc::c_char,
+        contents: *const libc::c_char,
+        size: usize,
+    );
+
+    // void ast_exporter_session_clear_virtual_files(ExportSession *session);
+    #[no_mangle]
+    fn ast_exporter_session_clear_virtual_files(session: *mut CExportSession);
+
+    // int ast_exporter_stream(int argc, const char *argv[], int debug,
+    //                         void (*on_chunk)(void *ctx, const uint8_t *data,
+    //                                          size_t size),
+    //                         void *ctx);
+    #[no_mangle]
+    fn ast_exporter_stream(
+        argc: libc::c_int,
+        argv: *const *const libc::c_char,
+        debug: libc::c_int,
+        on_chunk: extern "C" fn(ctx: *mut libc::c_void, data: *const u8, size: usize),
+        ctx: *mut libc::c_void,
+    ) -> libc::c_int;
+
+    // void ast_exporter_session_drop(ExportSession *session);
+    #[no_mangle]
+    fn ast_exporter_session_drop(session: *mut CExportSession);
+
     // void drop_export_result(ExportResult *result);
     #[no_mangle]
     fn drop_export_result(ptr: *mut ExportResult);
@@ -101,25 +666,73 @@ extern "C" {
     fn clang_version() -> *const libc::c_char;
 }
 
-unsafe fn marshal_result(result: *const ExportResult) -> HashMap<String, Vec<u8>> {
-    let mut output = HashMap::new();
+/// Output of the exporter, still owned by the exporter. The CBOR of each entry
+/// is borrowed in place from the buffers it was encoded into, and those
+/// buffers are released when this is dropped.
+struct ExportedCbors(*mut ExportResult);
 
-    let n = (*result).entries as isize;
-    for i in 0..n {
-        let ref res = *result;
+impl ExportedCbors {
+    fn len(&self) -> usize {
+        unsafe { (*self.0).entries }
+    }
 
-        // Convert name field
-        let cname = CStr::from_ptr(*res.names.offset(i));
-        let name = cname.to_str().unwrap().to_owned();
+    fn segments(&self, i: usize) -> Vec<&[u8]> {
+        assert!(i < self.len());
+        unsafe {
+            let ref res = *self.0;
+            let n = *res.segment_counts.add(i);
+            let segments = slice::from_raw_parts(*res.segments.add(i), n);
+            segments
+                .iter()
+                .map(|s| slice::from_raw_parts(s.data, s.size))
+                .collect()
+        }
+    }
+}
 
-        // Convert CBOR bytes
-        let csize = *res.sizes.offset(i);
-        let cbytes = *res.bytes.offset(i);
-        let bytes = slice::from_raw_parts(cbytes, csize);
-        let mut v = Vec::new();
-        v.extend_from_slice(bytes);
+impl Drop for ExportedCbors {
+    fn drop(&mut self) {
+        unsafe { drop_export_result(self.0) }
+    }
+}
+
+/// Reads the concatenation of a list of byte slices without copying them into
+/// a single buffer first.
+struct SegmentReader<'a> {
+    segments: &'a [&'a [u8]],
+    current: &'a [u8],
+}
+
+impl<'a> SegmentReader<'a> {
+    fn new(segments: &'a [&'a [u8]]) -> Self {
+        SegmentReader {
+            segments,
+            current: &[],
+        }
+    }
+}
+
+impl<'a> Read for SegmentReader<'a> {
+    fn read(&mut self, buf: &mut [u8]) -> io::Result<usize> {
+        while self.current.is_empty() {
+            match self.segments.split_first() {
+                Some((first, rest)) => {
+                    self.current = first;
+                    self.segments = rest;
+                }
+                None => return Ok(0),
+            }
+        }
+        self.current.read(buf)
+    }
+}
 
-        output.insert(name, v);
+/// Decode a CBOR value split across `segments`. The common single-segment
+/// case is decoded straight from the exporter's buffer.
+fn decode_segments(segments: &[&[u8]]) -> serde_cbor::Result<Value> {
+    match segments {
+        [] => from_slice(&[]),
+        [bytes] => from_slice(bytes),
+        _ => from_reader(SegmentReader::new(segments)),
     }
-    output
 }
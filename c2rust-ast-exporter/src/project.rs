@@ -0,0 +1,1118 @@
+//! Merges the exports of the translation units of a project into one project
+//! file. Types, and the records, typedefs, enums and function prototypes
+//! that several translation units have in common (usually because they come
+//! from the same header), are stored once for the whole project rather than
+//! once per translation unit. Declarations are merged if they have the same
+//! structure down to their source locations, and types if they are built
+//! the same way from the same declarations. Translation units keep the IDs
+//! they were exported with, so the `AstContext` of each one can be rebuilt
+//! exactly as it was exported.
+
+use clang_ast::ASTEntryTag::*;
+use clang_ast::TypeTag::*;
+use clang_ast::*;
+use serde_cbor::{from_reader, to_writer};
+use std::collections::{BTreeMap, HashMap, HashSet};
+use std::io::{self, Error, ErrorKind, Read, Write};
+use std::path::{Path, PathBuf};
+
+/// First element of a project file
+const MAGIC: &str = "c2rust-project";
+/// Version of the project file format
+pub const VERSION: u64 = 1;
+
+fn invalid_data<E: ToString>(error: E) -> Error {
+    Error::new(ErrorKind::InvalidData, error.to_string())
+}
+
+fn int(n: u64) -> Value {
+    Value::Integer(n as i128)
+}
+
+fn opt_int(n: Option<u64>) -> Value {
+    n.map_or(Value::Null, int)
+}
+
+fn opt_text(s: Option<&str>) -> Value {
+    s.map_or(Value::Null, |s| Value::Text(s.to_string()))
+}
+
+fn as_u64(value: &Value) -> io::Result<u64> {
+    match *value {
+        Value::Integer(n) if n >= 0 && n <= u64::max_value() as i128 => Ok(n as u64),
+        _ => Err(invalid_data("Expected an integer in project file")),
+    }
+}
+
+fn as_opt_u64(value: &Value) -> io::Result<Option<u64>> {
+    match *value {
+        Value::Null => Ok(None),
+        ref value => as_u64(value).map(Some),
+    }
+}
+
+fn as_array(value: &Value) -> io::Result<&[Value]> {
+    match *value {
+        Value::Array(ref values) => Ok(values),
+        _ => Err(invalid_data("Expected an array in project file")),
+    }
+}
+
+/// `values[i]`, or an error if there are not that many
+fn get(values: &[Value], i: usize) -> io::Result<&Value> {
+    values
+        .get(i)
+        .ok_or_else(|| invalid_data("Truncated entry in project file"))
+}
+
+fn as_u64s(value: &Value) -> io::Result<Vec<u64>> {
+    as_array(value)?.iter().map(as_u64).collect()
+}
+
+/// Add `value` to `values` unless it is already there, and return its index
+fn intern(values: &mut Vec<Value>, indices: &mut BTreeMap<Value, usize>, value: Value) -> usize {
+    if let Some(&index) = indices.get(&value) {
+        return index;
+    }
+    values.push(value.clone());
+    indices.insert(value, values.len() - 1);
+    values.len() - 1
+}
+
+/// What a reference in the extras of a type node refers to
+#[derive(Clone, Copy)]
+enum RefKind {
+    /// A type, with qualifiers in the low bits
+    Type,
+    /// A record, enum or typedef declaration
+    Decl,
+}
+
+/// Map the references in the extras of `node` with `map`. Returns None if
+/// `map` does, or if the type refers to expressions or is not known here, as
+/// such types are not shared.
+fn map_type_refs<F>(node: &TypeNode, mut map: F) -> Option<Vec<Value>>
+where
+    F: FnMut(RefKind, u64) -> Option<u64>,
+{
+    let mut map_ref = |kind, value: &Value| match *value {
+        Value::Integer(id) => map(kind, id as u64).map(int),
+        _ => None,
+    };
+
+    let mut extras = node.extras.clone();
+    let first = match node.tag {
+        TagInt | TagShort | TagLong | TagLongLong | TagUInt | TagUShort | TagULong
+        | TagULongLong | TagDouble | TagLongDouble | TagFloat | TagUChar | TagSChar
+        | TagChar | TagVoid | TagBool | TagSWChar | TagUWChar | TagInt128 | TagUInt128
+        | TagBuiltinFn | TagHalf => return Some(extras),
+
+        TagPointer | TagReference | TagBlockPointer | TagComplexType | TagTypeOfType
+        | TagDecayedType | TagElaboratedType | TagParenType | TagAttributedType
+        | TagConstantArrayType | TagIncompleteArrayType | TagVectorType => {
+            map_ref(RefKind::Type, extras.get(0)?)?
+        }
+        // Unless its size is an expression
+        TagVariableArrayType if extras.get(1) == Some(&Value::Null) => {
+            map_ref(RefKind::Type, extras.get(0)?)?
+        }
+        TagStructType | TagUnionType | TagEnumType | TagTypedefType => {
+            map_ref(RefKind::Decl, extras.get(0)?)?
+        }
+        // The return type followed by the parameter types
+        TagFunctionType => match *extras.get(0)? {
+            Value::Array(ref types) => Value::Array(
+                types
+                    .iter()
+                    .map(|ty| map_ref(RefKind::Type, ty))
+                    .collect::<Option<_>>()?,
+            ),
+            _ => return None,
+        },
+        _ => return None,
+    };
+    extras[0] = first;
+    Some(extras)
+}
+
+/// ID a unit has for a qualified reference to a shared type, given the
+/// first ID it has for each shared type
+fn local_type_id(first_ids: &HashMap<usize, u64>, value: u64) -> Option<u64> {
+    first_ids
+        .get(&((value >> TypeNode::ID_SHIFT) as usize))
+        .map(|&id| id | (value & !TypeNode::ID_MASK))
+}
+
+/// Rebuild a shared type for a unit, given the first ID it has for each
+/// shared type and the ID of the declaration with each key index
+fn unit_type<F>(value: &Value, first_ids: &HashMap<usize, u64>, decl_id: F) -> io::Result<TypeNode>
+where
+    F: Fn(usize) -> Option<u64>,
+{
+    let values = as_array(value)?;
+    let shared = TypeNode {
+        tag: import_type_tag(as_u64(get(values, 0)?)?),
+        extras: values[1..].to_vec(),
+    };
+    let extras = map_type_refs(&shared, |kind, value| match kind {
+        RefKind::Type => local_type_id(first_ids, value),
+        RefKind::Decl => decl_id(value as usize),
+    })
+    .ok_or_else(|| invalid_data("Dangling reference in project file"))?;
+    Ok(TypeNode {
+        tag: shared.tag,
+        extras,
+    })
+}
+
+/// Whether a node tagged `tag` can be part of a shared declaration, as its
+/// root if `parent` is None or else as a child of a node tagged `parent`.
+/// Nodes that can be are declarations whose extras are all plain values.
+fn is_shareable(parent: Option<ASTEntryTag>, tag: ASTEntryTag) -> bool {
+    match (parent, tag) {
+        (None, TagStructDecl)
+        | (None, TagUnionDecl)
+        | (None, TagEnumDecl)
+        | (None, TagTypedefDecl)
+        | (None, TagFunctionDecl)
+        | (Some(TagStructDecl), TagFieldDecl)
+        | (Some(TagUnionDecl), TagFieldDecl)
+        | (Some(TagEnumDecl), TagEnumConstantDecl)
+        | (Some(TagFunctionDecl), TagVarDecl)
+        | (Some(TagFunctionDecl), TagParmVarDecl) => true,
+        _ => false,
+    }
+}
+
+/// A type of a translation unit
+enum UnitType {
+    /// Index of a type shared by the project
+    Shared(usize),
+    Local(TypeNode),
+}
+
+/// A translation unit in a project, without what it shares with others
+struct ProjectUnit {
+    path: PathBuf,
+    top_nodes: Vec<u64>,
+    files: Vec<SrcFile>,
+    comments: Vec<CommentNode>,
+    va_list_kind: BuiltinVaListKind,
+    /// AST nodes that are not part of a shared declaration, by ID
+    nodes: Vec<(u64, AstNode)>,
+    /// Types by ID
+    types: Vec<(u64, UnitType)>,
+    /// IDs of the declarations that shared types refer to, by the index of
+    /// their key
+    decl_ids: Vec<(usize, u64)>,
+    /// Indices of shared declarations, each with the ID and file ID of its
+    /// nodes in preorder
+    decls: Vec<(usize, Vec<(u64, u64)>)>,
+}
+
+/// The exports of the translation units of a project, merged
+#[derive(Default)]
+pub struct ProjectAst {
+    /// Shared types: their tag followed by their extras, in which references
+    /// to other types are indices into `types` (shifted left by
+    /// `TypeNode::ID_SHIFT` bits, with qualifiers in the low bits) and
+    /// references to declarations are indices into `decl_keys`
+    types: Vec<Value>,
+    type_indices: BTreeMap<Value, usize>,
+    /// What identifies the declarations shared types refer to: their tag,
+    /// name, file path, line and column
+    decl_keys: Vec<Value>,
+    decl_key_indices: BTreeMap<Value, usize>,
+    /// Shared declarations, each the nodes of its subtree in preorder: their
+    /// tag, the indices of their children in the subtree, their span (with
+    /// a file path rather than a file ID), their shared type, whether they
+    /// are rvalues, the text of the macro they were expanded from and their
+    /// extras
+    decls: Vec<Value>,
+    decl_indices: BTreeMap<Value, usize>,
+    units: Vec<ProjectUnit>,
+    /// Index of the unit that defines each externally visible function or
+    /// variable. If several do, the one whose path comes first, so that it
+    /// does not depend on the order units are added in.
+    symbols: BTreeMap<String, usize>,
+}
+
+/// State for adding one translation unit to a project
+struct UnitMerger<'a> {
+    project: &'a mut ProjectAst,
+    context: &'a AstContext,
+    /// Shared type index by ID, None if the type is not shared
+    type_indices: HashMap<u64, Option<usize>>,
+    /// ID of the declaration with each key, None if several have it
+    key_ids: BTreeMap<Value, Option<u64>>,
+    /// ID of the declaration with each key index that shared types refer to
+    decl_ids: BTreeMap<usize, u64>,
+    /// First ID the unit keeps for each shared type, which is the one
+    /// `unit_context` maps references to it back to
+    first_ids: HashMap<usize, u64>,
+}
+
+impl<'a> UnitMerger<'a> {
+    fn new(project: &'a mut ProjectAst, context: &'a AstContext) -> Self {
+        let mut merger = UnitMerger {
+            project,
+            context,
+            type_indices: HashMap::new(),
+            key_ids: BTreeMap::new(),
+            decl_ids: BTreeMap::new(),
+            first_ids: HashMap::new(),
+        };
+        for (id, _) in context.ast_nodes.iter() {
+            if let Some(key) = merger.decl_key(id) {
+                merger
+                    .key_ids
+                    .entry(key)
+                    .and_modify(|found| *found = None)
+                    .or_insert(Some(id));
+            }
+        }
+        merger
+    }
+
+    fn file_path(&self, fileid: u64) -> Value {
+        self.context
+            .files
+            .get(fileid as usize)
+            .and_then(|file| file.path.as_ref())
+            .map_or(Value::Null, |path| {
+                Value::Text(path.to_string_lossy().into_owned())
+            })
+    }
+
+    fn decl_key(&self, id: u64) -> Option<Value> {
+        let node = self.context.ast_nodes.get(&id)?;
+        match node.tag {
+            TagStructDecl | TagUnionDecl | TagEnumDecl | TagTypedefDecl => {}
+            _ => return None,
+        }
+        Some(Value::Array(vec![
+            int(node.tag as u64),
+            node.extras.get(0).cloned().unwrap_or(Value::Null),
+            self.file_path(node.loc.fileid),
+            int(node.loc.begin_line),
+            int(node.loc.begin_column),
+        ]))
+    }
+
+    /// Index of the key of a declaration a shared type refers to
+    fn decl_ref(&mut self, id: u64) -> Option<u64> {
+        let key = self.decl_key(id)?;
+        if self.key_ids.get(&key) != Some(&Some(id)) {
+            return None;
+        }
+        let project = &mut *self.project;
+        let index = intern(
+            &mut project.decl_keys,
+            &mut project.decl_key_indices,
+            key,
+        );
+        self.decl_ids.insert(index, id);
+        Some(index as u64)
+    }
+
+    /// Index of the shared type with ID `id`, if it can be shared
+    fn type_index(&mut self, id: u64) -> Option<usize> {
+        if let Some(&index) = self.type_indices.get(&id) {
+            return index;
+        }
+        // Types don't refer to themselves, but don't loop forever if they do
+        self.type_indices.insert(id, None);
+
+        let context = self.context;
+        let index = context.type_nodes.get(&id).and_then(|node| {
+            let extras = map_type_refs(node, |kind, id| match kind {
+                RefKind::Type => self.type_ref(id),
+                RefKind::Decl => self.decl_ref(id),
+            })?;
+            let mut value = vec![int(node.tag as u64)];
+            value.extend(extras);
+            let project = &mut *self.project;
+            Some(intern(
+                &mut project.types,
+                &mut project.type_indices,
+                Value::Array(value),
+            ))
+        });
+        self.type_indices.insert(id, index);
+        index
+    }
+
+    /// Shared form of a qualified type ID
+    fn type_ref(&mut self, id: u64) -> Option<u64> {
+        let index = self.type_index(id & TypeNode::ID_MASK)?;
+        Some(((index as u64) << TypeNode::ID_SHIFT) | (id & !TypeNode::ID_MASK))
+    }
+
+    /// Add the node with ID `id` and its descendants to `nodes` in shared
+    /// form, recording their IDs and file IDs in `ids`. Returns the index
+    /// of the node, or None if it cannot be shared.
+    fn shared_decl_node(
+        &mut self,
+        id: u64,
+        parent: Option<ASTEntryTag>,
+        nodes: &mut Vec<Value>,
+        ids: &mut Vec<(u64, u64)>,
+    ) -> Option<usize> {
+        let context = self.context;
+        let node = context.ast_nodes.get(&id)?;
+        if !is_shareable(parent, node.tag) || !node.macro_expansions.is_empty() {
+            return None;
+        }
+        let type_id = match node.type_id {
+            Some(type_id) => {
+                let shared = self.type_ref(type_id)?;
+                if local_type_id(&self.first_ids, shared) != Some(type_id) {
+                    return None;
+                }
+                int(shared)
+            }
+            None => Value::Null,
+        };
+
+        let index = nodes.len();
+        nodes.push(Value::Null);
+        ids.push((id, node.loc.fileid));
+        let mut children = vec![];
+        for child in &node.children {
+            children.push(match *child {
+                Some(child) => int(self.shared_decl_node(child, Some(node.tag), nodes, ids)? as u64),
+                None => Value::Null,
+            });
+        }
+
+        let loc = &node.loc;
+        let mut value = vec![
+            int(node.tag as u64),
+            Value::Array(children),
+            Value::Array(vec![
+                self.file_path(loc.fileid),
+                int(loc.begin_line),
+                int(loc.begin_column),
+                int(loc.end_line),
+                int(loc.end_column),
+            ]),
+            type_id,
+            Value::Bool(node.rvalue.is_rvalue()),
+            opt_text(node.macro_expansion_text.as_ref().map(String::as_str)),
+        ];
+        value.extend(node.extras.iter().cloned());
+        nodes[index] = Value::Array(value);
+        Some(index)
+    }
+
+    /// Index of the shared declaration with ID `id`, if it can be shared,
+    /// along with the IDs and file IDs of its nodes
+    fn shared_decl(&mut self, id: u64) -> Option<(usize, Vec<(u64, u64)>)> {
+        let mut nodes = vec![];
+        let mut ids = vec![];
+        self.shared_decl_node(id, None, &mut nodes, &mut ids)?;
+        let project = &mut *self.project;
+        let index = intern(
+            &mut project.decls,
+            &mut project.decl_indices,
+            Value::Array(nodes),
+        );
+        Some((index, ids))
+    }
+
+    /// Decide which types of the unit are kept shared. A unit can have
+    /// several IDs for the same shared type, and references to it come back
+    /// as the first, so a type is only kept shared if it comes back as it
+    /// was exported; until none is left that would not.
+    fn shared_types(&mut self) -> BTreeMap<u64, usize> {
+        let context = self.context;
+        let mut shared: BTreeMap<u64, usize> = context
+            .type_nodes
+            .iter()
+            .filter_map(|(id, _)| self.type_index(id).map(|index| (id, index)))
+            .collect();
+        loop {
+            self.first_ids.clear();
+            for (&id, &index) in &shared {
+                self.first_ids.entry(index).or_insert(id);
+            }
+            let decl_ids = &self.decl_ids;
+            let types = &self.project.types;
+            let first_ids = &self.first_ids;
+            let local: Vec<u64> = shared
+                .iter()
+                .filter(|&(&id, &index)| {
+                    let decl_id = |key| decl_ids.get(&key).cloned();
+                    let extras = unit_type(&types[index], first_ids, decl_id)
+                        .ok()
+                        .map(|node| node.extras);
+                    extras.as_ref() != context.type_nodes.get(&id).map(|node| &node.extras)
+                })
+                .map(|(&id, _)| id)
+                .collect();
+            if local.is_empty() {
+                return shared;
+            }
+            for id in local {
+                shared.remove(&id);
+            }
+        }
+    }
+
+    fn merge(mut self, path: &Path) {
+        let context = self.context;
+
+        let shared_types = self.shared_types();
+        let types = context
+            .type_nodes
+            .iter()
+            .map(|(id, node)| match shared_types.get(&id) {
+                Some(&index) => (id, UnitType::Shared(index)),
+                None => (id, UnitType::Local(node.clone())),
+            })
+            .collect();
+
+        let mut decls = vec![];
+        let mut shared_ids = HashSet::new();
+        for (id, node) in context.ast_nodes.iter() {
+            if !is_shareable(None, node.tag) {
+                continue;
+            }
+            if let Some((index, ids)) = self.shared_decl(id) {
+                shared_ids.extend(ids.iter().map(|&(id, _)| id));
+                decls.push((index, ids));
+            }
+        }
+        let nodes = context
+            .ast_nodes
+            .iter()
+            .filter(|&(id, _)| !shared_ids.contains(&id))
+            .map(|(id, node)| (id, node.clone()))
+            .collect();
+
+        let unit_index = self.project.units.len();
+        for &id in &context.top_nodes {
+            let node = match context.ast_nodes.get(&id) {
+                Some(node) => node,
+                None => continue,
+            };
+            let is_definition = match node.tag {
+                TagFunctionDecl => {
+                    node.children.last().map_or(false, Option::is_some)
+                        && node.extras.get(1) == Some(&Value::Bool(true))
+                }
+                TagVarDecl => {
+                    node.extras.get(3) == Some(&Value::Bool(true))
+                        && node.extras.get(4) == Some(&Value::Bool(true))
+                }
+                _ => false,
+            };
+            if let (true, Some(&Value::Text(ref name))) = (is_definition, node.extras.get(0)) {
+                let units = &self.project.units;
+                self.project
+                    .symbols
+                    .entry(name.clone())
+                    .and_modify(|unit| {
+                        if path < units[*unit].path.as_path() {
+                            *unit = unit_index;
+                        }
+                    })
+                    .or_insert(unit_index);
+            }
+        }
+
+        self.project.units.push(ProjectUnit {
+            path: path.to_path_buf(),
+            top_nodes: context.top_nodes.clone(),
+            files: context.files.clone(),
+            comments: context.comments.clone(),
+            va_list_kind: context.va_list_kind,
+            nodes,
+            types,
+            decl_ids: self.decl_ids.into_iter().collect(),
+            decls,
+        });
+    }
+}
+
+fn encode_loc(loc: &SrcLoc) -> Value {
+    Value::Array(vec![int(loc.fileid), int(loc.line), int(loc.column)])
+}
+
+fn decode_loc(value: &Value) -> io::Result<SrcLoc> {
+    let values = as_u64s(value)?;
+    match values[..] {
+        [fileid, line, column] => Ok(SrcLoc {
+            fileid,
+            line,
+            column,
+        }),
+        _ => Err(invalid_data("Expected a location in project file")),
+    }
+}
+
+fn encode_node(id: u64, node: &AstNode) -> Value {
+    let loc = &node.loc;
+    Value::Array(vec![
+        int(id),
+        int(node.tag as u64),
+        Value::Array(node.children.iter().cloned().map(opt_int).collect()),
+        Value::Array(vec![
+            int(loc.fileid),
+            int(loc.begin_line),
+            int(loc.begin_column),
+            int(loc.end_line),
+            int(loc.end_column),
+        ]),
+        opt_int(node.type_id),
+        Value::Bool(node.rvalue.is_rvalue()),
+        Value::Array(node.macro_expansions.iter().cloned().map(int).collect()),
+        opt_text(node.macro_expansion_text.as_ref().map(String::as_str)),
+        Value::Array(node.extras.clone()),
+    ])
+}
+
+fn decode_node(value: &Value) -> io::Result<(u64, AstNode)> {
+    let values = as_array(value)?;
+    let loc = as_u64s(get(values, 3)?)?;
+    if loc.len() != 5 {
+        return Err(invalid_data("Expected a span in project file"));
+    }
+    let node = AstNode {
+        tag: import_ast_tag(as_u64(get(values, 1)?)?),
+        children: as_array(get(values, 2)?)?
+            .iter()
+            .map(as_opt_u64)
+            .collect::<io::Result<_>>()?,
+        loc: SrcSpan {
+            fileid: loc[0],
+            begin_line: loc[1],
+            begin_column: loc[2],
+            end_line: loc[3],
+            end_column: loc[4],
+        },
+        type_id: as_opt_u64(get(values, 4)?)?,
+        rvalue: if *get(values, 5)? == Value::Bool(true) {
+            LRValue::RValue
+        } else {
+            LRValue::LValue
+        },
+        macro_expansions: as_u64s(get(values, 6)?)?,
+        macro_expansion_text: expect_opt_str(get(values, 7)?)
+            .ok_or_else(|| invalid_data("Expected a string in project file"))?
+            .map(str::to_string),
+        extras: as_array(get(values, 8)?)?.to_vec(),
+    };
+    Ok((as_u64(get(values, 0)?)?, node))
+}
+
+impl ProjectUnit {
+    fn encode(&self) -> Value {
+        let files = self
+            .files
+            .iter()
+            .map(|file| {
+                Value::Array(vec![
+                    opt_text(file.path.as_ref().map(|path| path.to_str().unwrap_or("?"))),
+                    file.include_loc.as_ref().map_or(Value::Null, encode_loc),
+                ])
+            })
+            .collect();
+        let comments = self
+            .comments
+            .iter()
+            .map(|comment| {
+                Value::Array(vec![
+                    encode_loc(&comment.loc),
+                    Value::Text(comment.string.clone()),
+                ])
+            })
+            .collect();
+        let types = self
+            .types
+            .iter()
+            .map(|&(id, ref ty)| match *ty {
+                UnitType::Shared(index) => Value::Array(vec![int(id), int(index as u64)]),
+                UnitType::Local(ref node) => Value::Array(vec![
+                    int(id),
+                    int(node.tag as u64),
+                    Value::Array(node.extras.clone()),
+                ]),
+            })
+            .collect();
+        let decls = self
+            .decls
+            .iter()
+            .map(|&(index, ref ids)| {
+                let ids = ids
+                    .iter()
+                    .map(|&(id, fileid)| Value::Array(vec![int(id), int(fileid)]))
+                    .collect();
+                Value::Array(vec![int(index as u64), Value::Array(ids)])
+            })
+            .collect();
+
+        Value::Array(vec![
+            Value::Text(self.path.to_string_lossy().into_owned()),
+            Value::Array(self.top_nodes.iter().cloned().map(int).collect()),
+            Value::Array(files),
+            Value::Array(comments),
+            int(self.va_list_kind as u64),
+            Value::Array(
+                self.nodes
+                    .iter()
+                    .map(|&(id, ref node)| encode_node(id, node))
+                    .collect(),
+            ),
+            Value::Array(types),
+            Value::Array(
+                self.decl_ids
+                    .iter()
+                    .map(|&(index, id)| Value::Array(vec![int(index as u64), int(id)]))
+                    .collect(),
+            ),
+            Value::Array(decls),
+        ])
+    }
+
+    fn decode(value: &Value) -> io::Result<Self> {
+        let values = as_array(value)?;
+        let path = match *get(values, 0)? {
+            Value::Text(ref path) => PathBuf::from(path),
+            _ => return Err(invalid_data("Expected a path in project file")),
+        };
+
+        let files = as_array(get(values, 2)?)?
+            .iter()
+            .map(|file| {
+                let file = as_array(file)?;
+                let path = match *get(file, 0)? {
+                    Value::Text(ref path) if path != "?" => Some(PathBuf::from(path)),
+                    _ => None,
+                };
+                let include_loc = match *get(file, 1)? {
+                    Value::Null => None,
+                    ref loc => Some(decode_loc(loc)?),
+                };
+                Ok(SrcFile { path, include_loc })
+            })
+            .collect::<io::Result<_>>()?;
+        let comments = as_array(get(values, 3)?)?
+            .iter()
+            .map(|comment| {
+                let comment = as_array(comment)?;
+                match *get(comment, 1)? {
+                    Value::Text(ref string) => Ok(CommentNode {
+                        loc: decode_loc(get(comment, 0)?)?,
+                        string: string.clone(),
+                    }),
+                    _ => Err(invalid_data("Expected a comment in project file")),
+                }
+            })
+            .collect::<io::Result<_>>()?;
+        let types = as_array(get(values, 6)?)?
+            .iter()
+            .map(|ty| {
+                let ty = as_array(ty)?;
+                let id = as_u64(get(ty, 0)?)?;
+                if ty.len() == 2 {
+                    return Ok((id, UnitType::Shared(as_u64(&ty[1])? as usize)));
+                }
+                let node = TypeNode {
+                    tag: import_type_tag(as_u64(get(ty, 1)?)?),
+                    extras: as_array(get(ty, 2)?)?.to_vec(),
+                };
+                Ok((id, UnitType::Local(node)))
+            })
+            .collect::<io::Result<_>>()?;
+        let decl_ids = as_array(get(values, 7)?)?
+            .iter()
+            .map(|entry| {
+                let entry = as_u64s(entry)?;
+                match entry[..] {
+                    [index, id] => Ok((index as usize, id)),
+                    _ => Err(invalid_data("Expected a declaration ID in project file")),
+                }
+            })
+            .collect::<io::Result<_>>()?;
+        let decls = as_array(get(values, 8)?)?
+            .iter()
+            .map(|decl| {
+                let decl = as_array(decl)?;
+                let ids = as_array(get(decl, 1)?)?
+                    .iter()
+                    .map(|ids| {
+                        let ids = as_u64s(ids)?;
+                        match ids[..] {
+                            [id, fileid] => Ok((id, fileid)),
+                            _ => Err(invalid_data("Expected a node ID in project file")),
+                        }
+                    })
+                    .collect::<io::Result<_>>()?;
+                Ok((as_u64(get(decl, 0)?)? as usize, ids))
+            })
+            .collect::<io::Result<_>>()?;
+
+        Ok(ProjectUnit {
+            path,
+            top_nodes: as_u64s(get(values, 1)?)?,
+            files,
+            comments,
+            va_list_kind: import_va_list_kind(as_u64(get(values, 4)?)?),
+            nodes: as_array(get(values, 5)?)?
+                .iter()
+                .map(decode_node)
+                .collect::<io::Result<_>>()?,
+            types,
+            decl_ids,
+            decls,
+        })
+    }
+}
+
+impl ProjectAst {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    /// Add the export of the translation unit at `path`
+    pub fn add_unit(&mut self, path: &Path, context: &AstContext) {
+        UnitMerger::new(self, context).merge(path);
+    }
+
+    pub fn unit_count(&self) -> usize {
+        self.units.len()
+    }
+
+    pub fn unit_path(&self, unit: usize) -> &Path {
+        &self.units[unit].path
+    }
+
+    /// Index of the unit defining each externally visible function or
+    /// variable
+    pub fn symbols(&self) -> &BTreeMap<String, usize> {
+        &self.symbols
+    }
+
+    /// Number of types stored once for all the units that have them
+    pub fn shared_type_count(&self) -> usize {
+        self.types.len()
+    }
+
+    /// Number of declarations stored once for all the units that have them
+    pub fn shared_decl_count(&self) -> usize {
+        self.decls.len()
+    }
+
+    /// Rebuild the export of a unit
+    pub fn unit_context(&self, unit: usize) -> io::Result<AstContext> {
+        let unit = &self.units[unit];
+        let dangling = || invalid_data("Dangling reference in project file");
+
+        let mut ast_nodes = NodeTable::new(0);
+        for &(id, ref node) in &unit.nodes {
+            ast_nodes.insert(id, node.clone());
+        }
+
+        // References to a shared type come back as the first ID the unit
+        // has for it; types and declarations are only shared if they then
+        // come back as they were exported
+        let mut first_ids = HashMap::new();
+        for &(id, ref ty) in &unit.types {
+            if let UnitType::Shared(index) = *ty {
+                first_ids.entry(index).or_insert(id);
+            }
+        }
+        let decl_ids: HashMap<usize, u64> = unit.decl_ids.iter().cloned().collect();
+
+        let mut type_nodes = NodeTable::new(TypeNode::ID_SHIFT);
+        for &(id, ref ty) in &unit.types {
+            let node = match *ty {
+                UnitType::Local(ref node) => node.clone(),
+                UnitType::Shared(index) => unit_type(
+                    self.types.get(index).ok_or_else(dangling)?,
+                    &first_ids,
+                    |key| decl_ids.get(&key).cloned(),
+                )?,
+            };
+            type_nodes.insert(id, node);
+        }
+
+        for &(index, ref ids) in &unit.decls {
+            let nodes = as_array(self.decls.get(index).ok_or_else(dangling)?)?;
+            if nodes.len() != ids.len() {
+                return Err(dangling());
+            }
+            for (node, &(id, fileid)) in nodes.iter().zip(ids) {
+                let values = as_array(node)?;
+                let children = as_array(get(values, 1)?)?
+                    .iter()
+                    .map(|child| match as_opt_u64(child)? {
+                        Some(child) => ids
+                            .get(child as usize)
+                            .map(|&(id, _)| Some(id))
+                            .ok_or_else(dangling),
+                        None => Ok(None),
+                    })
+                    .collect::<io::Result<_>>()?;
+                let span = as_array(get(values, 2)?)?;
+                let node = AstNode {
+                    tag: import_ast_tag(as_u64(get(values, 0)?)?),
+                    children,
+                    loc: SrcSpan {
+                        fileid,
+                        begin_line: as_u64(get(span, 1)?)?,
+                        begin_column: as_u64(get(span, 2)?)?,
+                        end_line: as_u64(get(span, 3)?)?,
+                        end_column: as_u64(get(span, 4)?)?,
+                    },
+                    type_id: match as_opt_u64(get(values, 3)?)? {
+                        Some(value) => Some(local_type_id(&first_ids, value).ok_or_else(dangling)?),
+                        None => None,
+                    },
+                    rvalue: if *get(values, 4)? == Value::Bool(true) {
+                        LRValue::RValue
+                    } else {
+                        LRValue::LValue
+                    },
+                    macro_expansions: vec![],
+                    macro_expansion_text: match *get(values, 5)? {
+                        Value::Text(ref text) => Some(text.clone()),
+                        _ => None,
+                    },
+                    extras: values[6..].to_vec(),
+                };
+                ast_nodes.insert(id, node);
+            }
+        }
+
+        Ok(AstContext {
+            ast_nodes,
+            type_nodes,
+            top_nodes: unit.top_nodes.clone(),
+            comments: unit.comments.clone(),
+            files: unit.files.clone(),
+            va_list_kind: unit.va_list_kind,
+        })
+    }
+
+    /// Write the project file
+    pub fn write_to<W: Write>(&self, writer: W) -> io::Result<()> {
+        let symbols = self
+            .symbols
+            .iter()
+            .map(|(name, &unit)| Value::Array(vec![Value::Text(name.clone()), int(unit as u64)]))
+            .collect();
+        let project = Value::Array(vec![
+            Value::Text(MAGIC.to_string()),
+            int(VERSION),
+            Value::Array(self.types.clone()),
+            Value::Array(self.decl_keys.clone()),
+            Value::Array(self.decls.clone()),
+            Value::Array(self.units.iter().map(ProjectUnit::encode).collect()),
+            Value::Array(symbols),
+        ]);
+        to_writer(writer, &project).map_err(invalid_data)
+    }
+
+    /// Read a project file written by `write_to`
+    pub fn read_from<R: Read>(reader: R) -> io::Result<Self> {
+        let project: Value = from_reader(reader).map_err(invalid_data)?;
+        let values = as_array(&project)?;
+        if *get(values, 0)? != Value::Text(MAGIC.to_string()) {
+            return Err(invalid_data("Not a project file"));
+        }
+        let version = as_u64(get(values, 1)?)?;
+        if version != VERSION {
+            return Err(invalid_data(format!(
+                "Unsupported project file version {} (expected {})",
+                version, VERSION
+            )));
+        }
+
+        let index = |values: &[Value]| -> BTreeMap<Value, usize> {
+            values
+                .iter()
+                .cloned()
+                .enumerate()
+                .map(|(i, value)| (value, i))
+                .collect()
+        };
+        let types = as_array(get(values, 2)?)?.to_vec();
+        let decl_keys = as_array(get(values, 3)?)?.to_vec();
+        let decls = as_array(get(values, 4)?)?.to_vec();
+        let units = as_array(get(values, 5)?)?
+            .iter()
+            .map(ProjectUnit::decode)
+            .collect::<io::Result<_>>()?;
+        let symbols = as_array(get(values, 6)?)?
+            .iter()
+            .map(|symbol| {
+                let symbol = as_array(symbol)?;
+                match *get(symbol, 0)? {
+                    Value::Text(ref name) => Ok((name.clone(), as_u64(get(symbol, 1)?)? as usize)),
+                    _ => Err(invalid_data("Expected a symbol in project file")),
+                }
+            })
+            .collect::<io::Result<_>>()?;
+
+        Ok(ProjectAst {
+            type_indices: index(&types),
+            types,
+            decl_key_indices: index(&decl_keys),
+            decl_keys,
+            decl_indices: index(&decls),
+            decls,
+            units,
+            symbols,
+        })
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn span(fileid: u64, line: u64) -> SrcSpan {
+        SrcSpan {
+            fileid,
+            begin_line: line,
+            begin_column: 1,
+            end_line: line,
+            end_column: 10,
+        }
+    }
+
+    fn node(
+        tag: ASTEntryTag,
+        children: &[u64],
+        loc: SrcSpan,
+        type_id: Option<u64>,
+        extras: Vec<Value>,
+    ) -> AstNode {
+        AstNode {
+            tag,
+            children: children.iter().cloned().map(Some).collect(),
+            loc,
+            type_id,
+            rvalue: LRValue::LValue,
+            macro_expansions: vec![],
+            macro_expansion_text: None,
+            extras,
+        }
+    }
+
+    fn text(s: &str) -> Value {
+        Value::Text(s.to_string())
+    }
+
+    /// A unit that includes `common.h`, which declares `struct point` and
+    /// the typedef `cint`, and defines `f`. `first` is the first AST node
+    /// ID, so that units number their nodes differently. The unit has two
+    /// IDs for `int`, and `cint` and a pointer type are built from the
+    /// second.
+    fn unit(path: &str, first: u64) -> AstContext {
+        let files = vec![
+            SrcFile {
+                path: Some(PathBuf::from(path)),
+                include_loc: None,
+            },
+            SrcFile {
+                path: Some(PathBuf::from("common.h")),
+                include_loc: Some(SrcLoc {
+                    fileid: 0,
+                    line: 1,
+                    column: 1,
+                }),
+            },
+        ];
+        let (point, x, y) = (first, first + 1, first + 2);
+        let (cint, f, body) = (first + 3, first + 4, first + 5);
+
+        let mut type_nodes = NodeTable::new(TypeNode::ID_SHIFT);
+        let types = vec![
+            (8, TagInt, vec![]),
+            (16, TagStructType, vec![int(point)]),
+            (24, TagPointer, vec![int(16)]),
+            (32, TagInt, vec![]),
+            (40, TagTypedefType, vec![int(cint)]),
+            (48, TagFunctionType, vec![Value::Array(vec![int(8), int(24)])]),
+            (56, TagPointer, vec![int(32)]),
+        ];
+        for (id, tag, extras) in types {
+            type_nodes.insert(id, TypeNode { tag, extras });
+        }
+
+        let mut ast_nodes = NodeTable::new(0);
+        let const_int = Some(32 | TypeNode::CONST_MASK);
+        let nodes = vec![
+            (
+                point,
+                node(
+                    TagStructDecl,
+                    &[x, y],
+                    span(1, 2),
+                    None,
+                    vec![text("point"), Value::Bool(true)],
+                ),
+            ),
+            (x, node(TagFieldDecl, &[], span(1, 3), Some(8), vec![text("x")])),
+            (y, node(TagFieldDecl, &[], span(1, 4), Some(8), vec![text("y")])),
+            (cint, node(TagTypedefDecl, &[], span(1, 6), const_int, vec![text("cint")])),
+            (
+                f,
+                node(
+                    TagFunctionDecl,
+                    &[body],
+                    span(0, 3),
+                    Some(48),
+                    vec![text("f"), Value::Bool(true)],
+                ),
+            ),
+            (body, node(TagCompoundStmt, &[], span(0, 4), None, vec![])),
+        ];
+        for (id, node) in nodes {
+            ast_nodes.insert(id, node);
+        }
+
+        AstContext {
+            ast_nodes,
+            type_nodes,
+            top_nodes: vec![point, cint, f],
+            comments: vec![CommentNode {
+                loc: SrcLoc {
+                    fileid: 0,
+                    line: 2,
+                    column: 1,
+                },
+                string: "// f".to_string(),
+            }],
+            files,
+            va_list_kind: BuiltinVaListKind::CharPtrBuiltinVaList,
+        }
+    }
+
+    #[test]
+    fn units_round_trip() {
+        let paths = ["b.c", "a.c"];
+        let units = vec![unit(paths[0], 10), unit(paths[1], 1)];
+        let mut project = ProjectAst::new();
+        for (path, context) in paths.iter().zip(&units) {
+            project.add_unit(Path::new(path), context);
+        }
+        // The struct is shared; the typedef refers to the second ID for
+        // `int`, so it is not
+        assert_eq!(project.shared_decl_count(), 1);
+
+        let mut file = vec![];
+        project.write_to(&mut file).unwrap();
+        let project = ProjectAst::read_from(&file[..]).unwrap();
+        assert_eq!(project.unit_count(), 2);
+        for (i, context) in units.iter().enumerate() {
+            assert_eq!(project.unit_context(i).unwrap(), *context);
+        }
+        // Both define `f`, and it is recorded for the first path
+        assert_eq!(project.symbols().get("f"), Some(&1));
+        assert_eq!(project.unit_path(1), Path::new(paths[1]));
+    }
+}
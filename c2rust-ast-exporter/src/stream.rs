@@ -0,0 +1,157 @@
+//! Decoder for the items `ast_exporter_stream` passes to its callback (see
+//! AstExporter.cpp), fed chunk by chunk while the exporter is still encoding
+//! the rest of the translation unit.
+
+use clang_ast::*;
+use serde_cbor::Deserializer;
+use std::collections::VecDeque;
+use std::io::{self, Error, ErrorKind};
+use std::mem;
+
+fn invalid_data<E: ToString>(error: E) -> Error {
+    Error::new(ErrorKind::InvalidData, error.to_string())
+}
+
+/// Where the decoder is in the stream
+enum State {
+    /// Expecting the header
+    Header,
+    /// Expecting strings, entries or the end of the entries
+    Entries,
+    /// Expecting the tail of the export
+    Tail,
+    Done(AstContext),
+}
+
+pub(crate) struct StreamDecoder {
+    state: State,
+    offsets: bool,
+    strings: Vec<String>,
+    asts: NodeTable<AstNode>,
+    types: NodeTable<TypeNode>,
+    /// The raw spans of the AST nodes if positions are offsets. They are
+    /// only converted to lines and columns at the end of the stream, which
+    /// is where the offsets the lines of each file start at are.
+    offset_spans: Vec<(u64, [u64; 3])>,
+}
+
+impl StreamDecoder {
+    pub fn new() -> Self {
+        StreamDecoder {
+            state: State::Header,
+            offsets: false,
+            strings: vec![],
+            asts: NodeTable::new(0),
+            types: NodeTable::new(TypeNode::ID_SHIFT),
+            offset_spans: vec![],
+        }
+    }
+
+    /// Decode the items in `chunk`
+    pub fn chunk(&mut self, chunk: &[u8]) -> io::Result<()> {
+        for item in Deserializer::from_slice(chunk).into_iter::<Value>() {
+            self.item(item.map_err(invalid_data)?)?;
+        }
+        Ok(())
+    }
+
+    fn item(&mut self, item: Value) -> io::Result<()> {
+        match self.state {
+            State::Header => {
+                let (offsets,): (bool,) = from_value(item).map_err(invalid_data)?;
+                self.offsets = offsets;
+                self.state = State::Entries;
+            }
+            State::Entries => match item {
+                Value::Text(string) => self.strings.push(string),
+                Value::Array(entry) => self.entry(entry.into())?,
+                Value::Null => self.state = State::Tail,
+                _ => return Err(invalid_data("Unexpected item in AST stream")),
+            },
+            State::Tail => {
+                let context = self.tail(item)?;
+                self.state = State::Done(context);
+            }
+            State::Done(_) => return Err(invalid_data("Trailing items in AST stream")),
+        }
+        Ok(())
+    }
+
+    fn entry(&mut self, entry: VecDeque<Value>) -> io::Result<()> {
+        if !self.offsets {
+            return import_entry(
+                entry,
+                |entry| Positions::Lines.pop_span(entry),
+                &self.strings,
+                &mut self.asts,
+                &mut self.types,
+            );
+        }
+
+        // Keep the offsets and fill in the span later
+        let id = match entry.front() {
+            Some(&Value::Integer(id)) => id as u64,
+            _ => 0,
+        };
+        let mut span = None;
+        import_entry(
+            entry,
+            |entry| {
+                let mut values = [0; 3];
+                Positions::pop_values(entry, &mut values)?;
+                span = Some(values);
+                Ok(SrcSpan {
+                    fileid: values[0],
+                    begin_line: 0,
+                    begin_column: 0,
+                    end_line: 0,
+                    end_column: 0,
+                })
+            },
+            &self.strings,
+            &mut self.asts,
+            &mut self.types,
+        )?;
+        if let Some(span) = span {
+            self.offset_spans.push((id, span));
+        }
+        Ok(())
+    }
+
+    fn tail(&mut self, tail: Value) -> io::Result<AstContext> {
+        let (top_nodes, files, raw_comments, va_list_kind): (
+            Vec<u64>,
+            Vec<VecDeque<Value>>,
+            Vec<VecDeque<Value>>,
+            u64,
+        ) = from_value(tail).map_err(invalid_data)?;
+
+        let (positions, files) = import_files(files, self.offsets)?;
+        let comments = import_comments(raw_comments, &positions, &files)?;
+
+        let mut ast_nodes = mem::replace(&mut self.asts, NodeTable::new(0));
+        for &(id, ref span) in &self.offset_spans {
+            if let Some(node) = ast_nodes.get_mut(id) {
+                positions.check_file(span[0])?;
+                node.loc = positions.span(span);
+            }
+        }
+
+        Ok(AstContext {
+            ast_nodes,
+            type_nodes: mem::replace(&mut self.types, NodeTable::new(TypeNode::ID_SHIFT)),
+            top_nodes,
+            comments,
+            files,
+            va_list_kind: import_va_list_kind(va_list_kind),
+        })
+    }
+
+    /// The decoded AST, once the whole stream has been decoded
+    pub fn finish(self) -> io::Result<AstContext> {
+        match self.state {
+            State::Done(context) => Ok(context),
+            _ => Err(invalid_data("Truncated AST stream")),
+        }
+    }
+}
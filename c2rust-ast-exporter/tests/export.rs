@@ -0,0 +1,1035 @@
+extern crate c2rust_ast_exporter;
+extern crate serde_cbor;
+extern crate zstd;
+
+use c2rust_ast_exporter::clang_ast::{schema, ASTEntryTag, AstContext, SrcSpan};
+use c2rust_ast_exporter::{get_clang_major_version, read_untyped_ast, ExportRoot, ExportSession};
+use serde_cbor::Value;
+use std::collections::HashSet;
+use std::env;
+use std::fs;
+use std::io::ErrorKind;
+use std::path::{Path, PathBuf};
+use std::process;
+use std::sync::Arc;
+use std::thread;
+
+/// A directory of C sources under the system temporary directory, removed
+/// when dropped
+struct Sources {
+    dir: PathBuf,
+}
+
+impl Sources {
+    fn new(name: &str) -> Sources {
+        let dir = env::temp_dir().join(format!("c2rust-ast-exporter-{}-{}", name, process::id()));
+        let _ = fs::remove_dir_all(&dir);
+        fs::create_dir_all(&dir).unwrap();
+        Sources { dir }
+    }
+
+    fn add(&self, name: &str, contents: &str) -> PathBuf {
+        let path = self.dir.join(name);
+        fs::write(&path, contents).unwrap();
+        path
+    }
+}
+
+impl Drop for Sources {
+    fn drop(&mut self) {
+        let _ = fs::remove_dir_all(&self.dir);
+    }
+}
+
+const COMMON_H: &str = r#"/* Shared by every file, so it ends up in a preamble */
+#define SQUARE(x) ((x) * (x))
+
+struct pair {
+    int a, b;
+};
+
+static inline int square_sum(struct pair p) {
+    return SQUARE(p.a) + SQUARE(p.b);
+}
+"#;
+
+const FIRST_C: &str = r#"#include "common.h"
+
+int first(void) {
+    struct pair p = { 1, 2 };
+    return square_sum(p);
+}
+"#;
+
+const SECOND_C: &str = r#"#include "common.h"
+
+/* Expands a macro defined in the preamble */
+int second(int x) {
+    struct pair p = { x, SQUARE(x) };
+    return square_sum(p);
+}
+"#;
+
+/// Export `SECOND_C` on its own, and again after `FIRST_C` in the same
+/// session, by which time the headers they share are precompiled
+fn export_with_and_without_preamble(configure: fn(&mut ExportSession)) -> (Vec<u8>, Vec<u8>) {
+    let sources = Sources::new("preamble");
+    sources.add("common.h", COMMON_H);
+    let first = sources.add("first.c", FIRST_C);
+    let second = sources.add("second.c", SECOND_C);
+
+    let mut fresh = ExportSession::without_database(&[]);
+    configure(&mut fresh);
+    let without = fresh.get_export_with_args(&second, &[], false).unwrap();
+
+    let mut shared = ExportSession::without_database(&[]);
+    configure(&mut shared);
+    shared.get_export_with_args(&first, &[], false).unwrap();
+    let with = shared.get_export_with_args(&second, &[], false).unwrap();
+
+    (without, with)
+}
+
+#[test]
+fn test_preamble_export_matches() {
+    let (without, with) = export_with_and_without_preamble(|_| ());
+    assert!(without == with, "export changed with a precompiled preamble");
+}
+
+#[test]
+fn test_preamble_export_matches_with_offsets() {
+    let (without, with) =
+        export_with_and_without_preamble(|session| session.set_offset_positions(true));
+    assert!(without == with, "export changed with a precompiled preamble");
+}
+
+fn export_cached(file: &Path, cache_dir: &Path) -> Vec<u8> {
+    let mut session = ExportSession::without_database(&[]);
+    session.set_cache(cache_dir, 1 << 20);
+    session.get_export_with_args(file, &[], false).unwrap()
+}
+
+#[test]
+fn test_export_cache() {
+    let sources = Sources::new("cache");
+    let file = sources.add("cached.c", "int cached(void) { return 1; }\n");
+    let cache_dir = sources.dir.join("cache");
+
+    let first = export_cached(&file, &cache_dir);
+    assert!(fs::read_dir(&cache_dir).unwrap().next().is_some(), "nothing was cached");
+    assert!(export_cached(&file, &cache_dir) == first, "the cached export differs");
+
+    sources.add("cached.c", "int cached(void) { return 2; }\n");
+    assert!(export_cached(&file, &cache_dir) != first, "a stale export was used");
+}
+
+#[test]
+fn test_export_cache_sees_headers() {
+    let sources = Sources::new("cache-headers");
+    sources.add("value.h", "#define VALUE 1\n");
+    let file = sources.add(
+        "cached.c",
+        "#include \"value.h\"\nint cached(void) { return VALUE; }\n",
+    );
+    let cache_dir = sources.dir.join("cache");
+
+    let first = export_cached(&file, &cache_dir);
+    assert!(export_cached(&file, &cache_dir) == first, "the cached export differs");
+
+    // Only the header changes, which the cache must notice from the files
+    // recorded by the first export
+    sources.add("value.h", "#define VALUE 2\n");
+    assert!(export_cached(&file, &cache_dir) != first, "a stale export was used");
+}
+
+#[test]
+fn test_malformed_export_is_an_error() {
+    let sources = Sources::new("malformed");
+    // An AST node entry that ends after its ID
+    let entry = Value::Array(vec![Value::Integer(1)]);
+    let items = Value::Array(vec![
+        Value::Array(vec![entry]),
+        Value::Array(vec![]),
+        Value::Array(vec![]),
+        Value::Array(vec![]),
+        Value::Integer(0),
+        Value::Array(vec![]),
+        Value::Bool(false),
+    ]);
+    let path = sources.dir.join("malformed.cbor");
+    fs::write(&path, serde_cbor::to_vec(&items).unwrap()).unwrap();
+    match read_untyped_ast(&path) {
+        Err(e) => assert_eq!(e.kind(), ErrorKind::InvalidData),
+        Ok(_) => panic!("a malformed export was read"),
+    }
+
+    fs::write(&path, b"\x9f\x01").unwrap();
+    match read_untyped_ast(&path) {
+        Err(e) => assert_eq!(e.kind(), ErrorKind::InvalidData),
+        Ok(_) => panic!("a truncated export was read"),
+    }
+}
+
+const COMMENTS_C: &str = "int zero = 0;\n// Adds one\nint add_one(int x) { return x + 1; }\n";
+
+#[test]
+fn test_comments_follow_their_files() {
+    let sources = Sources::new("comments");
+    let file = sources.add("comments.c", COMMENTS_C);
+    let cache_dir = sources.dir.join("cache");
+    // The comments of `export`, read back like an export written by the
+    // exporter binary or plugin
+    let read = |export: &[u8]| -> Vec<String> {
+        let path = sources.dir.join("comments.cbor");
+        fs::write(&path, export).unwrap();
+        let context = c2rust_ast_exporter::read_untyped_ast(&path).unwrap();
+        context.comments.into_iter().map(|comment| comment.string).collect()
+    };
+
+    let export = export_cached(&file, &cache_dir);
+    assert_eq!(read(&export), vec!["// Adds one"]);
+
+    // Trailing whitespace moves the comment without changing its line or
+    // column, so the cached export must not be used
+    sources.add("comments.c", &COMMENTS_C.replace(";\n", ";  \n"));
+    assert_eq!(read(&export_cached(&file, &cache_dir)), vec!["// Adds one"]);
+
+    // The comment changed since `export`, so it is left out rather than
+    // read from the wrong place
+    sources.add("comments.c", &COMMENTS_C.replace("one", "two"));
+    assert!(read(&export).is_empty(), "a stale comment was read");
+}
+
+/// The span of the top-level declaration named `name`
+fn top_decl_span(context: &AstContext, name: &str) -> SrcSpan {
+    let name = Value::Text(name.to_owned());
+    context
+        .top_nodes
+        .iter()
+        .filter_map(|id| context.ast_nodes.get(id))
+        .find(|node| node.extras.first() == Some(&name))
+        .expect("declaration not found")
+        .loc
+}
+
+/// The number of files named `name` in `context`
+fn count_files(context: &AstContext, name: &str) -> usize {
+    context
+        .files
+        .iter()
+        .filter(|file| file.path.as_ref().map_or(false, |path| path.ends_with(name)))
+        .count()
+}
+
+/// A header without include guards, included twice
+const DECL_H: &str = "int NAME = 1;\n";
+
+const INCLUDES_C: &str = r#"#define NAME first
+#include "decl.h"
+#undef NAME
+#define NAME second
+#include "decl.h"
+"#;
+
+#[test]
+fn test_offset_positions() {
+    let sources = Sources::new("offsets");
+    sources.add("decl.h", DECL_H);
+    let file = sources.add("includes.c", INCLUDES_C);
+
+    let lines = ExportSession::without_database(&[])
+        .get_untyped_ast_with_args(&file, &[], false)
+        .unwrap();
+    let mut session = ExportSession::without_database(&[]);
+    session.set_offset_positions(true);
+    let offsets = session.get_untyped_ast_with_args(&file, &[], false).unwrap();
+
+    for name in &["first", "second"] {
+        let expected = top_decl_span(&lines, name);
+        let actual = top_decl_span(&offsets, name);
+        assert_eq!(
+            (expected.begin_line, expected.begin_column),
+            (actual.begin_line, actual.begin_column)
+        );
+        assert_eq!(
+            (expected.end_line, expected.end_column),
+            (actual.end_line, actual.end_column)
+        );
+        assert_eq!(
+            lines.files[expected.fileid as usize].path,
+            offsets.files[actual.fileid as usize].path
+        );
+    }
+
+    // Only offset positions export a header included several times once
+    assert_eq!(count_files(&lines, "decl.h"), 2);
+    assert_eq!(count_files(&offsets, "decl.h"), 1);
+}
+
+const COLUMNAR_C: &str = r#"/* Compared between the CBOR and columnar formats */
+#define SCALE 2.5
+
+struct point {
+    int x, y;
+};
+
+static const char *name = "point";
+
+double scaled(struct point p) {
+    // Expanded from a macro
+    return SCALE * (p.x + p.y);
+}
+"#;
+
+#[test]
+fn test_columnar_matches_cbor() {
+    let sources = Sources::new("columnar");
+    let file = sources.add("columnar.c", COLUMNAR_C);
+
+    for &offsets in &[false, true] {
+        let export = |columnar| {
+            let mut session = ExportSession::without_database(&[]);
+            session.set_offset_positions(offsets);
+            session.set_columnar(columnar);
+            session.get_untyped_ast_with_args(&file, &[], false).unwrap()
+        };
+        assert!(export(false) == export(true), "the formats decode differently");
+    }
+}
+
+#[test]
+fn test_stream_matches_export() {
+    let sources = Sources::new("stream");
+    let file = sources.add("stream.c", COLUMNAR_C);
+    sources.add(
+        "compile_commands.json",
+        &format!(
+            r#"[{{"directory": {:?}, "file": "stream.c", "arguments": ["cc", "-c", "stream.c"]}}]"#,
+            sources.dir.to_str().unwrap()
+        ),
+    );
+
+    for &offsets in &[false, true] {
+        let mut session = ExportSession::new(&sources.dir, &[]).unwrap();
+        session.set_offset_positions(offsets);
+        let exported = session.get_untyped_ast(&file, false).unwrap();
+        let streamed = session.stream_untyped_ast(&file, false).unwrap();
+        assert!(exported == streamed, "the streamed AST differs");
+    }
+}
+
+const MACROS_H: &str = r#"#define ONE 1
+#define TWO (ONE + ONE)
+#define SQUARE(x) ((x) * (x))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define CLAMP(x, lo, hi) MAX(lo, MIN(x, hi))
+
+/* Expanded while building the preamble */
+static inline int square_two(void) {
+    return SQUARE(TWO);
+}
+"#;
+
+const MACROS_C: &str = r#"#include "macros.h"
+
+#define SCALE (TWO * SQUARE(TWO))
+#define FLAGS (1 << 3 | 1 << 5)
+#define ID(x) x
+
+static const int table[] = { ONE, TWO, SQUARE(3), SCALE, ID(FLAGS) };
+
+int clamp(int x) {
+    return CLAMP(x, ONE, SCALE);
+}
+
+int nested(int y) {
+    return SQUARE(MAX(y, TWO)) + ID(SQUARE(ONE)) + ID(y);
+}
+"#;
+
+#[test]
+fn test_macro_expansion_index_matches_lexing() {
+    let sources = Sources::new("macros");
+    sources.add("macros.h", MACROS_H);
+    let first = sources.add("first.c", "#include \"macros.h\"\nint first(void) { return TWO; }\n");
+    let file = sources.add("macros.c", MACROS_C);
+
+    // The export of `file` on its own, and with the preamble it shares with
+    // `first`, whose expansions are found by lexing either way
+    let export = |index| {
+        let mut fresh = ExportSession::without_database(&[]);
+        fresh.set_macro_expansion_index(index);
+        let alone = fresh.get_untyped_ast_with_args(&file, &[], false).unwrap();
+
+        let mut shared = ExportSession::without_database(&[]);
+        shared.set_macro_expansion_index(index);
+        shared.get_untyped_ast_with_args(&first, &[], false).unwrap();
+        let with_preamble = shared.get_untyped_ast_with_args(&file, &[], false).unwrap();
+        (alone, with_preamble)
+    };
+
+    let (indexed, indexed_preamble) = export(true);
+    let (lexed, lexed_preamble) = export(false);
+    let expanded = indexed
+        .ast_nodes
+        .values()
+        .filter(|node| !node.macro_expansions.is_empty())
+        .count();
+    assert!(expanded > 0, "no expression was expanded from a macro");
+    assert!(indexed == lexed, "the index finds other expansions");
+    assert!(indexed_preamble == lexed_preamble, "the index finds other expansions");
+}
+
+/// `value` with its integers, and those of any arrays in it, replaced by null
+fn erase_integers(value: &Value) -> Value {
+    match *value {
+        Value::Integer(_) => Value::Null,
+        Value::Array(ref values) => Value::Array(values.iter().map(erase_integers).collect()),
+        ref value => value.clone(),
+    }
+}
+
+/// A description of an exported AST that does not depend on how the exporter
+/// numbered its nodes, types and files, for comparing exports that number
+/// them differently. Integers in extras may be IDs, so they are left out,
+/// except for those of fields, which are their sizes and offsets.
+fn describe(context: &AstContext) -> Vec<String> {
+    let path = |fileid: u64| &context.files[fileid as usize].path;
+    let span = |loc: &SrcSpan| {
+        format!(
+            "{:?} {}:{}-{}:{}",
+            path(loc.fileid),
+            loc.begin_line,
+            loc.begin_column,
+            loc.end_line,
+            loc.end_column
+        )
+    };
+
+    // Top-level declarations in order
+    let mut description: Vec<String> = context
+        .top_nodes
+        .iter()
+        .map(|id| {
+            let node = context.ast_nodes.get(id).unwrap();
+            format!("top {:?} {}", node.tag, span(&node.loc))
+        })
+        .collect();
+
+    let mut nodes: Vec<String> = context
+        .ast_nodes
+        .values()
+        .map(|node| {
+            let extras: Vec<Value> = if node.tag == ASTEntryTag::TagFieldDecl {
+                node.extras.clone()
+            } else {
+                node.extras.iter().map(erase_integers).collect()
+            };
+            let children: Vec<bool> = node.children.iter().map(Option::is_some).collect();
+            format!(
+                "node {:?} {} {:?} {:?} {} {:?} {:?}",
+                node.tag,
+                span(&node.loc),
+                node.rvalue,
+                children,
+                node.type_id.is_some(),
+                node.macro_expansion_text,
+                extras
+            )
+        })
+        .collect();
+    nodes.sort();
+
+    let mut types: Vec<String> = context
+        .type_nodes
+        .values()
+        .map(|ty| {
+            let extras: Vec<Value> = ty.extras.iter().map(erase_integers).collect();
+            format!("type {:?} {:?}", ty.tag, extras)
+        })
+        .collect();
+    types.sort();
+
+    description.extend(nodes);
+    description.extend(types);
+    description.extend(context.comments.iter().map(|comment| {
+        format!(
+            "comment {:?} {}:{} {:?}",
+            path(comment.loc.fileid),
+            comment.loc.line,
+            comment.loc.column,
+            comment.string
+        )
+    }));
+    description
+}
+
+const PARALLEL_C: &str = r#"/* Declarations for the encoding threads to share out */
+struct flags {
+    unsigned ready : 1;
+    unsigned mode : 3;
+    int value;
+};
+
+typedef struct flags flags_t;
+
+enum level { LOW, HIGH };
+
+static int count;
+
+int get_mode(const flags_t *f) {
+    return f->mode;
+}
+
+void set_ready(flags_t *f, enum level l) {
+    f->ready = l == HIGH;
+    count++;
+}
+
+unsigned total(flags_t *fs, unsigned n) {
+    unsigned sum = 0;
+    for (unsigned i = 0; i < n; i++)
+        sum += fs[i].value + get_mode(&fs[i]);
+    return sum;
+}
+"#;
+
+#[test]
+fn test_parallel_matches_serial() {
+    let sources = Sources::new("parallel");
+    let file = sources.add("parallel.c", PARALLEL_C);
+
+    let export = |threads| {
+        let mut session = ExportSession::without_database(&[]);
+        session.set_encode_threads(threads);
+        session.get_untyped_ast_with_args(&file, &[], false).unwrap()
+    };
+    let serial = describe(&export(1));
+    for &threads in &[2, 4] {
+        assert_eq!(serial, describe(&export(threads)));
+    }
+}
+
+const SCHEMA_C: &str = r#"/* Has a node of each kind ast_schema.def describes */
+struct point {
+    int x, y;
+};
+
+int first(int *values, int n) {
+    int i = 0;
+    for (;;) {
+        if (i >= n)
+            break;
+        else if (values[i] < 0) {
+            i++;
+            continue;
+        }
+        goto found;
+    }
+    while (i < n)
+        i++;
+    do {
+        ;
+    } while (0);
+found:
+    switch (i) {
+    default:
+        return (values[i]);
+    }
+    return ((struct point){1, 2}).x;
+}
+"#;
+
+#[test]
+fn test_schema_nodes_decode() {
+    let sources = Sources::new("schema");
+    let file = sources.add("schema.c", SCHEMA_C);
+
+    for &columnar in &[false, true] {
+        let mut session = ExportSession::without_database(&[]);
+        session.set_columnar(columnar);
+        let context = session.get_untyped_ast_with_args(&file, &[], false).unwrap();
+
+        let mut tags = HashSet::new();
+        for node in context.ast_nodes.values() {
+            if let Some(matches) = schema::matches_schema(node) {
+                assert!(matches, "{:?} does not match the schema", node);
+                tags.insert(node.tag);
+            }
+        }
+        // All 14 kinds of nodes ast_schema.def describes
+        assert_eq!(tags.len(), 14);
+    }
+}
+
+/// A source file with `count` functions, each calling the one before it
+fn many_functions(count: usize) -> String {
+    let mut source = String::from("int f0(int x) { return x; }\n");
+    for i in 1..count {
+        source.push_str(&format!(
+            "int f{}(int x) {{ return f{}(x * {} + 1) - x; }}\n",
+            i,
+            i - 1,
+            i
+        ));
+    }
+    source
+}
+
+#[test]
+fn test_segmented_export_decodes_like_contiguous() {
+    let sources = Sources::new("segments");
+    let file = sources.add("segments.c", &many_functions(8000));
+
+    let session = ExportSession::without_database(&[]);
+    let bytes = session.get_export_with_args(&file, &[], false).unwrap();
+    // Larger than one segment of the exporter's output buffer
+    assert!(bytes.len() > 1 << 20, "the export fits in one segment");
+
+    // Decoded in place from the exporter's segments, and from one copy of
+    // them as written by the exporter binary
+    let segmented = session.get_untyped_ast_with_args(&file, &[], false).unwrap();
+    let copy = sources.dir.join("segments.cbor");
+    fs::write(&copy, &bytes).unwrap();
+    assert!(read_untyped_ast(&copy).unwrap() == segmented, "the segments decode differently");
+}
+
+#[test]
+fn test_concurrent_exports_match_serial() {
+    let sources = Sources::new("concurrent");
+    sources.add("common.h", COMMON_H);
+    let files = vec![
+        sources.add("first.c", FIRST_C),
+        sources.add("second.c", SECOND_C),
+        sources.add("columnar.c", COLUMNAR_C),
+        sources.add("parallel.c", PARALLEL_C),
+    ];
+
+    let serial: Vec<Vec<String>> = files
+        .iter()
+        .map(|file| {
+            let session = ExportSession::without_database(&[]);
+            describe(&session.get_untyped_ast_with_args(file, &[], false).unwrap())
+        })
+        .collect();
+
+    // Each file exported twice at once through the same session
+    let session = Arc::new(ExportSession::without_database(&[]));
+    let threads: Vec<_> = files
+        .iter()
+        .chain(files.iter())
+        .map(|file| {
+            let session = session.clone();
+            let file = file.clone();
+            thread::spawn(move || {
+                describe(&session.get_untyped_ast_with_args(&file, &[], false).unwrap())
+            })
+        })
+        .collect();
+    for (i, thread) in threads.into_iter().enumerate() {
+        assert_eq!(serial[i % files.len()], thread.join().unwrap());
+    }
+}
+
+const REACHABLE_C: &str = r#"/* Declarations used, directly or not, by `entry`, and others */
+struct used_type {
+    int a;
+};
+
+struct unused_type {
+    int b;
+};
+
+static int helper(struct used_type t) {
+    return t.a;
+}
+
+static int unused_helper(void) {
+    return 0;
+}
+
+int entry(void) {
+    struct used_type t = { 1 };
+    return helper(t);
+}
+"#;
+
+/// The names of the top-level declarations of `context`
+fn top_decl_names(context: &AstContext) -> HashSet<String> {
+    context
+        .top_nodes
+        .iter()
+        .filter_map(|id| context.ast_nodes.get(id))
+        .filter_map(|node| match node.extras.first() {
+            Some(Value::Text(name)) => Some(name.clone()),
+            _ => None,
+        })
+        .collect()
+}
+
+/// Check which of the declarations in `REACHABLE_C` `context` has
+fn assert_exported(context: &AstContext, exported: &[&str], left_out: &[&str]) {
+    let names = top_decl_names(context);
+    for name in exported {
+        assert!(names.contains(*name), "{} was not exported", name);
+    }
+    for name in left_out {
+        assert!(!names.contains(*name), "{} was exported", name);
+    }
+}
+
+#[test]
+fn test_prune_unused_decls() {
+    let sources = Sources::new("prune");
+    let file = sources.add("prune.c", REACHABLE_C);
+
+    let mut session = ExportSession::without_database(&[]);
+    let all = session.get_untyped_ast_with_args(&file, &[], false).unwrap();
+    assert_exported(
+        &all,
+        &["entry", "helper", "used_type", "unused_helper", "unused_type"],
+        &[],
+    );
+
+    session.set_prune_unused_decls(true);
+    let pruned = session.get_untyped_ast_with_args(&file, &[], false).unwrap();
+    assert_exported(
+        &pruned,
+        &["entry", "helper", "used_type"],
+        &["unused_helper", "unused_type"],
+    );
+}
+
+#[test]
+fn test_decls_only() {
+    let sources = Sources::new("decls-only");
+    let file = sources.add("decls_only.c", REACHABLE_C);
+
+    for &decls_only in &[false, true] {
+        let mut session = ExportSession::without_database(&[]);
+        session.set_decls_only(decls_only);
+        let context = session.get_untyped_ast_with_args(&file, &[], false).unwrap();
+        assert_exported(
+            &context,
+            &["entry", "helper", "used_type", "unused_helper", "unused_type"],
+            &[],
+        );
+
+        // Parameters and then the body, which is left out
+        let helper = context
+            .ast_nodes
+            .values()
+            .find(|node| {
+                node.tag == ASTEntryTag::TagFunctionDecl
+                    && node.extras.first() == Some(&Value::Text("helper".to_owned()))
+            })
+            .unwrap();
+        assert_eq!(helper.children.len(), 2);
+        assert!(helper.children[0].is_some(), "the parameter is missing");
+        assert_eq!(helper.children[1].is_none(), decls_only);
+
+        let returns = context
+            .ast_nodes
+            .values()
+            .filter(|node| node.tag == ASTEntryTag::TagReturnStmt)
+            .count();
+        assert_eq!(returns == 0, decls_only);
+    }
+}
+
+#[test]
+fn test_export_roots() {
+    let sources = Sources::new("roots");
+    let file = sources.add("roots.c", REACHABLE_C);
+
+    let export = |roots: &[ExportRoot]| {
+        let mut session = ExportSession::without_database(&[]);
+        session.set_export_roots(roots);
+        session.get_untyped_ast_with_args(&file, &[], false).unwrap()
+    };
+
+    assert_exported(
+        &export(&[ExportRoot::Name("helper".to_owned())]),
+        &["helper", "used_type"],
+        &["entry", "unused_helper", "unused_type"],
+    );
+    // The first line of `entry`
+    assert_exported(
+        &export(&[ExportRoot::Lines(file.clone(), 18, 18)]),
+        &["entry", "helper", "used_type"],
+        &["unused_helper", "unused_type"],
+    );
+    assert_exported(
+        &export(&[]),
+        &["entry", "helper", "used_type", "unused_helper", "unused_type"],
+        &[],
+    );
+}
+
+#[test]
+fn test_command_line_roots_do_not_accumulate() {
+    let sources = Sources::new("command-line-roots");
+    let file = sources.add("roots.c", REACHABLE_C);
+    let file = file.to_str().unwrap();
+
+    let only_helper = ["ast-exporter", "--only-decl=helper", file, "--"];
+    assert_exported(
+        &c2rust_ast_exporter::stream_untyped_ast(&only_helper, false).unwrap(),
+        &["helper", "used_type"],
+        &["entry", "unused_helper", "unused_type"],
+    );
+    // The root given by the previous command line no longer applies
+    let everything = ["ast-exporter", file, "--"];
+    assert_exported(
+        &c2rust_ast_exporter::stream_untyped_ast(&everything, false).unwrap(),
+        &["entry", "helper", "used_type", "unused_helper", "unused_type"],
+        &[],
+    );
+}
+
+/// The program at the path in the environment variable `var` or, if that is
+/// not set, the first of `names` on the `PATH`. Tests that need a program
+/// that cannot be found are skipped.
+fn find_program(var: &str, names: &[String]) -> Option<PathBuf> {
+    if let Some(path) = env::var_os(var) {
+        return Some(PathBuf::from(path));
+    }
+    let paths = env::var_os("PATH")?;
+    names
+        .iter()
+        .flat_map(|name| env::split_paths(&paths).map(move |dir| dir.join(name)))
+        .find(|path| path.is_file())
+}
+
+/// The clang in `$CLANG`, or the one on the `PATH` of the version the
+/// exporter is linked against
+fn find_clang() -> Option<PathBuf> {
+    let mut names = vec!["clang".to_owned()];
+    if let Some(major) = get_clang_major_version() {
+        names.insert(0, format!("clang-{}", major));
+    }
+    find_program("CLANG", &names)
+}
+
+/// The arguments the exporter passes to clang along with those of each file,
+/// for building the same AST as it does with another tool
+const EXPORTER_CLANG_ARGS: &[&str] = &[
+    "-fparse-all-comments",
+    "-Wwrite-strings",
+    "-D_FORTIFY_SOURCE=0",
+    "-DC2RUST=1",
+];
+
+/// The lines of `describe(context)` about the file named `name`
+fn describe_file(context: &AstContext, name: &str) -> Vec<String> {
+    describe(context)
+        .into_iter()
+        .filter(|line| line.contains(name))
+        .collect()
+}
+
+#[test]
+fn test_ast_file_matches_source() {
+    let clang = match find_clang() {
+        Some(clang) => clang,
+        None => {
+            eprintln!("skipped: clang not found, set CLANG");
+            return;
+        }
+    };
+    let sources = Sources::new("ast-file");
+    let file = sources.add("ast_file.c", COLUMNAR_C);
+    let ast = sources.dir.join("ast_file.ast");
+
+    let status = process::Command::new(&clang)
+        .args(EXPORTER_CLANG_ARGS)
+        .arg("-emit-ast")
+        .arg("-o")
+        .arg(&ast)
+        .arg(&file)
+        .status()
+        .unwrap();
+    assert!(status.success(), "{} -emit-ast failed", clang.display());
+
+    let session = ExportSession::without_database(&[]);
+    let parsed = session.get_untyped_ast_with_args(&file, &[], false).unwrap();
+    let loaded = session.get_untyped_ast_from_ast_file(&ast, false).unwrap();
+    assert_eq!(
+        describe_file(&parsed, "ast_file.c"),
+        describe_file(&loaded, "ast_file.c")
+    );
+}
+
+#[test]
+fn test_plugin_matches_export() {
+    let (clang, plugin) = match (find_clang(), find_program("C2RUST_AST_EXPORTER_PLUGIN", &[])) {
+        (Some(clang), Some(plugin)) => (clang, plugin),
+        _ => {
+            eprintln!("skipped: set CLANG and C2RUST_AST_EXPORTER_PLUGIN");
+            return;
+        }
+    };
+    let sources = Sources::new("plugin");
+    let file = sources.add("plugin.c", COLUMNAR_C);
+    let object = sources.dir.join("plugin.o");
+
+    // Built as the wrapper builds a project, writing plugin.o.cbor
+    let status = process::Command::new("sh")
+        .arg(Path::new(env!("CARGO_MANIFEST_DIR")).join("cc_wrapper.sh"))
+        .arg(&clang)
+        .arg(&plugin)
+        .args(EXPORTER_CLANG_ARGS)
+        .arg("-c")
+        .arg(&file)
+        .arg("-o")
+        .arg(&object)
+        .env_remove("C2RUST_PLUGIN_ARGS")
+        .status()
+        .unwrap();
+    assert!(status.success(), "building with the plugin failed");
+
+    let exported = ExportSession::without_database(&[])
+        .get_untyped_ast_with_args(&file, &[], false)
+        .unwrap();
+    let built = read_untyped_ast(&sources.dir.join("plugin.o.cbor")).unwrap();
+    assert_eq!(
+        describe_file(&exported, "plugin.c"),
+        describe_file(&built, "plugin.c")
+    );
+}
+
+/// The number of entries of each tag in a list of the stats report
+fn tag_counts(report: &str) -> Vec<(u32, usize)> {
+    let number = |line: &str, key: &str| -> usize {
+        let start = line.find(key).unwrap() + key.len();
+        let digits = line[start..].trim_start();
+        let end = digits.find(|c: char| !c.is_ascii_digit()).unwrap();
+        digits[..end].parse().unwrap()
+    };
+    report
+        .lines()
+        .filter(|line| line.contains("\"tag\":"))
+        .map(|line| (number(line, "\"tag\":") as u32, number(line, "\"count\":")))
+        .collect()
+}
+
+#[test]
+fn test_export_stats() {
+    let sources = Sources::new("stats");
+    let file = sources.add("stats.c", COLUMNAR_C);
+
+    let mut session = ExportSession::without_database(&[]);
+    session.set_export_stats(true, true);
+    let bytes = session.get_export_with_args(&file, &[], false).unwrap();
+    let context = session.get_untyped_ast_with_args(&file, &[], false).unwrap();
+
+    let report = fs::read_to_string(format!("{}.export-stats.json", file.display())).unwrap();
+    assert!(report.contains(&format!("\"bytes\": {},", bytes.len())));
+    let trace = fs::read_to_string(format!("{}.export-trace.json", file.display())).unwrap();
+    assert!(trace.contains("\"traceEvents\""));
+
+    // The entries and types encoded of each tag are those decoded
+    let types_start = report.find("\"types\":").unwrap();
+    for &(tag, count) in &tag_counts(&report[..types_start]) {
+        let decoded = context
+            .ast_nodes
+            .values()
+            .filter(|node| node.tag as u32 == tag)
+            .count();
+        assert_eq!(count, decoded, "entries of tag {}", tag);
+    }
+    for &(tag, count) in &tag_counts(&report[types_start..]) {
+        let decoded = context
+            .type_nodes
+            .values()
+            .filter(|ty| ty.tag as u32 == tag)
+            .count();
+        assert_eq!(count, decoded, "types of tag {}", tag);
+    }
+    let counted: usize = tag_counts(&report).iter().map(|&(_, count)| count).sum();
+    let decoded = context.ast_nodes.values().count() + context.type_nodes.values().count();
+    assert_eq!(counted, decoded);
+}
+
+#[test]
+fn test_compressed_export() {
+    let sources = Sources::new("compress");
+    let file = sources.add("compress.c", COLUMNAR_C);
+
+    for &columnar in &[false, true] {
+        let mut session = ExportSession::without_database(&[]);
+        session.set_columnar(columnar);
+        let bytes = session.get_export_with_args(&file, &[], false).unwrap();
+        let context = session.get_untyped_ast_with_args(&file, &[], false).unwrap();
+
+        let compressed = sources.dir.join("compress.zst");
+        fs::write(&compressed, zstd::stream::encode_all(&bytes[..], 3).unwrap()).unwrap();
+        assert!(read_untyped_ast(&compressed).unwrap() == context, "decompressed differently");
+    }
+
+    // Written by the exporter binary, which compresses the export as it
+    // writes it out
+    let exporter = match find_program("C2RUST_AST_EXPORTER", &[]) {
+        Some(exporter) => exporter,
+        None => {
+            eprintln!("skipped: set C2RUST_AST_EXPORTER to test the exporter binary");
+            return;
+        }
+    };
+    let status = process::Command::new(&exporter)
+        .arg("--compress=zstd")
+        .arg(&file)
+        .arg("--")
+        .status()
+        .unwrap();
+    assert!(status.success(), "{} failed", exporter.display());
+
+    let output = fs::canonicalize(&file).unwrap().with_extension("c.cbor.zst");
+    assert!(fs::read(&output).unwrap().starts_with(&[0x28, 0xb5, 0x2f, 0xfd]));
+    let exported = ExportSession::without_database(&[])
+        .get_untyped_ast_with_args(&file, &[], false)
+        .unwrap();
+    assert_eq!(describe(&exported), describe(&read_untyped_ast(&output).unwrap()));
+}
+
+const VIRTUAL_H: &str = "struct shape {\n    int sides;\n};\n";
+
+const VIRTUAL_C: &str = r#"#include "virtual.h"
+
+// Counts the sides
+int sides(struct shape s) {
+    return s.sides;
+}
+"#;
+
+#[test]
+fn test_virtual_files() {
+    let sources = Sources::new("virtual");
+    let header = sources.dir.join("virtual.h");
+    let file = sources.dir.join("virtual.c");
+
+    // Neither file is on disk yet
+    let mut session = ExportSession::without_database(&[]);
+    session.add_virtual_file(&header, VIRTUAL_H.as_bytes());
+    session.add_virtual_file(&file, VIRTUAL_C.as_bytes());
+    let in_memory = session.get_untyped_ast_with_args(&file, &[], false).unwrap();
+    assert!(in_memory.comments.iter().any(|c| c.string == "// Counts the sides"));
+
+    sources.add("virtual.h", VIRTUAL_H);
+    sources.add("virtual.c", VIRTUAL_C);
+    let on_disk = ExportSession::without_database(&[])
+        .get_untyped_ast_with_args(&file, &[], false)
+        .unwrap();
+    assert_eq!(describe(&in_memory), describe(&on_disk));
+
+    // Virtual files hide those on disk until they are cleared
+    session.add_virtual_file(&file, b"int replaced;\n");
+    let replaced = session.get_untyped_ast_with_args(&file, &[], false).unwrap();
+    assert!(top_decl_names(&replaced).contains("replaced"));
+    assert!(!top_decl_names(&replaced).contains("sides"));
+
+    session.clear_virtual_files();
+    let cleared = session.get_untyped_ast_with_args(&file, &[], false).unwrap();
+    assert_eq!(describe(&on_disk), describe(&cleared));
+}
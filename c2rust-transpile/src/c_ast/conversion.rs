@@ -1,4 +1,5 @@
 use crate::c_ast::*;
+use c2rust_ast_exporter::clang_ast::schema::*;
 use c2rust_ast_exporter::clang_ast::*;
 use failure::err_msg;
 use std::collections::HashMap;
@@ -324,9 +325,10 @@ impl ConversionContext {
     ///
     /// Returns the new ID that identifies this new node.
     fn visit_node_type(&mut self, node_id: ClangId, node_ty: NodeType) -> ImporterId {
-        // Type node IDs have extra information on them
+        // Type node IDs have extra information on them, and are numbered
+        // separately from AST nodes, so they are tagged to keep them apart
         let node_id = if node_ty & node_types::TYPE != 0 {
-            node_id & TypeNode::ID_MASK
+            (node_id & TypeNode::ID_MASK) | TypeNode::ID_TAG
         } else {
             node_id
         };
@@ -820,11 +822,13 @@ impl ConversionContext {
             match node.tag {
                 // Statements
                 ASTEntryTag::TagBreakStmt if expected_ty & OTHER_STMT != 0 => {
+                    BreakStmtNode::decode(node).expect("Malformed break statement");
                     self.add_stmt(new_id, located(node, CStmtKind::Break));
                     self.processed_nodes.insert(new_id, OTHER_STMT);
                 }
 
                 ASTEntryTag::TagContinueStmt if expected_ty & OTHER_STMT != 0 => {
+                    ContinueStmtNode::decode(node).expect("Malformed continue statement");
                     self.add_stmt(new_id, located(node, CStmtKind::Continue));
                     self.processed_nodes.insert(new_id, OTHER_STMT);
                 }
@@ -862,7 +866,9 @@ impl ConversionContext {
                 }
 
                 ASTEntryTag::TagReturnStmt if expected_ty & OTHER_STMT != 0 => {
-                    let return_expr_opt = node.children[0].map(|id| self.visit_expr(id));
+                    let ReturnStmtNode { value } =
+                        ReturnStmtNode::decode(node).expect("Malformed return statement");
+                    let return_expr_opt = value.map(|id| self.visit_expr(id));
 
                     let return_stmt = CStmtKind::Return(return_expr_opt);
 
@@ -871,15 +877,14 @@ impl ConversionContext {
                 }
 
                 ASTEntryTag::TagIfStmt if expected_ty & OTHER_STMT != 0 => {
-                    let scrutinee_old =
-                        node.children[0].expect("If condition expression not found");
-                    let scrutinee = self.visit_expr(scrutinee_old);
-
-                    let true_variant_old =
-                        node.children[1].expect("If then body statement not found");
-                    let true_variant = self.visit_stmt(true_variant_old);
-
-                    let false_variant = node.children[2].map(|id| self.visit_stmt(id));
+                    let IfStmtNode {
+                        scrutinee,
+                        true_variant,
+                        false_variant,
+                    } = IfStmtNode::decode(node).expect("Malformed if statement");
+                    let scrutinee = self.visit_expr(scrutinee);
+                    let true_variant = self.visit_stmt(true_variant);
+                    let false_variant = false_variant.map(|id| self.visit_stmt(id));
 
                     let if_stmt = CStmtKind::If {
                         scrutinee,
@@ -902,6 +907,7 @@ impl ConversionContext {
                 }
 
                 ASTEntryTag::TagNullStmt if expected_ty & OTHER_STMT != 0 => {
+                    NullStmtNode::decode(node).expect("Malformed null statement");
                     let null_stmt = CStmtKind::Empty;
 
                     self.add_stmt(new_id, located(node, null_stmt));
@@ -909,14 +915,16 @@ impl ConversionContext {
                 }
 
                 ASTEntryTag::TagForStmt if expected_ty & OTHER_STMT != 0 => {
-                    let init = node.children[0].map(|id| self.visit_stmt(id));
-
-                    let condition = node.children[1].map(|id| self.visit_expr(id));
-
-                    let increment = node.children[2].map(|id| self.visit_expr(id));
-
-                    let body_old = node.children[3].expect("For loop body not found");
-                    let body = self.visit_stmt(body_old);
+                    let ForStmtNode {
+                        init,
+                        condition,
+                        increment,
+                        body,
+                    } = ForStmtNode::decode(node).expect("Malformed for loop");
+                    let init = init.map(|id| self.visit_stmt(id));
+                    let condition = condition.map(|id| self.visit_expr(id));
+                    let increment = increment.map(|id| self.visit_expr(id));
+                    let body = self.visit_stmt(body);
 
                     let for_stmt = CStmtKind::ForLoop {
                         init,
@@ -930,11 +938,10 @@ impl ConversionContext {
                 }
 
                 ASTEntryTag::TagWhileStmt if expected_ty & OTHER_STMT != 0 => {
-                    let condition_old = node.children[0].expect("While loop condition not found");
-                    let condition = self.visit_expr(condition_old);
-
-                    let body_old = node.children[1].expect("While loop body not found");
-                    let body = self.visit_stmt(body_old);
+                    let WhileStmtNode { condition, body } =
+                        WhileStmtNode::decode(node).expect("Malformed while loop");
+                    let condition = self.visit_expr(condition);
+                    let body = self.visit_stmt(body);
 
                     let while_stmt = CStmtKind::While { condition, body };
 
@@ -943,11 +950,10 @@ impl ConversionContext {
                 }
 
                 ASTEntryTag::TagDoStmt if expected_ty & OTHER_STMT != 0 => {
-                    let body_old = node.children[0].expect("Do loop body not found");
-                    let body = self.visit_stmt(body_old);
-
-                    let condition_old = node.children[1].expect("Do loop condition not found");
-                    let condition = self.visit_expr(condition_old);
+                    let DoStmtNode { body, condition } =
+                        DoStmtNode::decode(node).expect("Malformed do loop");
+                    let body = self.visit_stmt(body);
+                    let condition = self.visit_expr(condition);
 
                     let do_stmt = CStmtKind::DoWhile { body, condition };
 
@@ -956,8 +962,9 @@ impl ConversionContext {
                 }
 
                 ASTEntryTag::TagLabelStmt if expected_ty & LABEL_STMT != 0 => {
-                    let substmt_old = node.children[0].expect("Label sub-statement not found");
-                    let substmt = self.visit_stmt(substmt_old);
+                    let LabelStmtNode { substmt, .. } =
+                        LabelStmtNode::decode(node).expect("Malformed label statement");
+                    let substmt = self.visit_stmt(substmt);
 
                     let label_stmt = CStmtKind::Label(substmt);
 
@@ -966,11 +973,10 @@ impl ConversionContext {
                 }
 
                 ASTEntryTag::TagSwitchStmt if expected_ty & OTHER_STMT != 0 => {
-                    let scrutinee_old = node.children[0].expect("Switch expression not found");
-                    let scrutinee = self.visit_expr(scrutinee_old);
-
-                    let body_old = node.children[1].expect("Switch body not found");
-                    let body = self.visit_stmt(body_old);
+                    let SwitchStmtNode { scrutinee, body } =
+                        SwitchStmtNode::decode(node).expect("Malformed switch statement");
+                    let scrutinee = self.visit_expr(scrutinee);
+                    let body = self.visit_stmt(body);
 
                     let switch_stmt = CStmtKind::Switch { scrutinee, body };
 
@@ -1005,8 +1011,9 @@ impl ConversionContext {
                 }
 
                 ASTEntryTag::TagDefaultStmt if expected_ty & OTHER_STMT != 0 => {
-                    let substmt_old = node.children[0].expect("Default sub-statement not found");
-                    let substmt = self.visit_stmt(substmt_old);
+                    let DefaultStmtNode { substmt } =
+                        DefaultStmtNode::decode(node).expect("Malformed default statement");
+                    let substmt = self.visit_stmt(substmt);
 
                     let default_stmt = CStmtKind::Default(substmt);
 
@@ -1069,7 +1076,8 @@ impl ConversionContext {
 
                 // Expressions
                 ASTEntryTag::TagParenExpr if expected_ty & (EXPR | STMT) != 0 => {
-                    let wrapped = node.children[0].expect("Expected wrapped paren expression");
+                    let ParenExprNode { wrapped } =
+                        ParenExprNode::decode(node).expect("Malformed paren expression");
                     let ty_old = node.type_id.expect("Expected expression to have type");
                     let ty = self.visit_qualified_type(ty_old);
 
@@ -1372,13 +1380,10 @@ impl ConversionContext {
                 }
 
                 ASTEntryTag::TagArraySubscriptExpr if expected_ty & (EXPR | STMT) != 0 => {
-                    let lhs_old =
-                        node.children[0].expect("Expected LHS on array subscript expression");
-                    let lhs = self.visit_expr(lhs_old);
-
-                    let rhs_old =
-                        node.children[1].expect("Expected RHS on array subscript expression");
-                    let rhs = self.visit_expr(rhs_old);
+                    let ArraySubscriptExprNode { lhs, rhs } = ArraySubscriptExprNode::decode(node)
+                        .expect("Malformed array subscript expression");
+                    let lhs = self.visit_expr(lhs);
+                    let rhs = self.visit_expr(rhs);
 
                     let ty_old = node.type_id.expect("Expected expression to have type");
                     let ty = self.visit_qualified_type(ty_old);
@@ -1450,8 +1455,9 @@ impl ConversionContext {
                         .expect("Expected compound literal to have type");
                     let ty = self.visit_qualified_type(ty_old);
 
-                    let val_old = node.children[0].expect("Expected child on compound literal");
-                    let val = self.visit_expr(val_old);
+                    let CompoundLiteralExprNode { initializer } =
+                        CompoundLiteralExprNode::decode(node).expect("Malformed compound literal");
+                    let val = self.visit_expr(initializer);
 
                     self.expr_possibly_as_stmt(
                         expected_ty,
@@ -3,6 +3,7 @@
 #![feature(box_patterns)]
 
 extern crate colored;
+extern crate crossbeam_utils;
 extern crate dtoa;
 extern crate rustc_parse;
 extern crate syntax;
@@ -42,11 +43,14 @@ pub mod translator;
 pub mod with_stmts;
 
 use std::collections::HashSet;
+use std::env;
 use std::fs::{self, File};
 use std::io;
 use std::io::prelude::*;
 use std::path::{Path, PathBuf};
 use std::process;
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::sync::Mutex;
 
 use failure::Error;
 use regex::Regex;
@@ -68,6 +72,9 @@ type PragmaSet = indexmap::IndexSet<(&'static str, &'static str)>;
 type CrateSet = indexmap::IndexSet<ExternCrate>;
 type TranspileResult = Result<(PathBuf, PragmaVec, CrateSet), ()>;
 
+/// Maximum size of the on-disk cache of exported ASTs
+const EXPORT_CACHE_SIZE: u64 = 1 << 30;
+
 /// Configuration settings for the translation process
 #[derive(Debug)]
 pub struct TranspilerConfig {
@@ -110,6 +117,45 @@ pub struct TranspilerConfig {
     pub translate_fn_macros: bool,
     pub disable_refactoring: bool,
     pub log_level: log::LevelFilter,
+    /// Number of translation units to transpile at once. The messages
+    /// printed for files transpiled at the same time may interleave.
+    pub jobs: usize,
+    /// Reuse ASTs exported by earlier runs for unchanged files
+    pub export_cache: bool,
+    /// Leave unused declarations out of the exported AST rather than pruning
+    /// them after importing it
+    pub prune_unused_decls: bool,
+    /// Have the exporter encode source positions as byte offsets rather than
+    /// presumed line and column numbers
+    pub offset_positions: bool,
+    /// Have the exporter write the columnar AST format instead of CBOR
+    pub columnar_ast: bool,
+    /// Decode each AST while the exporter is still encoding it. Streamed ASTs
+    /// are always CBOR and never cached.
+    pub stream_export: bool,
+    /// Number of threads the exporter encodes each translation unit on
+    pub encode_threads: u32,
+    /// Have the exporter leave function bodies out, so that only declarations
+    /// are translated
+    pub decls_only: bool,
+    /// Only translate the top-level declarations with these names, and the
+    /// declarations they use
+    pub only_decls: Vec<String>,
+    /// Only translate the top-level declarations overlapping these ranges of
+    /// lines, given as file, first line and last line, and the declarations
+    /// they use
+    pub only_lines: Vec<(PathBuf, u32, u32)>,
+    /// Merge the exported ASTs of all translation units into this project
+    /// file, storing the types and declarations they share once
+    pub export_project: Option<PathBuf>,
+    /// Have the exporter export the comments in system headers too
+    pub system_header_comments: bool,
+    /// Have the exporter write a report of where the time exporting each
+    /// file goes to `<file>.export-stats.json`
+    pub export_stats: bool,
+    /// Also have the exporter write the phases of each export as Chrome trace
+    /// events to `<file>.export-trace.json`
+    pub export_trace: bool,
 
     // Options that control build files
     /// Emit `Cargo.toml` and `lib.rs`
@@ -238,6 +284,49 @@ pub fn transpile(tcfg: TranspilerConfig, cc_db: &Path, extra_clang_args: &[&str]
     let mut clang_args: Vec<&str> = clang_args.iter().map(AsRef::as_ref).collect();
     clang_args.extend_from_slice(extra_clang_args);
 
+    if tcfg.verbose {
+        println!("Additional Clang arguments: {}", clang_args.join(" "));
+    }
+
+    // Load the compilation database once and reuse it for every file
+    let mut session = match ast_exporter::ExportSession::new(cc_db, &clang_args) {
+        Ok(session) => session,
+        Err(e) => {
+            warn!("Error: {}. Nothing was transpiled.", e);
+            return;
+        }
+    };
+    if tcfg.export_cache {
+        if let Some(dir) = export_cache_dir() {
+            session.set_cache(&dir, EXPORT_CACHE_SIZE);
+        }
+    }
+    session.set_prune_unused_decls(tcfg.prune_unused_decls);
+    session.set_offset_positions(tcfg.offset_positions);
+    session.set_columnar(tcfg.columnar_ast);
+    session.set_encode_threads(tcfg.encode_threads);
+    session.set_decls_only(tcfg.decls_only);
+    session.set_system_header_comments(tcfg.system_header_comments);
+    session.set_export_stats(tcfg.export_stats, tcfg.export_trace);
+    let export_roots: Vec<_> = tcfg
+        .only_decls
+        .iter()
+        .map(|name| ast_exporter::ExportRoot::Name(name.clone()))
+        .chain(tcfg.only_lines.iter().map(|&(ref file, first, last)| {
+            ast_exporter::ExportRoot::Lines(file.clone(), first, last)
+        }))
+        .collect();
+    session.set_export_roots(&export_roots);
+
+    let jobs = tcfg.jobs;
+
+    // Project file the exported AST of each input file is merged into as
+    // soon as it has been translated
+    let project = tcfg
+        .export_project
+        .as_ref()
+        .map(|_| Mutex::new(ast_exporter::project::ProjectAst::new()));
+
     let mut top_level_ccfg = None;
     let mut workspace_members = vec![];
     let mut num_transpiled_files = 0;
@@ -279,14 +368,14 @@ pub fn transpile(tcfg: TranspilerConfig, cc_db: &Path, extra_clang_args: &[&str]
             }
         }
 
-        let results = cmds
-            .iter()
-            .map(|cmd| transpile_single(&tcfg, cmd.abs_file(),
-                                        &ancestor_path,
-                                        &build_dir,
-                                        cc_db,
-                                        &clang_args))
-            .collect::<Vec<TranspileResult>>();
+        let inputs = cmds.iter().map(|cmd| cmd.abs_file()).collect::<Vec<_>>();
+        let results = parallel_map(jobs, &inputs, |input| {
+            transpile_single(&tcfg, input.clone(),
+                             &ancestor_path,
+                             &build_dir,
+                             &session,
+                             project.as_ref())
+        });
         let mut modules = vec![];
         let mut modules_skipped = false;
         let mut pragmas = PragmaSet::new();
@@ -337,6 +426,11 @@ pub fn transpile(tcfg: TranspilerConfig, cc_db: &Path, extra_clang_args: &[&str]
         }
     }
 
+    if let (Some(path), Some(project)) = (tcfg.export_project.as_ref(), project) {
+        export_project(path, project.into_inner().unwrap())
+            .unwrap_or_else(|e| warn!("Writing project file {} failed: {}", path.display(), e));
+    }
+
     if num_transpiled_files == 0 {
         warn!("No C files found in compile_commands.json; nothing to do.");
         return;
@@ -349,6 +443,14 @@ pub fn transpile(tcfg: TranspilerConfig, cc_db: &Path, extra_clang_args: &[&str]
     }
 }
 
+/// Directory for cached AST exports, in `$XDG_CACHE_HOME` or `~/.cache`
+fn export_cache_dir() -> Option<PathBuf> {
+    env::var_os("XDG_CACHE_HOME")
+        .map(PathBuf::from)
+        .or_else(|| env::var_os("HOME").map(|home| Path::new(&home).join(".cache")))
+        .map(|dir| dir.join("c2rust").join("ast-exporter"))
+}
+
 /// Ensure that clang can locate the system headers on macOS 10.14+.
 ///
 /// MacOS 10.14 does not have a `/usr/include` folder even if Xcode
@@ -442,13 +544,58 @@ fn reorganize_definitions(
     Ok(())
 }
 
+/// Apply `f` to every item on up to `jobs` threads, returning the results in
+/// the order of `items`.
+fn parallel_map<T, R, F>(jobs: usize, items: &[T], f: F) -> Vec<R>
+where
+    T: Sync,
+    R: Send,
+    F: Fn(&T) -> R + Sync,
+{
+    if jobs <= 1 || items.len() <= 1 {
+        return items.iter().map(f).collect();
+    }
+
+    let next = AtomicUsize::new(0);
+    let results = items.iter().map(|_| Mutex::new(None)).collect::<Vec<_>>();
+    crossbeam_utils::thread::scope(|scope| {
+        for _ in 0..jobs.min(items.len()) {
+            scope.spawn(|_| loop {
+                let i = next.fetch_add(1, Ordering::SeqCst);
+                if i >= items.len() {
+                    break;
+                }
+                let res = f(&items[i]);
+                *results[i].lock().unwrap() = Some(res);
+            });
+        }
+    })
+    .expect("Transpiler thread panicked");
+
+    results
+        .into_iter()
+        .map(|res| res.into_inner().unwrap().unwrap())
+        .collect()
+}
+
+/// Write the project file the exported ASTs were merged into to `path`
+fn export_project(path: &Path, project: ast_exporter::project::ProjectAst) -> io::Result<()> {
+    info!(
+        "Merged {} translation units, sharing {} types and {} declarations",
+        project.unit_count(),
+        project.shared_type_count(),
+        project.shared_decl_count()
+    );
+    project.write_to(io::BufWriter::new(File::create(path)?))
+}
+
 fn transpile_single(
     tcfg: &TranspilerConfig,
     input_path: PathBuf,
     ancestor_path: &Path,
     build_dir: &Path,
-    cc_db: &Path,
-    extra_clang_args: &[&str],
+    session: &ast_exporter::ExportSession,
+    project: Option<&Mutex<ast_exporter::project::ProjectAst>>,
 ) -> TranspileResult {
     let output_path = get_output_path(tcfg, &input_path, ancestor_path, build_dir);
     if output_path.exists() && !tcfg.overwrite_existing {
@@ -465,17 +612,13 @@ fn transpile_single(
         return Err(());
     }
 
-    if tcfg.verbose {
-        println!("Additional Clang arguments: {}", extra_clang_args.join(" "));
-    }
-
     // Extract the untyped AST from the CBOR file
-    let untyped_context = match ast_exporter::get_untyped_ast(
-        input_path.as_path(),
-        cc_db,
-        extra_clang_args,
-        tcfg.debug_ast_exporter,
-    ) {
+    let untyped_context = if tcfg.stream_export {
+        session.stream_untyped_ast(input_path.as_path(), tcfg.debug_ast_exporter)
+    } else {
+        session.get_untyped_ast(input_path.as_path(), tcfg.debug_ast_exporter)
+    };
+    let untyped_context = match untyped_context {
         Err(e) => {
             warn!(
                 "Error: {}. Skipping {}; is it well-formed C?",
@@ -503,6 +646,14 @@ fn transpile_single(
         conv.typed_context
     };
 
+    // Merge the exported AST now rather than keeping it until all the input
+    // files are done. With several jobs, units are added in the order they
+    // finish in.
+    if let Some(project) = project {
+        project.lock().unwrap().add_unit(&input_path, &untyped_context);
+    }
+    drop(untyped_context);
+
     if tcfg.dump_typed_context {
         println!("Clang AST");
         println!("{:#?}", typed_context);
@@ -114,6 +114,32 @@ fn main() {
         emit_no_std: matches.is_present("emit-no-std"),
         enabled_warnings,
         log_level,
+        export_cache: !matches.is_present("no-export-cache"),
+        prune_unused_decls: matches.is_present("prune-unused-decls"),
+        offset_positions: matches.is_present("offset-positions"),
+        columnar_ast: matches.is_present("columnar-ast"),
+        stream_export: matches.is_present("stream-export"),
+        encode_threads: matches
+            .value_of("encode-threads")
+            .map_or(1, |threads| {
+                threads.parse().expect("Invalid number of encoding threads")
+            }),
+        decls_only: matches.is_present("decls-only"),
+        only_decls: matches
+            .values_of("only-decl")
+            .map(|values| values.map(String::from).collect())
+            .unwrap_or_else(|| vec![]),
+        only_lines: matches
+            .values_of("only-lines")
+            .map(|values| values.map(parse_line_range).collect())
+            .unwrap_or_else(|| vec![]),
+        export_project: matches.value_of("export-project").map(PathBuf::from),
+        system_header_comments: matches.is_present("system-header-comments"),
+        export_stats: matches.is_present("export-stats"),
+        export_trace: matches.is_present("export-trace"),
+        jobs: matches
+            .value_of("jobs")
+            .map_or(1, |jobs| jobs.parse().expect("Invalid number of jobs")),
     };
     // binaries imply emit-build-files
     if !tcfg.binaries.is_empty() {
@@ -126,3 +152,16 @@ fn main() {
 
     c2rust_transpile::transpile(tcfg, &cc_json_path, &extra_args);
 }
+
+/// Parse a `FILE:FIRST-LAST` range of lines. File names may contain colons.
+fn parse_line_range(range: &str) -> (PathBuf, u32, u32) {
+    let mut parts = range.rsplitn(2, ':');
+    let lines = parts.next().unwrap();
+    let file = parts.next().expect("Line ranges must be FILE:FIRST-LAST");
+    let mut lines = lines
+        .splitn(2, '-')
+        .map(|line| line.parse().expect("Invalid line number"));
+    let first = lines.next().unwrap();
+    let last = lines.next().expect("Line ranges must be FILE:FIRST-LAST");
+    (PathBuf::from(file), first, last)
+}
@@ -0,0 +1,44 @@
+/* Enough declarations and types that AST node and type IDs overlap */
+typedef unsigned long size_type;
+
+struct point {
+  int x;
+  int y;
+};
+
+typedef struct point point_t;
+
+enum direction { NORTH, EAST, SOUTH, WEST };
+
+union number {
+  int i;
+  float f;
+};
+
+static const double scale = 2.5;
+
+static int manhattan(const point_t *p) {
+  return (p->x < 0 ? -p->x : p->x) + (p->y < 0 ? -p->y : p->y);
+}
+
+static point_t step(point_t p, enum direction d) {
+  switch (d) {
+  case NORTH: p.y++; break;
+  case EAST: p.x++; break;
+  case SOUTH: p.y--; break;
+  case WEST: p.x--; break;
+  }
+  return p;
+}
+
+void many_decls(unsigned buffer_size, int buffer[]) {
+  point_t p = { 0, 0 };
+  union number n;
+  size_type i;
+
+  for (i = 0; i < buffer_size; i++) {
+    p = step(p, (enum direction)(i % 4));
+    n.i = manhattan(&p);
+    buffer[i] = n.i + (int)(scale * i);
+  }
+}
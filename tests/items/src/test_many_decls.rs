@@ -0,0 +1,25 @@
+extern crate libc;
+
+use many_decls::rust_many_decls;
+
+use self::libc::{c_int, c_uint};
+
+#[link(name = "test")]
+extern "C" {
+    #[no_mangle]
+    fn many_decls(_: c_uint, _: *mut c_int);
+}
+
+const BUFFER_SIZE: usize = 8;
+
+pub fn test_many_decls() {
+    let mut buffer = [0; BUFFER_SIZE];
+    let mut rust_buffer = [0; BUFFER_SIZE];
+
+    unsafe {
+        many_decls(BUFFER_SIZE as u32, buffer.as_mut_ptr());
+        rust_many_decls(BUFFER_SIZE as u32, rust_buffer.as_mut_ptr());
+    }
+
+    assert_eq!(buffer, rust_buffer);
+}